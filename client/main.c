@@ -2,6 +2,7 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "spfs/interface.h"
 #include "spfs/context.h"
@@ -39,7 +40,8 @@ static int send_mode(const char *socket_path, spfs_mode_t mode, const char *path
 {
 	size_t len;
 	struct external_cmd *package;
-	int err;
+	struct spfs_reply_s reply = { };
+	int sock, err;
 
 	fprintf(stdout, "changing mode to %d (path: %s)\n", mode, path_to_send ? : "none");
 	len = mode_packet_size(path_to_send);
@@ -51,8 +53,23 @@ static int send_mode(const char *socket_path, spfs_mode_t mode, const char *path
 	}
 	fill_mode_packet(package, mode, path_to_send, 0);
 
-	err = send_packet(socket_path, package, len);
+	sock = seqpacket_sock(socket_path, false, false, NULL);
+	if (sock < 0) {
+		err = sock;
+		goto free_package;
+	}
 
+	err = seqpacket_sock_send_reply(sock, package, len,
+					&reply, sizeof(reply));
+	if (!err && (mode == SPFS_PROXY_MODE))
+		fprintf(stdout, "reopened %u file handles (%u skipped) in %ld us\n",
+				reply.reopened, reply.skipped, reply.reopen_us);
+	if (!err)
+		fprintf(stdout, "link remap lookups avoided: %lu\n",
+				reply.xattr_lookups_avoided);
+
+	close(sock);
+free_package:
 	free(package);
 	return err;
 }
@@ -151,6 +168,11 @@ static int execude_manage_cmd(int argc, char **argv)
 {
 	char *payload = NULL;
 	char *socket_path = NULL;
+	struct {
+		int	status;
+		char	text[4096];
+	} reply = { };
+	int sock, err;
 	static struct option opts[] = {
 		{"socket-path",		required_argument,	0,	1003 },
 		{"help",		no_argument,		0,	'h'},
@@ -194,7 +216,18 @@ static int execude_manage_cmd(int argc, char **argv)
 
 	fprintf(stdout, "sending: '%s'\n", payload);
 
-	return send_packet(socket_path, payload, strlen(payload) + 1);
+	sock = seqpacket_sock(socket_path, false, false, NULL);
+	if (sock < 0)
+		return sock;
+
+	/* Some commands (like "stats") reply with text after status */
+	err = seqpacket_sock_send_reply(sock, payload, strlen(payload) + 1,
+					&reply, sizeof(reply) - 1);
+	if (reply.text[0])
+		fprintf(stdout, "%s", reply.text);
+
+	close(sock);
+	return err;
 }
 
 static int execude_mode_cmd(int argc, char **argv)
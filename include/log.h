@@ -17,17 +17,36 @@ static inline pid_t gettid(void)
 
 extern const char *__progname;
 
+/* Messages above this level are compiled out */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX		LOG_DEBUG
+#endif
+
+extern int log_level;
+
+static inline bool log_enabled(unsigned int level)
+{
+	return (level <= LOG_LEVEL_MAX) && ((int)level <= log_level);
+}
+
+pid_t log_tid(void);
 int print_on_level(unsigned int loglevel, const char *format, ...);
 
+/* Level is checked before any arguments are evaluated */
 #define print_with_header(verbosity, fmt, ...)			\
 ({								\
-	char *v = #verbosity;					\
+	int __res = 0;						\
 								\
-	print_on_level(LOG_ ## verbosity,			\
-			"%s(%d): %s%*s: "fmt,			\
-			__progname, gettid(), v,		\
-			7 - strlen(v), "",			\
-			##__VA_ARGS__);				\
+	if (log_enabled(LOG_ ## verbosity)) {			\
+		char *v = #verbosity;				\
+								\
+		__res = print_on_level(LOG_ ## verbosity,	\
+				"%s(%d): %s%*s: "fmt,		\
+				__progname, log_tid(), v,	\
+				7 - strlen(v), "",		\
+				##__VA_ARGS__);			\
+	}							\
+	__res;							\
 })
 
 #define pr_emerg(fmt, ...)					\
@@ -66,4 +85,8 @@ void log_ts_control(bool enable);
 int setup_log_ts(const char *log_file, int verbosity, bool enable_ts);
 int setup_log(const char *log_file, int verbosity);
 
+int start_log_writer(void);
+void forget_log_writer(void);
+void log_flush(void);
+
 #endif
@@ -5,6 +5,9 @@
 
 #include "include/ptrace.h"
 
+/* Max number of fds in one SCM_RIGHTS message */
+#define CR_SCM_MAX_FD		(252)
+
 struct fd_opts {
 	char flags;
 	struct {
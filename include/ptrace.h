@@ -53,6 +53,7 @@ typedef uint32_t u32;
 
 #define PME_PRESENT		(1ULL << 63)
 #define PME_SWAP		(1ULL << 62)
+#define PME_FILE		(1ULL << 61)
 
 #define _KNSIG		64
 # define _NSIG_BPW	64
@@ -164,6 +165,7 @@ struct parasite_ctl {
 	pid_t			pid;
 	unsigned long		syscall_ip;
 	unsigned long		syscall_ip_saved;
+	unsigned long		syscall_vec_ip;
 	struct thread_ctx	orig;
 };
 
@@ -185,6 +187,24 @@ void *mmap_seized(struct parasite_ctl *ctl,
 		  void *addr, size_t length, int prot,
 		  int flags, int fd, off_t offset);
 
+/*
+ * Syscall vector: array of syscalls, executed by the task in one run.
+ * Array must be placed in parasite map. Execution stops on the first failed
+ * syscall. Layout is used by injected code and must not be changed.
+ */
+struct seized_syscall_s {
+	uint64_t	nr;
+	uint64_t	args[6];
+	uint64_t	ret;
+};
+
+#define SYSCALL_VEC_CODE_SIZE	64
+
+void syscall_vec_install(struct parasite_ctl *ctl, unsigned long offset);
+/* Returns number of successfully executed syscalls or negative on error */
+int syscall_vec_seized(struct parasite_ctl *ctl, struct seized_syscall_s *calls,
+		       int nr_calls);
+
 ssize_t sendmsg_seized(struct parasite_ctl *ctl, int sockfd,
 		       const struct msghdr *msg, int flags);
 ssize_t recvmsg_seized(struct parasite_ctl *ctl, int sockfd,
@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 char *xvstrcat(char *str, const char *fmt, va_list args);
 extern char *xstrcat(char *str, const char *fmt, ...);
@@ -33,6 +34,18 @@ bool unlinked_path(const char *path);
 
 void strip_deleted(char *path);
 
+/* FNV-1a */
+static inline uint64_t str_hash(const char *str)
+{
+	uint64_t hval = 0xcbf29ce484222325ULL;
+
+	while (*str) {
+		hval ^= (unsigned char)*str++;
+		hval *= 0x100000001b3ULL;
+	}
+	return hval;
+}
+
 bool sillyrenamed_path(const char *path);
 
 #endif
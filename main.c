@@ -155,10 +155,12 @@ static void do_something(int *pipe_fd, int fd)
 int main()
 {
 	unsigned long  setfd[3] = { FD_CLOEXEC, 0, FD_CLOEXEC };
-	int src[3], dst[3], ret, exe, cwd_fd;
+	int src[3], dst[3], remote[2], ret, exe, cwd_fd;
 	unsigned long addr = 0x12345678;
 	unsigned size = sizeof(addr);
 	struct swapfd_exchange se;
+	struct swap_fd_s sfd;
+	struct swap_map_s smap;
 	struct parasite_ctl *ctl;
 	pid_t child;
 	int fd[2], st = TASK_ALIVE;
@@ -262,11 +264,25 @@ int main()
 		ret = 0;
 #endif
 	ret = -1;
-	if (swap_fd(ctl, src[0], dst[0], 0, 0) != 0)
+	remote[0] = dst[0];
+	remote[1] = src[0];
+	if (transfer_local_fds(ctl, remote, 2) != 2)
 		goto out_destroy;
 
-	if (swap_map(ctl, src[0], addr, addr + 2 * PAGE_SIZE,
-		     PROT_READ|PROT_WRITE, MAP_PRIVATE, 0) != 0)
+	sfd.src_fd	= src[0];
+	sfd.remote_fd	= remote[0];
+	sfd.cloexec	= 0;
+	sfd.pos		= 0;
+	if (swap_fds(ctl, &sfd, 1) != 1)
+		goto out_destroy;
+
+	smap.remote_fd	= remote[1];
+	smap.start	= addr;
+	smap.end	= addr + 2 * PAGE_SIZE;
+	smap.prot	= PROT_READ|PROT_WRITE;
+	smap.flags	= MAP_PRIVATE;
+	smap.pgoff	= 0;
+	if (swap_maps(ctl, &smap, 1) != 1)
 		goto out_destroy;
 	pr_debug("Success\n");
 
@@ -24,6 +24,9 @@
 #include "context.h"
 #include "spfs.h"
 #include "replace.h"
+#include "swapfd.h"
+#include "workers.h"
+#include "scheduler.h"
 
 static struct spfs_manager_context_s spfs_manager_context;
 
@@ -86,6 +89,12 @@ static void sigchld_handler(int signal, siginfo_t *siginfo, void *data)
 
 	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
 		struct spfs_info_s *info;
+		/* Replacer is a worker as well */
+		bool worker = release_worker(pid);
+
+		/* Job of the worker, if it was killed in the middle */
+		if (worker)
+			sched_release(pid);
 
 		if ((info = find_spfs_by_replacer(ctx->spfs_mounts, pid))) {
 			if (WEXITSTATUS(status) == 0)
@@ -105,6 +114,8 @@ static void sigchld_handler(int signal, siginfo_t *siginfo, void *data)
 				pr_info("spfs list is empty. Exiting.\n");
 				exit(0);
 			}
+		} else if (worker) {
+			pr_debug("worker %d exited, status=%d\n", pid, status);
 		} else {
 			pr_term_mnt_service_info(pid, status, "unknown", "unknown");
 		}
@@ -219,6 +230,9 @@ static int configure(struct spfs_manager_context_s *ctx)
 	if (!ctx->freeze_cgroups)
 		return -1;
 
+	if (sched_init(ctx->max_jobs))
+		return -1;
+
 	if (open_namespaces(getpid(), ctx->ns_fds))
 		return -1;
 
@@ -237,6 +251,10 @@ static void help(const char *program)
 	printf("\t-s   --socket-path     interface socket path\n");
 	printf("\t-d   --daemon          daemonize\n");
 	printf("\t     --exit-with-spfs  exit, when spfs has exited\n");
+	printf("\t     --verify-maps N   verify every N-th copied run of private pages\n");
+	printf("\t     --workers N       number of spare command workers (default: %d)\n", SPFS_MANAGER_WORKERS);
+	printf("\t     --max-jobs N      number of replace jobs run at once (default: number of CPUs, 0 - no limit)\n");
+	printf("\t     --priority ID:PRIO  priority of container ID jobs (default: 0, can be used multiple times)\n");
 	printf("\t-h   --help            print this help and exit\n");
 	printf("\t-v                     increase verbosity (can be used multiple times)\n");
 	printf("\n");
@@ -244,7 +262,9 @@ static void help(const char *program)
 
 static int parse_options(int argc, char **argv, char **work_dir, char **log,
 			 char **log_dir, char **socket_path, int *verbosity,
-			 bool *daemonize, bool *exit_with_spfs)
+			 bool *daemonize, bool *exit_with_spfs,
+			 unsigned *verify_maps, unsigned *workers,
+			 unsigned *max_jobs)
 {
 	static struct option opts[] = {
 		{"work-dir",		required_argument,      0, 'w'},
@@ -253,12 +273,16 @@ static int parse_options(int argc, char **argv, char **work_dir, char **log,
 		{"socket-path",		required_argument,      0, 's'},
 		{"daemon",		required_argument,      0, 'd'},
 		{"exit-with-spfs",	no_argument,		0, 1000},
+		{"verify-maps",		required_argument,	0, 1001},
+		{"workers",		required_argument,	0, 1002},
+		{"max-jobs",		required_argument,	0, 1003},
+		{"priority",		required_argument,	0, 1004},
 		{"help",		no_argument,		0, 'h'},
 		{0,			0,			0,  0 }
 	};
 
 	while (1) {
-		int c;
+		int c, rate, nr;
 
 		c = getopt_long(argc, argv, "w:l:s:p:vhd", opts, NULL);
 		if (c == -1)
@@ -286,6 +310,31 @@ static int parse_options(int argc, char **argv, char **work_dir, char **log,
 			case 1000:
 				*exit_with_spfs = true;
 				break;
+			case 1001:
+				if (xatoi(optarg, &rate) || (rate < 0)) {
+					pr_err("invalid verify rate: %s\n", optarg);
+					return -EINVAL;
+				}
+				*verify_maps = rate;
+				break;
+			case 1002:
+				if (xatoi(optarg, &nr) || (nr < 0)) {
+					pr_err("invalid number of workers: %s\n", optarg);
+					return -EINVAL;
+				}
+				*workers = nr;
+				break;
+			case 1003:
+				if (xatoi(optarg, &nr) || (nr < 0)) {
+					pr_err("invalid number of jobs: %s\n", optarg);
+					return -EINVAL;
+				}
+				*max_jobs = nr;
+				break;
+			case 1004:
+				if (sched_set_priority(optarg))
+					return -EINVAL;
+				break;
 			case 'h':
 				help(argv[0]);
 				exit(EXIT_SUCCESS);
@@ -326,16 +375,20 @@ struct spfs_manager_context_s *create_context(int argc, char **argv)
 	struct spfs_manager_context_s *ctx = &spfs_manager_context;
 
 	ctx->progname = __progname;
+	ctx->workers = SPFS_MANAGER_WORKERS;
+	ctx->max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
 
 	(void) close_inherited_fds();
 
 	if (parse_options(argc, argv, &ctx->work_dir, &ctx->log_file,
 				&ctx->log_dir, &ctx->socket_path,
 				&ctx->verbosity, &ctx->daemonize,
-				&ctx->exit_with_spfs)) {
+				&ctx->exit_with_spfs, &ctx->verify_maps,
+				&ctx->workers, &ctx->max_jobs)) {
 		pr_err("failed to parse options\n");
 		return NULL;
 	}
+	set_map_verify_rate(ctx->verify_maps);
 
 	if (atexit(cleanup)) {
 		pr_err("failed to register cleanup function\n");
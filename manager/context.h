@@ -15,6 +15,9 @@ struct spfs_manager_context_s {
 	int	verbosity;
 	bool	daemonize;
 	bool	exit_with_spfs;
+	unsigned	verify_maps;
+	unsigned	workers;
+	unsigned	max_jobs;
 	char	*ovz_id;
 
 	int	sock;
@@ -28,6 +31,7 @@ struct spfs_manager_context_s {
 struct spfs_manager_context_s *create_context(int argc, char **argv);
 
 extern int spfs_manager_packet_handler(int sock, void *data, void *package, size_t psize);
+extern int spfs_manager_run_job(int sock, void *data, void *job, size_t size);
 
 const int *mgr_ns_fds(void);
 const char *mgr_work_dir(void);
@@ -4,6 +4,10 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
 
 #include "include/log.h"
 #include "include/shm.h"
@@ -12,6 +16,8 @@
 #include "freeze.h"
 #include "processes.h"
 
+static const struct freezer_ops_s *freezer_ops(const char *freezer_cgroup);
+
 static struct freeze_cgroup_s *__find_freeze_cgroup(const struct shared_list *groups, const char *path)
 {
 	struct freeze_cgroup_s *fg;
@@ -45,6 +51,9 @@ static struct freeze_cgroup_s *create_freeze_cgroup(const char *path)
 		return NULL;
 	}
 
+	fg->ops = freezer_ops(path);
+	pr_debug("freezer cgroup %s: %s\n", path, fg->ops->name);
+
 	return fg;
 }
 
@@ -90,63 +99,103 @@ int unlock_cgroup(struct freeze_cgroup_s *fg)
 	return 0;
 }
 
-static int freezer_open_state(const char *freezer_cgroup)
+/* Time to wait for freezer to reach requested state */
+#define FREEZER_TIMEOUT_MS	10000
+
+/* Freezer v1 doesn't notify about state change: state is re-read with
+ * growing interval */
+#define FREEZER_POLL_MIN_US	500
+#define FREEZER_POLL_MAX_US	(100 * 1000)
+
+static long freezer_elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int freezer_open(const char *freezer_cgroup, const char *file, int flags)
 {
 	int fd;
 	char path[PATH_MAX];
 
-	snprintf(path, sizeof(path), "%s/freezer.state", freezer_cgroup);
-	fd = open(path, O_RDWR);
+	snprintf(path, sizeof(path), "%s/%s", freezer_cgroup, file);
+	fd = open(path, flags);
 	if (fd < 0) {
 		pr_perror("Unable to open %s", path);
-		return -1;
+		return -errno;
 	}
 	return fd;
 }
 
-static int freezer_set_state(const char *freezer_cgroup, const char *state)
+static ssize_t freezer_read(int fd, const char *freezer_cgroup, char *buf, size_t size)
 {
-	int fd, err = 0, tries = 100;
+	ssize_t bytes;
 
-	fd = freezer_open_state(freezer_cgroup);
-	if (fd < 0)
-		return fd;
+	if (lseek(fd, 0, SEEK_SET)) {
+		pr_perror("failed to lseek fd %d", fd);
+		return -errno;
+	}
+
+	bytes = read(fd, buf, size - 1);
+	if (bytes < 0) {
+		pr_perror("failed to read %s state", freezer_cgroup);
+		return -errno;
+	}
+	buf[bytes] = '\0';
+	return bytes;
+}
 
+static int freezer_write(int fd, const char *freezer_cgroup, const char *state)
+{
 	if (write(fd, state, strlen(state)) != strlen(state)) {
 		pr_perror("Unable to set %s state to %s", freezer_cgroup, state);
-		err = -errno;
-		goto close_fd;
+		return -errno;
 	}
+	return 0;
+}
 
-	/* We should wait while state is updated in reality */
-	while (tries--) {
-		char cstate[16];
-		ssize_t bytes;
+static int freezer_v1_set_state(const char *freezer_cgroup, bool frozen)
+{
+	const char *state = frozen ? "FROZEN" : "THAWED";
+	unsigned delay = FREEZER_POLL_MIN_US;
+	struct timespec start;
+	char cstate[16];
+	int fd, err;
 
-		if (lseek(fd, 0, SEEK_SET)) {
-			pr_err("failed to lseek fd %d", fd);
-			err = -errno;
-			goto close_fd;
-		}
+	fd = freezer_open(freezer_cgroup, "freezer.state", O_RDWR);
+	if (fd < 0)
+		return fd;
 
-		bytes = read(fd, cstate, sizeof(cstate));
-		if (bytes < 0) {
-			pr_perror("failed to read %s state", freezer_cgroup);
-			err = -errno;
+	err = freezer_write(fd, freezer_cgroup, state);
+	if (err)
+		goto close_fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* We should wait while state is updated in reality */
+	while (1) {
+		err = freezer_read(fd, freezer_cgroup, cstate, sizeof(cstate));
+		if (err < 0)
 			goto close_fd;
-		}
-		cstate[bytes-1] = '\0';
+		err = 0;
 
-		if (!strcmp(state, cstate))
+		if (!strncmp(state, cstate, strlen(state)))
 			break;
 
-		usleep(100 * 1000);
-	}
+		if (freezer_elapsed_ms(&start) > FREEZER_TIMEOUT_MS) {
+			pr_err("timed out to set state %s to freezer cgroup %s\n",
+					state, freezer_cgroup);
+			err = -ETIMEDOUT;
+			break;
+		}
 
-	if (tries < 0) {
-		pr_err("timed out to set state %s to freezer cgroup %s\n",
-				state, freezer_cgroup);
-		err = -ETIMEDOUT;
+		usleep(delay);
+		delay *= 2;
+		if (delay > FREEZER_POLL_MAX_US)
+			delay = FREEZER_POLL_MAX_US;
 	}
 
 close_fd:
@@ -154,13 +203,114 @@ close_fd:
 	return err;
 }
 
+/* Returns 1, if "frozen" field of cgroup.events is equal to @frozen */
+static int freezer_v2_check(int fd, const char *freezer_cgroup, bool frozen)
+{
+	char events[256], *p;
+	int err;
+
+	err = freezer_read(fd, freezer_cgroup, events, sizeof(events));
+	if (err < 0)
+		return err;
+
+	p = strstr(events, "frozen ");
+	if (!p) {
+		pr_err("no freezer state in %s/cgroup.events\n", freezer_cgroup);
+		return -EINVAL;
+	}
+	return (p[strlen("frozen ")] == '1') == frozen;
+}
+
+/* Cgroup v2 notifies about "frozen" change in cgroup.events: waiting is
+ * driven by poll(2) on it. Events file is read before the state is changed:
+ * notifications, happened after the read, wake poll up. */
+static int freezer_v2_set_state(const char *freezer_cgroup, bool frozen)
+{
+	struct pollfd pfd = { .events = POLLPRI, };
+	struct timespec start;
+	long timeout;
+	int fd, err;
+
+	pfd.fd = freezer_open(freezer_cgroup, "cgroup.events", O_RDONLY);
+	if (pfd.fd < 0)
+		return pfd.fd;
+
+	err = freezer_v2_check(pfd.fd, freezer_cgroup, frozen);
+	if (err < 0)
+		goto close_events;
+
+	fd = freezer_open(freezer_cgroup, "cgroup.freeze", O_WRONLY);
+	if (fd < 0) {
+		err = fd;
+		goto close_events;
+	}
+	err = freezer_write(fd, freezer_cgroup, frozen ? "1" : "0");
+	close(fd);
+	if (err)
+		goto close_events;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (1) {
+		err = freezer_v2_check(pfd.fd, freezer_cgroup, frozen);
+		if (err < 0)
+			break;
+		if (err) {
+			err = 0;
+			break;
+		}
+
+		timeout = FREEZER_TIMEOUT_MS - freezer_elapsed_ms(&start);
+		if (timeout <= 0) {
+			pr_err("timed out to %s cgroup %s\n",
+					frozen ? "freeze" : "thaw", freezer_cgroup);
+			err = -ETIMEDOUT;
+			break;
+		}
+
+		if (poll(&pfd, 1, timeout) < 0) {
+			pr_perror("failed to poll %s/cgroup.events", freezer_cgroup);
+			err = -errno;
+			break;
+		}
+	}
+
+close_events:
+	close(pfd.fd);
+	return err;
+}
+
+static const struct freezer_ops_s freezer_v1_ops = {
+	.name		= "v1",
+	.threads_file	= "tasks",
+	.set_state	= freezer_v1_set_state,
+};
+
+static const struct freezer_ops_s freezer_v2_ops = {
+	.name		= "v2",
+	.threads_file	= "cgroup.threads",
+	.set_state	= freezer_v2_set_state,
+};
+
+/* Unified hierarchy cgroup has cgroup.freeze file (except root one, which
+ * can't be frozen anyway) */
+static const struct freezer_ops_s *freezer_ops(const char *freezer_cgroup)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/cgroup.freeze", freezer_cgroup);
+	if (!access(path, F_OK))
+		return &freezer_v2_ops;
+	return &freezer_v1_ops;
+}
+
 int thaw_cgroup(const struct freeze_cgroup_s *fg)
 {
 	int err;
 
-	err = freezer_set_state(fg->path, "THAWED");
+	err = fg->ops->set_state(fg->path, false);
 	if (err) {
-		freezer_set_state(fg->path, "FROZEN");
+		fg->ops->set_state(fg->path, true);
 		pr_err("failed to thaw cgroup %s\n", fg->path);
 	} else
 		pr_debug("cgroup %s was thawed\n", fg->path);
@@ -171,26 +321,20 @@ int freeze_cgroup(const struct freeze_cgroup_s *fg)
 {
 	int err;
 
-	err = freezer_set_state(fg->path, "FROZEN");
+	err = fg->ops->set_state(fg->path, true);
 	if (err) {
-		freezer_set_state(fg->path, "THAWED");
+		fg->ops->set_state(fg->path, false);
 		pr_err("failed to freeze cgroup %s\n", fg->path);
 	} else
 		pr_debug("cgroup %s was frozen\n", fg->path);
 	return err;
 }
 
-int cgroup_pids(const struct freeze_cgroup_s *fg, char **list)
+int cgroup_pids(const struct freeze_cgroup_s *fg, pid_t **pids)
 {
-	char *tasks_file;
-	int err;
-
-	tasks_file = xsprintf("%s/tasks", fg->path);
-	if (!tasks_file)
-		return -ENOMEM;
+	char threads_file[PATH_MAX];
 
-	err = get_pids_list(tasks_file, list);
-
-	free(tasks_file);
-	return err;
+	snprintf(threads_file, sizeof(threads_file), "%s/%s",
+			fg->path, fg->ops->threads_file);
+	return read_pids(threads_file, pids);
 }
@@ -2,16 +2,26 @@
 #define __SPFS_MANAGER_FREEZE_H_
 
 #include <unistd.h>
+#include <stdbool.h>
 #include <semaphore.h>
 
 #include "include/list.h"
 
 struct shared_list;
 
+/* Freezer cgroup hierarchy specific operations */
+struct freezer_ops_s {
+	const char		*name;
+	/* File with ids of all the cgroup threads */
+	const char		*threads_file;
+	int			(*set_state)(const char *path, bool frozen);
+};
+
 struct freeze_cgroup_s {
 	struct list_head	list;
 	char			*path;
 	sem_t			sem;
+	const struct freezer_ops_s *ops;
 };
 
 struct freeze_cgroup_s *get_freeze_cgroup(struct shared_list *list, const char *path);
@@ -21,6 +31,6 @@ int unlock_cgroup(struct freeze_cgroup_s *fg);
 int thaw_cgroup(const struct freeze_cgroup_s *fg);
 int freeze_cgroup(const struct freeze_cgroup_s *fg);
 
-int cgroup_pids(const struct freeze_cgroup_s *fg, char **list);
+int cgroup_pids(const struct freeze_cgroup_s *fg, pid_t **pids);
 
 #endif
@@ -13,6 +13,9 @@
 #include "spfs.h"
 #include "freeze.h"
 #include "replace.h"
+#include "workers.h"
+#include "scheduler.h"
+#include "plan.h"
 
 /*
  * 1) Mount of SPFS
@@ -29,11 +32,23 @@
  *
  * 3) Replace SPFS with another file system:
  *
- * replace:id=<spfs_id>;source=<source>;type=<fs_type>;flags=<mount flags>;freeze_cgroup=<path to cgroup>
+ * replace:id=<spfs_id>;source=<source>;type=<fs_type>;flags=<mount flags>;freeze_cgroup=<path to cgroup>;ovz_id=<container id>
  *
  * 4) Switch processes from one fs to another
  *
- * switch:source=<path-to_source_mnt>;target=<path_to_target_mnt>;device=<src_mnt_dev_id>;freeze_cgroup=<path to cgroup>;ns_pid=<pid>
+ * switch:source=<path-to_source_mnt>;target=<path_to_target_mnt>;device=<src_mnt_dev_id>;freeze_cgroup=<path to cgroup>;ns_pid=<pid>;ovz_id=<container id>
+ *
+ * Replace and switch are scheduled as jobs of the container "ovz_id" (manager
+ * container by default), so that its priority is applied.
+ *
+ * 5) Get scheduler statistics (replied as text after status)
+ *
+ * stats;
+ *
+ * 6) Estimate work of switch without freeze: processes are scanned, but keep
+ * running (replied as text after status)
+ *
+ * plan;source=<path-to_source_mnt>;target=<path_to_target_mnt>;device=<src_mnt_dev_id>;freeze_cgroup=<path to cgroup>;ns_pid=<pid>
  *
  * After string comes options as blob (string or binary).
  */
@@ -43,7 +58,15 @@ typedef int (*cmd_handler_t)(int sock, struct spfs_manager_context_s *ctx, char
 struct spfs_manager_cmd_handler_s {
 	char *cmd;
 	cmd_handler_t handle;
-	bool fork;
+	bool worker;
+	/* Handler sends reply itself */
+	bool reply;
+};
+
+/* Command to be executed by worker */
+struct spfs_manager_job_s {
+	const struct spfs_manager_cmd_handler_s *handler;
+	char options[];
 };
 
 struct opt_array_s {
@@ -399,10 +422,13 @@ static int process_replace_cmd(int sock, struct spfs_manager_context_s *ctx,
 		[5] = { "bindmounts=", NULL },
 		[6] = { "mode=", NULL },
 		[7] = { "all", NULL, true },
+		[8] = { "ovz_id=", NULL },
 		{ NULL, NULL },
 	};
 	const char *opt_id, *opt_source, *opt_type, *opt_flags;
 	const char *opt_freeze_cgroup, *opt_bindmounts, *opt_mode, *opt_all;
+	const char *opt_ovz_id;
+	struct sched_job_s job;
 	struct spfs_info_s *info;
 	void *opts = NULL;
 	int err;
@@ -425,6 +451,7 @@ static int process_replace_cmd(int sock, struct spfs_manager_context_s *ctx,
 	opt_bindmounts = opt_array[5].value;
 	opt_mode = opt_array[6].value;
 	opt_all = opt_array[7].value;
+	opt_ovz_id = opt_array[8].value ? : mgr_ovz_id();
 
 	if (opt_mode) {
 		mode = get_replace_mode(opt_mode);
@@ -498,11 +525,37 @@ static int process_replace_cmd(int sock, struct spfs_manager_context_s *ctx,
 	/* TODO: there can be races in spfs replacement. Is it a problem? */
 	info->replacer = getpid();
 
-	return replace_spfs(sock, info, opt_source, opt_type, opt_flags, opts);
+	sched_job_init(&job, opt_ovz_id);
+
+	err = replace_spfs(sock, info, opt_source, opt_type, opt_flags, opts, &job);
+
+	/* Worker doesn't exit, when replace is done. So it releases spfs mount
+	 * reference itself instead of SIGCHLD handler: descriptors are
+	 * shared with manager. */
+	if (!err)
+		spfs_release_mnt(info);
+	info->replacer = -1;
+	return err;
 }
 
-static int process_switch_cmd(int sock, struct spfs_manager_context_s *ctx,
-			      char *options, size_t size)
+/* Options of switch and plan commands */
+struct switch_opts_s {
+	struct freeze_cgroup_s	*fg;
+	char			*source_mnt;
+	char			*target_mnt;
+	int			src_dev;
+	int			ns_pid;
+	const char		*ovz_id;
+};
+
+static void put_switch_options(struct switch_opts_s *so)
+{
+	free(so->source_mnt);
+	free(so->target_mnt);
+}
+
+static int get_switch_options(struct spfs_manager_context_s *ctx,
+			      char *options, struct switch_opts_s *so)
 {
 	struct opt_array_s opt_array[] = {
 		[0] = { "source=", NULL },
@@ -510,14 +563,15 @@ static int process_switch_cmd(int sock, struct spfs_manager_context_s *ctx,
 		[2] = { "freeze_cgroup=", NULL },
 		[3] = { "device=", NULL },
 		[4] = { "ns_pid=", NULL },
+		[5] = { "ovz_id=", NULL },
 		{ NULL, NULL },
 	};
 	int err;
-	struct freeze_cgroup_s *fg;
-	int ns_pid = 0, src_dev = 0;
 	char *source_mnt, *target_mnt;
 	char *freeze_cgroup, *device, *ns_process_id;
 
+	memset(so, 0, sizeof(*so));
+
 	err = parse_cmd_options(opt_array, options);
 	if (err) {
 		pr_err("failed to parse options for replace command\n");
@@ -529,6 +583,7 @@ static int process_switch_cmd(int sock, struct spfs_manager_context_s *ctx,
 	freeze_cgroup = opt_array[2].value;
 	device = opt_array[3].value;
 	ns_process_id = opt_array[4].value;
+	so->ovz_id = opt_array[5].value;
 
 	if (target_mnt == NULL) {
 		pr_err("target mountpoint wasn't provided\n");
@@ -547,7 +602,7 @@ static int process_switch_cmd(int sock, struct spfs_manager_context_s *ctx,
 	}
 
 	if (device) {
-		err = xatoi(device, &src_dev);
+		err = xatoi(device, &so->src_dev);
 		if (err) {
 			pr_err("failed to convert device id: %s\n", device);
 			return err;
@@ -555,56 +610,114 @@ static int process_switch_cmd(int sock, struct spfs_manager_context_s *ctx,
 	}
 
 	if (ns_process_id) {
-		err = xatoi(ns_process_id, &ns_pid);
+		err = xatoi(ns_process_id, &so->ns_pid);
 		if (err) {
 			pr_err("failed to convert pid: %s\n", ns_process_id);
 			return err;
 		}
 	}
 
-	fg = get_freeze_cgroup(ctx->freeze_cgroups, freeze_cgroup);
-	if (!fg) {
+	so->fg = get_freeze_cgroup(ctx->freeze_cgroups, freeze_cgroup);
+	if (!so->fg) {
 		pr_err("failed to get freezer cgroup %s\n", freeze_cgroup);
 		return -EINVAL;
 	}
 
-	target_mnt = canonicalize_file_name(target_mnt);
-	if (!target_mnt) {
-		pr_perror("failed to get %s canonical view", opt_array[1].value);
+	so->target_mnt = canonicalize_file_name(target_mnt);
+	if (!so->target_mnt) {
+		pr_perror("failed to get %s canonical view", target_mnt);
 		return -errno;
 	}
 
 	if (source_mnt) {
 		struct stat st;
 
-		source_mnt = canonicalize_file_name(source_mnt);
-		if (!source_mnt) {
-			pr_perror("failed to get %s canonical view", opt_array[0].value);
+		so->source_mnt = canonicalize_file_name(source_mnt);
+		if (!so->source_mnt) {
+			pr_perror("failed to get %s canonical view", source_mnt);
 			err = -errno;
-			goto free_target_mnt;
+			goto put_options;
 		}
 
-		if (stat(source_mnt, &st) < 0) {
-			pr_perror("failed to stat %s", source_mnt);
+		if (stat(so->source_mnt, &st) < 0) {
+			pr_perror("failed to stat %s", so->source_mnt);
 			err = -errno;
-			goto free_target_mnt;
+			goto put_options;
 		}
-		src_dev = st.st_dev;
+		so->src_dev = st.st_dev;
 	}
+	return 0;
+
+put_options:
+	put_switch_options(so);
+	return err;
+}
 
-	err = replace_resources(fg, source_mnt, src_dev, target_mnt, ns_pid);
+static int process_switch_cmd(int sock, struct spfs_manager_context_s *ctx,
+			      char *options, size_t size)
+{
+	struct switch_opts_s so;
+	struct sched_job_s job;
+	int err;
+
+	err = get_switch_options(ctx, options, &so);
+	if (err)
+		return err;
+
+	sched_job_init(&job, so.ovz_id ? : mgr_ovz_id());
+
+	err = replace_resources(so.fg, so.source_mnt, so.src_dev,
+				so.target_mnt, so.ns_pid, &job);
 
-	free(source_mnt);
-free_target_mnt:
-	free(target_mnt);
+	put_switch_options(&so);
 	return err;
 }
 
+static int process_plan_cmd(int sock, struct spfs_manager_context_s *ctx,
+			    char *options, size_t size)
+{
+	struct {
+		int	status;
+		char	text[1024];
+	} reply = { };
+	struct plan_stat_s stat;
+	struct switch_opts_s so;
+	int len;
+
+	reply.status = get_switch_options(ctx, options, &so);
+	if (reply.status)
+		return send_status(sock, reply.status);
+
+	reply.status = plan_resources(so.fg, so.source_mnt, so.src_dev,
+				      so.target_mnt, so.ns_pid, &stat);
+	put_switch_options(&so);
+	if (reply.status)
+		return send_status(sock, reply.status);
+
+	len = plan_stat(&stat, reply.text, sizeof(reply.text));
+	return send_reply(sock, &reply, sizeof(reply.status) + len + 1);
+}
+
+static int process_stats_cmd(int sock, struct spfs_manager_context_s *ctx,
+			     char *options, size_t size)
+{
+	struct {
+		int	status;
+		char	text[1024];
+	} reply = { };
+	int len;
+
+	len = sched_stat(reply.text, sizeof(reply.text));
+	return send_reply(sock, &reply, sizeof(reply.status) + len + 1);
+}
+
 const struct spfs_manager_cmd_handler_s handlers[] = {
 	{ "mount", process_mount_cmd, false },
 	{ "mode", process_mode_cmd, true },
 	{ "replace", process_replace_cmd, true },
 	{ "switch", process_switch_cmd, true },
+	{ "stats", process_stats_cmd, false, true },
+	{ "plan", process_plan_cmd, true, true },
 	{ NULL, NULL }
 };
 
@@ -636,12 +749,14 @@ const struct spfs_manager_cmd_handler_s *get_cmd_handler(const char *cmd)
 	return NULL;
 }
 
-static int spfs_manager_handle_packet(cmd_handler_t handler, int sock, void *data, void *package, size_t psize)
+static int spfs_manager_handle_packet(const struct spfs_manager_cmd_handler_s *handler,
+				      int sock, void *data, void *package, size_t psize)
 {
 	int ret;
 
-	ret = handler(sock, data, package, psize);
-	(void) send_status(sock, ret);
+	ret = handler->handle(sock, data, package, psize);
+	if (!handler->reply)
+		(void) send_status(sock, ret);
 	return ret;
 }
 
@@ -662,26 +777,28 @@ int spfs_manager_packet_handler(int sock, void *data, void *package, size_t psiz
 	if (!handler)
 		return -EINVAL;
 
-	if (handler->fork) {
-		switch (fork()) {
-			case -1:
-				pr_perror("failed to fork");
-				return -errno;
-			case 0:
-
-				/* TODO dropping inherited handlerforof the
-				 * SIGCHLD might be done somehow better.
-				 * This is required to prevent a situation,
-				 * when wait() returns ECHILD
-				 * (ct_run()->collect_child).
-				 */
-				signal(SIGCHLD, SIG_DFL);
-
-				_exit(spfs_manager_handle_packet(handler->handle, sock, data, options, psize - (options - cmd)));
-			default:
-				return 0;
+	if (handler->worker) {
+		char buf[WORKER_JOB_MAX];
+		struct spfs_manager_job_s *job = (void *)buf;
+		size_t size = psize - (options - cmd);
+
+		if (sizeof(*job) + size > sizeof(buf)) {
+			pr_err("request is too big: %ld\n", psize);
+			return -E2BIG;
 		}
+
+		job->handler = handler;
+		memcpy(job->options, options, size);
+		return queue_worker_job(sock, job, sizeof(*job) + size);
 	}
 
-	return spfs_manager_handle_packet(handler->handle, sock, data, options, psize - (options - cmd));
+	return spfs_manager_handle_packet(handler, sock, data, options, psize - (options - cmd));
+}
+
+int spfs_manager_run_job(int sock, void *data, void *job, size_t size)
+{
+	struct spfs_manager_job_s *j = job;
+
+	return spfs_manager_handle_packet(j->handler, sock, data, j->options,
+					  size - sizeof(*j));
 }
@@ -4,12 +4,12 @@
 #include <errno.h>
 #include <sys/types.h>
 
-#include "include/socket.h"
 #include "include/log.h"
 
 #include "context.h"
 #include "interface.h"
 #include "cgroup.h"
+#include "workers.h"
 
 int main(int argc, char *argv[])
 {
@@ -35,5 +35,8 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	return unreliable_socket_loop(ctx->sock, ctx, false, spfs_manager_packet_handler);
+	if (start_workers(ctx->workers, spfs_manager_run_job, ctx))
+		return -1;
+
+	return workers_socket_loop(ctx->sock, ctx, spfs_manager_packet_handler);
 }
@@ -0,0 +1,183 @@
+#include "spfs_config.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "include/log.h"
+
+#include "maps.h"
+
+/* Parse speed of /proc/<pid>/maps.
+ * Synthetic maps files of the given sizes are generated: every fourth
+ * mapping is backed by a file, the rest are anonymous, as for processes
+ * with big heaps and lots of thread stacks. Each file is parsed by stdio
+ * and sscanf, as it was done before, and by maps reader. Only file backed
+ * mappings are decoded in both cases.
+ */
+
+static double maps_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int maps_bench_generate(char *path, unsigned lines)
+{
+	unsigned long addr = 0x400000;
+	FILE *f;
+	unsigned i;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("failed to create maps file");
+		return -1;
+	}
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		perror("failed to open maps file");
+		close(fd);
+		return -1;
+	}
+
+	for (i = 0; i < lines; i++, addr += 0x21000) {
+		if (i % 4)
+			fprintf(f, "%012lx-%012lx rw-p 00000000 00:00 0 \n",
+				addr, addr + 0x21000);
+		else
+			fprintf(f, "%012lx-%012lx r-xp %08x fd:01 %u"
+				   "                     /usr/lib64/libbench-%u.so\n",
+				addr, addr + 0x21000, i << 12, 1000000 + i, i);
+	}
+
+	if (fclose(f)) {
+		perror("failed to write maps file");
+		return -1;
+	}
+	return 0;
+}
+
+static long maps_bench_stdio(const char *path)
+{
+	char map[PATH_MAX];
+	long found = 0;
+	FILE *fmap;
+
+	fmap = fopen(path, "r");
+	if (!fmap)
+		return -1;
+
+	while (fgets(map, sizeof(map), fmap)) {
+		unsigned long start, end, ino;
+		unsigned long long pgoff;
+		char r, w, x, s;
+		int ret, path_off;
+
+		map[strlen(map)-1] = '\0';
+
+		ret = sscanf(map, "%lx-%lx %c%c%c%c %llx %*x:%*x %lu %n",
+				&start, &end, &r, &w, &x, &s, &pgoff,
+				&ino, &path_off);
+		if (ret != 8) {
+			found = -1;
+			break;
+		}
+
+		if (!ino)
+			continue;
+
+		found += map[path_off] == '/';
+	}
+
+	fclose(fmap);
+	return found;
+}
+
+static long maps_bench_reader(const char *path)
+{
+	struct maps_reader_s mr;
+	struct maps_entry_s me;
+	long found = 0;
+	int ret;
+
+	if (maps_open(&mr, path, true))
+		return -1;
+
+	while ((ret = maps_next(&mr, &me)) > 0)
+		found += me.path[0] == '/';
+
+	maps_close(&mr);
+	return ret ? -1 : found;
+}
+
+static double maps_bench_run(long (*parse)(const char *path), const char *path,
+			     unsigned loops, long *found)
+{
+	double start;
+	unsigned i;
+
+	start = maps_bench_now();
+	for (i = 0; i < loops; i++)
+		*found = parse(path);
+	return maps_bench_now() - start;
+}
+
+static int maps_bench(unsigned lines, unsigned loops)
+{
+	char path[] = "/tmp/spfs-maps-bench.XXXXXX";
+	double t_stdio, t_reader;
+	long f_stdio, f_reader;
+	int err = 1;
+
+	if (maps_bench_generate(path, lines))
+		return 1;
+
+	t_stdio = maps_bench_run(maps_bench_stdio, path, loops, &f_stdio);
+	t_reader = maps_bench_run(maps_bench_reader, path, loops, &f_reader);
+
+	if ((f_stdio < 0) || (f_stdio != f_reader)) {
+		printf("%u lines: results differ: %ld vs %ld\n",
+				lines, f_stdio, f_reader);
+		goto unlink;
+	}
+
+	printf("%u lines (%ld files), %u loops: stdio %.1f Mlines/s, "
+	       "reader %.1f Mlines/s (x%.1f)\n",
+	       lines, f_reader, loops,
+	       lines * (double)loops / t_stdio / 1e6,
+	       lines * (double)loops / t_reader / 1e6,
+	       t_stdio / t_reader);
+	err = 0;
+
+unlink:
+	unlink(path);
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned loops = 20;
+	int err;
+
+	if (argc > 1)
+		loops = atoi(argv[1]);
+	if (!loops) {
+		printf("usage: %s [loops]\n", argv[0]);
+		return 1;
+	}
+
+	err = setup_log("/dev/null", 0);
+	if (err)
+		return 1;
+
+	err = maps_bench(10000, loops * 10);
+	err |= maps_bench(100000, loops);
+	return err;
+}
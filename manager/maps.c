@@ -0,0 +1,206 @@
+#include "spfs_config.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#include "include/log.h"
+
+#include "maps.h"
+
+/* Reader of /proc/<pid>/maps.
+ * File is read by large chunks into the reader buffer, and lines are parsed
+ * in place: there are no allocations and no stdio. Lines are split in fields
+ * first, and inode is decoded before the rest of the line: for processes with
+ * lots of mappings most of them are anonymous and are skipped right away.
+ *
+ * 00400000-0040b000 r-xp 00000000 08:01 1234       /bin/cat
+ */
+
+int maps_open(struct maps_reader_s *mr, const char *path, bool files_only)
+{
+	mr->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (mr->fd < 0) {
+		pr_perror("failed to open %s", path);
+		return -errno;
+	}
+	mr->files_only = files_only;
+	mr->pos = mr->len = 0;
+	mr->eof = false;
+	return 0;
+}
+
+void maps_close(struct maps_reader_s *mr)
+{
+	close(mr->fd);
+	mr->fd = -1;
+}
+
+/* Returns 1 and the next line, terminated by zero, or 0 at the end */
+static int maps_line(struct maps_reader_s *mr, char **line)
+{
+	ssize_t bytes;
+	char *nl;
+
+	while (1) {
+		nl = memchr(mr->buf + mr->pos, '\n', mr->len - mr->pos);
+		if (nl) {
+			*nl = '\0';
+			*line = mr->buf + mr->pos;
+			mr->pos = nl - mr->buf + 1;
+			return 1;
+		}
+
+		if (mr->eof) {
+			if (mr->pos == mr->len)
+				return 0;
+			/* Last line without newline. There is always room
+			 * for terminating zero. */
+			mr->buf[mr->len] = '\0';
+			*line = mr->buf + mr->pos;
+			mr->pos = mr->len;
+			return 1;
+		}
+
+		/* Beginning of a line is moved to the start of the buffer */
+		memmove(mr->buf, mr->buf + mr->pos, mr->len - mr->pos);
+		mr->len -= mr->pos;
+		mr->pos = 0;
+
+		if (mr->len == sizeof(mr->buf) - 1) {
+			pr_err("maps line is too long\n");
+			return -EINVAL;
+		}
+
+		bytes = read(mr->fd, mr->buf + mr->len, sizeof(mr->buf) - 1 - mr->len);
+		if (bytes < 0) {
+			pr_perror("failed to read maps");
+			return -errno;
+		}
+		if (!bytes)
+			mr->eof = true;
+		mr->len += bytes;
+	}
+}
+
+static char *parse_hex(char *p, unsigned long long *val, char delim)
+{
+	unsigned long long v = 0;
+	char *s = p;
+
+	for (;; p++) {
+		if ((*p >= '0') && (*p <= '9'))
+			v = (v << 4) | (*p - '0');
+		else if ((*p >= 'a') && (*p <= 'f'))
+			v = (v << 4) | (*p - 'a' + 10);
+		else
+			break;
+	}
+
+	if ((p == s) || (*p != delim))
+		return NULL;
+	*val = v;
+	return p + 1;
+}
+
+static char *parse_dec(char *p, unsigned long *val)
+{
+	unsigned long v = 0;
+	char *s = p;
+
+	for (; (*p >= '0') && (*p <= '9'); p++)
+		v = v * 10 + (*p - '0');
+
+	if ((p == s) || (*p && (*p != ' ')))
+		return NULL;
+	*val = v;
+	return p;
+}
+
+static char *skip_field(char *p)
+{
+	while (*p && (*p != ' '))
+		p++;
+	while (*p == ' ')
+		p++;
+	return p;
+}
+
+/* Returns 1, if line was parsed, 0, if it was skipped, or -EINVAL */
+static int maps_parse(const struct maps_reader_s *mr, char *line,
+		      struct maps_entry_s *me)
+{
+	unsigned long long val;
+	char *p;
+	int i;
+
+	/* Range, permissions, offset and device go before inode */
+	for (i = 0, p = line; i < 4; i++)
+		p = skip_field(p);
+
+	p = parse_dec(p, &me->ino);
+	if (!p)
+		goto err;
+	if (!me->ino && mr->files_only)
+		return 0;
+
+	while (*p == ' ')
+		p++;
+	me->path = p;
+
+	p = parse_hex(line, &val, '-');
+	if (!p)
+		goto err;
+	me->start = val;
+
+	p = parse_hex(p, &val, ' ');
+	if (!p)
+		goto err;
+	me->end = val;
+
+	for (i = 0; i < 4; i++, p++) {
+		if (!*p)
+			goto err;
+		me->perms[i] = *p;
+	}
+	if (*p++ != ' ')
+		goto err;
+
+	p = parse_hex(p, &me->pgoff, ' ');
+	if (!p)
+		goto err;
+
+	p = parse_hex(p, &val, ':');
+	if (!p)
+		goto err;
+	me->major = val;
+
+	p = parse_hex(p, &val, ' ');
+	if (!p)
+		goto err;
+	me->minor = val;
+
+	return 1;
+
+err:
+	pr_err("failed to parse maps line '%s'\n", line);
+	return -EINVAL;
+}
+
+/* Returns 1 and the next entry, 0 at the end or -errno */
+int maps_next(struct maps_reader_s *mr, struct maps_entry_s *me)
+{
+	char *line;
+	int ret;
+
+	do {
+		ret = maps_line(mr, &line);
+		if (ret <= 0)
+			return ret;
+
+		ret = maps_parse(mr, line, me);
+	} while (!ret);
+
+	return ret;
+}
@@ -0,0 +1,37 @@
+#ifndef __SPFS_MANAGER_MAPS_H_
+#define __SPFS_MANAGER_MAPS_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Fits any line: path is limited by PATH_MAX */
+#define MAPS_BUF_SIZE		(64 << 10)
+
+/* Line of /proc/<pid>/maps. Path points into reader buffer and is valid
+ * until the next line is read. */
+struct maps_entry_s {
+	unsigned long		start;
+	unsigned long		end;
+	char			perms[4];
+	unsigned long long	pgoff;
+	unsigned		major;
+	unsigned		minor;
+	unsigned long		ino;
+	char			*path;
+};
+
+struct maps_reader_s {
+	int			fd;
+	/* Lines without inode (anonymous, heap, stack) are skipped */
+	bool			files_only;
+	size_t			pos;
+	size_t			len;
+	bool			eof;
+	char			buf[MAPS_BUF_SIZE];
+};
+
+int maps_open(struct maps_reader_s *mr, const char *path, bool files_only);
+int maps_next(struct maps_reader_s *mr, struct maps_entry_s *me);
+void maps_close(struct maps_reader_s *mr);
+
+#endif
@@ -0,0 +1,193 @@
+#include "spfs_config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "include/log.h"
+
+#include "plan.h"
+
+/* Plan of replace.
+ * Scan stage finds resources on source mount and puts them into the plan.
+ * Examine stage collects resources from it. Plan is also built on its own,
+ * without processes being stopped, to estimate the work of replace ahead
+ * of freeze.
+ * Entries are appended to the last process. Number of entries in each
+ * array is accounted in plan statistics.
+ */
+
+void plan_init(struct replace_plan_s *plan)
+{
+	memset(plan, 0, sizeof(*plan));
+}
+
+void plan_release(struct replace_plan_s *plan)
+{
+	free(plan->processes);
+	free(plan->fds);
+	free(plan->maps);
+	free(plan->strings);
+	plan_init(plan);
+}
+
+/* Makes room for one more element of @array */
+static int plan_grow(void **array, unsigned *size, unsigned nr,
+		     size_t elem_size)
+{
+	unsigned new_size;
+	void *new_array;
+
+	if (nr < *size)
+		return 0;
+
+	new_size = *size ? *size * 2 : 16;
+	new_array = realloc(*array, new_size * elem_size);
+	if (!new_array) {
+		pr_err("failed to grow plan\n");
+		return -ENOMEM;
+	}
+	*array = new_array;
+	*size = new_size;
+	return 0;
+}
+
+static struct plan_process_s *plan_last(struct replace_plan_s *plan)
+{
+	return &plan->processes[plan->stat.processes - 1];
+}
+
+/* Process gets its first resource */
+static void plan_account(struct replace_plan_s *plan)
+{
+	struct plan_process_s *pp = plan_last(plan);
+
+	if (!pp->flags && !pp->fds_nr && !pp->maps_nr)
+		plan->stat.swapped++;
+}
+
+int plan_add_process(struct replace_plan_s *plan, pid_t pid, unsigned flags,
+		     pid_t fdt_shared, pid_t fs_shared, pid_t mm_shared)
+{
+	struct plan_process_s *pp;
+	int err;
+
+	err = plan_grow((void **)&plan->processes, &plan->processes_size,
+			plan->stat.processes, sizeof(*plan->processes));
+	if (err)
+		return err;
+
+	pp = &plan->processes[plan->stat.processes++];
+	memset(pp, 0, sizeof(*pp));
+	pp->pid = pid;
+	pp->fdt_shared = fdt_shared;
+	pp->fs_shared = fs_shared;
+	pp->mm_shared = mm_shared;
+	pp->fds = plan->stat.fds;
+	pp->maps = plan->stat.maps;
+
+	if (flags)
+		plan->stat.swapped++;
+	pp->flags = flags;
+	plan->stat.fs += !!(flags & PLAN_CWD) + !!(flags & PLAN_ROOT) +
+			 !!(flags & PLAN_EXE);
+	return 0;
+}
+
+int plan_add_fd(struct replace_plan_s *plan, int fd)
+{
+	int err;
+
+	err = plan_grow((void **)&plan->fds, &plan->fds_size,
+			plan->stat.fds, sizeof(*plan->fds));
+	if (err)
+		return err;
+
+	plan_account(plan);
+	plan->fds[plan->stat.fds++] = fd;
+	plan_last(plan)->fds_nr++;
+	return 0;
+}
+
+static int plan_add_string(struct replace_plan_s *plan, const char *str,
+			   size_t *offset)
+{
+	size_t len = strlen(str) + 1;
+
+	if (plan->strings_len + len > plan->strings_size) {
+		size_t size = plan->strings_size ? plan->strings_size : 4096;
+		char *strings;
+
+		while (plan->strings_len + len > size)
+			size *= 2;
+
+		strings = realloc(plan->strings, size);
+		if (!strings) {
+			pr_err("failed to grow plan strings\n");
+			return -ENOMEM;
+		}
+		plan->strings = strings;
+		plan->strings_size = size;
+	}
+
+	memcpy(plan->strings + plan->strings_len, str, len);
+	*offset = plan->strings_len;
+	plan->strings_len += len;
+	return 0;
+}
+
+int plan_add_map(struct replace_plan_s *plan, const struct plan_map_s *map,
+		 const char *path)
+{
+	struct plan_map_s *pm;
+	int err;
+
+	err = plan_grow((void **)&plan->maps, &plan->maps_size,
+			plan->stat.maps, sizeof(*plan->maps));
+	if (err)
+		return err;
+
+	pm = &plan->maps[plan->stat.maps];
+	*pm = *map;
+	err = plan_add_string(plan, path, &pm->path);
+	if (err)
+		return err;
+
+	plan_account(plan);
+	plan->stat.maps++;
+	plan_last(plan)->maps_nr++;
+
+	if ((map->flags & MAP_PRIVATE) && (map->prot & PROT_WRITE))
+		plan->stat.private_bytes += map->end - map->start;
+	return 0;
+}
+
+void plan_print(const struct plan_stat_s *stat)
+{
+	pr_info("Plan: %u processes (%u to swap), %lu fds, %lu maps "
+		"(%llu KiB private max), %u cwd/root/exe, %u sockets, "
+		"scanned in %.3f ms\n",
+		stat->processes, stat->swapped, stat->fds, stat->maps,
+		stat->private_bytes >> 10, stat->fs, stat->sockets,
+		stat->scan_ns / 1000000.0);
+}
+
+int plan_stat(const struct plan_stat_s *stat, char *buf, size_t size)
+{
+	return snprintf(buf, size,
+			"processes: %u\n"
+			"processes to swap: %u\n"
+			"fds: %lu\n"
+			"maps: %lu\n"
+			"private KiB max: %llu\n"
+			"cwd, root and exe: %u\n"
+			"sockets to rebind: %u\n"
+			"scan ms: %.3f\n",
+			stat->processes, stat->swapped,
+			stat->fds, stat->maps,
+			stat->private_bytes >> 10,
+			stat->fs, stat->sockets,
+			stat->scan_ns / 1000000.0);
+}
@@ -0,0 +1,101 @@
+#ifndef __SPFS_MANAGER_PLAN_H_
+#define __SPFS_MANAGER_PLAN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Process cwd, root or exe is on source mount */
+#define PLAN_CWD		(1 << 0)
+#define PLAN_ROOT		(1 << 1)
+#define PLAN_EXE		(1 << 2)
+
+struct plan_map_s {
+	unsigned long		start;
+	unsigned long		end;
+	unsigned long long	pgoff;
+	unsigned		open_flags;
+	int			prot;
+	int			flags;
+	/* Target path, offset in plan strings */
+	size_t			path;
+};
+
+/* Shared structures (fd table, fs or mm) are planned for the process, which
+ * was scanned first, and the rest refer to it. */
+struct plan_process_s {
+	pid_t			pid;
+	unsigned		flags;
+	pid_t			fdt_shared;
+	pid_t			fs_shared;
+	pid_t			mm_shared;
+	/* Indexes of the first fd and map in plan arrays */
+	unsigned		fds;
+	unsigned		fds_nr;
+	unsigned		maps;
+	unsigned		maps_nr;
+};
+
+/* Estimated work of replace */
+struct plan_stat_s {
+	unsigned		processes;
+	unsigned		swapped;
+	unsigned long		fds;
+	unsigned long		maps;
+	/* Upper bound: size of writable private mappings */
+	unsigned long long	private_bytes;
+	unsigned		fs;
+	unsigned		sockets;
+	uint64_t		scan_ns;
+};
+
+/* Resources on source mount, which are to be replaced. Plan consists of
+ * flat arrays, which refer to each other by indexes. */
+struct replace_plan_s {
+	struct plan_stat_s	stat;
+
+	struct plan_process_s	*processes;
+	unsigned		processes_size;
+
+	int			*fds;
+	unsigned		fds_size;
+
+	struct plan_map_s	*maps;
+	unsigned		maps_size;
+
+	char			*strings;
+	size_t			strings_len;
+	size_t			strings_size;
+};
+
+void plan_init(struct replace_plan_s *plan);
+void plan_release(struct replace_plan_s *plan);
+
+int plan_add_process(struct replace_plan_s *plan, pid_t pid, unsigned flags,
+		     pid_t fdt_shared, pid_t fs_shared, pid_t mm_shared);
+int plan_add_fd(struct replace_plan_s *plan, int fd);
+int plan_add_map(struct replace_plan_s *plan, const struct plan_map_s *map,
+		 const char *path);
+
+static inline const int *plan_fds(const struct replace_plan_s *plan,
+				  const struct plan_process_s *pp)
+{
+	return &plan->fds[pp->fds];
+}
+
+static inline const struct plan_map_s *plan_maps(const struct replace_plan_s *plan,
+						 const struct plan_process_s *pp)
+{
+	return &plan->maps[pp->maps];
+}
+
+static inline const char *plan_map_path(const struct replace_plan_s *plan,
+					const struct plan_map_s *pm)
+{
+	return plan->strings + pm->path;
+}
+
+void plan_print(const struct plan_stat_s *stat);
+int plan_stat(const struct plan_stat_s *stat, char *buf, size_t size);
+
+#endif
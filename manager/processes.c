@@ -5,6 +5,11 @@
 #include <dirent.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 #include "include/list.h"
 #include "include/log.h"
@@ -20,6 +25,9 @@
 #include "file_obj.h"
 #include "swapfd.h"
 #include "link_remap.h"
+#include "maps.h"
+#include "plan.h"
+#include "unix-sockets.h"
 
 struct fd_info_s {
 	int		process_fd;
@@ -28,6 +36,8 @@ struct fd_info_s {
 	unsigned	flags;
 	int		mnt_id;
 	long long	pos;
+	struct swap_fd_lock_s *locks;
+	int		nr_locks;
 	char		path[PATH_MAX];
 	char		cwd[PATH_MAX];
 };
@@ -97,6 +107,7 @@ static void release_process_maps(struct process_info *p)
 static void release_process_fd(struct process_fd *pfd)
 {
 	process_resource_release(&pfd->res);
+	free(pfd->info.locks);
 	free(pfd);
 }
 
@@ -247,89 +258,103 @@ static int pid_is_kthread(pid_t pid)
 	return false;
 }
 
-int iterate_pids_list_name(const char *pids_list, void *data,
-			   int (*actor)(pid_t pid, void *data),
-			   const char *actor_name)
+int iterate_pids_name(const pid_t *pids, int nr_pids, void *data,
+		      int (*actor)(pid_t pid, void *data),
+		      const char *actor_name)
 {
-	char *list, *l, *pid;
-	int err = 0;
-
-	if (!pids_list) {
-		pr_err("pids_list is NULL\n");
-		return -EINVAL;
-	}
-
-	list = l = strdup(pids_list);
-	if (!list) {
-		pr_err("failed to allocate\n");
-		return -ENOMEM;
-	}
-
-	while ((pid = strsep(&l, "\n")) != NULL) {
-		int p;
+	int i, err;
 
-		if (!strlen(pid))
-			continue;
-
-		err = xatoi(pid, &p);
+	for (i = 0; i < nr_pids; i++) {
+		err = actor(pids[i], data);
 		if (err) {
-			pr_err("failed to convert pid %s to number\n", pid);
-			break;
+			pr_err("actor %s failed for pid %d\n", actor_name, pids[i]);
+			return err;
 		}
+	}
+	return 0;
+}
 
-		err = actor(p, data);
-		if (err) {
-			pr_err("actor %s failed for pid %d\n", actor_name, p);
-			break;
+static int add_pid(pid_t **pids, int *nr_pids, int *size, pid_t pid)
+{
+	if (*nr_pids == *size) {
+		int new_size = *size ? *size * 2 : 64;
+		pid_t *new_pids;
+
+		new_pids = realloc(*pids, new_size * sizeof(pid_t));
+		if (!new_pids) {
+			pr_err("failed to allocate pids array\n");
+			return -ENOMEM;
 		}
+		*pids = new_pids;
+		*size = new_size;
 	}
-	free(list);
-	return err;
+	(*pids)[(*nr_pids)++] = pid;
+	return 0;
 }
 
-int get_pids_list(const char *tasks_file, char **list)
+/* Reads newline-separated pids from cgroup file (like "tasks" or
+ * "cgroup.threads") into array. Numbers are parsed on the fly, while file is
+ * read by chunks, so pid may span chunk boundary.
+ * Returns number of pids or negative error. */
+int read_pids(const char *pids_file, pid_t **pids)
 {
-	char *pids_list;
-	int err = -ENOMEM, fd;
-	char buf[4096] = { };
+	int err = 0, fd, nr_pids = 0, size = 0;
+	char buf[4096], *c;
+	bool in_pid = false;
 	ssize_t bytes;
+	pid_t pid = 0;
 
-	fd = open(tasks_file, O_RDONLY);
+	fd = open(pids_file, O_RDONLY);
 	if (fd < 0) {
-		pr_perror("failed to open %s", tasks_file);
+		pr_perror("failed to open %s", pids_file);
 		return -errno;
 	}
 
-	pids_list = NULL;
-	do {
-		bytes = read(fd, buf, sizeof(buf) - 1);
-		if (bytes < 0) {
-			pr_perror("failed to read %s", tasks_file);
-			err = -errno;
-			goto free_pids_list;
-		}
-		buf[bytes] = '\0';
-		if (bytes) {
-			pids_list = xstrcat(pids_list, "%s", buf);
-			if (!pids_list) {
-				pr_err("failed to allocate\n");
-				goto close_fd;
+	*pids = NULL;
+	while ((bytes = read(fd, buf, sizeof(buf))) > 0) {
+		for (c = buf; c < buf + bytes; c++) {
+			if ((*c >= '0') && (*c <= '9')) {
+				pid = pid * 10 + (*c - '0');
+				in_pid = true;
+				continue;
 			}
+			if (*c != '\n') {
+				pr_err("%s: unexpected character: %#x\n",
+						pids_file, *c);
+				err = -EINVAL;
+				goto free_pids;
+			}
+			if (in_pid) {
+				err = add_pid(pids, &nr_pids, &size, pid);
+				if (err)
+					goto free_pids;
+			}
+			pid = 0;
+			in_pid = false;
 		}
-	} while (bytes > 0);
+	}
+	if (bytes < 0) {
+		pr_perror("failed to read %s", pids_file);
+		err = -errno;
+		goto free_pids;
+	}
+
+	if (in_pid) {
+		err = add_pid(pids, &nr_pids, &size, pid);
+		if (err)
+			goto free_pids;
+	}
 
-	*list = pids_list;
-	err = 0;
+	pr_debug("%s: %d pids\n", pids_file, nr_pids);
 
-	pr_debug("Pids list:\n%s\n", *list);
+	close(fd);
+	return nr_pids;
 
-close_fd:
+free_pids:
+	free(*pids);
+	*pids = NULL;
 	close(fd);
 	return err;
-
-free_pids_list:
-	free(pids_list);
-	goto close_fd;
 }
 
 static int transform_path(const char *source_path,
@@ -398,7 +423,7 @@ static int get_link_path(const char *link,
 	return fixup_source_path(path, size, source_mnt, target_mnt);
 }
 
-static int process_add_fd(struct process_info *p, const struct fd_info_s *fdi,
+static int process_add_fd(struct process_info *p, struct fd_info_s *fdi,
 			  void *fobj)
 {
 	struct process_fd *pfd;
@@ -412,6 +437,10 @@ static int process_add_fd(struct process_info *p, const struct fd_info_s *fdi,
 	pfd->info.source_fd = fdi->process_fd;
 	pfd->info.cloexec = (fdi->flags & O_CLOEXEC) ? FD_CLOEXEC : 0;
 	pfd->info.pos = fdi->pos;
+	/* Locks are handed over */
+	pfd->info.locks = fdi->locks;
+	pfd->info.nr_locks = fdi->nr_locks;
+	fdi->locks = NULL;
 	pfd->res.replaced = false;
 	pfd->res.fobj = fobj;
 	list_add_tail(&pfd->list, &p->fds);
@@ -457,53 +486,183 @@ static int copy_process_fd(struct process_info *p, int fd)
 	return recv_fd(p->pctl, false);
 }
 
-static int parse_fdinfo(pid_t pid, struct fd_info_s *fdi)
+/* Buffer for /proc files of examination thread. Grows on demand */
+static __thread struct proc_buf_s {
+	char		*buf;
+	size_t		size;
+} proc_buf;
+
+static void put_proc_buf(void)
 {
-	char path[PATH_MAX];
-	FILE *fdinfo;
-	char buf[64];
-	int err = 0;
+	free(proc_buf.buf);
+	proc_buf.buf = NULL;
+	proc_buf.size = 0;
+}
 
-	snprintf(path, PATH_MAX, "/proc/%d/fdinfo/%d", pid, fdi->process_fd);
+/* Reads the whole "name" file relative to "dir" into the thread buffer and
+ * terminates it with zero. Returns length or -errno. */
+static ssize_t read_proc_file(int dir, const char *name, char **buf)
+{
+	ssize_t bytes, len = 0;
+	char *b;
+	int fd;
 
-	fdinfo = fopen(path, "r");
-	if (!fdinfo) {
-		pr_perror("failed to open %s", path);
+	fd = openat(dir, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		pr_perror("failed to open %s", name);
 		return -errno;
 	}
 
-	while (fgets(buf, 64, fdinfo) != NULL) {
-		if (!strncmp(buf, "flags:\t", strlen("flags:\t"))) {
-			if (sscanf(buf + strlen("flags:\t"), "%o", &fdi->flags) != 1) {
-				pr_err("failed to sscanf '%s'\n", buf);
+	do {
+		if (proc_buf.size - len < 2) {
+			b = realloc(proc_buf.buf, proc_buf.size ? proc_buf.size * 2 : 4096);
+			if (!b) {
+				pr_err("failed to allocate proc buffer\n");
+				len = -ENOMEM;
+				break;
+			}
+			proc_buf.size = proc_buf.size ? proc_buf.size * 2 : 4096;
+			proc_buf.buf = b;
+		}
+
+		bytes = read(fd, proc_buf.buf + len, proc_buf.size - len - 1);
+		if (bytes < 0) {
+			pr_perror("failed to read %s", name);
+			len = -errno;
+			break;
+		}
+		len += bytes;
+	} while (bytes);
+
+	close(fd);
+
+	if (len >= 0) {
+		proc_buf.buf[len] = '\0';
+		*buf = proc_buf.buf;
+	}
+	return len;
+}
+
+/* lock:	1: POSIX  ADVISORY  WRITE 1234 08:01:5678 0 EOF */
+static int parse_fdinfo_lock(char *line, struct swap_fd_lock_s *lock)
+{
+	char *p;
+
+	p = strchr(line + strlen("lock:\t"), ':');
+	if (!p)
+		goto err;
+	p++;
+
+	if (strncmp(p, " POSIX  ADVISORY  ", 18) == 0)
+		lock->is_posix = true;
+	else if (strncmp(p, " FLOCK  ADVISORY  ", 18) == 0)
+		lock->is_posix = false;
+	else
+		goto err;
+	p += 18;
+
+	/* Kernels differ in padding after the type */
+	if (strncmp(p, "READ ", 5) == 0)
+		lock->type = F_RDLCK;
+	else if (strncmp(p, "WRITE ", 6) == 0)
+		lock->type = F_WRLCK;
+	else
+		goto err;
+	p += 5;
+
+	p = strrchr(p, ':');
+	if (!p)
+		goto err;
+	p++;
+
+	switch (sscanf(p, "%*d %lld %lld", &lock->start, &lock->end)) {
+		case 1:
+			/* end is EOF */
+			lock->end = -1;
+			break;
+		case 2:
+			break;
+		default:
+			goto err;
+	}
+	return 0;
+
+err:
+	pr_err("unknown lock: %s\n", line);
+	return -EINVAL;
+}
+
+static int add_fdinfo_lock(struct fd_info_s *fdi, char *line)
+{
+	struct swap_fd_lock_s *locks;
+
+	locks = realloc(fdi->locks, sizeof(*locks) * (fdi->nr_locks + 1));
+	if (!locks) {
+		pr_err("failed to allocate locks\n");
+		return -ENOMEM;
+	}
+	fdi->locks = locks;
+
+	if (parse_fdinfo_lock(line, &locks[fdi->nr_locks]))
+		return -EINVAL;
+
+	fdi->nr_locks++;
+	return 0;
+}
+
+/* Position, flags, mount id and locks are taken in one pass */
+static int parse_fdinfo(int dir, const char *name, struct fd_info_s *fdi)
+{
+	char *buf, *line, *next;
+	ssize_t len;
+	int err = 0;
+
+	len = read_proc_file(dir, name, &buf);
+	if (len < 0)
+		return len;
+
+	for (line = buf; line < buf + len; line = next) {
+		next = strchrnul(line, '\n');
+		*next++ = '\0';
+
+		if (!strncmp(line, "flags:\t", strlen("flags:\t"))) {
+			if (sscanf(line + strlen("flags:\t"), "%o", &fdi->flags) != 1) {
+				pr_err("failed to sscanf '%s'\n", line);
 				err = -EINVAL;
 			}
-		} else if (!strncmp(buf, "pos:\t", strlen("pos:\t"))) {
-			if (sscanf(buf + strlen("pos:\t"), "%lli", &fdi->pos) != 1) {
-				pr_err("failed to sscanf '%s'\n", buf);
+		} else if (!strncmp(line, "pos:\t", strlen("pos:\t"))) {
+			if (sscanf(line + strlen("pos:\t"), "%lli", &fdi->pos) != 1) {
+				pr_err("failed to sscanf '%s'\n", line);
 				err = -EINVAL;
 			}
-		} else if (!strncmp(buf, "mnt_id:\t", strlen("mnt_id:\t"))) {
-			if (sscanf(buf + strlen("mnt_id:\t"), "%i", &fdi->mnt_id) != 1) {
-				pr_err("failed to sscanf '%s'\n", buf);
+		} else if (!strncmp(line, "mnt_id:\t", strlen("mnt_id:\t"))) {
+			if (sscanf(line + strlen("mnt_id:\t"), "%i", &fdi->mnt_id) != 1) {
+				pr_err("failed to sscanf '%s'\n", line);
 				err = -EINVAL;
 			}
+		} else if (!strncmp(line, "lock:\t", strlen("lock:\t"))) {
+			err = add_fdinfo_lock(fdi, line);
 		}
+		if (err)
+			break;
 	}
 	if (err < 0)
-		pr_err("failed to parse %s: %d\n", path, err);
-	fclose(fdinfo);
+		pr_err("failed to parse %s: %d\n", name, err);
 	return err;
 }
 
 int pid_fd_mnt_id(pid_t pid, int fd)
 {
+	char path[PATH_MAX];
 	int err;
 	struct fd_info_s fdi = {
 		.process_fd = fd,
 	};
 
-	err = parse_fdinfo(pid, &fdi);
+	snprintf(path, PATH_MAX, "/proc/%d/fdinfo/%d", pid, fd);
+
+	err = parse_fdinfo(AT_FDCWD, path, &fdi);
+	free(fdi.locks);
 	if (err)
 		return err;
 
@@ -512,28 +671,27 @@ int pid_fd_mnt_id(pid_t pid, int fd)
 
 static void put_fd_info(struct fd_info_s *fdi)
 {
+	free(fdi->locks);
 	close(fdi->local_fd);
 }
 
-static int get_fd_info(struct process_info *p, int dir,
-		const char *process_fd, const struct replace_info_s *ri,
-		struct fd_info_s *fdi)
+/* Links and fdinfo are read relative to /proc/<pid> directory "dir" */
+static int get_fd_info(struct process_info *p, int dir, int process_fd,
+		const struct replace_info_s *ri, struct fd_info_s *fdi)
 {
+	char name[32];
 	int err;
 	ssize_t bytes;
 
-	err = xatoi(process_fd, &fdi->process_fd);
-	if (err) {
-		pr_err("failed to convert fd %s to number\n", process_fd);
-		return err;
-	}
+	fdi->process_fd = process_fd;
+	fdi->locks = NULL;
+	fdi->nr_locks = 0;
 
-	snprintf(fdi->path, PATH_MAX, "/proc/%d/fd/%d", p->pid, fdi->process_fd);
-	bytes = readlink(fdi->path, fdi->path, PATH_MAX - 1);
+	snprintf(name, sizeof(name), "fd/%d", fdi->process_fd);
+	bytes = readlinkat(dir, name, fdi->path, PATH_MAX - 1);
 	if (bytes < 0) {
-		pr_perror("failed to read link %s\n", fdi->path);
-		err = -errno;
-		goto close_local_fd;
+		pr_perror("failed to read link /proc/%d/%s\n", p->pid, name);
+		return -errno;
 	}
 	fdi->path[bytes] = '\0';
 
@@ -550,18 +708,18 @@ static int get_fd_info(struct process_info *p, int dir,
 		goto close_local_fd;
 	}
 
-	err = parse_fdinfo(p->pid, fdi);
+	snprintf(name, sizeof(name), "fdinfo/%d", fdi->process_fd);
+	err = parse_fdinfo(dir, name, fdi);
 	if (err) {
-		pr_err("failed to get fd flags for /proc/%d/fd/%d", p->pid,
+		pr_err("failed to get fd flags for /proc/%d/fd/%d\n", p->pid,
 				fdi->process_fd);
 		goto close_local_fd;
 	}
 
 	if (S_ISSOCK(fdi->st.st_mode)) {
-		snprintf(fdi->cwd, PATH_MAX, "/proc/%d/cwd", p->pid);
-		bytes = readlink(fdi->cwd, fdi->cwd, PATH_MAX - 1);
+		bytes = readlinkat(dir, "cwd", fdi->cwd, PATH_MAX - 1);
 		if (bytes < 0) {
-			pr_perror("failed to read link %s\n", fdi->cwd);
+			pr_perror("failed to read link /proc/%d/cwd\n", p->pid);
 			err = -errno;
 			goto close_local_fd;
 		}
@@ -574,7 +732,7 @@ static int get_fd_info(struct process_info *p, int dir,
 
 close_local_fd:
 	if (err) {
-		close(fdi->local_fd);
+		put_fd_info(fdi);
 		pr_err("failed to get /proc/%d/fd/%d ---> %s\n",
 					p->pid, fdi->process_fd, fdi->path);
 	}
@@ -600,6 +758,7 @@ static int is_mnt_fd(const struct fd_info_s *fdi, const struct replace_info_s *r
 struct fd_collect_s {
 	pid_t		pid;
 	int		fd;
+	struct file_key_s key;
 };
 
 static int collect_process_fd_cb(void *cb_data, void *new_fobj, void **res_fobj)
@@ -607,7 +766,7 @@ static int collect_process_fd_cb(void *cb_data, void *new_fobj, void **res_fobj)
 	int err;
 	struct fd_collect_s *fdc = cb_data;
 
-	err = collect_fd(fdc->pid, fdc->fd, new_fobj, res_fobj);
+	err = collect_fd(fdc->pid, fdc->fd, &fdc->key, new_fobj, res_fobj);
 	if (err)
 		pr_err("failed to add /proc/%d/fd/%d to tree\n",
 				fdc->pid, fdc->fd);
@@ -616,11 +775,17 @@ static int collect_process_fd_cb(void *cb_data, void *new_fobj, void **res_fobj)
 
 static int collect_process_fd(struct process_info *p,
 			      const struct replace_info_s *ri,
-			      const struct fd_info_s *fdi)
+			      struct fd_info_s *fdi)
 {
 	struct fd_collect_s fdc = {
 		.pid = p->pid,
 		.fd = fdi->process_fd,
+		.key = {
+			.dev = fdi->st.st_dev,
+			.ino = fdi->st.st_ino,
+			.pos = fdi->pos,
+			.flags = fdi->flags,
+		},
 	};
 	void *fobj;
 	int err;
@@ -644,39 +809,12 @@ static int collect_process_fd(struct process_info *p,
 	return process_add_fd(p, fdi, fobj);
 }
 
-static bool fd_skip_fast(const struct process_info *p, int dir,
-			 const char *process_fd,
-			 const struct replace_info_s *ri)
-{
-	struct stat st;
-
-	if (fstatat(dir, process_fd, &st, 0))
-		return false;
-
-	if (S_ISSOCK(st.st_mode)) {
-		if (is_parasite_sock(p->pctl, st.st_ino))
-			return true;
-		return false;
-	}
-
-	return st.st_dev != ri->src_dev;
-}
-
-static int examine_process_fd(struct process_info *p, int dir,
-			      const char *process_fd, const void *data)
+static int examine_process_fd(struct process_info *p, int dir, int process_fd,
+			      const struct replace_info_s *ri)
 {
 	int err;
-	const struct replace_info_s *ri = data;
 	struct fd_info_s fdi;
 
-	/* Fast path. In most of the cases opened file is accessible and
-	 * shouldn't be replaced.
-	 * Let's quickly check, whether it is so, and skip the fd copy and
-	 * other checks.
-	 */
-	if (fd_skip_fast(p, dir, process_fd, ri))
-		return 0;
-
 	err = get_fd_info(p, dir, process_fd, ri, &fdi);
 	if (err)
 		goto error;
@@ -738,15 +876,6 @@ close_dir:
 	return err;
 }
 
-static int collect_process_open_fds(struct process_info *p,
-				    const struct replace_info_s *ri)
-{
-	char dpath[PATH_MAX];
-
-	snprintf(dpath, PATH_MAX, "/proc/%d/fd", p->pid);
-	return iterate_dir_name(dpath, p, examine_process_fd, ri);
-}
-
 struct open_path_collect_s {
 	const char	*path;
 	unsigned	flags;
@@ -830,6 +959,48 @@ static bool is_mnt_map(int dir,
 	return is_mnt_file(dir, path, ri);
 }
 
+/* Verdicts of is_mnt_map() for files, already seen in process maps.
+ * Each library is mapped by several VMAs, so the same files show up again and
+ * again. Path is a part of the key: with mount ID check the same file can be
+ * mapped via different mounts. */
+#define MAP_VERDICTS_BITS	8
+#define MAP_VERDICTS		(1 << MAP_VERDICTS_BITS)
+
+struct map_verdict_s {
+	dev_t			dev;
+	unsigned long		ino;
+	uint64_t		path_hash;
+	bool			valid;
+	bool			mnt;
+};
+
+static bool is_mnt_map_cached(struct map_verdict_s *verdicts, int dir,
+			      const struct maps_entry_s *me,
+			      const struct replace_info_s *ri)
+{
+	dev_t dev = makedev(me->major, me->minor);
+	uint64_t path_hash, key;
+	struct map_verdict_s *vd;
+
+	/* Device in maps is the one of file superblock, which is not always
+	 * st_dev of the file (btrfs subvolumes, overlayfs). So mapping on any
+	 * device is checked, but only once per file. */
+	path_hash = str_hash(me->path);
+	key = ((uint64_t)me->ino ^ (uint64_t)dev ^ path_hash) * 0x9e3779b97f4a7c15ULL;
+	vd = &verdicts[key >> (64 - MAP_VERDICTS_BITS)];
+
+	if (vd->valid && (vd->dev == dev) && (vd->ino == me->ino) &&
+	    (vd->path_hash == path_hash))
+		return vd->mnt;
+
+	vd->dev = dev;
+	vd->ino = me->ino;
+	vd->path_hash = path_hash;
+	vd->mnt = is_mnt_map(dir, me->start, me->end, ri);
+	vd->valid = true;
+	return vd->mnt;
+}
+
 static int map_prot(char r, char w, char x)
 {
 	int prot = 0;
@@ -844,82 +1015,360 @@ static int map_prot(char r, char w, char x)
 	return prot;
 }
 
-static int collect_process_map_files(struct process_info *p,
-				     const struct replace_info_s *ri)
+/* Processes are examined in two stages.
+ * First, /proc of each process is scanned for resources on the replaced
+ * mount: opened files, cwd, root, exe and file mappings. This is what takes
+ * most of the time for large containers, and it doesn't require the process
+ * to be traced. So processes are scanned by a pool of workers concurrently.
+ * Then resources, which were found, are collected by the tracer thread, because
+ * file descriptors are copied from the process by parasite. Ptrace requests
+ * can be made by the tracer thread only.
+ */
+
+#define EXAMINE_MAX_WORKERS	16
+
+struct map_scan_s {
+	unsigned long		start;
+	unsigned long		end;
+	unsigned		open_flags;
+	int			prot;
+	int			flags;
+	unsigned long long	pgoff;
+	char			*path;
+};
+
+struct process_scan_s {
+	struct process_info		*p;
+	const struct replace_info_s	*ri;
+
+	/* Processes, which share fd table, fs or mm structures with this
+	 * one, or zero. Shared structures are scanned only once. */
+	pid_t				fdt_shared;
+	pid_t				fs_shared;
+	pid_t				mm_shared;
+
+	bool				mnt_cwd;
+	bool				mnt_root;
+	bool				mnt_exe;
+
+	int				*fds;
+	int				fds_nr;
+	int				fds_size;
+
+	struct map_scan_s		*maps;
+	int				maps_nr;
+	int				maps_size;
+};
+
+static void release_process_scan(struct process_scan_s *scan)
+{
+	int i;
+
+	for (i = 0; i < scan->maps_nr; i++)
+		free(scan->maps[i].path);
+	free(scan->maps);
+	free(scan->fds);
+}
+
+static int scan_add_fd(struct process_scan_s *scan, int fd)
 {
+	if (scan->fds_nr == scan->fds_size) {
+		int size = scan->fds_size ? scan->fds_size * 2 : 16;
+		int *fds;
+
+		fds = realloc(scan->fds, size * sizeof(*fds));
+		if (!fds) {
+			pr_err("failed to allocate fds\n");
+			return -ENOMEM;
+		}
+		scan->fds = fds;
+		scan->fds_size = size;
+	}
+	scan->fds[scan->fds_nr++] = fd;
+	return 0;
+}
+
+static int scan_add_map(struct process_scan_s *scan,
+			const struct map_scan_s *map)
+{
+	if (scan->maps_nr == scan->maps_size) {
+		int size = scan->maps_size ? scan->maps_size * 2 : 16;
+		struct map_scan_s *maps;
+
+		maps = realloc(scan->maps, size * sizeof(*maps));
+		if (!maps) {
+			pr_err("failed to allocate maps\n");
+			return -ENOMEM;
+		}
+		scan->maps = maps;
+		scan->maps_size = size;
+	}
+	scan->maps[scan->maps_nr] = *map;
+	scan->maps[scan->maps_nr].path = strdup(map->path);
+	if (!scan->maps[scan->maps_nr].path) {
+		pr_err("failed to allocate map path\n");
+		return -ENOMEM;
+	}
+	scan->maps_nr++;
+	return 0;
+}
+
+/* Returns zero, if structure is new, and sets shared pid otherwise */
+static int scan_shared(pid_t pid, int (*collect)(pid_t pid),
+		       pid_t (*exists)(pid_t pid), pid_t *shared)
+{
+	int err;
+
+	err = collect(pid);
+	if (err != -EEXIST)
+		return err;
+
+	*shared = exists(pid);
+	return (*shared < 0) ? *shared : 0;
+}
+
+static int scan_process_map_files(struct process_scan_s *scan)
+{
+	const struct replace_info_s *ri = scan->ri;
+	struct map_verdict_s verdicts[MAP_VERDICTS] = { };
+	struct maps_reader_s mr;
+	struct maps_entry_s me;
 	char map[PATH_MAX];
-	FILE *fmap;
-	int err = -ENOENT;
+	int err;
 	int dir;
 
-	snprintf(map, PATH_MAX, "/proc/%d/map_files", p->pid);
+	snprintf(map, PATH_MAX, "/proc/%d/map_files", scan->p->pid);
 	dir = open(map, O_RDONLY | O_DIRECTORY);
 	if (dir < 0) {
 		pr_perror("failed to open %s", map);
 		return -errno;
 	}
 
-	snprintf(map, PATH_MAX, "/proc/%d/maps", p->pid);
-	fmap = fopen(map, "r");
-	if (!fmap) {
-		pr_perror("failed to open %s", map);
-		err = -errno;
+	snprintf(map, PATH_MAX, "/proc/%d/maps", scan->p->pid);
+	err = maps_open(&mr, map, true);
+	if (err)
 		goto close_dir;
-	}
 
-
-	while (fgets(map, sizeof(map), fmap)) {
+	while ((err = maps_next(&mr, &me)) > 0) {
 		char path[PATH_MAX];
-		unsigned long start, end, ino;
-		int ret, path_off;
-		char *map_file;
-		unsigned flags = O_RDONLY;
-		char r, w, x, s;
-		unsigned long long pgoff;
-
-		map[strlen(map)-1] = '\0';
-
-		ret = sscanf(map, "%lx-%lx %c%c%c%c %llx %*x:%*x %lu %n",
-				&start, &end, &r, &w, &x, &s, &pgoff, &ino, &path_off);
-		if (ret != 8) {
-			pr_err("failed to parse '%s': %d\n", map, ret);
-			err = -EINVAL;
-			goto close_fmap;
-		}
-
-		if (!ino)
-			continue;
-
-		if (!is_mnt_map(dir, start, end, ri))
+		struct map_scan_s ms = {
+			.start = me.start,
+			.end = me.end,
+			.pgoff = me.pgoff,
+			.open_flags = O_RDONLY,
+			.path = path,
+		};
+
+		if (!is_mnt_map_cached(verdicts, dir, &me, ri))
 			continue;
 
-		map_file = map + path_off;
-
-		err = transform_path(map_file, ri->source_mnt, ri->target_mnt,
+		err = transform_path(me.path, ri->source_mnt, ri->target_mnt,
 				     path, sizeof(path));
 		if (err)
-			goto close_fmap;
+			goto close_maps;
 
-		err = map_open_flags(dir, start, end, &flags);
+		err = map_open_flags(dir, ms.start, ms.end, &ms.open_flags);
 		if (err)
-			goto close_fmap;
+			goto close_maps;
+
+		ms.prot = map_prot(me.perms[0], me.perms[1], me.perms[2]);
+		ms.flags = me.perms[3] == 's' ? MAP_SHARED : MAP_PRIVATE;
 
-		err = collect_map_file(p, ri, start, end, flags, path,
-				       map_prot(r, w, x),
-				       s == 's' ? MAP_SHARED : MAP_PRIVATE,
-				       pgoff);
+		err = scan_add_map(scan, &ms);
 		if (err)
-			goto close_fmap;
+			goto close_maps;
 	}
-	err = 0;
-close_fmap:
-	fclose(fmap);
+close_maps:
+	maps_close(&mr);
 close_dir:
 	close(dir);
 	return err;
 
 }
 
+static int scan_process_mm(struct process_scan_s *scan)
+{
+	char path[PATH_MAX];
+	int dir, err;
+
+	err = scan_shared(scan->p->pid, collect_mm, mm_exists, &scan->mm_shared);
+	if (err || scan->mm_shared)
+		return err;
+
+	snprintf(path, PATH_MAX, "/proc/%d", scan->p->pid);
+	dir = open(path, O_RDONLY | O_DIRECTORY);
+	if (dir < 0) {
+		pr_perror("failed to open %s", path);
+		return -errno;
+	}
+
+	scan->mnt_exe = is_mnt_file(dir, "exe", scan->ri);
+
+	close(dir);
+
+	return scan_process_map_files(scan);
+}
+
+static int scan_process_fs(struct process_scan_s *scan)
+{
+	char path[PATH_MAX];
+	int dir, err;
+
+	err = scan_shared(scan->p->pid, collect_fs_struct, fs_struct_exists,
+			  &scan->fs_shared);
+	if (err || scan->fs_shared)
+		return err;
+
+	snprintf(path, PATH_MAX, "/proc/%d", scan->p->pid);
+	dir = open(path, O_RDONLY | O_DIRECTORY);
+	if (dir < 0) {
+		pr_perror("failed to open %s", path);
+		return -errno;
+	}
+
+	scan->mnt_cwd = is_mnt_file(dir, "cwd", scan->ri);
+	scan->mnt_root = is_mnt_file(dir, "root", scan->ri);
+
+	close(dir);
+	return 0;
+}
+
+/* In most of the cases opened file is accessible and shouldn't be replaced.
+ * Let's quickly check, whether it is so, and skip the fd copy and other
+ * checks. */
+static bool fd_skip_fast(int dir, const char *process_fd,
+			 const struct replace_info_s *ri)
+{
+	struct stat st;
+	void *data;
+
+	if (fstatat(dir, process_fd, &st, 0))
+		return false;
+
+	if (S_ISSOCK(st.st_mode))
+		return find_unix_socket(st.st_ino, &data) == -ENOENT;
+
+	return st.st_dev != ri->src_dev;
+}
+
+static int scan_process_fd(struct process_info *p, int dir,
+			   const char *process_fd, const void *data)
+{
+	struct process_scan_s *scan = (struct process_scan_s *)data;
+	int fd, err;
+
+	if (fd_skip_fast(dir, process_fd, scan->ri))
+		return 0;
+
+	err = xatoi(process_fd, &fd);
+	if (err) {
+		pr_err("failed to convert fd %s to number\n", process_fd);
+		return err;
+	}
+
+	return scan_add_fd(scan, fd);
+}
+
+static int scan_process_fds(struct process_scan_s *scan)
+{
+	char dpath[PATH_MAX];
+	int err;
+
+	err = scan_shared(scan->p->pid, collect_fd_table, fd_table_exists,
+			  &scan->fdt_shared);
+	if (err || scan->fdt_shared)
+		return err;
+
+	snprintf(dpath, PATH_MAX, "/proc/%d/fd", scan->p->pid);
+	return iterate_dir_name(dpath, scan->p, scan_process_fd, scan);
+}
+
+static int scan_process(struct process_scan_s *scan)
+{
+	int err;
+
+	pr_debug("Process %d: scanning...\n", scan->p->pid);
+
+	err = scan_process_fs(scan);
+	if (err)
+		return err;
+
+	err = scan_process_fds(scan);
+	if (err)
+		return err;
+
+	return scan_process_mm(scan);
+}
+
+struct scan_pool_s {
+	struct process_scan_s	*scans;
+	int			nr;
+	int			next;
+	int			err;
+};
+
+static void *scan_worker(void *data)
+{
+	struct scan_pool_s *pool = data;
+	int i, err;
+
+	while (!__atomic_load_n(&pool->err, __ATOMIC_RELAXED)) {
+		i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+		if (i >= pool->nr)
+			break;
+
+		err = scan_process(&pool->scans[i]);
+		if (err) {
+			pr_err("failed to scan process %d\n",
+					pool->scans[i].p->pid);
+			__atomic_store_n(&pool->err, err, __ATOMIC_RELAXED);
+		}
+	}
+	put_proc_buf();
+	return NULL;
+}
+
+static int scan_processes(struct process_scan_s *scans, int nr)
+{
+	pthread_t workers[EXAMINE_MAX_WORKERS];
+	struct scan_pool_s pool = {
+		.scans = scans,
+		.nr = nr,
+	};
+	sigset_t blockmask, oldmask;
+	long nr_workers;
+	int i, err;
+
+	nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_workers > EXAMINE_MAX_WORKERS)
+		nr_workers = EXAMINE_MAX_WORKERS;
+	if (nr_workers > nr)
+		nr_workers = nr;
+
+	pr_debug("Scanning %d processes with %ld workers...\n", nr,
+			(nr_workers > 1) ? nr_workers : 1);
+
+	/* Current thread is a worker as well. Signals are handled by it. */
+	sigfillset(&blockmask);
+	pthread_sigmask(SIG_BLOCK, &blockmask, &oldmask);
+	for (i = 0; i < nr_workers - 1; i++) {
+		err = pthread_create(&workers[i], NULL, scan_worker, &pool);
+		if (err) {
+			pr_warn("failed to create scan worker: %d\n", err);
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	nr_workers = i;
+
+	scan_worker(&pool);
+
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i], NULL);
+
+	return pool.err;
+}
+
 static int get_process_env(struct process_info *p,
 			   const struct replace_info_s *ri,
 			   const char *dentry, char *path, size_t size)
@@ -962,93 +1411,62 @@ static int collect_process_env(struct process_info *p,
 	return 0;
 }
 
-static int collect_process_exe(struct process_info *p,
-			       const struct replace_info_s *ri)
-{
-	int dir, err;
-	char path[PATH_MAX];
-	bool mnt_exe;
-
-	snprintf(path, PATH_MAX, "/proc/%d", p->pid);
-	dir = open(path, O_RDONLY | O_DIRECTORY);
-	if (dir < 0) {
-		pr_perror("failed to open %s", path);
-		return -errno;
-	}
-
-	mnt_exe = is_mnt_file(dir, "exe", ri);
-
-	close(dir);
-
-	if (!mnt_exe)
-		return 0;
-
-	err = collect_process_env(p, ri, "exe", S_IFREG, &p->exe.fobj);
-	if (err)
-		return err;
-	return 0;
-}
-
 static int collect_process_maps(struct process_info *p,
-				const struct replace_info_s *ri)
+				const struct replace_info_s *ri,
+				const struct replace_plan_s *plan,
+				const struct plan_process_s *pp)
 {
-	int err;
-	pid_t pid;
+	const struct plan_map_s *maps = plan_maps(plan, pp);
+	int i, err;
 
-	pid = mm_exists(p->pid);
-	if (pid) {
+	if (pp->mm_shared) {
 		pr_info("    /proc/%d/map_files ---> ignoring (shared with process %d)\n",
-				p->pid, pid);
+				p->pid, pp->mm_shared);
 		return 0;
 	}
 
-	err = collect_process_exe(p, ri);
-	if (err)
-		return err;
-
-	err = collect_process_map_files(p, ri);
-	if (err)
-		return err;
+	if (pp->flags & PLAN_EXE) {
+		err = collect_process_env(p, ri, "exe", S_IFREG, &p->exe.fobj);
+		if (err)
+			return err;
+	}
 
-	if (p->maps_nr) {
-		p->swap_resources = true;
+	for (i = 0; i < pp->maps_nr; i++) {
+		const struct plan_map_s *pm = &maps[i];
 
-		err = collect_mm(p->pid);
+		err = collect_map_file(p, ri, pm->start, pm->end,
+				       pm->open_flags, plan_map_path(plan, pm),
+				       pm->prot, pm->flags, pm->pgoff);
+		if (err)
+			return err;
 	}
 
-	return err;
+	if (p->maps_nr)
+		p->swap_resources = true;
+
+	return 0;
 }
 
-static int collect_process_cwd_root(struct process_info *p,
-				    const struct replace_info_s *ri)
+static int collect_process_fs(struct process_info *p,
+			      const struct replace_info_s *ri,
+			      const struct plan_process_s *pp)
 {
-	bool mnt_cwd, mnt_root;
-	int dir, err;
-	char path[PATH_MAX];
 	struct process_fs *fs = &p->fs;
+	int err;
 
-	snprintf(path, PATH_MAX, "/proc/%d", p->pid);
-	dir = open(path, O_RDONLY | O_DIRECTORY);
-	if (dir < 0) {
-		pr_perror("failed to open %s", path);
-		return -errno;
-	}
-
-	mnt_cwd = is_mnt_file(dir, "cwd", ri);
-	mnt_root = is_mnt_file(dir, "root", ri);
-
-	close(dir);
-
-	if (!mnt_cwd && ! mnt_root)
+	if (pp->fs_shared) {
+		pr_info("    /proc/%d/<root,cwd> ---> ignoring (shared with process %d)\n",
+				p->pid, pp->fs_shared);
 		return 0;
+	}
 
-	if (mnt_cwd) {
+	if (pp->flags & PLAN_CWD) {
 		err = collect_process_env(p, ri, "cwd", S_IFDIR, &fs->cwd.fobj);
 		if (err)
 			return err;
 	}
 
-	if (mnt_root) {
+	if (pp->flags & PLAN_ROOT) {
 		char path[PATH_MAX] = { };
 
 		err = get_process_env(p, ri, "root", path, sizeof(path));
@@ -1059,65 +1477,54 @@ static int collect_process_cwd_root(struct process_info *p,
 		if (!fs->root)
 			return -ENOMEM;
 	}
-	return 0;
-}
 
-static int collect_process_fs(struct process_info *p,
-			      const struct replace_info_s *ri)
-{
-	int err;
-	pid_t pid;
-	struct process_fs *fs = &p->fs;
-
-	pid = fs_struct_exists(p->pid);
-	if (pid) {
-		pr_info("    /proc/%d/<root,cwd> ---> ignoring (shared with process %d)\n",
-				p->pid, pid);
-		return 0;
-	}
-
-	err = collect_process_cwd_root(p, ri);
-	if (err)
-		return err;
-
-	if (fs->cwd.fobj || fs->root) {
+	if (fs->cwd.fobj || fs->root)
 		p->swap_resources = true;
 
-		err = collect_fs_struct(p->pid);
-		if (err)
-			pr_err("failed to collect process %d fs\n", p->pid);
-	}
-
-	return err;
+	return 0;
 }
 
 static int collect_process_fds(struct process_info *p,
-			       const struct replace_info_s *ri)
+			       const struct replace_info_s *ri,
+			       const struct replace_plan_s *plan,
+			       const struct plan_process_s *pp)
 {
-	int err;
-	pid_t pid;
+	const int *fds = plan_fds(plan, pp);
+	char path[PATH_MAX];
+	int i, dir, err = 0;
 
-	pid = fd_table_exists(p->pid);
-	if (pid) {
+	if (pp->fdt_shared) {
 		pr_info("    /proc/%d/fd ---> ignoring (shared with process %d)\n",
-				p->pid, pid);
+				p->pid, pp->fdt_shared);
 		return 0;
 	}
 
-	err = collect_process_open_fds(p, ri);
+	snprintf(path, PATH_MAX, "/proc/%d", p->pid);
+	dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir < 0) {
+		pr_perror("failed to open %s", path);
+		return -errno;
+	}
+
+	for (i = 0; i < pp->fds_nr; i++) {
+		err = examine_process_fd(p, dir, fds[i], ri);
+		if (err)
+			break;
+	}
+	close(dir);
 	if (err)
 		return err;
 
-	if (p->fds_nr) {
+	if (p->fds_nr)
 		p->swap_resources = true;
 
-		err = collect_fd_table(p->pid);
-	}
-
-	return err;
+	return 0;
 }
 
-static int examine_one_process(struct process_info *p, const struct replace_info_s *ri)
+static int examine_one_process(struct process_info *p,
+			       const struct replace_info_s *ri,
+			       const struct replace_plan_s *plan,
+			       const struct plan_process_s *pp)
 {
 	int err;
 
@@ -1127,15 +1534,15 @@ static int examine_one_process(struct process_info *p, const struct replace_info
 	if (err)
 		return err;
 
-	err = collect_process_fs(p, ri);
+	err = collect_process_fs(p, ri, pp);
 	if (err)
 		return err;
 
-	err = collect_process_fds(p, ri);
+	err = collect_process_fds(p, ri, plan, pp);
 	if (err)
 		goto destroy_process_fds;
 
-	err = collect_process_maps(p, ri);
+	err = collect_process_maps(p, ri, plan, pp);
 	if (err)
 		goto destroy_process_maps;
 
@@ -1148,34 +1555,229 @@ destroy_process_fds:
 	return err;
 }
 
-static int cmp_pid(struct process_info *p, int dir,
-		   const char *dentry, const void *data)
+/* Set of thread group ids, listed in /proc.
+ * Threads can't be found in /proc readdir, although any real access to
+ * thread proc dentry will succeed. So the set is collected once by single
+ * readdir, and then any task is checked in constant time. */
+struct tgid_set_s {
+	unsigned long	*bits;
+	pid_t		max;
+};
+
+#define TGID_BITS	(sizeof(unsigned long) * 8)
+
+static int tgid_set_add(struct tgid_set_s *set, pid_t pid)
 {
-	return p->pid == atoi(dentry);
+	if (pid > set->max) {
+		pid_t max = (set->max + 1) * 2 - 1;
+		unsigned long *bits;
+		size_t old_size = (set->max + 1) / 8, size;
+
+		while (max < pid)
+			max = (max + 1) * 2 - 1;
+		size = (max + 1) / 8;
+
+		bits = realloc(set->bits, size);
+		if (!bits) {
+			pr_err("failed to allocate tgid set\n");
+			return -ENOMEM;
+		}
+		memset((char *)bits + old_size, 0, size - old_size);
+		set->bits = bits;
+		set->max = max;
+	}
+	set->bits[pid / TGID_BITS] |= 1UL << (pid % TGID_BITS);
+	return 0;
+}
+
+static bool tgid_set_test(const struct tgid_set_s *set, pid_t pid)
+{
+	if (pid > set->max)
+		return false;
+	return set->bits[pid / TGID_BITS] & (1UL << (pid % TGID_BITS));
+}
+
+static int add_tgid(struct process_info *p, int dir,
+		    const char *dentry, const void *data)
+{
+	struct tgid_set_s *set = (struct tgid_set_s *)data;
+
+	if (!isdigit(dentry[0]))
+		return 0;
+
+	return tgid_set_add(set, atoi(dentry));
+}
+
+static int collect_tgids(struct tgid_set_s *set)
+{
+	set->max = TGID_BITS * 1024 - 1;
+	set->bits = calloc(1, (set->max + 1) / 8);
+	if (!set->bits) {
+		pr_err("failed to allocate tgid set\n");
+		return -ENOMEM;
+	}
+
+	return iterate_dir_name("/proc", NULL, add_tgid, set);
+}
+
+static bool task_is_thread(const struct tgid_set_s *tgids,
+			   struct process_info *p)
+{
+	return !tgid_set_test(tgids, p->pid);
+}
+
+static uint64_t plan_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int plan_scan(struct replace_plan_s *plan,
+		     const struct process_scan_s *scan)
+{
+	unsigned flags = 0;
+	int i, err;
+
+	if (scan->mnt_cwd)
+		flags |= PLAN_CWD;
+	if (scan->mnt_root)
+		flags |= PLAN_ROOT;
+	if (scan->mnt_exe)
+		flags |= PLAN_EXE;
+
+	err = plan_add_process(plan, scan->p->pid, flags, scan->fdt_shared,
+			       scan->fs_shared, scan->mm_shared);
+	if (err)
+		return err;
+
+	for (i = 0; i < scan->fds_nr; i++) {
+		err = plan_add_fd(plan, scan->fds[i]);
+		if (err)
+			return err;
+	}
+
+	for (i = 0; i < scan->maps_nr; i++) {
+		const struct map_scan_s *ms = &scan->maps[i];
+		struct plan_map_s pm = {
+			.start = ms->start,
+			.end = ms->end,
+			.pgoff = ms->pgoff,
+			.open_flags = ms->open_flags,
+			.prot = ms->prot,
+			.flags = ms->flags,
+		};
+
+		err = plan_add_map(plan, &pm, ms->path);
+		if (err)
+			return err;
+	}
+	return 0;
 }
 
-static bool task_is_thread(struct process_info *p)
+/* Scan stage: processes of the collection are scanned, and resources, which
+ * were found, are put into the plan. Scanned processes are returned in plan
+ * order. */
+static int plan_collection(struct list_head *collection,
+			   const struct replace_info_s *ri,
+			   struct replace_plan_s *plan,
+			   struct process_info ***planned)
 {
-	/* Here is checked whether process pid can be found in /proc.
-	 * Note: this works only when readdir is used. Any real access to
-	 * thread proc dentry will succeed.
-	 */
-	return iterate_dir_name("/proc", p, cmp_pid, NULL) > 0 ? false : true;
+	struct process_scan_s *scans;
+	struct process_info *p, **procs;
+	struct tgid_set_s tgids;
+	uint64_t start;
+	int i, nr = 0, err;
+
+	err = collect_tgids(&tgids);
+	if (err)
+		goto free_tgids;
+
+	list_for_each_entry(p, collection, list)
+		nr++;
+
+	err = -ENOMEM;
+	scans = calloc(nr ? nr : 1, sizeof(*scans));
+	if (!scans) {
+		pr_err("failed to allocate process scans\n");
+		goto free_tgids;
+	}
+
+	procs = calloc(nr ? nr : 1, sizeof(*procs));
+	if (!procs) {
+		pr_err("failed to allocate planned processes\n");
+		goto free_scans;
+	}
+
+	nr = 0;
+	list_for_each_entry(p, collection, list) {
+		if (task_is_thread(&tgids, p))
+			continue;
+
+		scans[nr].p = p;
+		scans[nr].ri = ri;
+		procs[nr] = p;
+		nr++;
+	}
+
+	start = plan_now();
+	err = scan_processes(scans, nr);
+	plan->stat.scan_ns = plan_now() - start;
+	if (err)
+		goto free_procs;
+
+	for (i = 0; i < nr; i++) {
+		err = plan_scan(plan, &scans[i]);
+		if (err)
+			goto free_procs;
+	}
+	plan->stat.sockets = unix_sockets_bound();
+
+	*planned = procs;
+	procs = NULL;
+
+free_procs:
+	free(procs);
+free_scans:
+	for (i = 0; i < nr; i++)
+		release_process_scan(&scans[i]);
+	free(scans);
+free_tgids:
+	free(tgids.bits);
+	return err;
 }
 
 int examine_processes(struct list_head *collection,
 		      const struct replace_info_s *ri)
 {
-	struct process_info *p, *tmp;
-	int err;
+	struct process_info *p, **procs = NULL;
+	struct replace_plan_s plan;
+	int i, err;
+
+	plan_init(&plan);
+
+	err = plan_collection(collection, ri, &plan, &procs);
+	if (err)
+		goto release_plan;
 
-	list_for_each_entry_safe(p, tmp, collection, list) {
-		if (task_is_thread(p))
+	plan_print(&plan.stat);
+
+	for (i = 0; i < plan.stat.processes; i++) {
+		const struct plan_process_s *pp = &plan.processes[i];
+
+		p = procs[i];
+
+		/* Parasite is required to copy fds and to swap
+		 * resources. If nothing was found, process is left as is.
+		 * Shared resources are collected and swapped through the
+		 * process, which was scanned. */
+		if (!pp->flags && !pp->fds_nr && !pp->maps_nr)
 			continue;
 
-		err = examine_one_process(p, ri);
+		err = examine_one_process(p, ri, &plan, pp);
 		if (err)
-			return err;
+			goto release_plan;
 
 		if (!p->swap_resources) {
 			/* We don't need parasite in this case.
@@ -1198,11 +1800,15 @@ int examine_processes(struct list_head *collection,
 			if (err) {
 				pr_err("failed to remove parasite "
 						"from process %d\n", p->pid);
-				return err;
+				goto release_plan;
 			}
 		}
 	}
-	return 0;
+
+release_plan:
+	free(procs);
+	plan_release(&plan);
+	return err;
 }
 
 static struct process_info *create_process_info(pid_t pid)
@@ -1247,8 +1853,60 @@ static int collect_one_process(pid_t pid, void *data)
 	return 0;
 }
 
-int collect_processes(const char *pids, struct list_head *collection)
+int collect_processes(const pid_t *pids, int nr_pids, struct list_head *collection)
 {
 	pr_debug("Collecting processes...\n");
-	return iterate_pids_list(pids, collection, collect_one_process);
+	return iterate_pids(pids, nr_pids, collection, collect_one_process);
+}
+
+static int plan_one_process(pid_t pid, void *data)
+{
+	struct process_info *p;
+	struct list_head *collection = data;
+
+	if (pid_is_kthread(pid))
+		return 0;
+
+	p = create_process_info(pid);
+	if (!p)
+		return -ENOMEM;
+
+	list_add_tail(&p->list, collection);
+	return 0;
+}
+
+/* Dry run of scan stage. Processes are neither stopped, nor attached to, so
+ * the plan is an estimation only. Scan fails, if a process exits while
+ * being scanned. */
+int plan_processes(const pid_t *pids, int nr_pids,
+		   const struct replace_info_s *ri, struct plan_stat_s *stat)
+{
+	struct process_info *p, *tmp, **procs = NULL;
+	struct replace_plan_s plan;
+	LIST_HEAD(collection);
+	int err;
+
+	plan_init(&plan);
+
+	pr_debug("Planning processes...\n");
+	err = iterate_pids(pids, nr_pids, &collection, plan_one_process);
+	if (err)
+		goto free_processes;
+
+	err = plan_collection(&collection, ri, &plan, &procs);
+	if (err)
+		goto free_processes;
+
+	plan_print(&plan.stat);
+	*stat = plan.stat;
+
+free_processes:
+	list_for_each_entry_safe(p, tmp, &collection, list) {
+		list_del(&p->list);
+		free(p);
+	}
+	free(procs);
+	plan_release(&plan);
+	release_shared_resources();
+	return err;
 }
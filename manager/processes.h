@@ -13,22 +13,26 @@ struct replace_info_s {
 	const char		*target_mnt;
 };
 
-int get_pids_list(const char *tasks_file, char **list);
+int read_pids(const char *pids_file, pid_t **pids);
 
-int collect_processes(const char *pids, struct list_head *collection);
+int collect_processes(const pid_t *pids, int nr_pids, struct list_head *collection);
 
 int examine_processes(struct list_head *collection,
 		      const struct replace_info_s *ri);
 
-int iterate_pids_list_name(const char *pids_list, void *data,
-			   int (*actor)(pid_t pid, void *data),
-			   const char *actor_name);
+struct plan_stat_s;
+int plan_processes(const pid_t *pids, int nr_pids,
+		   const struct replace_info_s *ri, struct plan_stat_s *stat);
+
+int iterate_pids_name(const pid_t *pids, int nr_pids, void *data,
+		      int (*actor)(pid_t pid, void *data),
+		      const char *actor_name);
 
 #define __stringify(x...)     #x
 #define stringify(x...)       __stringify(x)
 
-#define iterate_pids_list(pids_list, data, actor)		\
-	iterate_pids_list_name(pids_list, data, actor, stringify(actor))
+#define iterate_pids(pids, nr_pids, data, actor)		\
+	iterate_pids_name(pids, nr_pids, data, actor, stringify(actor))
 
 int seize_processes(struct list_head *processes);
 void release_processes(struct list_head *processes);
@@ -38,10 +42,15 @@ struct process_resource {
 	void			*fobj;
 };
 
+struct swap_fd_lock_s;
+
 struct fd_info {
 	int			source_fd;
 	unsigned long		cloexec;
 	long long		pos;
+	/* Taken from fdinfo together with the rest */
+	struct swap_fd_lock_s	*locks;
+	int			nr_locks;
 };
 
 struct process_fd {
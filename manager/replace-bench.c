@@ -0,0 +1,135 @@
+#include "spfs_config.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "include/log.h"
+#include "include/socket.h"
+
+/* Throughput of replace commands, served by spfs-manager.
+ * Each thread sends "switch" commands for its own freezer cgroup one by one
+ * and waits for the reply. Cgroups are expected to be empty, so what is
+ * measured is command dispatch, cgroup freeze and thaw, pid namespace join
+ * and processes collection.
+ * Run spfs-manager with "--workers 0" to get a process per command.
+ */
+
+#define REPLACE_BENCH_MAX_THREADS	64
+
+struct replace_bench_s {
+	pthread_t		thread;
+	const char		*cgroup;
+	unsigned		commands;
+	unsigned		failed;
+	double			latency;
+	double			max_latency;
+};
+
+static const char *replace_bench_socket;
+static dev_t replace_bench_dev;
+
+static double replace_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *replace_bench(void *data)
+{
+	struct replace_bench_s *rb = data;
+	char cmd[4096];
+	double start, latency;
+	unsigned i;
+	int len;
+
+	len = snprintf(cmd, sizeof(cmd), "switch;target=/;device=%ld;freeze_cgroup=%s",
+			replace_bench_dev, rb->cgroup);
+
+	for (i = 0; i < rb->commands; i++) {
+		start = replace_bench_now();
+		if (send_packet(replace_bench_socket, cmd, len + 1))
+			rb->failed++;
+		latency = replace_bench_now() - start;
+
+		rb->latency += latency;
+		if (latency > rb->max_latency)
+			rb->max_latency = latency;
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct replace_bench_s rb[REPLACE_BENCH_MAX_THREADS] = { };
+	unsigned commands, total = 0, failed = 0;
+	double start, elapsed, latency = 0, max_latency = 0;
+	int nr_threads, i, err;
+	struct stat st;
+
+	if (argc < 4) {
+		printf("usage: %s <manager socket> <commands per cgroup> "
+		       "<freezer cgroup>...\n", argv[0]);
+		return 1;
+	}
+
+	replace_bench_socket = argv[1];
+	commands = atoi(argv[2]);
+	nr_threads = argc - 3;
+
+	if (!commands || (nr_threads > REPLACE_BENCH_MAX_THREADS)) {
+		printf("invalid arguments\n");
+		return 1;
+	}
+
+	if (stat("/", &st)) {
+		perror("failed to stat /");
+		return 1;
+	}
+	replace_bench_dev = st.st_dev;
+
+	err = setup_log("/dev/null", 0);
+	if (err)
+		return 1;
+
+	start = replace_bench_now();
+
+	for (i = 0; i < nr_threads; i++) {
+		rb[i].cgroup = argv[i + 3];
+		rb[i].commands = commands;
+
+		err = pthread_create(&rb[i].thread, NULL, replace_bench, &rb[i]);
+		if (err) {
+			printf("failed to create thread: %d\n", err);
+			nr_threads = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(rb[i].thread, NULL);
+		total += rb[i].commands;
+		failed += rb[i].failed;
+		latency += rb[i].latency;
+		if (rb[i].max_latency > max_latency)
+			max_latency = rb[i].max_latency;
+	}
+
+	elapsed = replace_bench_now() - start;
+	if (!total)
+		return 1;
+
+	printf("%u commands (%u failed), %d cgroups: %.1f commands/s, "
+	       "latency avg %.3f ms, max %.3f ms\n",
+	       total, failed, nr_threads, total / elapsed,
+	       latency / total * 1000, max_latency * 1000);
+	return failed ? 1 : 0;
+}
@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 #include "include/util.h"
 #include "include/log.h"
@@ -15,19 +16,21 @@
 #include "processes.h"
 #include "context.h"
 #include "unix-sockets.h"
+#include "scheduler.h"
+#include "plan.h"
 
 static int do_replace_resources(struct freeze_cgroup_s *fg,
 				struct replace_info_s *ri,
 				int *ns_fds)
 {
-	char *pids;
-	int err;
+	pid_t *pids;
+	int err, nr_pids;
 	LIST_HEAD(processes);
 	unsigned orig_ns_mask;
 
-	err = cgroup_pids(fg, &pids);
-	if (err)
-		return err;
+	nr_pids = cgroup_pids(fg, &pids);
+	if (nr_pids < 0)
+		return nr_pids;
 
 	/* We need to set target mount namespace, because we need /proc, where
 	 * we can check, whether process being collected is kthread or not.
@@ -36,7 +39,7 @@ static int do_replace_resources(struct freeze_cgroup_s *fg,
 	if (err)
 		goto free_pids;
 
-	err = collect_processes(pids, &processes);
+	err = collect_processes(pids, nr_pids, &processes);
 	if (err)
 		goto release_processes;
 
@@ -118,10 +121,33 @@ int __replace_resources(struct freeze_cgroup_s *fg, int *ns_fds,
 	return err ? err : status;
 }
 
+static int open_source_mnt(const char *source_mnt,
+			   int *src_mnt_ref, int *src_mnt_id)
+{
+	int err;
+
+	*src_mnt_ref = open(source_mnt, O_PATH);
+	if (*src_mnt_ref < 0) {
+		pr_perror("failed to open %s", source_mnt);
+		return -errno;
+	}
+
+	*src_mnt_id = pid_fd_mnt_id(getpid(), *src_mnt_ref);
+	if (*src_mnt_id < 0) {
+		pr_err("failed to %s mount ID: %d\n",
+				source_mnt, *src_mnt_id);
+		err = *src_mnt_id;
+		close(*src_mnt_ref);
+		*src_mnt_ref = -1;
+		return err;
+	}
+	return 0;
+}
+
 int replace_resources(struct freeze_cgroup_s *fg,
 		      const char *source_mnt, dev_t src_dev,
 		      const char *target_mnt,
-		      pid_t ns_pid)
+		      pid_t ns_pid, struct sched_job_s *job)
 {
 	int res = 0, err, src_mnt_ref = -1, src_mnt_id = -1;
 	int ct_ns_fds[NS_MAX], *ns_fds = NULL;
@@ -136,26 +162,19 @@ int replace_resources(struct freeze_cgroup_s *fg,
 	}
 
 	if (source_mnt) {
-		src_mnt_ref = open(source_mnt, O_PATH);
-		if (src_mnt_ref < 0) {
-			err = -errno;
-			pr_perror("failed to open %s", source_mnt);
-			goto close_ns_fds;
-		}
-
-		src_mnt_id = pid_fd_mnt_id(getpid(), src_mnt_ref);
-		if (src_mnt_id < 0) {
-			pr_err("failed to %s mount ID: %d\n",
-					source_mnt, src_mnt_id);
-			err = src_mnt_id;
+		err = open_source_mnt(source_mnt, &src_mnt_ref, &src_mnt_id);
+		if (err)
 			goto close_ns_fds;
-		}
 	}
 
-	err = lock_cgroup(fg);
+	err = sched_job_begin(job);
 	if (err)
 		goto close_mnt_ref;
 
+	err = lock_cgroup(fg);
+	if (err)
+		goto end_job;
+
 	err = freeze_cgroup(fg);
 	if (err)
 		goto unlock_cgroup;
@@ -168,6 +187,8 @@ int replace_resources(struct freeze_cgroup_s *fg,
 
 unlock_cgroup:
 	(void) unlock_cgroup(fg);
+end_job:
+	sched_job_end(job, err ? err : res);
 close_mnt_ref:
 	if (src_mnt_ref != -1)
 		close(src_mnt_ref);
@@ -176,3 +197,100 @@ close_ns_fds:
 		close_namespaces(ns_fds);
 	return err ? err : res;
 }
+
+static int do_plan_resources(struct freeze_cgroup_s *fg,
+			     struct replace_info_s *ri,
+			     int *ns_fds, struct plan_stat_s *stat)
+{
+	pid_t *pids;
+	int err, nr_pids;
+
+	nr_pids = cgroup_pids(fg, &pids);
+	if (nr_pids < 0)
+		return nr_pids;
+
+	err = join_namespaces(ns_fds, NS_MNT_MASK | NS_NET_MASK, NULL);
+	if (err)
+		goto free_pids;
+
+	err = collect_unix_sockets(ri);
+	if (err)
+		goto free_pids;
+
+	err = plan_processes(pids, nr_pids, ri, stat);
+
+free_pids:
+	free(pids);
+	return err;
+}
+
+/* Estimates the work of replace: processes of the cgroup are scanned, but
+ * the cgroup is not frozen. */
+int plan_resources(struct freeze_cgroup_s *fg,
+		   const char *source_mnt, dev_t src_dev,
+		   const char *target_mnt,
+		   pid_t ns_pid, struct plan_stat_s *stat)
+{
+	int err, status = 0, pid, src_mnt_ref = -1, src_mnt_id = -1;
+	int ct_ns_fds[NS_MAX], *ns_fds = NULL;
+	struct plan_stat_s *shared_stat;
+	struct replace_info_s ri = {
+		.src_dev = src_dev,
+		.source_mnt = source_mnt,
+		.target_mnt = target_mnt,
+	};
+
+	shared_stat = mmap(NULL, sizeof(*shared_stat), PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared_stat == MAP_FAILED) {
+		pr_perror("failed to allocate plan statistics");
+		return -errno;
+	}
+
+	if (ns_pid) {
+		err = open_namespaces(ns_pid, ct_ns_fds);
+		if (err) {
+			pr_perror("failed to open %d namespaces", ns_pid);
+			goto unmap_stat;
+		}
+		ns_fds = ct_ns_fds;
+	}
+
+	if (source_mnt) {
+		err = open_source_mnt(source_mnt, &src_mnt_ref, &src_mnt_id);
+		if (err)
+			goto close_ns_fds;
+	}
+	ri.src_mnt_ref = src_mnt_ref;
+	ri.src_mnt_id = src_mnt_id;
+
+	/* Pids of the cgroup are virtual, like in replace */
+	err = join_namespaces(ns_fds, NS_PID_MASK, NULL);
+	if (err)
+		goto close_mnt_ref;
+
+	pid = fork();
+	switch (pid) {
+		case -1:
+			pr_perror("failed to fork");
+			err = -errno;
+			break;
+		case 0:
+			_exit(do_plan_resources(fg, &ri, ns_fds, shared_stat));
+		default:
+			err = collect_child(pid, &status, 0);
+	}
+
+	if (!err && !status)
+		*stat = *shared_stat;
+
+close_mnt_ref:
+	if (src_mnt_ref != -1)
+		close(src_mnt_ref);
+close_ns_fds:
+	if (ns_fds)
+		close_namespaces(ns_fds);
+unmap_stat:
+	munmap(shared_stat, sizeof(*shared_stat));
+	return err ? err : status;
+}
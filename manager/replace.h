@@ -4,6 +4,8 @@
 #include <stddef.h>
 
 struct freeze_cgroup_s;
+struct sched_job_s;
+struct plan_stat_s;
 
 int __replace_resources(struct freeze_cgroup_s *fg, int *ns_fds,
 		        const char *source_mnt, dev_t src_dev,
@@ -13,6 +15,11 @@ int __replace_resources(struct freeze_cgroup_s *fg, int *ns_fds,
 int replace_resources(struct freeze_cgroup_s *fg,
 		      const char *source_mnt, dev_t src_dev,
 		      const char *target_mnt,
-		      pid_t ns_pid);
+		      pid_t ns_pid, struct sched_job_s *job);
+
+int plan_resources(struct freeze_cgroup_s *fg,
+		   const char *source_mnt, dev_t src_dev,
+		   const char *target_mnt,
+		   pid_t ns_pid, struct plan_stat_s *stat);
 
 #endif
@@ -0,0 +1,459 @@
+#include "spfs_config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "include/util.h"
+#include "include/log.h"
+#include "include/shm.h"
+#include "include/list.h"
+#include "include/futex.h"
+
+#include "scheduler.h"
+
+/* Scheduler of replace jobs.
+ * Job (freeze, replace of resources and thaw of a container) is heavy, so
+ * only limited number of them is run at once. The rest wait in queue,
+ * ordered by container priority and then by arrival.
+ * Jobs are executed by workers: scheduler lives in shared memory, and job
+ * waits for its turn on a futex in its entry.
+ * Scheduler lock is a robust mutex: worker can be killed while holding it.
+ * Entry of a dead worker is marked from SIGCHLD handler, and released by
+ * manager main loop, which is woken up by a pipe.
+ */
+
+/* Each job is executed by its own worker */
+#define SCHED_JOBS_MAX		512
+#define SCHED_PRIORITIES_MAX	64
+
+struct sched_entry_s {
+	struct list_head	list;
+	pid_t			pid;
+	int			prio;
+	/* Set, when job is allowed to run */
+	int			running;
+	/* Set, when worker of the job is dead */
+	int			dead;
+};
+
+struct sched_stat_s {
+	unsigned long		jobs;
+	unsigned long		failed;
+	unsigned		max_queued;
+	uint64_t		wait_ns;
+	uint64_t		max_wait_ns;
+	uint64_t		run_ns;
+	uint64_t		max_run_ns;
+};
+
+struct sched_s {
+	pthread_mutex_t		lock;
+	unsigned		max_running;
+	unsigned		nr_running;
+	unsigned		nr_queued;
+	struct list_head	running;
+	struct list_head	queue;
+	struct list_head	free;
+	struct sched_stat_s	stat;
+	struct sched_entry_s	entries[SCHED_JOBS_MAX];
+};
+
+struct sched_priority_s {
+	char			ovz_id[32];
+	int			prio;
+};
+
+static struct sched_s *sched;
+
+/* Written by SIGCHLD handler, when a worker with a job is dead */
+static int sched_dead_pipe[2] = { -1, -1 };
+
+/* Set on start. Workers have their own copy */
+static struct sched_priority_s sched_priorities[SCHED_PRIORITIES_MAX];
+static int sched_nr_priorities;
+
+static uint64_t sched_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sched_enqueue(struct sched_entry_s *entry);
+
+/* Lock owner was killed, and lists could be left half-updated. They are
+ * rebuilt from the entries. Order of queued jobs of the same priority is
+ * lost. */
+static void sched_recover(void)
+{
+	struct sched_entry_s *e;
+	int i;
+
+	INIT_LIST_HEAD(&sched->running);
+	INIT_LIST_HEAD(&sched->queue);
+	INIT_LIST_HEAD(&sched->free);
+	sched->nr_running = sched->nr_queued = 0;
+
+	for (i = 0; i < SCHED_JOBS_MAX; i++) {
+		e = &sched->entries[i];
+
+		if (!e->pid)
+			list_add_tail(&e->list, &sched->free);
+		else if (e->running) {
+			list_add_tail(&e->list, &sched->running);
+			sched->nr_running++;
+		} else
+			sched_enqueue(e);
+	}
+}
+
+static int sched_lock(void)
+{
+	int err;
+
+	err = pthread_mutex_lock(&sched->lock);
+	if (err == EOWNERDEAD) {
+		pr_warn("scheduler lock owner is dead, recovering\n");
+		sched_recover();
+		err = pthread_mutex_consistent(&sched->lock);
+	}
+	if (err) {
+		pr_err("failed to lock scheduler: %d\n", err);
+		return -err;
+	}
+	return 0;
+}
+
+static void sched_unlock(void)
+{
+	int err;
+
+	err = pthread_mutex_unlock(&sched->lock);
+	if (err)
+		pr_err("failed to unlock scheduler: %d\n", err);
+}
+
+/* "ID:PRIO". Jobs of containers with greater priority are run first */
+int sched_set_priority(const char *opt)
+{
+	struct sched_priority_s *p;
+	const char *colon;
+	int err;
+
+	if (sched_nr_priorities == SCHED_PRIORITIES_MAX) {
+		pr_err("too many priorities: %d\n", SCHED_PRIORITIES_MAX);
+		return -E2BIG;
+	}
+	p = &sched_priorities[sched_nr_priorities];
+
+	colon = strchr(opt, ':');
+	if (!colon || (colon == opt) ||
+	    (colon - opt >= sizeof(p->ovz_id))) {
+		pr_err("invalid priority: %s\n", opt);
+		return -EINVAL;
+	}
+
+	err = xatoi(colon + 1, &p->prio);
+	if (err) {
+		pr_err("invalid priority value: %s\n", colon + 1);
+		return err;
+	}
+
+	memcpy(p->ovz_id, opt, colon - opt);
+	p->ovz_id[colon - opt] = '\0';
+	sched_nr_priorities++;
+	return 0;
+}
+
+static int sched_priority(const char *ovz_id)
+{
+	int i;
+
+	if (!ovz_id)
+		return 0;
+
+	for (i = 0; i < sched_nr_priorities; i++) {
+		if (!strcmp(sched_priorities[i].ovz_id, ovz_id))
+			return sched_priorities[i].prio;
+	}
+	return 0;
+}
+
+void sched_job_init(struct sched_job_s *job, const char *ovz_id)
+{
+	job->ovz_id = ovz_id;
+	job->prio = sched_priority(ovz_id);
+	job->entry = NULL;
+	job->queued_ns = job->start_ns = 0;
+}
+
+/* Must be called with scheduler locked */
+static void sched_dispatch(void)
+{
+	struct sched_entry_s *e;
+
+	while (!list_empty(&sched->queue)) {
+		if (sched->max_running && (sched->nr_running >= sched->max_running))
+			break;
+
+		e = list_first_entry(&sched->queue, struct sched_entry_s, list);
+		list_move_tail(&e->list, &sched->running);
+		sched->nr_queued--;
+		sched->nr_running++;
+
+		__atomic_store_n(&e->running, 1, __ATOMIC_SEQ_CST);
+		(void) futex_wake(&e->running);
+	}
+}
+
+/* Must be called with scheduler locked */
+static void sched_enqueue(struct sched_entry_s *entry)
+{
+	struct sched_entry_s *e;
+
+	/* Behind all the jobs of the same or greater priority */
+	list_for_each_entry(e, &sched->queue, list) {
+		if (e->prio < entry->prio) {
+			list_add_tail(&entry->list, &e->list);
+			goto queued;
+		}
+	}
+	list_add_tail(&entry->list, &sched->queue);
+
+queued:
+	sched->nr_queued++;
+}
+
+/* Waits, until job is allowed to run */
+int sched_job_begin(struct sched_job_s *job)
+{
+	struct sched_entry_s *e;
+	int err;
+
+	job->queued_ns = sched_now();
+
+	err = sched_lock();
+	if (err)
+		return err;
+
+	if (list_empty(&sched->free)) {
+		sched_unlock();
+		pr_err("too many jobs: %d\n", SCHED_JOBS_MAX);
+		return -EAGAIN;
+	}
+
+	e = list_first_entry(&sched->free, struct sched_entry_s, list);
+	list_del(&e->list);
+	e->pid = getpid();
+	e->prio = job->prio;
+	e->running = 0;
+	e->dead = 0;
+
+	sched_enqueue(e);
+	sched_dispatch();
+
+	if (sched->nr_queued > sched->stat.max_queued)
+		sched->stat.max_queued = sched->nr_queued;
+
+	if (!e->running)
+		pr_info("job for container %s (priority %d) is queued (%u in queue)\n",
+				job->ovz_id ? : "none", job->prio,
+				sched->nr_queued);
+
+	sched_unlock();
+
+	while (!__atomic_load_n(&e->running, __ATOMIC_SEQ_CST))
+		(void) futex_wait(&e->running, 0, NULL);
+
+	job->entry = e;
+	job->start_ns = sched_now();
+	return 0;
+}
+
+static void sched_account(const struct sched_job_s *job, int err,
+			  uint64_t wait_ns, uint64_t run_ns)
+{
+	struct sched_stat_s *stat = &sched->stat;
+
+	stat->jobs++;
+	if (err)
+		stat->failed++;
+
+	stat->wait_ns += wait_ns;
+	if (wait_ns > stat->max_wait_ns)
+		stat->max_wait_ns = wait_ns;
+
+	stat->run_ns += run_ns;
+	if (run_ns > stat->max_run_ns)
+		stat->max_run_ns = run_ns;
+}
+
+void sched_job_end(struct sched_job_s *job, int err)
+{
+	struct sched_entry_s *e = job->entry;
+	uint64_t wait_ns, run_ns;
+
+	if (!e)
+		return;
+
+	wait_ns = job->start_ns - job->queued_ns;
+	run_ns = sched_now() - job->start_ns;
+
+	if (sched_lock())
+		return;
+
+	list_move(&e->list, &sched->free);
+	e->pid = 0;
+	sched->nr_running--;
+	sched_account(job, err, wait_ns, run_ns);
+	sched_dispatch();
+
+	sched_unlock();
+
+	job->entry = NULL;
+
+	pr_info("job for container %s (priority %d) %s: waited %.3f ms, ran %.3f ms\n",
+			job->ovz_id ? : "none", job->prio,
+			err ? "failed" : "done",
+			wait_ns / 1000000.0, run_ns / 1000000.0);
+}
+
+/* Worker is dead. Called from SIGCHLD handler, so scheduler lock isn't
+ * taken: entry of a dead worker isn't changed by anyone else, until it's
+ * released by sched_release_dead(). */
+void sched_release(pid_t pid)
+{
+	struct sched_entry_s *e;
+	int i;
+
+	if (!sched)
+		return;
+
+	for (i = 0; i < SCHED_JOBS_MAX; i++) {
+		e = &sched->entries[i];
+
+		if (__atomic_load_n(&e->pid, __ATOMIC_ACQUIRE) != pid)
+			continue;
+
+		__atomic_store_n(&e->dead, 1, __ATOMIC_RELEASE);
+		if (write(sched_dead_pipe[1], "", 1) < 0 && (errno != EAGAIN))
+			pr_perror("failed to wake up scheduler");
+		break;
+	}
+}
+
+int sched_dead_fd(void)
+{
+	return sched_dead_pipe[0];
+}
+
+/* Jobs of dead workers are dropped from queue or from running list */
+void sched_release_dead(void)
+{
+	struct sched_entry_s *e;
+	char buf[64];
+	int i;
+
+	while (read(sched_dead_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	if (sched_lock())
+		return;
+
+	for (i = 0; i < SCHED_JOBS_MAX; i++) {
+		e = &sched->entries[i];
+
+		if (!e->pid || !__atomic_load_n(&e->dead, __ATOMIC_ACQUIRE))
+			continue;
+
+		pr_info("job of dead worker %d is released\n", e->pid);
+		if (e->running)
+			sched->nr_running--;
+		else
+			sched->nr_queued--;
+		list_move(&e->list, &sched->free);
+		e->pid = 0;
+		e->running = 0;
+		e->dead = 0;
+	}
+	sched_dispatch();
+
+	sched_unlock();
+}
+
+/* Called by manager without scheduler lock, so values can be slightly
+ * inconsistent */
+int sched_stat(char *buf, size_t size)
+{
+	struct sched_stat_s stat = sched->stat;
+	unsigned long jobs = stat.jobs ? : 1;
+
+	return snprintf(buf, size,
+			"running: %u\n"
+			"max running: %u\n"
+			"queued: %u\n"
+			"max queued: %u\n"
+			"jobs: %lu\n"
+			"failed: %lu\n"
+			"wait avg ms: %.3f\n"
+			"wait max ms: %.3f\n"
+			"run avg ms: %.3f\n"
+			"run max ms: %.3f\n",
+			sched->nr_running, sched->max_running,
+			sched->nr_queued, stat.max_queued,
+			stat.jobs, stat.failed,
+			stat.wait_ns / jobs / 1000000.0,
+			stat.max_wait_ns / 1000000.0,
+			stat.run_ns / jobs / 1000000.0,
+			stat.max_run_ns / 1000000.0);
+}
+
+/* Zero max_running means no limit */
+int sched_init(unsigned max_running)
+{
+	pthread_mutexattr_t attr;
+	int i, err;
+
+	sched = shm_alloc(sizeof(*sched));
+	if (!sched) {
+		pr_err("failed to allocate scheduler\n");
+		return -ENOMEM;
+	}
+	memset(sched, 0, sizeof(*sched));
+
+	if (pthread_mutexattr_init(&attr)) {
+		pr_err("failed to initialize scheduler lock attributes\n");
+		return -ENOMEM;
+	}
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	err = pthread_mutex_init(&sched->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (err) {
+		pr_err("failed to initialize scheduler lock: %d\n", err);
+		return -err;
+	}
+
+	if (pipe2(sched_dead_pipe, O_CLOEXEC | O_NONBLOCK)) {
+		pr_perror("failed to create scheduler pipe");
+		return -errno;
+	}
+
+	sched->max_running = max_running;
+	INIT_LIST_HEAD(&sched->running);
+	INIT_LIST_HEAD(&sched->queue);
+	INIT_LIST_HEAD(&sched->free);
+
+	for (i = 0; i < SCHED_JOBS_MAX; i++)
+		list_add_tail(&sched->entries[i].list, &sched->free);
+
+	pr_info("scheduler: up to %u jobs at once\n", max_running);
+	return 0;
+}
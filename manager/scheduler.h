@@ -0,0 +1,31 @@
+#ifndef __SPFS_MANAGER_SCHEDULER_H_
+#define __SPFS_MANAGER_SCHEDULER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct sched_entry_s;
+
+/* Freeze, replace and thaw of one container */
+struct sched_job_s {
+	const char		*ovz_id;
+	int			prio;
+	struct sched_entry_s	*entry;
+	uint64_t		queued_ns;
+	uint64_t		start_ns;
+};
+
+int sched_init(unsigned max_running);
+int sched_set_priority(const char *opt);
+
+void sched_job_init(struct sched_job_s *job, const char *ovz_id);
+int sched_job_begin(struct sched_job_s *job);
+void sched_job_end(struct sched_job_s *job, int err);
+
+void sched_release(pid_t pid);
+int sched_dead_fd(void);
+void sched_release_dead(void);
+int sched_stat(char *buf, size_t size);
+
+#endif
@@ -23,6 +23,7 @@
 #include "cgroup.h"
 #include "context.h"
 #include "processes.h"
+#include "scheduler.h"
 
 int create_spfs_info(const char *id,
 		     const char *mountpoint, const char *ns_mountpoint,
@@ -302,6 +303,7 @@ int spfs_send_mode(const struct spfs_info_s *info,
 {
 	size_t psize;
 	struct external_cmd *package;
+	struct spfs_reply_s reply = { };
 	int err;
 
 	pr_debug("changing spfs %s mode to %d (path: %s)\n", info->mnt.id, mode,
@@ -316,13 +318,16 @@ int spfs_send_mode(const struct spfs_info_s *info,
 	}
 	fill_mode_packet(package, mode, proxy_dir, ns_pid);
 
-	err = seqpacket_sock_send(info->sock, package, psize);
+	err = seqpacket_sock_send_reply(info->sock, package, psize,
+					&reply, sizeof(reply));
 	if (err)
 		pr_err("failed to switch spfs %s to %s mode to %s (ns_pid: %d): %d\n",
 				info->mnt.id, mode, proxy_dir, ns_pid, err);
 	else
-		pr_info("spfs %s mode was changed to %d (path: %s, ns_pid: %d)\n",
-				info->mnt.id, mode, proxy_dir, ns_pid);
+		pr_info("spfs %s mode was changed to %d (path: %s, ns_pid: %d, "
+			"reopened %u file handles, %u skipped, in %ld us)\n",
+				info->mnt.id, mode, proxy_dir, ns_pid,
+				reply.reopened, reply.skipped, reply.reopen_us);
 
 	free(package);
 	return err;
@@ -534,9 +539,10 @@ static int do_replace_spfs_resources(struct spfs_info_s *info)
 				   mnt->ns_mountpoint);
 }
 
-static int do_replace_spfs(struct spfs_info_s *info, const char *source)
+static int do_replace_spfs(struct spfs_info_s *info, const char *source,
+			   struct sched_job_s *job)
 {
-	int err, res;
+	int err = 0, res;
 
 	if (mgr_ovz_id()) {
 		err = move_to_cgroup("ve", "/");
@@ -544,10 +550,14 @@ static int do_replace_spfs(struct spfs_info_s *info, const char *source)
 			return err;
 	}
 
-	res = spfs_freeze_and_lock(info);
+	res = sched_job_begin(job);
 	if (res)
 		return res;
 
+	res = spfs_freeze_and_lock(info);
+	if (res)
+		goto end_job;
+
 	/* TODO: this should be done in a different way:
 	 * 1) Place target FS on top of spfs.
 	 * 2) Do resources collection.
@@ -564,6 +574,8 @@ static int do_replace_spfs(struct spfs_info_s *info, const char *source)
 
 	res = spfs_thaw_and_unlock(info);
 
+end_job:
+	sched_job_end(job, err ? err : res);
 	return err ? err : res;
 }
 
@@ -618,7 +630,8 @@ static int do_mount_target(struct spfs_info_s *info,
 
 int replace_spfs(int sock, struct spfs_info_s *info,
 		  const char *source, const char *fstype,
-		  const char *mountflags, const void *options)
+		  const char *mountflags, const void *options,
+		  struct sched_job_s *job)
 {
 	char *mnt;
 	int err;
@@ -656,7 +669,7 @@ int replace_spfs(int sock, struct spfs_info_s *info,
 		/*TODO: should umount the target ? */
 		goto free_mnt;
 
-	err = do_replace_spfs(info, mnt);
+	err = do_replace_spfs(info, mnt, job);
 
 free_mnt:
 	free(mnt);
@@ -63,9 +63,11 @@ int spfs_add_mount_paths(struct spfs_info_s *info, const char *bind_mounts);
 int spfs_send_mode(const struct spfs_info_s *info,
 		   spfs_mode_t mode, const char *proxy_dir, int ns_pid);
 
+struct sched_job_s;
 int replace_spfs(int sock, struct spfs_info_s *info,
 		  const char *source, const char *fstype,
-		  const char *mountflags, const void *options);
+		  const char *mountflags, const void *options,
+		  struct sched_job_s *job);
 
 int spfs_prepare_env(struct spfs_info_s *info, const char *proxy_dir);
 int spfs_cleanup_env(struct spfs_info_s *info, bool killed);
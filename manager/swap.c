@@ -5,11 +5,13 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <stdbool.h>
 
 #include "include/log.h"
 #include "include/util.h"
+#include "include/pie-util-fd.h"
 
 #include "swap.h"
 #include "processes.h"
@@ -21,6 +23,7 @@ typedef enum swap_resource_type {
 	SWAP_RESOURCE_MAP,
 	SWAP_RESOURCE_FS,
 	SWAP_RESOURCE_EXE,
+	SWAP_RESOURCE_LOCKS,
 	SWAP_RESOURCE_MAX,
 } swap_resource_t;
 
@@ -44,49 +47,147 @@ static int do_swap_resource(const struct process_info *p, struct process_resourc
 	return 0;
 }
 
-static int do_swap_fd(const struct process_info *p, int target_fd, const void *data)
+/* Fds and mappings are swapped in batches: target fds of the whole batch are
+ * transferred to the process at once, and then installed by a few runs of
+ * syscall vector.
+ * Batch size is limited by one SCM_RIGHTS message, which also limits number
+ * of temporary fds in the process.
+ */
+#define SWAP_BATCH_SIZE		CR_SCM_MAX_FD
+
+struct swap_batch_s {
+	struct process_resource	*res[SWAP_BATCH_SIZE];
+	const void		*data[SWAP_BATCH_SIZE];
+	int			fds[SWAP_BATCH_SIZE];
+	int			nr;
+};
+
+static int swap_batch_add(struct swap_batch_s *b, struct process_resource *res,
+			  const void *data)
+{
+	int target_fd;
+
+	target_fd = get_fobj_fd(res->fobj);
+	if (target_fd < 0)
+		return target_fd;
+
+	b->res[b->nr] = res;
+	b->data[b->nr] = data;
+	b->fds[b->nr] = target_fd;
+	b->nr++;
+	return 0;
+}
+
+/* Callback swaps the whole batch and returns number of swapped resources.
+ * Process can be short of free fds to receive the whole batch at once: then
+ * it's swapped by parts, which fit. */
+static int swap_batch_flush(const struct process_info *p, struct swap_batch_s *b,
+			    int (*cb)(const struct process_info *p,
+				      const struct swap_batch_s *b))
 {
-	const struct fd_info *info = data;
+	int i, left = b->nr, nr, swapped;
+
+	b->nr = 0;
+	while (left) {
+		nr = transfer_local_fds(p->pctl, b->fds, left);
+		if (nr < 0)
+			return nr;
+
+		b->nr = nr;
+		swapped = cb(p, b);
+		b->nr = 0;
+
+		for (i = 0; i < swapped; i++) {
+			b->res[i]->replaced = true;
+			release_file_obj(b->res[i]->fobj);
+		}
+		if (swapped != nr)
+			return -1;
+
+		left -= nr;
+		memmove(b->res, b->res + nr, sizeof(*b->res) * left);
+		memmove(b->data, b->data + nr, sizeof(*b->data) * left);
+		memmove(b->fds, b->fds + nr, sizeof(*b->fds) * left);
+	}
+	return 0;
+}
+
+static int do_swap_fds(const struct process_info *p, const struct swap_batch_s *b)
+{
+	struct swap_fd_s fds[SWAP_BATCH_SIZE];
+	int i;
+
+	for (i = 0; i < b->nr; i++) {
+		const struct fd_info *info = b->data[i];
 
-	pr_debug("    /proc/%d/fd/%d --> /proc/%d/fd/%d (%s%lli)\n",
-			getpid(), target_fd,
-			p->pid, info->source_fd,
-			info->cloexec ? "O_CLOEXEC, " : "", info->pos);
+		fds[i].src_fd = info->source_fd;
+		fds[i].remote_fd = b->fds[i];
+		fds[i].cloexec = info->cloexec;
+		fds[i].pos = info->pos;
 
-	return swap_fd(p->pctl, info->source_fd, target_fd,
-		       info->cloexec, info->pos);
+		pr_debug("    /proc/%d/fd/%d --> /proc/%d/fd/%d (%s%lli)\n",
+				p->pid, fds[i].remote_fd,
+				p->pid, fds[i].src_fd,
+				info->cloexec ? "O_CLOEXEC, " : "", info->pos);
+	}
+
+	return swap_fds(p->pctl, fds, b->nr);
 }
 
 static int do_swap_process_fds(struct process_info *p)
 {
-	struct process_fd *pfd, *tmp;
+	struct swap_batch_s batch = { .nr = 0 };
+	struct process_fd *pfd;
 	int err;
 
 	if (!p->fds_nr)
 		return 0;
 
-	list_for_each_entry_safe(pfd, tmp, &p->fds, list) {
-		err = do_swap_resource(p, &pfd->res, &pfd->info, do_swap_fd);
+	list_for_each_entry(pfd, &p->fds, list) {
+		err = swap_batch_add(&batch, &pfd->res, &pfd->info);
 		if (err)
-			return err;
-		release_file_obj(pfd->res.fobj);
+			goto flush;
+
+		if (batch.nr == SWAP_BATCH_SIZE) {
+			err = swap_batch_flush(p, &batch, do_swap_fds);
+			if (err)
+				return err;
+		}
 	}
-	return 0;
+	return swap_batch_flush(p, &batch, do_swap_fds);
+
+flush:
+	/* Swap, what was collected already */
+	(void) swap_batch_flush(p, &batch, do_swap_fds);
+	return err;
 }
 
-static int do_swap_map(const struct process_info *p, int target_fd, const void *data)
+static int do_swap_maps(const struct process_info *p, const struct swap_batch_s *b)
 {
-	const struct map_info *info = data;
-
-	pr_debug("    /proc/%d/fd/%d --> /proc/%d/map_files/%lx-%lx\n",
-			getpid(), target_fd, p->pid, info->start, info->end);
+	struct swap_map_s maps[SWAP_BATCH_SIZE];
+	int i;
+
+	for (i = 0; i < b->nr; i++) {
+		const struct map_info *info = b->data[i];
+
+		maps[i].remote_fd = b->fds[i];
+		maps[i].start = info->start;
+		maps[i].end = info->end;
+		maps[i].prot = info->prot;
+		maps[i].flags = info->flags;
+		maps[i].pgoff = info->pgoff;
+
+		pr_debug("    /proc/%d/fd/%d --> /proc/%d/map_files/%lx-%lx\n",
+				p->pid, maps[i].remote_fd, p->pid,
+				info->start, info->end);
+	}
 
-	return swap_map(p->pctl, target_fd, info->start, info->end,
-			info->prot, info->flags, info->pgoff);
+	return swap_maps(p->pctl, maps, b->nr);
 }
 
 static int do_swap_process_maps(struct process_info *p)
 {
+	struct swap_batch_s batch = { .nr = 0 };
 	struct process_map *pm;
 	int err;
 
@@ -94,13 +195,21 @@ static int do_swap_process_maps(struct process_info *p)
 		return 0;
 
 	list_for_each_entry(pm, &p->maps, list) {
-		err = do_swap_resource(p, &pm->res, &pm->info, do_swap_map);
+		err = swap_batch_add(&batch, &pm->res, &pm->info);
 		if (err)
-			return err;
-		release_file_obj(pm->res.fobj);
+			goto flush;
+
+		if (batch.nr == SWAP_BATCH_SIZE) {
+			err = swap_batch_flush(p, &batch, do_swap_maps);
+			if (err)
+				return err;
+		}
 	}
+	return swap_batch_flush(p, &batch, do_swap_maps);
 
-	return 0;
+flush:
+	(void) swap_batch_flush(p, &batch, do_swap_maps);
+	return err;
 }
 
 static int do_swap_root(struct process_info *p, const char *root)
@@ -174,6 +283,44 @@ static int do_swap_process_exe(struct process_info *p)
 	return err;
 }
 
+static int swap_locks_flush(const struct process_info *p,
+			    const struct swap_fd_s *fds, int nr)
+{
+	if (!nr)
+		return 0;
+
+	return (swap_fd_locks(p->pctl, fds, nr) == nr) ? 0 : -1;
+}
+
+/* Locks of the old files were dropped with them */
+static int do_swap_process_locks(struct process_info *p)
+{
+	struct swap_fd_s fds[SWAP_BATCH_SIZE];
+	struct process_fd *pfd;
+	int nr = 0, err;
+
+	list_for_each_entry(pfd, &p->fds, list) {
+		if (!pfd->res.replaced || !pfd->info.nr_locks)
+			continue;
+
+		fds[nr].src_fd = pfd->info.source_fd;
+		fds[nr].remote_fd = -1;
+		fds[nr].locks = pfd->info.locks;
+		fds[nr].nr_locks = pfd->info.nr_locks;
+
+		pr_debug("    %d locks --> /proc/%d/fd/%d\n",
+				fds[nr].nr_locks, p->pid, fds[nr].src_fd);
+
+		if (++nr == SWAP_BATCH_SIZE) {
+			err = swap_locks_flush(p, fds, nr);
+			if (err)
+				return err;
+			nr = 0;
+		}
+	}
+	return swap_locks_flush(p, fds, nr);
+}
+
 typedef int (*swap_handler_t)(struct process_info *p);
 
 static swap_handler_t swap_resources_handlers[SWAP_RESOURCE_MAX] = {
@@ -181,6 +328,7 @@ static swap_handler_t swap_resources_handlers[SWAP_RESOURCE_MAX] = {
 	[SWAP_RESOURCE_MAP]  = do_swap_process_maps,
 	[SWAP_RESOURCE_FS] = do_swap_process_fs,
 	[SWAP_RESOURCE_EXE] = do_swap_process_exe,
+	[SWAP_RESOURCE_LOCKS] = do_swap_process_locks,
 };
 
 static swap_handler_t get_swap_handler(swap_resource_t type)
@@ -221,9 +369,19 @@ static int process_do_swap_handlers(struct process_info *p,
 
 static int do_swap_process_resources(struct process_info *p)
 {
+	int err, lerr;
+
 	pr_info("Swapping process %d resources:\n", p->pid);
 
-	return process_do_swap_handlers(p, SWAP_RESOURCE_FDS, SWAP_RESOURCE_MAX);
+	err = process_do_swap_handlers(p, SWAP_RESOURCE_FDS, SWAP_RESOURCE_LOCKS);
+
+	/* Fds, swapped already, get their locks back, even if the rest has
+	 * failed */
+	lerr = process_do_swap_handler(p, SWAP_RESOURCE_LOCKS);
+	if (lerr)
+		pr_err("failed to restore locks of process %d\n", p->pid);
+
+	return err ? : lerr;
 }
 
 int do_swap_resources(const struct list_head *processes)
@@ -21,7 +21,9 @@
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <syscall.h>
+#include <time.h>
 #include <stdint.h>
 #include <linux/prctl.h>
 #include <string.h>
@@ -31,50 +33,56 @@
 #include "include/log.h"
 
 #include "swapfd.h"
+#include "maps.h"
 
-#define MMAP_SIZE (PATH_MAX + BUILTIN_SYSCALL_SIZE)
+/*
+ * Parasite map layout:
+ * - arguments of single syscalls (paths, scm_fdset)
+ * - injected syscall instruction at PATH_MAX
+ * - syscall vector code
+ * - syscall vector with its arguments
+ */
+#define SYSCALL_VEC_CODE_OFF	(PATH_MAX + BUILTIN_SYSCALL_SIZE)
+#define SWAP_VEC_OFF		(SYSCALL_VEC_CODE_OFF + SYSCALL_VEC_CODE_SIZE)
+#define SWAP_VEC_CALLS		1024
+#define SWAP_VEC_LOCKS		256
+#define SWAP_VEC_IOVS		1024	/* IOV_MAX */
+
+struct swap_vec_s {
+	struct seized_syscall_s	calls[SWAP_VEC_CALLS];
+	struct flock		locks[SWAP_VEC_LOCKS];
+	struct iovec		iov[SWAP_VEC_IOVS];
+	struct iovec		riov[SWAP_VEC_IOVS];
+};
+
+#define MMAP_SIZE (SWAP_VEC_OFF + sizeof(struct swap_vec_s))
 #define MAX_BIND_ATTEMPTS	1000
 
 static void *find_mapping(pid_t pid)
 {
 	char path[PATH_MAX];
 	void *result = MAP_FAILED;
-	size_t size = 0;
-	char *line;
-	FILE *fp;
+	struct maps_reader_s mr;
+	struct maps_entry_s me;
 
 	sprintf(path, "/proc/%d/maps", pid);
-	fp = fopen(path, "r");
-	if (!fp) {
-		pr_perror("Can't open %s", path);
+	if (maps_open(&mr, path, false))
 		return result;
-	}
-
-	while (getline(&line, &size, fp) != -1) {
-		unsigned long start;
-		char x, p;
-		int ret;
-
-		ret = sscanf(line, "%lx-%*x %*c%*c%c%c", &start, &x, &p);
-		if (ret != 3) {
-			pr_err("Can't parse line: %s", line);
-			result = MAP_FAILED;
-			break;
-		}
 
-		if (p != 'p')
+	while (maps_next(&mr, &me) > 0) {
+		if (me.perms[3] != 'p')
 			continue;
 
-		if (x != 'x' || start > TASK_SIZE)
+		if (me.perms[2] != 'x' || me.start > TASK_SIZE)
 			continue;
 
-		result = (void *)start;
-		pr_debug("    Using mapping: %s", line);
+		result = (void *)me.start;
+		pr_debug("    Using mapping: %lx-%lx %.4s %s\n",
+			 me.start, me.end, me.perms, me.path);
 		break;
 	}
 
-	free(line);
-	fclose(fp);
+	maps_close(&mr);
 
 	return result;
 }
@@ -203,131 +211,403 @@ out:
 	return ret;
 }
 
-static int copy_private_content(struct parasite_ctl *ctl, unsigned long to,
-				unsigned long from, unsigned long size)
+/* Every map_verify_rate-th copied run of pages is compared with the source.
+ * Zero disables verification. */
+static unsigned map_verify_rate;
+
+void set_map_verify_rate(unsigned rate)
 {
-	int src = -1, dst = -1, ret = -1;
-	ssize_t copied = 0, count;
-	unsigned int size_map;
-	char buf[PAGE_SIZE];
-	uint64_t *map;
+	map_verify_rate = rate;
+}
 
-	if (size & (PAGE_SIZE - 1)) {
-		pr_err("Not aligned size: %lu\n", size);
-		return -EFAULT;
+/* Present and swapped pages are copied by runs up to this size */
+#define COPY_RUN_MAX		(1 << 20)
+
+struct copy_ctx_s {
+	pid_t	pid;
+	bool	vm;		/* process_vm_* can be used */
+	int	src;		/* /proc/pid/mem fds, opened on demand */
+	int	dst;
+	char	*buf;
+};
+
+static int copy_run_vm(struct copy_ctx_s *cc, unsigned long to,
+		       unsigned long from, size_t len)
+{
+	struct iovec local = {
+		.iov_base = cc->buf,
+		.iov_len = len,
+	};
+	struct iovec remote = {
+		.iov_base = (void *)from,
+		.iov_len = len,
+	};
+
+	if (process_vm_readv(cc->pid, &local, 1, &remote, 1, 0) != len)
+		return -1;
+
+	remote.iov_base = (void *)to;
+	if (process_vm_writev(cc->pid, &local, 1, &remote, 1, 0) != len)
+		return -1;
+
+	return 0;
+}
+
+static int copy_run_mem(struct copy_ctx_s *cc, unsigned long to,
+			unsigned long from, size_t len)
+{
+	if (cc->src < 0) {
+		cc->src = open_pid_mem(cc->pid, O_RDONLY);
+		if (cc->src < 0)
+			return cc->src;
+	}
+	if (cc->dst < 0) {
+		cc->dst = open_pid_mem(cc->pid, O_WRONLY);
+		if (cc->dst < 0)
+			return cc->dst;
+	}
+
+	if (pread(cc->src, cc->buf, len, from) != len) {
+		pr_perror("Can't read from tracee's memory %#lx-%#lx",
+				from, from + len);
+		return -1;
+	}
+	if (pwrite(cc->dst, cc->buf, len, to) != len) {
+		pr_perror("Can't write to tracee's memory %#lx-%#lx",
+				to, to + len);
+		return -1;
 	}
+	return 0;
+}
+
+/* process_vm_* don't force access, like /proc/pid/mem does, so they are used
+ * only if the old mapping is readable. The new one is always writable: it's
+ * mapped with PROT_WRITE until it's moved in place (see swap_maps_chunk()).
+ * If they fail anyway, the run is copied via /proc/pid/mem. */
+static int copy_run(struct copy_ctx_s *cc, unsigned long to,
+		    unsigned long from, size_t len)
+{
+	if (cc->vm && !copy_run_vm(cc, to, from, len))
+		return 0;
+
+	return copy_run_mem(cc, to, from, len);
+}
+
+/* Pages, which have to be carried over to the new mapping: CoWed and swapped
+ * ones. Clean file pages are faulted from the new backing. */
+static bool page_is_private(uint64_t pme)
+{
+	if (pme & PME_SWAP)
+		return true;
+	return (pme & PME_PRESENT) && !(pme & PME_FILE);
+}
+
+/* Returns number of private pages, starting from @page, up to @max */
+static unsigned long private_run(const uint64_t *map, unsigned long page,
+				 unsigned long nr_pages, unsigned long max)
+{
+	unsigned long run = 0;
+
+	while ((page + run < nr_pages) && (run < max) &&
+	       page_is_private(map[page + run]))
+		run++;
+	return run;
+}
+
+static uint64_t *read_pagemap(struct parasite_ctl *ctl, unsigned long from,
+			      unsigned long size)
+{
+	unsigned int size_map;
+	uint64_t *map;
 
 	size_map = PAGEMAP_LEN(size);
 	map = malloc(size_map);
 	if (!map) {
 		pr_perror("Can't malloc() %u for %d\n", size_map, ctl->pid);
-		return -ENOMEM;
+		return NULL;
 	}
 	if (pread(ctl->pagemap_fd, map, size_map, PAGEMAP_PFN_OFF(from)) != size_map) {
 		pr_perror("Can't read %d's pagemap file", ctl->pid);
-		goto free_map;
+		free(map);
+		return NULL;
+	}
+	return map;
+}
+
+static void log_throughput(const char *what, unsigned long bytes,
+			   unsigned long runs, const struct timespec *start)
+{
+	struct timespec end;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+	pr_debug("            %s %lu KiB in %lu runs, %.1f MB/s\n", what,
+			bytes >> 10, runs,
+			(secs > 0) ? bytes / secs / (1 << 20) : 0.0);
+}
+
+static int copy_private_content(struct parasite_ctl *ctl, const uint64_t *map,
+				unsigned long to, unsigned long from,
+				unsigned long size, int prot)
+{
+	struct copy_ctx_s cc = {
+		.pid = ctl->pid,
+		.vm = prot & PROT_READ,
+		.src = -1,
+		.dst = -1,
+	};
+	unsigned long nr_pages = size / PAGE_SIZE, page, run, copied = 0, runs = 0;
+	struct timespec start;
+	int ret = -1;
+
+	cc.buf = malloc(min(size, (unsigned long)COPY_RUN_MAX));
+	if (!cc.buf) {
+		pr_err("Can't allocate copy buffer for %d\n", ctl->pid);
+		return -ENOMEM;
 	}
 
-	src = open_pid_mem(ctl->pid, O_RDONLY);
-	if (src < 0)
-		goto free_map;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	dst = open_pid_mem(ctl->pid, O_WRONLY);
-	if (dst < 0)
-		goto close_src;
+	for (page = 0; page < nr_pages; page += run ? : 1) {
+		unsigned long off, len;
 
-	do {
-		count = PAGE_SIZE;
+		run = private_run(map, page, nr_pages, COPY_RUN_MAX / PAGE_SIZE);
+		if (!run)
+			continue;
 
-		if (map[copied/PAGE_SIZE] & (PME_PRESENT|PME_SWAP)) {
-			pr_debug("            copy %#lx-%#lx to %#lx-%#lx (%s)\n",
-					from + copied, from + copied + count,
-					to + copied, to + copied + count,
-					(map[copied/PAGE_SIZE] & PME_PRESENT) ?
-					"PME_PRESENT" : "PME_SWAP");
+		off = page * PAGE_SIZE;
+		len = run * PAGE_SIZE;
 
-			count = pread(src, buf, count, from + copied);
-			if (count < 0) {
-				pr_perror("Can't read from tracee's memory");
-				goto out;
-			}
-			if (count != pwrite(dst, buf, count, to + copied)) {
-				pr_perror("Can't write to tracee's memory");
-				goto out;
-			}
-			if (!equal_mappings(ctl->pid, from + copied,
-						to + copied, count)) {
-				pr_err(" (!) Mappings %#lx-%#lx and %#lx-%#lx "
-					"are different\n",
-					from + copied, from + copied + count,
-					to + copied, to + copied + count);
-		//		return -1;
-			}
-		}
-		copied += count;
-	} while (copied != size);
+		pr_debug("            copy %#lx-%#lx to %#lx-%#lx\n",
+				from + off, from + off + len,
+				to + off, to + off + len);
+
+		if (copy_run(&cc, to + off, from + off, len))
+			goto out;
+
+		copied += len;
+		runs++;
 
+		if (map_verify_rate && !(runs % map_verify_rate) &&
+		    !equal_mappings(ctl->pid, from + off, to + off, len))
+			pr_err(" (!) Mappings %#lx-%#lx and %#lx-%#lx "
+				"are different\n",
+				from + off, from + off + len,
+				to + off, to + off + len);
+	}
+
+	log_throughput("copied", copied, runs, &start);
 	ret = 0;
 
 out:
-	close(dst);
-close_src:
-	close(src);
-free_map:
-	free(map);
+	if (cc.dst >= 0)
+		close(cc.dst);
+	if (cc.src >= 0)
+		close(cc.src);
+	free(cc.buf);
 	return ret;
 }
 
-static bool sync_map_content(unsigned flags, int prot)
+/* Syscalls of fds or maps swap are queued into the vector and executed in
+ * one run of the process. Owner is the index of fd or map, the call belongs to.
+ */
+struct swap_vec_ctx_s {
+	struct parasite_ctl	*ctl;
+	struct swap_vec_s	*vec;
+	int			owner[SWAP_VEC_CALLS];
+	int			nr_calls;
+	int			nr_locks;
+};
+
+static void swap_vec_init(struct swap_vec_ctx_s *sv, struct parasite_ctl *ctl)
 {
-	return flags & MAP_PRIVATE;
+	sv->ctl = ctl;
+	sv->vec = ctl->local_map + SWAP_VEC_OFF;
+	sv->nr_calls = 0;
+	sv->nr_locks = 0;
 }
 
-static int move_map(struct parasite_ctl *ctl,
-		    unsigned long start, unsigned long end, int dst_fd,
-		    int prot, int flags, unsigned long long pgoff)
+static bool swap_vec_fits(const struct swap_vec_ctx_s *sv, int nr_calls,
+			  int nr_locks)
 {
-	int ret;
-	unsigned long sret, addr;
-	size_t length = end - start;
+	return (sv->nr_calls + nr_calls <= SWAP_VEC_CALLS) &&
+	       (sv->nr_locks + nr_locks <= SWAP_VEC_LOCKS);
+}
 
-	ret = syscall_seized(ctl, __NR_msync, &sret, start, length, MS_SYNC, 0, 0, 0);
-	if (ret || sret) {
-		pr_err("Can't msync at [%lx; %lx], ret=%d, sret=%d\n",
-			start, end, ret, (int)(long)sret);
-		return -1;
-	}
+static void swap_vec_add(struct swap_vec_ctx_s *sv, int owner, int nr,
+			 unsigned long arg1, unsigned long arg2,
+			 unsigned long arg3, unsigned long arg4,
+			 unsigned long arg5, unsigned long arg6)
+{
+	struct seized_syscall_s *c = &sv->vec->calls[sv->nr_calls];
+
+	c->nr = nr;
+	c->args[0] = arg1;
+	c->args[1] = arg2;
+	c->args[2] = arg3;
+	c->args[3] = arg4;
+	c->args[4] = arg5;
+	c->args[5] = arg6;
+	c->ret = 0;
+	sv->owner[sv->nr_calls++] = owner;
+}
 
-	pr_debug("        mmap to replace %lx-%lx, prot=%x, flags=%x, off=%lx\n",
-		 start, start + length, prot, flags, pgoff);
+/* Address of the vector object in the process */
+static unsigned long swap_vec_remote(const struct swap_vec_ctx_s *sv,
+				     const void *local)
+{
+	return (unsigned long)sv->ctl->remote_map + (local - sv->ctl->local_map);
+}
 
-	addr = (unsigned long)mmap_seized(ctl, 0, length, prot, flags, dst_fd, pgoff);
-	if (!addr) {
-		pr_err("mmap failed\n");
+/* Returns number of succeeded calls: it's less, than queued, on failure */
+static int swap_vec_run(struct swap_vec_ctx_s *sv)
+{
+	struct seized_syscall_s *c;
+	int done;
+
+	done = syscall_vec_seized(sv->ctl, sv->vec->calls, sv->nr_calls);
+	if (done < 0) {
+		pr_err("failed to execute syscall vector, pid=%d\n", sv->ctl->pid);
+		done = 0;
+	} else if (done < sv->nr_calls) {
+		c = &sv->vec->calls[done];
+		pr_err("Syscall %lu of vector failed: %d, pid=%d\n",
+				(unsigned long)c->nr, (int)(long)c->ret, sv->ctl->pid);
+	}
+
+	sv->nr_calls = 0;
+	sv->nr_locks = 0;
+	return done;
+}
+
+/* Pid of the process in its own pid namespace */
+static pid_t ns_pid(pid_t pid)
+{
+	char path[] = "/proc/XXXXXXXXXX/status";
+	char *line = NULL, *p;
+	size_t size = 0;
+	pid_t nspid = pid;
+	FILE *fp;
+
+	sprintf(path, "/proc/%d/status", pid);
+	fp = fopen(path, "r");
+	if (!fp) {
+		pr_perror("Can't open %s", path);
 		return -1;
 	}
 
-	if (sync_map_content(flags, prot)) {
-		ret = copy_private_content(ctl, addr, start, length);
-		if (ret)
-			return -1;
+	while (getline(&line, &size, fp) != -1) {
+		if (strncmp(line, "NSpid:", 6))
+			continue;
+		p = strrchr(line, '\t');
+		if (p)
+			nspid = atoi(p + 1);
+		break;
 	}
 
-	flags = MREMAP_FIXED | MREMAP_MAYMOVE;
-	pr_debug("        remapping %lx to %lx, size=%lx\n", addr, start, length);
-	ret = syscall_seized(ctl, __NR_mremap, &sret, addr, length, length, flags, start, 0);
-	if (ret || IS_ERR_VALUE(sret)) {
-		pr_err("Can't remap: ret=%d, sret=%d\n", ret, (int)(long)sret);
-		return -1;
+	free(line);
+	fclose(fp);
+	return nspid;
+}
+
+/* CoWed pages are carried over by the process itself: process_vm_readv from
+ * the old mapping to the new one is executed in the process, so page data
+ * doesn't pass through the manager.
+ * Moving the pages by mremap isn't an option: moved part of mapping would
+ * still be backed by the old file. */
+static int carry_private_content(struct swap_vec_ctx_s *sv, pid_t nspid,
+				 const uint64_t *map, unsigned long to,
+				 unsigned long from, unsigned long size, int prot)
+{
+	struct swap_vec_s *vec = sv->vec;
+	unsigned long nr_pages = size / PAGE_SIZE, page = 0, run;
+	unsigned long carried = 0, runs = 0;
+	struct timespec start;
+	int i;
+
+	/* Unlike /proc/pid/mem, process_vm_readv doesn't force access */
+	if (!(prot & PROT_READ) || (nspid <= 0))
+		return -EACCES;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (page < nr_pages) {
+		unsigned long len = 0;
+		int nr_iovs = 0;
+
+		for (; (page < nr_pages) && (nr_iovs < SWAP_VEC_IOVS); page += run ? : 1) {
+			run = private_run(map, page, nr_pages, nr_pages);
+			if (!run)
+				continue;
+
+			vec->iov[nr_iovs].iov_base = (void *)(to + page * PAGE_SIZE);
+			vec->iov[nr_iovs].iov_len = run * PAGE_SIZE;
+			vec->riov[nr_iovs].iov_base = (void *)(from + page * PAGE_SIZE);
+			vec->riov[nr_iovs].iov_len = run * PAGE_SIZE;
+			len += run * PAGE_SIZE;
+			nr_iovs++;
+		}
+		if (!nr_iovs)
+			break;
+
+		swap_vec_add(sv, 0, __NR_process_vm_readv, nspid,
+			     swap_vec_remote(sv, vec->iov), nr_iovs,
+			     swap_vec_remote(sv, vec->riov), nr_iovs, 0);
+		if ((swap_vec_run(sv) != 1) || (vec->calls[0].ret != len))
+			return -EFAULT;
+
+		for (i = 0; i < nr_iovs; i++) {
+			unsigned long dst = (unsigned long)vec->iov[i].iov_base;
+			unsigned long src = (unsigned long)vec->riov[i].iov_base;
+
+			runs++;
+			if (map_verify_rate && !(runs % map_verify_rate) &&
+			    !equal_mappings(sv->ctl->pid, src, dst, vec->iov[i].iov_len))
+				pr_err(" (!) Mappings %#lx-%#lx and %#lx-%#lx "
+					"are different\n",
+					src, src + vec->iov[i].iov_len,
+					dst, dst + vec->iov[i].iov_len);
+		}
+		carried += len;
 	}
 
-	if (!mapping_accessible(ctl->pid, start, length)) {
-		pr_err("Mapping %#lx-%#lx is not accessible after replace\n",
-				start, start + length);
+	log_throughput("carried", carried, runs, &start);
+	return 0;
+}
+
+/* Content of private mapping is carried over by the process, if possible, or
+ * copied by the manager otherwise */
+static int move_private_content(struct swap_vec_ctx_s *sv, pid_t nspid,
+				unsigned long to, unsigned long from,
+				unsigned long size, int prot)
+{
+	uint64_t *map;
+	int ret;
+
+	if (size & (PAGE_SIZE - 1)) {
+		pr_err("Not aligned size: %lu\n", size);
 		return -EFAULT;
 	}
 
-	return 0;
+	map = read_pagemap(sv->ctl, from, size);
+	if (!map)
+		return -1;
+
+	ret = carry_private_content(sv, nspid, map, to, from, size, prot);
+	if (ret) {
+		pr_debug("            can't carry %#lx-%#lx over, copying\n",
+				from, from + size);
+		ret = copy_private_content(sv->ctl, map, to, from, size, prot);
+	}
+
+	free(map);
+	return ret;
+}
+
+static bool sync_map_content(unsigned flags, int prot)
+{
+	return flags & MAP_PRIVATE;
 }
 
 static int transfer_local_fd(struct parasite_ctl *ctl, int local_fd)
@@ -349,25 +629,184 @@ static int transfer_local_fd(struct parasite_ctl *ctl, int local_fd)
 	return ret;
 }
 
-int swap_map(struct parasite_ctl *ctl, int map_fd,
-	     unsigned long start, unsigned long end,
-	     int prot, int flags, unsigned long long pgoff)
+/* Local fds are sent by chunks, fitting into one SCM_RIGHTS message: each
+ * chunk costs one sendmsg and one injected recvmsg, instead of a pair per fd.
+ * If the process is short of free fd slots, the message is truncated: fds,
+ * installed from it, are closed, and the chunk is resent by halves.
+ * Returns number of transferred fds, which is less than @nr_fds, if the
+ * process has no room for all of them at once, or -errno. Numbers of
+ * transferred fds in the process replace local ones in @fds.
+ */
+int transfer_local_fds(struct parasite_ctl *ctl, int *fds, int nr_fds)
 {
-	int err, remote_fd;
+	int remote[CR_SCM_MAX_FD];
+	int i = 0, nr, chunk = CR_SCM_MAX_FD, ret;
 
-	remote_fd = transfer_local_fd(ctl, map_fd);
-	if (remote_fd < 0)
-		return remote_fd;
+	while (i < nr_fds) {
+		nr = min(chunk, nr_fds - i);
 
-	err = move_map(ctl, start, end, remote_fd, prot, flags, pgoff);
-	if (err)
-		return err;
+		ret = send_fds(ctl, false, fds + i, nr, false);
+		if (ret < 0) {
+			pr_err("failed to send %d local fds to process %d\n",
+					nr, ctl->pid);
+			goto close_received;
+		}
+
+		ret = recv_fds(ctl, true, remote, nr, NULL);
+		if (ret == -ENFILE) {
+			close_remote_fds(ctl, remote, nr);
+			/* Received fds are to be swapped first to free slots */
+			if (i)
+				return i;
+			if (nr > 1) {
+				chunk = nr / 2;
+				pr_debug("process %d is short of fds, retry by %d\n",
+						ctl->pid, chunk);
+				continue;
+			}
+		}
+		if (ret < 0) {
+			pr_err("failed to receive %d local fds in process %d\n",
+					nr, ctl->pid);
+			goto close_received;
+		}
 
-	err = close_seized(ctl, remote_fd);
-	if (err)
-		pr_err("Can't close temporary fd=%d, pid=%d\n", remote_fd, ctl->pid);
+		memcpy(fds + i, remote, sizeof(int) * nr);
+		i += nr;
+	}
+	return i;
 
-	return err;
+close_received:
+	close_remote_fds(ctl, fds, i);
+	return ret;
+}
+
+void close_remote_fds(struct parasite_ctl *ctl, const int *fds, int nr_fds)
+{
+	int i;
+
+	for (i = 0; i < nr_fds; i++)
+		if ((fds[i] >= 0) && close_seized(ctl, fds[i]))
+			pr_err("Can't close temporary fd=%d, pid=%d\n",
+					fds[i], ctl->pid);
+}
+
+/* Mapping is replaced by a new one of remote fd, created elsewhere and moved
+ * in place by mremap. Private content is carried over in between. New private
+ * mapping is writable till then.
+ * So maps are swapped by two vector runs (plus content moving): msync and mmap
+ * for all maps, and then mprotect, mremap and close. New mappings, which were
+ * not moved in place, are unmapped by the third one.
+ */
+static int swap_maps_chunk(struct swap_vec_ctx_s *sv, pid_t nspid,
+			   const struct swap_map_s *maps, int nr_maps)
+{
+	struct parasite_ctl *ctl = sv->ctl;
+	unsigned long addr[SWAP_VEC_CALLS / 2];
+	int i, nr_calls, done, created, mapped, remapped;
+
+	for (i = 0; i < nr_maps; i++) {
+		const struct swap_map_s *m = &maps[i];
+		size_t length = m->end - m->start;
+		int prot = m->prot;
+
+		if (sync_map_content(m->flags, m->prot))
+			prot |= PROT_WRITE;
+
+		pr_debug("        mmap to replace %lx-%lx, prot=%x, flags=%x, off=%llx\n",
+			 m->start, m->end, m->prot, m->flags, m->pgoff);
+
+		swap_vec_add(sv, i, __NR_msync, m->start, length, MS_SYNC, 0, 0, 0);
+		swap_vec_add(sv, i, __NR_mmap, 0, length, prot, m->flags,
+			     m->remote_fd, m->pgoff);
+	}
+
+	done = swap_vec_run(sv);
+	created = mapped = done / 2;
+
+	for (i = 0; i < created; i++)
+		addr[i] = sv->vec->calls[2 * i + 1].ret;
+
+	for (i = 0; i < mapped; i++) {
+		const struct swap_map_s *m = &maps[i];
+
+		if (sync_map_content(m->flags, m->prot) &&
+		    move_private_content(sv, nspid, addr[i], m->start,
+					 m->end - m->start, m->prot)) {
+			mapped = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < mapped; i++) {
+		const struct swap_map_s *m = &maps[i];
+		size_t length = m->end - m->start;
+
+		pr_debug("        remapping %lx to %lx, size=%lx\n",
+			 addr[i], m->start, length);
+
+		if (sync_map_content(m->flags, m->prot) && !(m->prot & PROT_WRITE))
+			swap_vec_add(sv, i, __NR_mprotect, addr[i], length,
+				     m->prot, 0, 0, 0);
+		swap_vec_add(sv, i, __NR_mremap, addr[i], length, length,
+			     MREMAP_FIXED | MREMAP_MAYMOVE, m->start, 0);
+		swap_vec_add(sv, i, __NR_close, m->remote_fd, 0, 0, 0, 0, 0);
+	}
+
+	nr_calls = sv->nr_calls;
+	done = swap_vec_run(sv);
+	if (done == nr_calls)
+		remapped = mapped;
+	else if (sv->vec->calls[done].nr == __NR_close) {
+		/* Map is in place already: only its fd is left */
+		remapped = sv->owner[done] + 1;
+		close_remote_fds(ctl, &maps[remapped - 1].remote_fd, 1);
+	} else
+		remapped = sv->owner[done];
+
+	for (i = remapped; i < nr_maps; i++)
+		close_remote_fds(ctl, &maps[i].remote_fd, 1);
+
+	for (i = remapped; i < created; i++)
+		swap_vec_add(sv, i, __NR_munmap, addr[i],
+			     maps[i].end - maps[i].start, 0, 0, 0, 0);
+	nr_calls = sv->nr_calls;
+	if (nr_calls && (swap_vec_run(sv) != nr_calls))
+		pr_err("failed to unmap %d unused mappings, pid=%d\n",
+				nr_calls, ctl->pid);
+
+	for (i = 0; i < remapped; i++) {
+		const struct swap_map_s *m = &maps[i];
+
+		if (!mapping_accessible(ctl->pid, m->start, m->end - m->start)) {
+			pr_err("Mapping %#lx-%#lx is not accessible after replace\n",
+					m->start, m->end);
+			return i;
+		}
+	}
+	return remapped;
+}
+
+int swap_maps(struct parasite_ctl *ctl, const struct swap_map_s *maps, int nr_maps)
+{
+	struct swap_vec_ctx_s sv;
+	int i, j, nr, swapped;
+	pid_t nspid;
+
+	swap_vec_init(&sv, ctl);
+	nspid = ns_pid(ctl->pid);
+
+	for (i = 0; i < nr_maps; i += nr) {
+		nr = min(SWAP_VEC_CALLS / 3, nr_maps - i);
+
+		swapped = swap_maps_chunk(&sv, nspid, maps + i, nr);
+		if (swapped < nr) {
+			for (j = i + nr; j < nr_maps; j++)
+				close_remote_fds(ctl, &maps[j].remote_fd, 1);
+			return i + swapped;
+		}
+	}
+	return nr_maps;
 }
 
 static void destroy_dgram_socket(struct parasite_ctl *ctl)
@@ -588,6 +1027,7 @@ int set_parasite_ctl(pid_t pid, struct parasite_ctl **ret_ctl)
 	ctl->pid = pid;
 	ctl->syscall_ip = (unsigned long)addr;
 	ctl->syscall_ip_saved = (unsigned long)addr;
+	ctl->syscall_vec_ip = 0;
 	ctl->remote_sockfd = -1;
 	ctl->local_sockfd = -1;
 	ctl->map_length = MMAP_SIZE;
@@ -610,6 +1050,7 @@ int set_parasite_ctl(pid_t pid, struct parasite_ctl **ret_ctl)
 	 * are unstable over our moving of them.
 	 */
 	ctl->syscall_ip = (unsigned long)ctl->remote_map + PATH_MAX;
+	syscall_vec_install(ctl, SYSCALL_VEC_CODE_OFF);
 
 	if (set_dgram_socket(ctl) < 0)
 		goto destroy_parasite;
@@ -704,44 +1145,27 @@ static int change_cwd(struct parasite_ctl *ctl, int cwd_fd)
 	return 0;
 }
 
-struct lock {
-	loff_t start, end;
-	short type;
-	bool is_posix;
-	struct lock *next;
-};
-
-static int make_posix_lock(struct parasite_ctl *ctl, int fd, short type, loff_t start, loff_t end)
+static void add_posix_lock(struct swap_vec_ctx_s *sv, int owner, int fd,
+			   short type, loff_t start, loff_t end)
 {
-	unsigned long sret;
-	struct flock lock;
-	int ret;
+	struct flock *lock = &sv->vec->locks[sv->nr_locks++];
 
-	lock.l_type = type;
-	lock.l_start = start;
-	lock.l_whence = SEEK_SET;
+	lock->l_type = type;
+	lock->l_start = start;
+	lock->l_whence = SEEK_SET;
 	if (end == (loff_t)-1)
-		lock.l_len = 0;
+		lock->l_len = 0;
 	else
-		lock.l_len = end - start + 1;
-	lock.l_pid = ctl->pid;
-
-	memcpy((char *)ctl->local_map, (void *)&lock, sizeof(lock));
-
-	ret = syscall_seized(ctl, __NR_fcntl, &sret, fd, F_SETLK, (unsigned long)ctl->remote_map, 0, 0, 0);
-	if (ret < 0 || ((int)(long)sret) < 0) {
-		pr_err("Can't create posix lock, pid=%d, ret=%d, sret=%d\n", ctl->pid, ret, ((int)(long)sret));
-		return -1;
-	}
+		lock->l_len = end - start + 1;
+	lock->l_pid = sv->ctl->pid;
 
-	return 0;
+	swap_vec_add(sv, owner, __NR_fcntl, fd, F_SETLK,
+		     swap_vec_remote(sv, lock), 0, 0, 0);
 }
 
-static int make_flock_lock(struct parasite_ctl *ctl, int fd, short type)
+static int add_flock_lock(struct swap_vec_ctx_s *sv, int owner, int fd,
+			  short type)
 {
-	unsigned long sret;
-	int ret;
-
 	switch (type) {
 	case F_RDLCK:
 		type = LOCK_SH;
@@ -754,182 +1178,139 @@ static int make_flock_lock(struct parasite_ctl *ctl, int fd, short type)
 		return -1;
 	}
 
-	ret = syscall_seized(ctl, __NR_flock, &sret, fd, type, 0, 0, 0, 0);
-	if (ret < 0 || ((int)(long)sret) < 0) {
-		pr_err("Can't create flock, pid=%d, ret=%d, sret=%d\n", ctl->pid, ret, ((int)(long)sret));
-		return -1;
-	}
-
+	swap_vec_add(sv, owner, __NR_flock, fd, type, 0, 0, 0, 0);
 	return 0;
 }
 
-static int get_flocks(struct parasite_ctl *ctl, FILE *fp, struct lock *head)
+/* Replace a fd, having number @src_fd, with a fd, received from socket.
+ * Close of remote fd goes right after dup2: if dup2 fails, remote fd is the
+ * only one left open. */
+static void add_swap_fd(struct swap_vec_ctx_s *sv, int owner,
+			const struct swap_fd_s *sfd)
 {
-	struct lock *prev = head, *new;
-	char *line = NULL;
-	size_t size = 0;
-	int ret = 0;
+	swap_vec_add(sv, owner, __NR_dup2, sfd->remote_fd, sfd->src_fd, 0, 0, 0, 0);
+	swap_vec_add(sv, owner, __NR_close, sfd->remote_fd, 0, 0, 0, 0, 0);
+	if (sfd->pos != 0)
+		swap_vec_add(sv, owner, __NR_lseek, sfd->src_fd, sfd->pos,
+			     SEEK_SET, 0, 0, 0);
+	swap_vec_add(sv, owner, __NR_fcntl, sfd->src_fd, F_SETFD,
+		     sfd->cloexec, 0, 0, 0);
+}
 
-	while (getline(&line, &size, fp) != -1) {
-		loff_t start, end;
-		char *p = line;
-		bool is_posix;
-		short type;
-		if (strncmp(p, "lock:\t", 6) != 0)
-			continue;
-		p += 6;
-		p = strchr(p, ':');
-		if (!p) {
-			pr_err("Can't parse fdinfo file\n");
-			ret = -1;
-			break;
-		}
-		p++;
-
-		if (strncmp(p, " POSIX  ADVISORY  ", 18) == 0)
-			is_posix = true;
-		else if (strncmp(p, " FLOCK  ADVISORY  ", 18) == 0)
-			is_posix = false;
-		else {
-			pr_err("Unknown lock type: %s", line);
-			ret = -1;
-			break;
-		}
-		p += 18;
-
-		if (strncmp(p, "READ  ", 6) == 0)
-			type = F_RDLCK;
-		else if (strncmp(p, "WRITE ", 6) == 0)
-			type = F_WRLCK;
-		else {
-			pr_err("Unknown lock type: %s", line);
-			ret = -1;
-			break;
-		}
-		p += 6;
+static int add_fd_locks(struct swap_vec_ctx_s *sv, int owner,
+			const struct swap_fd_s *sfd)
+{
+	const struct swap_fd_lock_s *lock;
+	int i;
 
-		p = strrchr(p, ':');
-		if (!p) {
-			pr_err("Can't parse flock %s", line);
-			ret = -1;
-			break;
-		}
-		p++;
+	for (i = 0; i < sfd->nr_locks; i++) {
+		lock = &sfd->locks[i];
 
-		if (sscanf(p, "%*d %ld %ld", &start, &end) == 1) {
-			/* end is EOF */
-			end = (loff_t)-1;
-		}
-		pr_debug("type=%u, start=%ld, end=%ld\n", type, start, end);
+		if (lock->is_posix)
+			add_posix_lock(sv, owner, sfd->src_fd, lock->type,
+				       lock->start, lock->end);
+		else if (add_flock_lock(sv, owner, sfd->src_fd, lock->type))
+			return -1;
+	}
+	return 0;
+}
 
-		new = malloc(sizeof(*new));
-		if (!new) {
-			pr_err("Can't do malloc()\n");
-			ret = -1;
-			break;
-		}
+/* Returns index of the first not swapped fd. Sets @open_from to the index of
+ * the first fd, which remote fd wasn't closed. */
+static int swap_fds_run(struct swap_vec_ctx_s *sv, int swapped, int *open_from)
+{
+	int nr_calls = sv->nr_calls, done;
+
+	if (!nr_calls)
+		return swapped;
 
-		new->is_posix = is_posix;
-		new->type = type;
-		new->start = start;
-		new->end = end;
-		new->next = NULL;
-		prev->next = new;
-		prev = new;
+	done = swap_vec_run(sv);
+	if (done == nr_calls) {
+		*open_from = sv->owner[nr_calls - 1] + 1;
+		return *open_from;
 	}
 
-	free(line);
-	return ret;
+	*open_from = sv->owner[done];
+	if (sv->vec->calls[done].nr != __NR_dup2)
+		(*open_from)++;
+	return sv->owner[done];
 }
 
-/* Replace a fd, having number @src_fd, with a fd, received from socket */
-static int changefd(struct parasite_ctl *ctl, int src_fd, int dst_fd,
-		    unsigned long f_setfd, long long f_pos)
+int swap_fds(struct parasite_ctl *ctl, const struct swap_fd_s *fds, int nr_fds)
 {
-	char fdinfo[] = "/proc/XXXXXXXXXX/fdinfo/XXXXXXXXXX";
-	FILE *fp;
-	unsigned long sret;
-	int ret = 0, exit_code = 0;
-	struct lock head = {.next = NULL,}, *ptr;
+	struct swap_vec_ctx_s sv;
+	int i, swapped = 0, open_from = 0;
 
-	sprintf(fdinfo, "/proc/%d/fdinfo/%d", ctl->pid, src_fd);
-	fp = fopen(fdinfo, "r");
-	if (!fp) {
-		pr_perror("Can't open %s", fdinfo);
-		exit_code = -1;
-		goto out;
-	}
+	swap_vec_init(&sv, ctl);
 
-	if (get_flocks(ctl, fp, &head) < 0) {
-		exit_code = -1;
-		goto out;
-	}
+	for (i = 0; i < nr_fds; i++) {
+		if (!swap_vec_fits(&sv, 4, 0)) {
+			swapped = swap_fds_run(&sv, swapped, &open_from);
+			if (swapped < i)
+				break;
+		}
 
-	ret = syscall_seized(ctl, __NR_dup2, &sret, dst_fd, src_fd, 0, 0, 0, 0);
-	if (ret < 0 || ((int)(long)sret) < 0) {
-		pr_err("Can't dup2(%d, %d). pid=%d\n", dst_fd, src_fd, ctl->pid);
-		exit_code = -1;
-		goto out;
+		add_swap_fd(&sv, i, &fds[i]);
 	}
 
-	ret = close_seized(ctl, dst_fd);
-	if (ret < 0) {
-		pr_err("Can't close temporary fd, pid=%d\n", ctl->pid);
-		exit_code = -1;
-		goto out;
-	}
+	/* Swap, what is queued, even if queueing failed */
+	swapped = swap_fds_run(&sv, swapped, &open_from);
 
-	if (f_pos != 0) {
-		ret = syscall_seized(ctl, __NR_lseek, &sret, src_fd, f_pos, SEEK_SET, 0, 0, 0);
-		if (ret < 0 || ((int)(long)sret) < 0) {
-			pr_err("Can't lseek pid=%d, fd=%d, ret=%d, sret=%d\n",
-				ctl->pid, src_fd, ret, (int)(long)sret);
-			exit_code = -1;
-			goto out;
-		}
+	if (swapped < nr_fds) {
+		pr_err("failed to change source fd %d remote fd %d\n",
+				fds[swapped].src_fd, fds[swapped].remote_fd);
+		for (i = open_from; i < nr_fds; i++)
+			close_remote_fds(ctl, &fds[i].remote_fd, 1);
 	}
+	return swapped;
+}
 
-	ret = syscall_seized(ctl, __NR_fcntl, &sret, src_fd, F_SETFD, f_setfd, 0, 0, 0);
-	if (ret < 0 || ((int)(long)sret) < 0) {
-		pr_err("Can't fcntl pid=%d, fd=%d, ret=%d, sret=%d\n",
-			ctl->pid, src_fd, ret, (int)(long)sret);
-		exit_code = -1;
-	}
-out:
-	ptr = head.next;
-	while (ptr) {
-		struct lock *prev = ptr;
-		if (exit_code == 0) {
-			if (ptr->is_posix)
-				ret = make_posix_lock(ctl, src_fd, ptr->type, ptr->start, ptr->end);
-			else
-				ret = make_flock_lock(ctl, src_fd, ptr->type);
-		}
-		if (ret)
-			exit_code = ret;
-		ptr = ptr->next;
-		free(prev);
-	}
+/* Returns index of the first fd, which locks weren't set */
+static int swap_fd_locks_run(struct swap_vec_ctx_s *sv, int nr_fds)
+{
+	int nr_calls = sv->nr_calls, done;
 
-	if (fp)
-		fclose(fp);
-	return exit_code;
+	if (!nr_calls)
+		return nr_fds;
+
+	done = swap_vec_run(sv);
+	if (done < nr_calls)
+		return sv->owner[done];
+	return nr_fds;
 }
 
-int swap_fd(struct parasite_ctl *ctl, int src_fd, int dst_fd,
-	    unsigned long cloexec, long long pos)
+int swap_fd_locks(struct parasite_ctl *ctl, const struct swap_fd_s *fds, int nr_fds)
 {
-	int err, remote_fd;
+	struct swap_vec_ctx_s sv;
+	int i, nr_locks, done;
 
-	remote_fd = transfer_local_fd(ctl, dst_fd);
-	if (remote_fd < 0)
-		return remote_fd;
+	swap_vec_init(&sv, ctl);
 
-	err = changefd(ctl, src_fd, remote_fd, cloexec, pos);
-	if (err < 0)
-		pr_err("failed to change source fd %d remote fd %d\n", src_fd, remote_fd);
+	for (i = 0; i < nr_fds; i++) {
+		nr_locks = fds[i].nr_locks;
 
-	return err;
+		if (!swap_vec_fits(&sv, nr_locks, nr_locks)) {
+			done = swap_fd_locks_run(&sv, i);
+			if (done < i)
+				return done;
+		}
+
+		if (!swap_vec_fits(&sv, nr_locks, nr_locks)) {
+			pr_err("Too many locks (%d) on fd %d, pid=%d\n",
+					nr_locks, fds[i].src_fd, ctl->pid);
+			break;
+		}
+
+		if (add_fd_locks(&sv, i, &fds[i]))
+			break;
+	}
+
+	/* Set, what is queued, even if queueing failed */
+	done = swap_fd_locks_run(&sv, i);
+	if (done < nr_fds)
+		pr_err("failed to set locks on fd %d, pid=%d\n",
+				fds[done].src_fd, ctl->pid);
+	return done;
 }
 
 static int change_root(struct parasite_ctl *ctl, int cwd_fd, const char *root, bool restore_cwd)
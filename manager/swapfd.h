@@ -49,11 +49,49 @@ int swap_root(struct parasite_ctl *ctl, int cwd_fd, const char *root,
 	      bool restore_cwd);
 int swap_cwd(struct parasite_ctl *ctl, int cwd_fd);
 
-int swap_fd(struct parasite_ctl *ctl, int src_fd, int dst_fd,
-	    unsigned long cloexec, long long pos);
-int swap_map(struct parasite_ctl *ctl, int map_fd,
-	     unsigned long start, unsigned long end,
-	     int prot, int flags, unsigned long long pgoff);
+int transfer_local_fds(struct parasite_ctl *ctl, int *fds, int nr_fds);
+void close_remote_fds(struct parasite_ctl *ctl, const int *fds, int nr_fds);
+
+/* Lock, held via replaced fd. It's re-applied after the replace */
+struct swap_fd_lock_s {
+	long long		start;
+	long long		end;	/* -1 means EOF */
+	short			type;	/* F_RDLCK or F_WRLCK */
+	bool			is_posix;
+};
+
+/* Remote fds are the ones, transferred to the process by transfer_local_fds() */
+struct swap_fd_s {
+	int			src_fd;
+	int			remote_fd;
+	unsigned long		cloexec;
+	long long		pos;
+	/* Used by swap_fd_locks() only */
+	const struct swap_fd_lock_s *locks;
+	int			nr_locks;
+};
+
+struct swap_map_s {
+	int			remote_fd;
+	unsigned long		start;
+	unsigned long		end;
+	int			prot;
+	int			flags;
+	unsigned long long	pgoff;
+};
+
+/* Swap all the given fds or maps with a few runs of the process.
+ * Return number of swapped ones: it's less, than requested, on failure.
+ * Remote fds of not swapped ones are closed. */
+int swap_fds(struct parasite_ctl *ctl, const struct swap_fd_s *fds, int nr_fds);
+int swap_maps(struct parasite_ctl *ctl, const struct swap_map_s *maps, int nr_maps);
+
+/* Locks are set, when all the fds and maps are swapped: close of any fd of a
+ * file drops POSIX locks of the process on it. Returns number of fds, which
+ * locks were set. */
+int swap_fd_locks(struct parasite_ctl *ctl, const struct swap_fd_s *fds, int nr_fds);
+
+void set_map_verify_rate(unsigned rate);
 
 int is_parasite_sock(struct parasite_ctl *ctl, ino_t ino);
 
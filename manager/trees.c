@@ -1,10 +1,13 @@
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/syscall.h>
 #include <search.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include "include/list.h"
 #include "include/log.h"
@@ -30,6 +33,12 @@ struct replace_fd {
 	bool shared;
 };
 
+/* Opened files with the same cheap key. Only they are compared by kcmp */
+struct file_bucket_s {
+	struct file_key_s key;
+	void *fds_root;
+};
+
 struct open_path_s {
 	char *path;
 	unsigned flags;
@@ -61,11 +70,32 @@ static void *fifo_tree_root = NULL;
 static void *mm_tree_root = NULL;
 static void *sk_tree_root = NULL;
 
+/* Trees are filled by examination workers concurrently */
+static pthread_mutex_t trees_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set by tree comparators on kcmp failure. Protected by trees_lock */
+static int kcmp_err;
+
+/* Collected during one replace. Protected by trees_lock */
+static struct trees_stat_s {
+	unsigned long kcmp_calls[KCMP_TYPES];
+	unsigned long fds;
+	unsigned long file_buckets;
+} trees_stat;
+
 static void free_fd_node(void *nodep)
 {
 	free(nodep);
 }
 
+static void free_file_bucket_node(void *nodep)
+{
+	struct file_bucket_s *fb = nodep;
+
+	tdestroy(fb->fds_root, free_fd_node);
+	free(fb);
+}
+
 static void free_fd_table_node(void *nodep)
 {
 	free(nodep);
@@ -93,52 +123,132 @@ static void free_mm_node(void *nodep)
 
 void destroy_obj_trees(void)
 {
-	tdestroy(fd_tree_root, free_fd_node);
+	pthread_mutex_lock(&trees_lock);
+	if (trees_stat.fds || trees_stat.kcmp_calls[KCMP_FILES])
+		pr_info("kcmp calls: file %lu (%lu fds in %lu buckets), "
+			"files %lu, fs %lu, vm %lu\n",
+			trees_stat.kcmp_calls[KCMP_FILE], trees_stat.fds,
+			trees_stat.file_buckets,
+			trees_stat.kcmp_calls[KCMP_FILES],
+			trees_stat.kcmp_calls[KCMP_FS],
+			trees_stat.kcmp_calls[KCMP_VM]);
+	memset(&trees_stat, 0, sizeof(trees_stat));
+
+	tdestroy(fd_tree_root, free_file_bucket_node);
 	tdestroy(fd_table_tree_root, free_fd_table_node);
 	tdestroy(fs_struct_tree_root, free_fs_struct_node);
 	tdestroy(map_fd_tree_root, free_map_fd_node);
 	tdestroy(fifo_tree_root, free_fifo_node);
 	tdestroy(mm_tree_root, free_mm_node);
+	/* Worker process can do another replace */
+	fd_tree_root = fd_table_tree_root = fs_struct_tree_root = NULL;
+	map_fd_tree_root = fifo_tree_root = mm_tree_root = NULL;
+	pthread_mutex_unlock(&trees_lock);
 }
 
+/* Returns 0, if objects are the same, 1 or 2 otherwise (ordering), or
+ * -errno. Must be called with trees lock taken. */
 static int kcmp(int type, pid_t pid1, pid_t pid2, unsigned long idx1, unsigned long idx2)
 {
 	int ret;
 
+	trees_stat.kcmp_calls[type]++;
+
 	ret = syscall(SYS_kcmp, pid1, pid2, type, idx1, idx2);
+	if (ret < 0) {
+		pr_perror("kcmp (type: %d, pid1: %d, pid2: %d, "
+			  "idx1: %ld, idx2: %ld) failed",
+			  type, pid1, pid2, idx1, idx2);
+		return -errno;
+	}
+	if (ret > 2) {
+		pr_err("kcmp (type: %d, pid1: %d, pid2: %d, "
+		       "idx1: %ld, idx2: %ld) returned %d\n",
+		       type, pid1, pid2, idx1, idx2, ret);
+		return -EINVAL;
+	}
+	return ret;
+}
 
-	switch (ret) {
-		case 0:
-			return 0;
-		case 1:
-			return -1;
-		case 2:
-			return 1;
-		case -1:
-			pr_perror("kcmp (type: %d, pid1: %d, pid2: %d, "
-				  "idx1: %ld, idx2: %ld) failed",
-				  type, pid1, pid2, idx1, idx2);
-			break;
-		default:
-			pr_perror("kcmp (type: %d, pid1: %d, pid2: %d, "
-				  "idx1: %ld, idx2: %ld) returned %d\n",
-				  type, pid1, pid2, idx1, idx2);
-			break;
+/* Comparator for kcmp-ordered trees. On failure the search is stopped as
+ * if the object was found, and the error is left in kcmp_err: the tree
+ * can't be trusted after that, and the replace is aborted. */
+static int kcmp_order(int type, pid_t pid1, pid_t pid2,
+		      unsigned long idx1, unsigned long idx2)
+{
+	int ret;
+
+	ret = kcmp(type, pid1, pid2, idx1, idx2);
+	if (ret < 0) {
+		if (!kcmp_err)
+			kcmp_err = ret;
+		return 0;
+	}
+	return (ret == 1) ? -1 : (ret == 2);
+}
+
+static int compare_file_keys(const void *a, const void *b)
+{
+	const struct file_key_s *f = &((const struct file_bucket_s *)a)->key;
+	const struct file_key_s *s = &((const struct file_bucket_s *)b)->key;
+
+	if (f->ino != s->ino)
+		return f->ino < s->ino ? -1 : 1;
+	if (f->dev != s->dev)
+		return f->dev < s->dev ? -1 : 1;
+	if (f->pos != s->pos)
+		return f->pos < s->pos ? -1 : 1;
+	if (f->flags != s->flags)
+		return f->flags < s->flags ? -1 : 1;
+	return 0;
+}
+
+static int find_file_bucket(const struct file_key_s *key,
+			    struct file_bucket_s **bucket)
+{
+	struct file_bucket_s *new_fb, **found_fb;
+
+	new_fb = malloc(sizeof(*new_fb));
+	if (!new_fb) {
+		pr_err("failed to allocate\n");
+		return -ENOMEM;
+	}
+	new_fb->key = *key;
+	/* Close-on-exec flag belongs to descriptor, not to file */
+	new_fb->key.flags &= ~O_CLOEXEC;
+	new_fb->fds_root = NULL;
+
+	found_fb = tsearch(new_fb, &fd_tree_root, compare_file_keys);
+	if (!found_fb) {
+		pr_err("failed to add new file bucket to the tree\n");
+		free(new_fb);
+		return -ENOMEM;
 	}
-	_exit(EXIT_FAILURE);
+
+	if (*found_fb != new_fb)
+		free(new_fb);
+	else
+		trees_stat.file_buckets++;
+
+	*bucket = *found_fb;
+	return 0;
 }
 
 static int compare_fds(const void *a, const void *b)
 {
 	const struct replace_fd *f = a, *s = b;
 
-	return kcmp(KCMP_FILE, f->pid, s->pid, f->fd, s->fd);
+	return kcmp_order(KCMP_FILE, f->pid, s->pid, f->fd, s->fd);
 }
 
-int collect_fd(pid_t pid, int fd, void *file_obj, void **real_file_obj)
+/* Files are looked up by cheap key first (inode, device, position and
+ * flags), and only the files in the same bucket are compared by kcmp. */
+int collect_fd(pid_t pid, int fd, const struct file_key_s *key,
+	       void *file_obj, void **real_file_obj)
 {
-	struct replace_fd *new_fd, **found_fd;
-	int err = -ENOMEM;
+	struct file_bucket_s *fb;
+	struct replace_fd *new_fd, **found_fd, *rfd;
+	int err;
 
 	new_fd = malloc(sizeof(*new_fd));
 	if (!new_fd) {
@@ -150,22 +260,37 @@ int collect_fd(pid_t pid, int fd, void *file_obj, void **real_file_obj)
 	new_fd->shared = false;
 	new_fd->file_obj = file_obj;
 
-	found_fd = tsearch(new_fd, &fd_tree_root, compare_fds);
+	pthread_mutex_lock(&trees_lock);
+
+	err = find_file_bucket(key, &fb);
+	if (err)
+		goto unlock;
+
+	kcmp_err = 0;
+	found_fd = tsearch(new_fd, &fb->fds_root, compare_fds);
+	err = kcmp_err;
+	if (err)
+		goto unlock;
 	if (!found_fd) {
-		pr_err("failed to add new fd object to the tree\n");
-		goto free_new_fd;
+		err = -ENOMEM;
+		goto unlock;
 	}
 
-	if (*found_fd != new_fd) {
-		(*found_fd)->shared = true;
+	rfd = *found_fd;
+	if (rfd != new_fd) {
+		rfd->shared = true;
+		free(new_fd);
+		new_fd = NULL;
+	} else
+		trees_stat.fds++;
+	*real_file_obj = rfd->file_obj;
+
+unlock:
+	pthread_mutex_unlock(&trees_lock);
+	if (err) {
+		pr_err("failed to add new fd object to the tree\n");
 		free(new_fd);
 	}
-
-	*real_file_obj = (*found_fd)->file_obj;
-	return 0;
-
-free_new_fd:
-	free(new_fd);
 	return err;
 }
 
@@ -173,7 +298,7 @@ static int compare_fd_tables(const void *a, const void *b)
 {
 	const struct fd_table_s *f = a, *s = b;
 
-	return kcmp(KCMP_FILES, f->pid, s->pid, 0, 0);
+	return kcmp_order(KCMP_FILES, f->pid, s->pid, 0, 0);
 }
 
 pid_t fd_table_exists(pid_t pid)
@@ -181,16 +306,21 @@ pid_t fd_table_exists(pid_t pid)
 	struct fd_table_s fdt = {
 		.pid = pid,
 	}, **found_fdt;
+	pid_t found_pid;
 
+	pthread_mutex_lock(&trees_lock);
+	kcmp_err = 0;
 	found_fdt = tfind(&fdt, &fd_table_tree_root, compare_fd_tables);
-	if (!found_fdt)
-		return 0;
-	return (*found_fdt)->pid;
+	found_pid = found_fdt ? (*found_fdt)->pid : 0;
+	if (kcmp_err)
+		found_pid = kcmp_err;
+	pthread_mutex_unlock(&trees_lock);
+	return found_pid;
 }
 
 int collect_fd_table(pid_t pid)
 {
-	struct fd_table_s *new_fdt, **found_fdt;
+	struct fd_table_s *new_fdt, **found_fdt, *found;
 	int err = -ENOMEM;
 
 	new_fdt = malloc(sizeof(*new_fdt));
@@ -200,17 +330,25 @@ int collect_fd_table(pid_t pid)
 	}
 	new_fdt->pid = pid;
 
+	pthread_mutex_lock(&trees_lock);
+	kcmp_err = 0;
 	found_fdt = tsearch(new_fdt, &fd_table_tree_root, compare_fd_tables);
-	if (!found_fdt) {
+	err = kcmp_err;
+	found = found_fdt ? *found_fdt : NULL;
+	pthread_mutex_unlock(&trees_lock);
+	if (err)
+		goto free_new_fdt;
+	if (!found) {
 		pr_err("failed to add new fdt object to the tree\n");
+		err = -ENOMEM;
 		goto free_new_fdt;
 	}
 
-	if (*found_fdt == new_fdt)
+	if (found == new_fdt)
 		return 0;
 
 	pr_info("process %d shares fd table with process %d\n", pid,
-			(*found_fdt)->pid);
+			found->pid);
 
 	err = -EEXIST;
 
@@ -223,7 +361,7 @@ static int compare_fs_struct(const void *a, const void *b)
 {
 	const struct fs_struct_s *f = a, *s = b;
 
-	return kcmp(KCMP_FS, f->pid, s->pid, 0, 0);
+	return kcmp_order(KCMP_FS, f->pid, s->pid, 0, 0);
 }
 
 pid_t fs_struct_exists(pid_t pid)
@@ -231,16 +369,21 @@ pid_t fs_struct_exists(pid_t pid)
 	struct fs_struct_s fs = {
 		.pid = pid,
 	}, **found_fs;
+	pid_t found_pid;
 
+	pthread_mutex_lock(&trees_lock);
+	kcmp_err = 0;
 	found_fs = tfind(&fs, &fs_struct_tree_root, compare_fs_struct);
-	if (!found_fs)
-		return 0;
-	return (*found_fs)->pid;
+	found_pid = found_fs ? (*found_fs)->pid : 0;
+	if (kcmp_err)
+		found_pid = kcmp_err;
+	pthread_mutex_unlock(&trees_lock);
+	return found_pid;
 }
 
 int collect_fs_struct(pid_t pid)
 {
-	struct fs_struct_s *new_fs, **found_fs;
+	struct fs_struct_s *new_fs, **found_fs, *found;
 	int err = -ENOMEM;
 
 	new_fs = malloc(sizeof(*new_fs));
@@ -250,17 +393,25 @@ int collect_fs_struct(pid_t pid)
 	}
 	new_fs->pid = pid;
 
+	pthread_mutex_lock(&trees_lock);
+	kcmp_err = 0;
 	found_fs = tsearch(new_fs, &fs_struct_tree_root, compare_fs_struct);
-	if (!found_fs) {
+	err = kcmp_err;
+	found = found_fs ? *found_fs : NULL;
+	pthread_mutex_unlock(&trees_lock);
+	if (err)
+		goto free_new_fs;
+	if (!found) {
 		pr_err("failed to add new fs object to the tree\n");
+		err = -ENOMEM;
 		goto free_new_fs;
 	}
 
-	if (*found_fs == new_fs)
+	if (found == new_fs)
 		return 0;
 
 	pr_info("process %d shares fs struct with process %d\n", pid,
-			(*found_fs)->pid);
+			found->pid);
 	err = -EEXIST;
 
 free_new_fs:
@@ -285,7 +436,7 @@ static int compare_map_fd(const void *a, const void *b)
 
 int collect_open_path(const char *path, unsigned flags, void *file_obj, void **real_file_obj)
 {
-	struct open_path_s *new_op, **found_op;
+	struct open_path_s *new_op, **found_op, *found;
 	int err = -ENOMEM;
 
 	new_op = malloc(sizeof(*new_op));
@@ -301,17 +452,22 @@ int collect_open_path(const char *path, unsigned flags, void *file_obj, void **r
 	new_op->flags = flags;
 	new_op->file_obj = file_obj;
 
+	pthread_mutex_lock(&trees_lock);
 	found_op = tsearch(new_op, &map_fd_tree_root, compare_map_fd);
 	if (!found_op) {
+		pthread_mutex_unlock(&trees_lock);
 		pr_err("failed to add new map fd object to the tree\n");
 		goto free_new_op_path;
 	}
 
-	*real_file_obj = (*found_op)->file_obj;
+	found = *found_op;
+	pthread_mutex_unlock(&trees_lock);
+
+	*real_file_obj = found->file_obj;
 
 	err = 0;
 
-	if (*found_op == new_op)
+	if (found == new_op)
 		goto exit;
 
 free_new_op_path:
@@ -332,7 +488,7 @@ static int compare_paths(const void *a, const void *b)
 static int collect_path(const char *path, void **root)
 {
 	char *p;
-	const char **fp;
+	const char **fp, *found;
 
 	p = strdup(path);
 	if (!p) {
@@ -341,14 +497,17 @@ static int collect_path(const char *path, void **root)
 		return -ENOMEM;
 	}
 
+	pthread_mutex_lock(&trees_lock);
 	fp = tsearch(p, root, compare_paths);
+	found = fp ? *fp : NULL;
+	pthread_mutex_unlock(&trees_lock);
 	if (!fp) {
 		pr_err("failed to add new path object to the tree\n");
 		free(p);
 		return -ENOMEM;
 	}
 
-	if (*fp == p)
+	if (found == p)
 		return 0;
 
 	return -EEXIST;
@@ -363,7 +522,7 @@ static int compare_mm_struct(const void *a, const void *b)
 {
 	const struct mm_struct_s *f = a, *s = b;
 
-	return kcmp(KCMP_VM, f->pid, s->pid, 0, 0);
+	return kcmp_order(KCMP_VM, f->pid, s->pid, 0, 0);
 }
 
 pid_t mm_exists(pid_t pid)
@@ -371,17 +530,21 @@ pid_t mm_exists(pid_t pid)
 	struct mm_struct_s mm = {
 		.pid = pid,
 	}, **found_mm;
+	pid_t found_pid;
 
-
+	pthread_mutex_lock(&trees_lock);
+	kcmp_err = 0;
 	found_mm = tfind(&mm, &mm_tree_root, compare_mm_struct);
-	if (!found_mm)
-		return 0;
-	return (*found_mm)->pid;
+	found_pid = found_mm ? (*found_mm)->pid : 0;
+	if (kcmp_err)
+		found_pid = kcmp_err;
+	pthread_mutex_unlock(&trees_lock);
+	return found_pid;
 }
 
 int collect_mm(pid_t pid)
 {
-	struct mm_struct_s *new_mm, **found_mm;
+	struct mm_struct_s *new_mm, **found_mm, *found;
 	int err = -ENOMEM;
 
 	new_mm = malloc(sizeof(*new_mm));
@@ -391,17 +554,25 @@ int collect_mm(pid_t pid)
 	}
 	new_mm->pid = pid;
 
+	pthread_mutex_lock(&trees_lock);
+	kcmp_err = 0;
 	found_mm = tsearch(new_mm, &mm_tree_root, compare_mm_struct);
-	if (!found_mm) {
+	err = kcmp_err;
+	found = found_mm ? *found_mm : NULL;
+	pthread_mutex_unlock(&trees_lock);
+	if (err)
+		goto free_new_mm;
+	if (!found) {
 		pr_err("failed to add new mm object to the tree\n");
+		err = -ENOMEM;
 		goto free_new_mm;
 	}
 
-	if (*found_mm == new_mm)
+	if (found == new_mm)
 		return 0;
 
 	pr_info("process %d shares mm struct with process %d\n", pid,
-			(*found_mm)->pid);
+			found->pid);
 	err = -EEXIST;
 
 free_new_mm:
@@ -422,7 +593,7 @@ static int compare_sock_ino(const void *a, const void *b)
 
 int collect_unix_socket(ino_t ino, void *data)
 {
-	struct sock_struct_s *new_sk, **found_sk;
+	struct sock_struct_s *new_sk, **found_sk, *found;
 	int err = -ENOMEM;
 
 	new_sk = malloc(sizeof(*new_sk));
@@ -433,13 +604,17 @@ int collect_unix_socket(ino_t ino, void *data)
 	new_sk->ino = ino;
 	new_sk->data = data;
 
+	pthread_mutex_lock(&trees_lock);
 	found_sk = tsearch(new_sk, &sk_tree_root, compare_sock_ino);
 	if (!found_sk) {
+		pthread_mutex_unlock(&trees_lock);
 		pr_err("failed to add new socket object to the tree\n");
 		goto free_new_sk;
 	}
+	found = *found_sk;
+	pthread_mutex_unlock(&trees_lock);
 
-	if (*found_sk == new_sk)
+	if (found == new_sk)
 		return 0;
 
 	pr_err("socket with inode %d already exists\n", ino);
@@ -458,10 +633,11 @@ int find_unix_socket(ino_t ino, void **data)
 		.ino = ino,
 	}, **found_sk;
 
+	pthread_mutex_lock(&trees_lock);
 	found_sk = tfind(&cookie, &sk_tree_root, compare_sock_ino);
-	if (!found_sk) {
-		return -ENOENT;
-	}
-	*data = (*found_sk)->data;
-	return 0;
+	if (found_sk)
+		*data = (*found_sk)->data;
+	pthread_mutex_unlock(&trees_lock);
+
+	return found_sk ? 0 : -ENOENT;
 }
@@ -1,7 +1,19 @@
 #ifndef __SPFS_MANAGER_TREES_H_
 #define __SPFS_MANAGER_TREES_H_
 
-int collect_fd(pid_t pid, int fd, void *file_obj, void **real_file_obj);
+#include <sys/types.h>
+
+/* Cheap key of opened file: files with different keys are different */
+struct file_key_s {
+	dev_t		dev;
+	ino_t		ino;
+	long long	pos;
+	unsigned	flags;
+};
+
+int collect_fd(pid_t pid, int fd, const struct file_key_s *key,
+	       void *file_obj, void **real_file_obj);
+/* Returns pid of process, sharing the object, 0 or -errno */
 pid_t fd_table_exists(pid_t pid);
 int collect_fd_table(pid_t pid);
 pid_t fs_struct_exists(pid_t pid);
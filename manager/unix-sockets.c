@@ -231,6 +231,9 @@ free_sk:
 	return err;
 }
 
+/* Sockets, bound on source mount: they are to be bound again */
+static unsigned nr_bound_sockets;
+
 static int unix_collect_bound(const struct unix_diag_msg *m, struct nlattr **tb)
 {
 	struct unix_socket_info *sk;
@@ -243,9 +246,16 @@ static int unix_collect_bound(const struct unix_diag_msg *m, struct nlattr **tb)
 	err = unix_socket_collect(sk);
 	if (err)
 		unix_destroy_one(sk);
+	else
+		nr_bound_sockets++;
 	return 0;
 }
 
+unsigned unix_sockets_bound(void)
+{
+	return nr_bound_sockets;
+}
+
 static bool need_to_collect_bound(const struct unix_diag_msg *m,
 				  struct nlattr **tb,
 				  const struct replace_info_s *ri)
@@ -3,6 +3,7 @@
 
 struct replace_info_s;
 int collect_unix_sockets(struct replace_info_s *ri);
+unsigned unix_sockets_bound(void);
 
 int unix_sk_file_open(const char *cwd, unsigned flags, int source_fd);
 bool unix_sk_early_open(const char *cwd, unsigned flags, int source_fd);
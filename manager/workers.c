@@ -0,0 +1,470 @@
+#include "spfs_config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "include/util.h"
+#include "include/log.h"
+#include "include/shm.h"
+#include "include/namespaces.h"
+#include "include/socket.h"
+
+#include "context.h"
+#include "cgroup.h"
+#include "scheduler.h"
+#include "workers.h"
+
+/* Pool of persistent worker processes.
+ * Commands, which can take long (mode, replace, switch) are executed by
+ * workers, so manager keeps serving its socket without forking a child per
+ * command.
+ * Workers are cloned with CLONE_FILES: they share file descriptors table with
+ * manager. So descriptors, opened by manager after worker creation (spfs
+ * mount references, namespaces, connection sockets) are valid in workers, and
+ * descriptors, closed by worker (spfs mount reference on successful replace),
+ * are closed for manager as well.
+ * Jobs are sent via seqpacket socket pair, read by all idle workers. Number
+ * of idle workers is kept in shared memory. Manager reserves idle worker for
+ * each job and clones a new one, if there is none: replace on hold can wait
+ * for release command for a long time, and release must not wait for it.
+ * Worker exits instead of becoming idle, if there are enough idle workers
+ * already.
+ * Connection is passed to worker together with the job, and manager doesn't
+ * serve it until worker passes it back. Meanwhile manager serves the other
+ * connections, so jobs for different containers are run concurrently.
+ */
+
+#define WORKERS_MAX		512
+#define WORKER_STACK_SIZE	(1 << 20)
+/* Worker is recycled after this number of jobs to drop whatever was leaked */
+#define WORKER_MAX_JOBS		1024
+
+struct worker_msg_s {
+	/* Connection, passed to worker */
+	int			sock;
+	char			job[WORKER_JOB_MAX];
+};
+
+struct worker_slot_s {
+	pid_t			pid;
+	/* Connection socket of job in progress */
+	int			sock;
+};
+
+struct workers_shared_s {
+	int			idle;
+	struct worker_slot_s	slots[WORKERS_MAX];
+};
+
+struct worker_args_s {
+	struct worker_slot_s	*slot;
+	/* Reserved worker takes the first job without becoming idle */
+	bool			reserved;
+};
+
+static struct worker_pool_s {
+	int			jobs[2];
+	/* Connections, passed back by workers */
+	int			conns[2];
+	unsigned		spare;
+	worker_job_t		run;
+	void			*data;
+	struct workers_shared_s	*shared;
+} pool = {
+	.jobs = { -1, -1 },
+	.conns = { -1, -1 },
+};
+
+/* Worker becomes idle, unless there are enough idle workers already */
+static bool worker_get_idle(void)
+{
+	int *idle = &pool.shared->idle;
+	int nr = __atomic_load_n(idle, __ATOMIC_SEQ_CST);
+
+	do {
+		if (nr >= pool.spare)
+			return false;
+	} while (!__atomic_compare_exchange_n(idle, &nr, nr + 1, false,
+					      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	return true;
+}
+
+static bool worker_put_idle(void)
+{
+	int *idle = &pool.shared->idle;
+	int nr = __atomic_load_n(idle, __ATOMIC_SEQ_CST);
+
+	do {
+		if (!nr)
+			return false;
+	} while (!__atomic_compare_exchange_n(idle, &nr, nr - 1, false,
+					      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	return true;
+}
+
+static void worker_put_conn(int sock)
+{
+	if (write(pool.conns[1], &sock, sizeof(sock)) != sizeof(sock))
+		pr_perror("failed to pass connection %d back", sock);
+}
+
+/* Job can leave worker in container namespaces, cgroup and directory */
+static int worker_reset(void)
+{
+	int err;
+
+	/* Pid namespace for children isn't checked by join_namespaces() */
+	err = set_namespaces(mgr_ns_fds(), NS_PID_MASK);
+	if (err)
+		return err;
+
+	err = join_namespaces(mgr_ns_fds(), NS_UTS_MASK | NS_MNT_MASK |
+					    NS_NET_MASK | NS_USER_MASK, NULL);
+	if (err)
+		return err;
+
+	if (mgr_ovz_id()) {
+		err = move_to_cgroup("ve/", mgr_ovz_id());
+		if (err)
+			return err;
+	}
+
+	if (chdir(mgr_work_dir())) {
+		pr_perror("failed to chdir into %s", mgr_work_dir());
+		return -errno;
+	}
+	return 0;
+}
+
+static int worker(void *arg)
+{
+	struct worker_args_s *args = arg;
+	struct worker_slot_s *slot = args->slot;
+	bool reserved = args->reserved;
+	struct worker_msg_s msg;
+	ssize_t bytes;
+	int jobs, err;
+
+	/* Log writer thread wasn't cloned */
+	forget_log_writer();
+
+	if (prctl(PR_SET_PDEATHSIG, SIGKILL)) {
+		pr_perror("failed to set parent death signal");
+		_exit(EXIT_FAILURE);
+	}
+
+	/* Job children are collected by worker itself */
+	signal(SIGCHLD, SIG_DFL);
+
+	for (jobs = 0; jobs < WORKER_MAX_JOBS; jobs++) {
+		if (!reserved && !worker_get_idle())
+			break;
+		reserved = false;
+
+		bytes = recv(pool.jobs[1], &msg, sizeof(msg), 0);
+		if (bytes < (ssize_t)offsetof(struct worker_msg_s, job)) {
+			pr_perror("failed to receive job");
+			(void) worker_put_idle();
+			break;
+		}
+		__atomic_store_n(&slot->sock, msg.sock, __ATOMIC_SEQ_CST);
+
+		err = pool.run(msg.sock, pool.data, msg.job,
+			       bytes - offsetof(struct worker_msg_s, job));
+		pr_debug("worker %d: job finished with %d\n", getpid(), err);
+
+		__atomic_store_n(&slot->sock, -1, __ATOMIC_SEQ_CST);
+		worker_put_conn(msg.sock);
+
+		if (worker_reset()) {
+			pr_err("worker %d: failed to reset\n", getpid());
+			break;
+		}
+	}
+
+	pr_debug("worker %d: exiting after %d jobs\n", getpid(), jobs);
+	_exit(EXIT_SUCCESS);
+}
+
+static struct worker_slot_s *find_worker_slot(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < WORKERS_MAX; i++) {
+		if (pool.shared->slots[i].pid == pid)
+			return &pool.shared->slots[i];
+	}
+	return NULL;
+}
+
+static int clone_worker(bool reserved)
+{
+	struct worker_args_s args = {
+		.reserved = reserved,
+	};
+	struct worker_slot_s *slot;
+	sigset_t blockmask, oldmask;
+	void *stack;
+	pid_t pid;
+	int err = 0;
+
+	slot = find_worker_slot(0);
+	if (!slot) {
+		pr_err("too many workers: %d\n", WORKERS_MAX);
+		return -EAGAIN;
+	}
+	slot->sock = -1;
+	args.slot = slot;
+
+	stack = mmap(NULL, WORKER_STACK_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED) {
+		pr_perror("failed to allocate worker stack");
+		return -errno;
+	}
+
+	/* Worker slot has to be taken before worker exit can be handled */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &blockmask, &oldmask);
+
+	pid = clone(worker, stack + WORKER_STACK_SIZE, CLONE_FILES | SIGCHLD, &args);
+	if (pid == -1) {
+		pr_perror("failed to clone worker");
+		err = -errno;
+	} else
+		slot->pid = pid;
+
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+	/* Worker has its own copy of the stack */
+	munmap(stack, WORKER_STACK_SIZE);
+
+	if (!err)
+		pr_debug("worker %d started\n", pid);
+	return err;
+}
+
+/* Called on child exit. Returns true, if it was a worker */
+bool release_worker(pid_t pid)
+{
+	struct worker_slot_s *slot;
+
+	if (!pool.shared)
+		return false;
+
+	slot = find_worker_slot(pid);
+	if (!slot)
+		return false;
+
+	/* Worker was killed in the middle of a job. Its descriptors are
+	 * shared with manager and thus are not closed. Shut connection down
+	 * at least, so that client doesn't wait for the reply forever, and
+	 * pass it back to be closed by manager. */
+	if (slot->sock >= 0) {
+		shutdown(slot->sock, SHUT_RDWR);
+		worker_put_conn(slot->sock);
+	}
+
+	slot->sock = -1;
+	slot->pid = 0;
+	return true;
+}
+
+/* Returns WORKER_JOB_QUEUED, if connection was passed to worker */
+int queue_worker_job(int sock, const void *job, size_t size)
+{
+	struct worker_msg_s msg;
+	int err;
+
+	if (size > sizeof(msg.job)) {
+		pr_err("job is too big: %ld\n", size);
+		return -E2BIG;
+	}
+
+	msg.sock = sock;
+	memcpy(msg.job, job, size);
+
+	if (!worker_put_idle()) {
+		err = clone_worker(true);
+		if (err)
+			return err;
+	}
+
+	if (send(pool.jobs[0], &msg, offsetof(struct worker_msg_s, job) + size, 0) < 0) {
+		pr_perror("failed to queue job");
+		/* Worker was reserved and has to become idle back */
+		__atomic_add_fetch(&pool.shared->idle, 1, __ATOMIC_SEQ_CST);
+		return -errno;
+	}
+	return WORKER_JOB_QUEUED;
+}
+
+struct workers_conns_s {
+	struct pollfd		*fds;
+	int			nr;
+	int			size;
+};
+
+static int add_conn(struct workers_conns_s *conns, int sock)
+{
+	struct pollfd *fds;
+
+	if (conns->nr == conns->size) {
+		fds = realloc(conns->fds, sizeof(*fds) * conns->size * 2);
+		if (!fds) {
+			pr_err("failed to allocate connections\n");
+			return -ENOMEM;
+		}
+		conns->fds = fds;
+		conns->size *= 2;
+	}
+
+	conns->fds[conns->nr].fd = sock;
+	conns->fds[conns->nr].events = POLLIN;
+	conns->fds[conns->nr].revents = 0;
+	conns->nr++;
+	return 0;
+}
+
+static void del_conn(struct workers_conns_s *conns, int i)
+{
+	conns->fds[i] = conns->fds[--conns->nr];
+}
+
+/* Connections, passed to workers, are ignored by poll() */
+static void park_conn(struct workers_conns_s *conns, int i)
+{
+	conns->fds[i].fd = -conns->fds[i].fd - 1;
+}
+
+static void unpark_conn(struct workers_conns_s *conns, int sock)
+{
+	int i;
+
+	for (i = 0; i < conns->nr; i++) {
+		if (conns->fds[i].fd == -sock - 1) {
+			conns->fds[i].fd = sock;
+			return;
+		}
+	}
+	pr_err("unknown connection %d passed back\n", sock);
+}
+
+/* Like unreliable_socket_loop(), but connection with queued job isn't served
+ * until the job is done */
+int workers_socket_loop(int psock, void *data,
+			int (*packet_handler)(int sock, void *data, void *packet, size_t psize))
+{
+	struct workers_conns_s conns = {
+		.size = 16,
+	};
+	int sock, err, i;
+
+	conns.fds = malloc(sizeof(*conns.fds) * conns.size);
+	if (!conns.fds) {
+		pr_err("failed to allocate connections\n");
+		return -ENOMEM;
+	}
+
+	/* Listening socket, connections, passed back, and jobs of dead
+	 * workers */
+	if (add_conn(&conns, psock) || add_conn(&conns, pool.conns[0]) ||
+	    add_conn(&conns, sched_dead_fd()))
+		return -ENOMEM;
+
+	pr_info("%s: socket loop started\n", __func__);
+
+	while (1) {
+		if (poll(conns.fds, conns.nr, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("%s: poll failed", __func__);
+			break;
+		}
+
+		if (conns.fds[0].revents) {
+			sock = accept(psock, NULL, NULL);
+			if (sock < 0) {
+				pr_perror("%s: accept failed", __func__);
+				break;
+			}
+			pr_debug("%s: accepted new socket fd %d\n", __func__, sock);
+
+			if (add_conn(&conns, sock))
+				close(sock);
+		}
+
+		if (conns.fds[1].revents) {
+			if (read(pool.conns[0], &sock, sizeof(sock)) == sizeof(sock))
+				unpark_conn(&conns, sock);
+			else
+				pr_perror("%s: failed to read connection", __func__);
+		}
+
+		if (conns.fds[2].revents)
+			sched_release_dead();
+
+		for (i = conns.nr - 1; i > 2; i--) {
+			if ((conns.fds[i].fd < 0) || !conns.fds[i].revents)
+				continue;
+
+			sock = conns.fds[i].fd;
+
+			err = unreliable_conn_handler(sock, data, packet_handler);
+			if (err == WORKER_JOB_QUEUED)
+				park_conn(&conns, i);
+			else if (err) {
+				close(sock);
+				del_conn(&conns, i);
+			}
+		}
+	}
+	return 0;
+}
+
+int start_workers(unsigned spare, worker_job_t run, void *data)
+{
+	unsigned i;
+	int err;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pool.jobs)) {
+		pr_perror("failed to create jobs socket pair");
+		return -errno;
+	}
+
+	if (pipe2(pool.conns, O_CLOEXEC)) {
+		pr_perror("failed to create connections pipe");
+		return -errno;
+	}
+
+	pool.shared = shm_alloc(sizeof(*pool.shared));
+	if (!pool.shared) {
+		pr_err("failed to allocate workers\n");
+		return -ENOMEM;
+	}
+	memset(pool.shared, 0, sizeof(*pool.shared));
+
+	pool.spare = spare;
+	pool.run = run;
+	pool.data = data;
+
+	for (i = 0; i < spare; i++) {
+		err = clone_worker(false);
+		if (err)
+			return err;
+	}
+
+	pr_info("%d spare workers started\n", spare);
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef __SPFS_MANAGER_WORKERS_H_
+#define __SPFS_MANAGER_WORKERS_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Default number of spare workers */
+#define SPFS_MANAGER_WORKERS	4
+
+#define WORKER_JOB_MAX		8192
+
+/* Connection is passed to worker with the job */
+#define WORKER_JOB_QUEUED	1
+
+typedef int (*worker_job_t)(int sock, void *data, void *job, size_t size);
+
+int start_workers(unsigned spare, worker_job_t run, void *data);
+int queue_worker_job(int sock, const void *job, size_t size);
+bool release_worker(pid_t pid);
+int workers_socket_loop(int psock, void *data,
+			int (*packet_handler)(int sock, void *data, void *packet, size_t psize));
+
+#endif
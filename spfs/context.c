@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <sched.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -17,6 +18,8 @@
 
 #include "interface.h"
 #include "context.h"
+#include "xattr.h"
+#include "trace.h"
 
 #define UNIX_SEQPACKET
 
@@ -28,7 +31,6 @@ struct spfs_context_s fs_context = {
 		[SPFS_PROXY_MODE]	= &proxy_operations,
 		[SPFS_STUB_MODE]	= &stub_operations,
 	},
-	.wm_lock		= PTHREAD_MUTEX_INITIALIZER,
 	.packet_socket		= -1,
 };
 
@@ -60,36 +62,73 @@ const struct fuse_operations *get_operations(struct work_mode_s *wm)
 	return ops;
 }
 
-const struct work_mode_s *ctx_work_mode(void)
+spfs_mode_t ctx_work_mode(void)
 {
-	return get_context()->wm;
+	return __atomic_load_n(&get_context()->mode, __ATOMIC_ACQUIRE);
 }
 
-int wait_mode_change(int current_mode)
+/* Waiters sleep on context sequence counter, which is bumped on every work
+ * mode change and on request interrupt. So there are no periodic wakeups,
+ * and no wakeup can be lost in between of the checks below and the wait.
+ * Interrupt is delivered either by interrupt callback (low-level API), or by
+ * libfuse interrupt signal ("intr" option of high-level API), which breaks
+ * the wait with EINTR. */
+int __wait_mode_change(int current_mode, int (*interrupted)(void *data),
+		       void *data)
 {
-	int err;
-	const struct timespec timeout = {
-		.tv_sec = 0,
-		.tv_nsec = 100000000, // 100ms
-	};
+	struct spfs_context_s *ctx = get_context();
+	int seq, err;
+
+	while (1) {
+		seq = __atomic_load_n(&ctx->wm_seq, __ATOMIC_ACQUIRE);
 
-	while (!fuse_interrupted()) {
-		err = futex_wait(&get_context()->wm->mode, current_mode, &timeout);
-		/* Work mode wait changed */
-		if (!err)
+		/* Work mode changed */
+		if (ctx_work_mode() != current_mode)
 			return -ERESTARTSYS;
+
+		/* System call was interrupted */
+		if (interrupted(data))
+			return -EINTR;
+
+		err = futex_wait(&ctx->wm_seq, seq, NULL);
 		/* Handle error */
-		if (err != -ETIMEDOUT)
+		if (err && (err != -EAGAIN) && (err != -EINTR))
 			return err;
-		/* Timeout reached */
 	}
-	/* System call was interrupted */
-	return -EINTR;
 }
 
-static int wake_mode_waiters(struct work_mode_s *wm)
+static int fuse_request_interrupted(void *data)
+{
+	return fuse_interrupted();
+}
+
+int wait_mode_change(int current_mode)
 {
-	return futex_wake(&wm->mode);
+	return __wait_mode_change(current_mode, fuse_request_interrupted, NULL);
+}
+
+int wake_mode_waiters(void)
+{
+	struct spfs_context_s *ctx = get_context();
+
+	__atomic_add_fetch(&ctx->wm_seq, 1, __ATOMIC_RELEASE);
+	return futex_wake(&ctx->wm_seq);
+}
+
+void __work_mode_served(struct work_mode_s *wm)
+{
+	struct timespec now;
+	long us;
+
+	if (!__sync_bool_compare_and_swap(&wm->served, 0, 1))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - wm->switched.tv_sec) * 1000000 +
+	     (now.tv_nsec - wm->switched.tv_nsec) / 1000;
+
+	pr_info("%s: first request served in \"%s\" mode %ld us after switch\n",
+			__func__, work_modes[wm->mode], us);
 }
 
 static int do_open_proxy_directory(const char *path)
@@ -148,6 +187,9 @@ static int child_open_dir(void *data)
 	struct proxy_dir_info *pdi = data;
 	int fd;
 
+	/* Log writer thread wasn't cloned */
+	forget_log_writer();
+
 	fd = do_open_proxy_directory_ns(pdi->path, pdi->ns_pid);
 	if (fd < 0)
 		return fd;
@@ -222,6 +264,10 @@ static int open_proxy_directory(const char *path, int ns_pid)
 	return do_open_proxy_directory(path);
 }
 
+/* Work modes are created either on start or by socket thread only, so plain
+ * counter is enough. Generation is used to detect stale resolved objects. */
+static unsigned long wm_generation;
+
 static int create_work_mode(spfs_mode_t mode,
 			    const char *path, int mnt_ns_pid,
 			    struct work_mode_s **wm)
@@ -237,6 +283,9 @@ static int create_work_mode(spfs_mode_t mode,
 
 	new->mode = mode;
 	new->cnt = 1;
+	new->generation = ++wm_generation;
+	/* Only switch to Proxy mode latency is worth to measure */
+	new->served = (mode != SPFS_PROXY_MODE);
 	new->proxy_dir_fd = -1;
 	new->proxy_dir = NULL;
 
@@ -282,23 +331,112 @@ static void destroy_work_mode(struct work_mode_s *wm)
 	free(wm);
 }
 
-/* Well... Get and put methods below are worng in generic case.
- * They work properly, because:
- * 1) Current work mode is being hold by context. And in *get* method we
- * protect agains its change.
- * 2) Any arch word operation is atomic on x86 arch.
- * These two assumtions are enough to make this work properly on x86{_64}
- * architecture.
- * For others we either need to protec these operations by lock, or introduced
- * atomic operations.
+/* Work mode is published by socket thread with plain atomic pointer store and
+ * read by FUSE threads without any locks.
+ * Counter reference can't be taken on published pointer directly, because the
+ * pointer can be replaced and the structure released in between. So the
+ * reference is taken in a read-side section: each thread announces the period
+ * it has entered the section in, and socket thread waits for all the threads,
+ * which could see previous work mode, to leave their sections (grace period),
+ * before dropping context reference to it.
+ * Besides this, each thread caches a reference to the work mode it has served
+ * last request in. Cached reference is owned by whoever has exchanged it out
+ * of the cache. So in the common case request takes no shared locks and
+ * touches no shared counters. Socket thread drains the caches on work mode
+ * change, so old proxy directory is not pinned by idle threads.
  */
+struct wm_reader_s {
+	struct list_head	list;
+	unsigned long		period;
+	struct work_mode_s	*cached;
+};
+
+static unsigned long wm_period = 1;
+static LIST_HEAD(wm_readers);
+static pthread_mutex_t wm_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t wm_reader_key;
+static pthread_once_t wm_reader_once = PTHREAD_ONCE_INIT;
+static __thread struct wm_reader_s *wm_reader;
+
+static void destroy_wm_reader(void *data)
+{
+	struct wm_reader_s *r = data;
+
+	pthread_mutex_lock(&wm_readers_lock);
+	list_del(&r->list);
+	pthread_mutex_unlock(&wm_readers_lock);
+
+	put_work_mode(r->cached);
+	free(r);
+}
+
+static void create_wm_reader_key(void)
+{
+	if (pthread_key_create(&wm_reader_key, destroy_wm_reader))
+		pr_crit("%s: failed to create work mode reader key\n", __func__);
+}
+
+static struct wm_reader_s *get_wm_reader(void)
+{
+	struct wm_reader_s *r = wm_reader;
+
+	if (r)
+		return r;
+
+	pthread_once(&wm_reader_once, create_wm_reader_key);
+
+	r = malloc(sizeof(*r));
+	if (!r) {
+		pr_err("%s: failed to allocate work mode reader\n", __func__);
+		return NULL;
+	}
+	r->period = 0;
+	r->cached = NULL;
+
+	pthread_mutex_lock(&wm_readers_lock);
+	list_add(&r->list, &wm_readers);
+	pthread_mutex_unlock(&wm_readers_lock);
+
+	/* Destructor releases the reader on thread exit */
+	pthread_setspecific(wm_reader_key, r);
+
+	wm_reader = r;
+	return r;
+}
+
+/* Waits for all the readers, which could see previous work mode, to leave
+ * read-side section, and drops cached references. Called by socket thread
+ * only, after new work mode is published. */
+static void synchronize_work_mode(void)
+{
+	unsigned long period;
+	struct wm_reader_s *r;
+
+	period = __atomic_add_fetch(&wm_period, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&wm_readers_lock);
+	list_for_each_entry(r, &wm_readers, list) {
+		unsigned long p;
+
+		while (1) {
+			p = __atomic_load_n(&r->period, __ATOMIC_SEQ_CST);
+			if (!p || (p >= period))
+				break;
+			sched_yield();
+		}
+
+		put_work_mode(__atomic_exchange_n(&r->cached, NULL,
+						  __ATOMIC_SEQ_CST));
+	}
+	pthread_mutex_unlock(&wm_readers_lock);
+}
 
 void put_work_mode(struct work_mode_s *wm)
 {
 	if (!wm)
 		return;
 
-	if (--wm->cnt)
+	if (__atomic_sub_fetch(&wm->cnt, 1, __ATOMIC_ACQ_REL))
 		return;
 
 	destroy_work_mode(wm);
@@ -307,31 +445,67 @@ void put_work_mode(struct work_mode_s *wm)
 struct work_mode_s *get_work_mode(void)
 {
 	struct spfs_context_s *ctx = get_context();
+	struct wm_reader_s *r;
 	struct work_mode_s *wm;
-	int err;
 
-	/* Protect against work mode change */
-	err = pthread_mutex_lock(&ctx->wm_lock);
-	if (err) {
-		pr_err("%s: failed to lock wm_lock: %d\n", __func__, err);
+	r = get_wm_reader();
+	if (!r)
 		return NULL;
-	}
 
-	wm = ctx->wm;
-	wm->cnt++;
+	/* Enter read-side section: store of the period must be visible
+	 * before work mode is read. */
+	__atomic_store_n(&r->period,
+			 __atomic_load_n(&wm_period, __ATOMIC_SEQ_CST),
+			 __ATOMIC_SEQ_CST);
+
+	wm = __atomic_load_n(&ctx->wm, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&wm->cnt, 1, __ATOMIC_RELAXED);
 
-        pthread_mutex_unlock(&ctx->wm_lock);
+	__atomic_store_n(&r->period, 0, __ATOMIC_RELEASE);
 	return wm;
 }
 
-static bool stale_work_mode(spfs_mode_t mode, const char *proxy_dir)
+/* Returns current work mode reference for the duration of a request.
+ * Must be paired with work_mode_leave() in the same thread. */
+struct work_mode_s *work_mode_enter(void)
 {
 	struct spfs_context_s *ctx = get_context();
+	struct wm_reader_s *r;
+	struct work_mode_s *wm;
 
+	r = get_wm_reader();
+	if (!r)
+		return NULL;
+
+	wm = __atomic_exchange_n(&r->cached, NULL, __ATOMIC_SEQ_CST);
+	if (wm && (wm == __atomic_load_n(&ctx->wm, __ATOMIC_SEQ_CST)))
+		return wm;
+
+	put_work_mode(wm);
+	return get_work_mode();
+}
+
+void work_mode_leave(struct work_mode_s *wm)
+{
+	struct spfs_context_s *ctx = get_context();
+	struct wm_reader_s *r = wm_reader;
+
+	put_work_mode(__atomic_exchange_n(&r->cached, wm, __ATOMIC_SEQ_CST));
+
+	/* Work mode could have been changed, while the request was served.
+	 * Either socket thread sees the reference in cache, or we see new
+	 * work mode here. */
+	if (wm != __atomic_load_n(&ctx->wm, __ATOMIC_SEQ_CST))
+		put_work_mode(__atomic_exchange_n(&r->cached, NULL,
+						  __ATOMIC_SEQ_CST));
+}
+
+static bool stale_work_mode(spfs_mode_t mode, const char *proxy_dir)
+{
 	if (mode == SPFS_PROXY_MODE)
 		return true;
 
-	return mode != ctx->wm->mode;
+	return mode != ctx_work_mode();
 }
 
 int set_work_mode(struct spfs_context_s *ctx, spfs_mode_t mode,
@@ -350,17 +524,20 @@ int set_work_mode(struct spfs_context_s *ctx, spfs_mode_t mode,
 				return err;
 			}
 
-			err = pthread_mutex_lock(&ctx->wm_lock);
-			if (err) {
-				pr_err("%s: failed to lock wm: %d\n", __func__, err);
-				free(new_wm);
-				return -err;
-			}
-			get_context()->wm = new_wm;
-		        pthread_mutex_unlock(&ctx->wm_lock);
+			if (cur_wm)
+				clock_gettime(CLOCK_MONOTONIC, &new_wm->switched);
+			else
+				new_wm->served = 1;
+			__atomic_store_n(&get_context()->wm, new_wm,
+					 __ATOMIC_SEQ_CST);
+			__atomic_store_n(&get_context()->mode, mode,
+					 __ATOMIC_RELEASE);
 
 			if (cur_wm) {
-				wake_mode_waiters(cur_wm);
+				if ((mode == SPFS_PROXY_MODE) && ctx->reopen_handles)
+					(void) ctx->reopen_handles(&ctx->reopen_stat);
+				wake_mode_waiters();
+				synchronize_work_mode();
 				put_work_mode(cur_wm);
 			}
 			break;
@@ -375,7 +552,8 @@ int change_work_mode(struct spfs_context_s *ctx, spfs_mode_t mode,
 		     const char *path, int ns_pid)
 {
 	int err;
-	spfs_mode_t cur_mode = ctx->wm->mode;
+	spfs_mode_t cur_mode = ctx_work_mode();
+	uint64_t start;
 
 	pr_info("%s: changing work mode from \"%s\" to \"%s\" "
 		"(path: %s, ns_pid: %d)\n",
@@ -388,7 +566,9 @@ int change_work_mode(struct spfs_context_s *ctx, spfs_mode_t mode,
 		return 0;
 	}
 
+	start = spfs_trace_start();
 	err = set_work_mode(ctx, mode, path, ns_pid);
+	spfs_trace(SPFS_TRACE_mode_switch, path, mode, start, err);
 	if (err)
 		pr_err("%s: changing work mode to \"%s\" "
 			"(path: %s, ns_pid: %d) failed\n",
@@ -416,6 +596,21 @@ static int setup_context(struct spfs_context_s *ctx,
 #include <sys/types.h>          /* See NOTES */
 #include <sys/socket.h>
 
+static int spfs_conn_handler(int sock, struct spfs_context_s *ctx)
+{
+	struct spfs_reply_s reply;
+
+	memset(&ctx->reopen_stat, 0, sizeof(ctx->reopen_stat));
+
+	reply.status = unreliable_conn_handler(sock, ctx, spfs_execute_cmd);
+	reply.reopened = ctx->reopen_stat.reopened;
+	reply.skipped = ctx->reopen_stat.skipped;
+	reply.reopen_us = ctx->reopen_stat.time_us;
+	reply.xattr_lookups_avoided = spfs_xattr_lookups_avoided();
+
+	return send_reply(sock, &reply, sizeof(reply));
+}
+
 static void *sock_routine(void *ptr)
 {
         struct spfs_context_s *ctx = ptr;
@@ -434,7 +629,7 @@ static void *sock_routine(void *ptr)
 		pr_debug("%s: accepted new socket\n", __func__);
 
 		do {
-			err = reliable_conn_handler(sock, ctx, spfs_execute_cmd);
+			err = spfs_conn_handler(sock, ctx);
 		} while (ctx->single_user && (err == 0));
 
 		pr_debug("%s: closed interface socket\n", __func__);
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "include/list.h"
 
@@ -25,11 +26,26 @@ struct work_mode_s {
 	spfs_mode_t		mode;
 	char                    *proxy_dir;
 	int			proxy_dir_fd;
+	unsigned long		generation;
+	struct timespec		switched;
+	int			served;
+};
+
+/* File handles, reopened on switch to Proxy mode */
+struct reopen_stat_s {
+	unsigned		reopened;
+	unsigned		skipped;
+	long			time_us;
 };
 
 struct spfs_context_s {
 	struct work_mode_s	*wm;
-	pthread_mutex_t		wm_lock;
+	/* Mode of current work mode, read without reference to it */
+	spfs_mode_t		mode;
+	int			wm_seq;
+
+	int			(*reopen_handles)(struct reopen_stat_s *st);
+	struct reopen_stat_s	reopen_stat;
 
 	struct fuse_operations	*operations[SPFS_MAX_MODE];
 
@@ -58,10 +74,24 @@ int change_work_mode(struct spfs_context_s *ctx, spfs_mode_t mode,
 int set_work_mode(struct spfs_context_s *ctx, spfs_mode_t mode,
 		  const char *path, int mnt_ns_pid);
 int wait_mode_change(int current_mode);
+int __wait_mode_change(int current_mode, int (*interrupted)(void *data),
+		       void *data);
+int wake_mode_waiters(void);
+
+void __work_mode_served(struct work_mode_s *wm);
+
+/* Reports latency of the first request, served after work mode switch */
+static inline void work_mode_served(struct work_mode_s *wm)
+{
+	if (!wm->served)
+		__work_mode_served(wm);
+}
 
-const struct work_mode_s *ctx_work_mode(void);
+spfs_mode_t ctx_work_mode(void);
 struct work_mode_s *get_work_mode(void);
 void put_work_mode(struct work_mode_s *wm);
+struct work_mode_s *work_mode_enter(void);
+void work_mode_leave(struct work_mode_s *wm);
 
 extern int spfs_execute_cmd(int sock, void *data, void *package, size_t psize);
 
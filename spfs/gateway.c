@@ -4,29 +4,42 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "include/util.h"
 #include "include/log.h"
+#include "include/list.h"
 
 #include "context.h"
 #include "xattr.h"
+#include "trace.h"
 
 struct gateway_fh_s {
 	struct work_mode_s *wm;
 	unsigned open_flags;
 	uint64_t fh;
+
+	/* Protects wm and fh against reopen */
+	pthread_rwlock_t lock;
+	/* Previous backing file handle. It's released on next reopen or on
+	 * release, because buffer, returned by read_buf(), can still refer to
+	 * it. */
+	struct gateway_fh_s *retired;
+	/* Path is kept to reopen the handle on work mode change */
+	char *path;
+	struct list_head list;
 };
 
-static int gateway_release(const char *path, struct fuse_file_info *fi);
-static int gateway_open(const char *path, struct fuse_file_info *fi);
+/* Table of the file handles, returned to libfuse. Handle pointer is the key,
+ * returned to us in fi->fh. */
+static LIST_HEAD(gateway_fhs);
+static pthread_rwlock_t gateway_fhs_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-static int gateway_opendir(const char *path, struct fuse_file_info *fi);
-static int gateway_releasedir(const char *path, struct fuse_file_info *fi);
+#define GATEWAY_REOPEN_THREADS	8
 
-static struct work_mode_s *gateway_fh_mode(uint64_t gw_fh)
-{
-	return ((struct gateway_fh_s *)gw_fh)->wm;
-}
+static int gateway_release(const char *path, struct fuse_file_info *fi);
+static int gateway_releasedir(const char *path, struct fuse_file_info *fi);
 
 static struct gateway_fh_s *gateway_pop_context(struct fuse_file_info *fi)
 {
@@ -48,8 +61,64 @@ static void gateway_set_fh(struct gateway_fh_s *gw_fh, struct fuse_file_info *fi
 	fi->fh = (uint64_t)gw_fh;
 }
 
+/* Adds the handle, returned to libfuse, to the table */
+static int gateway_add_fh(const char *path, struct fuse_file_info *fi)
+{
+	struct gateway_fh_s *gw_fh = (struct gateway_fh_s *)fi->fh;
+
+	gw_fh->path = strdup(path);
+	if (!gw_fh->path) {
+		/* Not fatal: the handle will be reopened on demand */
+		pr_warn("%s: failed to allocate path for '%s'\n", __func__, path);
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(&gateway_fhs_lock);
+	list_add(&gw_fh->list, &gateway_fhs);
+	pthread_rwlock_unlock(&gateway_fhs_lock);
+	return 0;
+}
+
+static void gateway_unlink_fh(struct gateway_fh_s *gw_fh)
+{
+	if (list_empty(&gw_fh->list))
+		return;
+
+	pthread_rwlock_wrlock(&gateway_fhs_lock);
+	list_del_init(&gw_fh->list);
+	pthread_rwlock_unlock(&gateway_fhs_lock);
+}
+
+/* Updates paths of the handles, opened in renamed file or directory */
+static void gateway_move_fhs(const char *from, const char *to)
+{
+	struct gateway_fh_s *gw_fh;
+	size_t len = strlen(from);
+	char *path;
+
+	pthread_rwlock_wrlock(&gateway_fhs_lock);
+	list_for_each_entry(gw_fh, &gateway_fhs, list) {
+		if (strncmp(gw_fh->path, from, len))
+			continue;
+		if (gw_fh->path[len] && (gw_fh->path[len] != '/'))
+			continue;
+
+		path = xsprintf("%s%s", to, gw_fh->path + len);
+		if (!path) {
+			pr_err("%s: failed to allocate path for '%s'\n",
+					__func__, gw_fh->path);
+			continue;
+		}
+		free(gw_fh->path);
+		gw_fh->path = path;
+	}
+	pthread_rwlock_unlock(&gateway_fhs_lock);
+}
+
 static void gateway_release_fh(struct gateway_fh_s *gw_fh)
 {
+	pthread_rwlock_destroy(&gw_fh->lock);
+	free(gw_fh->path);
 	put_work_mode(gw_fh->wm);
 	free(gw_fh);
 }
@@ -65,6 +134,10 @@ static int gateway_create_fh(struct gateway_fh_s **gw_fh, unsigned open_flags)
 	fh->open_flags = open_flags;
 	fh->wm = NULL;
 	fh->fh = 0;
+	fh->retired = NULL;
+	fh->path = NULL;
+	INIT_LIST_HEAD(&fh->list);
+	pthread_rwlock_init(&fh->lock, NULL);
 
 	*gw_fh = fh;
 	return 0;
@@ -109,62 +182,20 @@ static char *gateway_full_path(const char *path, const struct work_mode_s *wm)
 			gateway_real_path(path, real, PATH_MAX));
 }
 
-inline static bool gateway_stale_fh(struct fuse_file_info *fi)
+inline static bool gateway_stale_fh(struct gateway_fh_s *gw_fh)
 {
-	return gateway_fh_mode(fi->fh) != get_context()->wm;
+	return gw_fh->wm != get_context()->wm;
 }
 
-inline static int gateway_reopen_fh(const char *path, struct fuse_file_info *fi)
+static int gateway_release_gw_fh(const char *path, struct gateway_fh_s *gw_fh)
 {
-	struct gateway_fh_s *cur_fh = (struct gateway_fh_s *)fi->fh;
-	struct gateway_fh_s *new_fh, tmp_fh;
 	struct fuse_file_info tmp_fi = {
-		/* This file info will be used to open and We care only about
-		 * open flags here */
-		.flags = cur_fh->open_flags,
+		.fh = (uint64_t)gw_fh,
 	};
-	int (*open)(const char *path, struct fuse_file_info *fi) =
-		(fi->flags & O_DIRECTORY) ? gateway_opendir : gateway_open;
-	int (*release)(const char *path, struct fuse_file_info *fi) =
-		(fi->flags & O_DIRECTORY) ? gateway_releasedir : gateway_release;
-	int err;
 
-	pr_info("%s: reopening file handle for '%s' (mode: %d -> %d, proxy_dir: '%s' -> '%s')\n",
-			__func__, path,
-			gateway_fh_mode(fi->fh)->mode,
-			ctx_work_mode()->mode,
-			gateway_fh_mode(fi->fh)->proxy_dir ? : 0,
-			ctx_work_mode()->proxy_dir ? : 0);
-
-	/* Open new fh by using temporary fi */
-	err = open(path, &tmp_fi);
-	if (err) {
-		pr_err("%s: failed to open new file handler for '%s'\n",
-				__func__, path);
-		return err;
-	}
-	new_fh = (struct gateway_fh_s *)tmp_fi.fh;
-
-	/* Here we swap contents of new fh and cur fh.
-	 * The reason for this is that cur fh pointer is stored in libfuse
-	 * internals, so we can't simply replace the pointer itself (original
-	 * one will be returned to us on next call).
-	 */
-	tmp_fh = *new_fh;
-	*new_fh = *cur_fh;
-	*cur_fh = tmp_fh;
-
-	/* Releasing new fh with contents of _original_ one:
-	 * 1) close previous file descriptor (tmp_fi->fh->fh)
-	 * 2) and release memory, used by old file handle (tmp_fi->cur_fh).
-	 */
-	err = release(path, &tmp_fi);
-	if (err) {
-		pr_err("%s: failed to release old file handler for '%s'\n",
-				__func__, path);
-		return err;
-	}
-	return err;
+	if (gw_fh->open_flags & O_DIRECTORY)
+		return gateway_releasedir(path, &tmp_fi);
+	return gateway_release(path, &tmp_fi);
 }
 
 int update_work_mode(struct gateway_fh_s *gw_fh)
@@ -187,6 +218,7 @@ int update_work_mode(struct gateway_fh_s *gw_fh)
 	const struct fuse_operations *___ops = get_operations(__fh->wm);	\
 										\
 	if (___ops->__func) {							\
+		uint64_t ___start = spfs_trace_start();				\
 		char *___fpath;							\
 										\
 		___err = -ENOMEM;						\
@@ -194,6 +226,10 @@ int update_work_mode(struct gateway_fh_s *gw_fh)
 		if (___fpath)							\
 			___err = ___ops->__func(___fpath, ##__VA_ARGS__);	\
 		free(___fpath);							\
+		if (___err != -ERESTARTSYS)					\
+			work_mode_served(__fh->wm);				\
+		spfs_trace(SPFS_TRACE_##__func, __path, __fh->wm->mode,	\
+			   ___start, ___err);					\
 	}									\
 	if (___err < 0)								\
 		pr_info("= %d (%s)\n", ___err, strerror(-___err));		\
@@ -218,24 +254,19 @@ int update_work_mode(struct gateway_fh_s *gw_fh)
  * open(), opendir(), create(),
  * and
  * release() and releasedir().
- * Unfortunatelly, libfuse copies fi instead of using the one, returned from
- * open() call...
- * Because of this, we can't reopen the file only once on mode change.
- * We have to open a correct file and close it instead on each time and the
- * fi-related callback is called.
- * Note: we have to _close_ the file each time, because otherwise we quickly
- * run out of file descriptors */
+ * Stale handle is reopened once on first call after mode change, and the
+ * following calls use the new backing file. */
 #define GATEWAY_METHOD_FI_RESTARTABLE(_func, _path, _fi, ...)			\
 ({										\
-	int _err = 0;								\
+	struct gateway_fh_s *_gw_fh = (struct gateway_fh_s *)_fi->fh;		\
+	int _err;								\
 										\
 	do {									\
-		if (gateway_stale_fh(_fi))					\
-			_err = gateway_reopen_fh(_path, _fi);			\
-										\
-		if (!_err)							\
-			_err = GATEWAY_METHOD_FI(_func, _path, _fi,		\
-						 ##__VA_ARGS__);		\
+		_err = gateway_lock_fh(_path, _gw_fh);				\
+		if (_err)							\
+			break;							\
+		_err = GATEWAY_METHOD_FI(_func, _path, _fi, ##__VA_ARGS__);	\
+		pthread_rwlock_unlock(&_gw_fh->lock);				\
 	} while (_err == -ERESTARTSYS);						\
 	_err;									\
 })
@@ -256,17 +287,21 @@ int update_work_mode(struct gateway_fh_s *gw_fh)
 })
 
 /* This macro is used for any operation without fh.
- * Temporary fh is created on stack to fit macro calling convention */
+ * Temporary fh is created on stack to fit macro calling convention. Work mode
+ * reference is taken only for the request duration. */
 #define GATEWAY_METHOD_RESTARTABLE(_func, _path, ...)				\
 ({										\
-	struct gateway_fh_s __on_stack_fh = {					\
-		.wm = NULL,							\
-	}, *__gw_fh = &__on_stack_fh;						\
+	struct gateway_fh_s __on_stack_fh, *__gw_fh = &__on_stack_fh;		\
 	int __err;								\
 										\
-	__err = GATEWAY_METHOD_FH_RESTARTABLE(_func, _path, __gw_fh,		\
-					      ##__VA_ARGS__);			\
-										\
+	do {									\
+		__err = -EFAULT;						\
+		__gw_fh->wm = work_mode_enter();				\
+		if (!__gw_fh->wm)						\
+			break;							\
+		__err = GATEWAY_METHOD(_func, _path, __gw_fh, ##__VA_ARGS__);	\
+		work_mode_leave(__gw_fh->wm);					\
+	} while (__err == -ERESTARTSYS);					\
 	__err;									\
 })
 
@@ -292,32 +327,294 @@ int update_work_mode(struct gateway_fh_s *gw_fh)
 })
 
 /* This macro is called for link(), symlink() and rename(), where there are two
- * paths to fix in case of PROXY mode. */
+ * paths to fix in case of PROXY mode. Work mode reference is held until the
+ * call returns: second path refers to its proxy directory descriptor. */
 #define GATEWAY_LINK_RESTARTABLE(_func, _f, _s)					\
 ({										\
-	char *_fs;								\
-	int _err = -ENOMEM;							\
+	struct work_mode_s *_wm;						\
+	char *_fs = NULL;							\
+	int _err = -EFAULT;							\
 										\
-	_fs = gateway_full_path(_s, ctx_work_mode());				\
+	_wm = work_mode_enter();						\
+	if (_wm) {								\
+		_err = -ENOMEM;							\
+		_fs = gateway_full_path(_s, _wm);				\
+	}									\
 	if (_fs)								\
 		_err = GATEWAY_METHOD_RESTARTABLE(_func, _f, _fs);		\
 	free(_fs);								\
+	if (_wm)								\
+		work_mode_leave(_wm);						\
 	_err;									\
 })
 
 /* This macro below is used for release() and releasedir(), because in this
- * case only original fh matters.
+ * case only original fh matters. Retired backing file is released as well.
+ * Handle is removed from the table first, so it can't be reopened in parallel.
  */
 #define GATEWAY_RELEASE(_func, _path, _fi, ...)					\
 ({										\
-	int _err;								\
+	struct gateway_fh_s *_gw_fh = (struct gateway_fh_s *)_fi->fh;		\
+	int _err = 0;								\
 										\
-	_err = GATEWAY_METHOD_FI(_func, _path, _fi, ##__VA_ARGS__);		\
+	gateway_unlink_fh(_gw_fh);						\
+	if (_gw_fh->retired) {							\
+		_err = gateway_release_gw_fh(_path, _gw_fh->retired);		\
+		if (!_err)							\
+			_gw_fh->retired = NULL;					\
+	}									\
+	if (!_err)								\
+		_err = GATEWAY_METHOD_FI(_func, _path, _fi, ##__VA_ARGS__);	\
 	if (!_err)								\
-		gateway_release_fh((struct gateway_fh_s *)_fi->fh);		\
+		gateway_release_fh(_gw_fh);					\
 	_err;									\
 })
 
+/* Opens new backing file for the handle. The file handle returned is not
+ * added to the table. */
+static int gateway_open_backing(const char *path, unsigned open_flags,
+				struct gateway_fh_s **new_fh)
+{
+	struct fuse_file_info tmp_fi = {
+		/* This file info will be used to open and We care only about
+		 * open flags here */
+		.flags = open_flags,
+	}, *fi = &tmp_fi;
+	int err;
+
+	if (open_flags & O_DIRECTORY)
+		err = GATEWAY_OPEN_RESTARTABLE(opendir, path, fi, fi);
+	else
+		err = GATEWAY_OPEN_RESTARTABLE(open, path, fi, fi);
+	if (err) {
+		pr_err("%s: failed to open new file handler for '%s'\n",
+				__func__, path);
+		return err;
+	}
+
+	*new_fh = (struct gateway_fh_s *)fi->fh;
+	return 0;
+}
+
+/* Installs new backing file into the handle, if it was opened in newer work
+ * mode. Must be called with handle write lock held.
+ * Returns file handle to release: either the new one, or previously retired
+ * one. */
+static struct gateway_fh_s *gateway_swap_fh(const char *path,
+					    struct gateway_fh_s *gw_fh,
+					    struct gateway_fh_s *new_fh)
+{
+	struct gateway_fh_s tmp_fh;
+
+	if (new_fh->wm->generation <= gw_fh->wm->generation)
+		return new_fh;
+
+	pr_info("%s: reopened file handle for '%s' (mode: %d -> %d, proxy_dir: '%s' -> '%s')\n",
+			__func__, path,
+			gw_fh->wm->mode, new_fh->wm->mode,
+			gw_fh->wm->proxy_dir ? : 0,
+			new_fh->wm->proxy_dir ? : 0);
+
+	/* Swap backing files of the handles and retire the old one */
+	tmp_fh.wm = new_fh->wm;
+	tmp_fh.fh = new_fh->fh;
+	new_fh->wm = gw_fh->wm;
+	new_fh->fh = gw_fh->fh;
+	gw_fh->wm = tmp_fh.wm;
+	gw_fh->fh = tmp_fh.fh;
+
+	tmp_fh.retired = gw_fh->retired;
+	gw_fh->retired = new_fh;
+	return tmp_fh.retired;
+}
+
+static int gateway_release_old_fh(const char *path, struct gateway_fh_s *old_fh)
+{
+	int err;
+
+	if (!old_fh)
+		return 0;
+
+	err = gateway_release_gw_fh(path, old_fh);
+	if (err)
+		pr_err("%s: failed to release old file handler for '%s'\n",
+				__func__, path);
+	return err;
+}
+
+/* Libfuse gives us a copy of fi on each call, so the handle pointer can't be
+ * replaced. Instead, backing file handle is reopened in place, under handle
+ * write lock. New file is opened without the lock to not block other requests
+ * in case of Stub mode; if somebody else has reopened the handle in between,
+ * the new file is just released. */
+static int gateway_reopen_fh(const char *path, struct gateway_fh_s *gw_fh)
+{
+	struct gateway_fh_s *new_fh;
+	int err;
+
+	err = gateway_open_backing(path, gw_fh->open_flags, &new_fh);
+	if (err)
+		return err;
+
+	pthread_rwlock_wrlock(&gw_fh->lock);
+	new_fh = gateway_swap_fh(path, gw_fh, new_fh);
+	pthread_rwlock_unlock(&gw_fh->lock);
+
+	return gateway_release_old_fh(path, new_fh);
+}
+
+/* Locks the handle for read and reopens it, if work mode has changed.
+ * In Stub mode work mode change is waited for without the lock, so the
+ * handle can be migrated right after the change. */
+static int gateway_lock_fh(const char *path, struct gateway_fh_s *gw_fh)
+{
+	int err;
+
+	while (1) {
+		pthread_rwlock_rdlock(&gw_fh->lock);
+		if (!gateway_stale_fh(gw_fh)) {
+			if (gw_fh->wm->mode != SPFS_STUB_MODE)
+				return 0;
+			pthread_rwlock_unlock(&gw_fh->lock);
+
+			err = wait_mode_change(SPFS_STUB_MODE);
+			if (err != -ERESTARTSYS)
+				return err;
+			continue;
+		}
+		pthread_rwlock_unlock(&gw_fh->lock);
+
+		err = gateway_reopen_fh(path, gw_fh);
+		if (err)
+			return err;
+	}
+}
+
+/* Reopens the handle on work mode change. Returns 1, if the handle was
+ * reopened, or 0, if it's current already. Handles, being used by requests
+ * in previous Proxy mode, are skipped: they will be reopened on demand. */
+static int gateway_migrate_fh(struct gateway_fh_s *gw_fh)
+{
+	struct gateway_fh_s *new_fh, *old_fh = NULL;
+	int err = 0, reopened = 0;
+
+	if (pthread_rwlock_trywrlock(&gw_fh->lock))
+		return -EBUSY;
+
+	if (gateway_stale_fh(gw_fh)) {
+		err = gateway_open_backing(gw_fh->path, gw_fh->open_flags,
+					   &new_fh);
+		if (!err) {
+			old_fh = gateway_swap_fh(gw_fh->path, gw_fh, new_fh);
+			reopened = (old_fh != new_fh);
+		}
+	}
+	pthread_rwlock_unlock(&gw_fh->lock);
+
+	if (err)
+		return err;
+
+	(void) gateway_release_old_fh(gw_fh->path, old_fh);
+	return reopened;
+}
+
+struct gateway_migrate_s {
+	struct gateway_fh_s	**fhs;
+	unsigned		nr;
+	unsigned		next;
+	unsigned		reopened;
+	unsigned		skipped;
+};
+
+static void *gateway_migrate_fhs(void *data)
+{
+	struct gateway_migrate_s *gm = data;
+	unsigned i;
+	int err;
+
+	while (1) {
+		i = __atomic_fetch_add(&gm->next, 1, __ATOMIC_RELAXED);
+		if (i >= gm->nr)
+			break;
+
+		err = gateway_migrate_fh(gm->fhs[i]);
+		if (err > 0)
+			__atomic_add_fetch(&gm->reopened, 1, __ATOMIC_RELAXED);
+		else if (err < 0)
+			__atomic_add_fetch(&gm->skipped, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/* Called by socket thread, when new Proxy work mode is published, but before
+ * Stub mode waiters are woken up. Handles are reopened in parallel. */
+static int gateway_reopen_fhs(struct reopen_stat_s *st)
+{
+	struct gateway_migrate_s gm = { };
+	pthread_t threads[GATEWAY_REOPEN_THREADS];
+	struct gateway_fh_s *gw_fh;
+	struct timespec start, end;
+	int nr_threads, i, err;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Table is locked to protect the handles against release and paths
+	 * against rename */
+	pthread_rwlock_rdlock(&gateway_fhs_lock);
+
+	list_for_each_entry(gw_fh, &gateway_fhs, list)
+		gm.nr++;
+	if (!gm.nr)
+		goto unlock;
+
+	gm.fhs = malloc(sizeof(*gm.fhs) * gm.nr);
+	if (!gm.fhs) {
+		pr_err("%s: failed to allocate file handles array\n", __func__);
+		goto unlock;
+	}
+
+	i = 0;
+	list_for_each_entry(gw_fh, &gateway_fhs, list)
+		gm.fhs[i++] = gw_fh;
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > GATEWAY_REOPEN_THREADS)
+		nr_threads = GATEWAY_REOPEN_THREADS;
+	if (nr_threads > gm.nr)
+		nr_threads = gm.nr;
+
+	/* Current thread is a worker as well */
+	for (i = 0; i < nr_threads - 1; i++) {
+		err = pthread_create(&threads[i], NULL, gateway_migrate_fhs, &gm);
+		if (err) {
+			pr_warn("%s: failed to create reopen thread: %d\n",
+					__func__, err);
+			break;
+		}
+	}
+	nr_threads = i;
+
+	(void) gateway_migrate_fhs(&gm);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	free(gm.fhs);
+unlock:
+	pthread_rwlock_unlock(&gateway_fhs_lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	st->reopened = gm.reopened;
+	st->skipped = gm.skipped;
+	st->time_us = (end.tv_sec - start.tv_sec) * 1000000 +
+		      (end.tv_nsec - start.tv_nsec) / 1000;
+
+	pr_info("%s: reopened %u file handles (%u skipped) in %ld us\n",
+			__func__, st->reopened, st->skipped, st->time_us);
+	return 0;
+}
+
 static int gateway_getattr(const char *path, struct stat *stbuf)
 {
 	pr_info("%s(\"%s\", ...) = ...\n", __func__, path);
@@ -371,8 +668,10 @@ static int gateway_rename(const char *from, const char *to)
 
 	pr_info("%s(\"%s\", \"%s\") = ...\n", __func__, from, to);
 	err = GATEWAY_LINK_RESTARTABLE(rename, from, to);
-	if (!err)
+	if (!err) {
 		(void) spfs_move_xattrs(from, to);
+		gateway_move_fhs(from, to);
+	}
 	return err;
 }
 
@@ -514,14 +813,14 @@ static int gateway_open(const char *path, struct fuse_file_info *fi)
 {
 	pr_info("%s(\"%s\", ...) = ...\n", __func__, path);
 	return GATEWAY_OPEN_RESTARTABLE(open, path, fi,
-					fi);
+					fi) ? : gateway_add_fh(path, fi);
 }
 
 static int gateway_opendir(const char *path, struct fuse_file_info *fi)
 {
 	pr_info("%s(\"%s\", ...) = ...\n", __func__, path);
 	return GATEWAY_OPEN_RESTARTABLE(opendir, path, fi,
-					fi);
+					fi) ? : gateway_add_fh(path, fi);
 }
 
 static int gateway_create(const char *path, mode_t mode,
@@ -529,7 +828,7 @@ static int gateway_create(const char *path, mode_t mode,
 {
 	pr_info("%s(\"%s\", 0%o, ...) = ...\n", __func__, path, mode);
 	return GATEWAY_OPEN_RESTARTABLE(create, path, fi,
-					mode, fi);
+					mode, fi) ? : gateway_add_fh(path, fi);
 }
 
 static int gateway_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
@@ -608,19 +907,28 @@ static int gateway_poll(const char *path, struct fuse_file_info *fi,
 {
 	return GATEWAY_METHOD_RESTARTABLE(poll, path, fi, ph, reventsp);
 }
+#endif
 
 static int gateway_write_buf(const char *path, struct fuse_bufvec *buf,
 			     off_t off, struct fuse_file_info *fi)
 {
-	return GATEWAY_METHOD_RESTARTABLE(write_buf, path, buf, off, fi->fh);
+	pr_info("%s(\"%s\", %p, %ld, ...) = ...\n", __func__,
+			path, buf, off);
+	return GATEWAY_METHOD_FI_RESTARTABLE(write_buf, path, fi,
+					     buf, off, fi);
 }
 
+/* Note: returned buffer refers to backing file descriptor, which is then
+ * spliced to FUSE device by libfuse. */
 static int gateway_read_buf(const char *path, struct fuse_bufvec **bufp,
 			    size_t size, off_t off, struct fuse_file_info *fi)
 {
-	return GATEWAY_METHOD_RESTARTABLE(read_buf, path, bufp, size, off, fi->fh);
+	pr_info("%s(\"%s\", %p, %ld, %ld, ...) = ...\n", __func__,
+			path, bufp, size, off);
+	return GATEWAY_METHOD_FI_RESTARTABLE(read_buf, path, fi,
+					     bufp, size, off, fi);
 }
-#endif
+
 static int gateway_flock(const char *path, struct fuse_file_info *fi, int op)
 {
 	pr_info("%s(\"%s\", %d, ...) = ...\n", __func__, path, op);
@@ -637,7 +945,28 @@ static int gateway_fallocate(const char *path, int mode, off_t offset,
 					     mode, offset, lenght, fi);
 }
 
+/* Let libfuse splice data between backing files and FUSE device */
+void gateway_conn_init(struct fuse_conn_info *conn)
+{
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if (conn->capable & FUSE_CAP_SPLICE_READ)
+		conn->want |= FUSE_CAP_SPLICE_READ;
+
+	pr_info("%s: splice write: %s, splice read: %s\n", __func__,
+			(conn->want & FUSE_CAP_SPLICE_WRITE) ? "yes" : "no",
+			(conn->want & FUSE_CAP_SPLICE_READ) ? "yes" : "no");
+}
+
+static void *gateway_init(struct fuse_conn_info *conn)
+{
+	gateway_conn_init(conn);
+	get_context()->reopen_handles = gateway_reopen_fhs;
+	return NULL;
+}
+
 struct fuse_operations gateway_operations = {
+	.init		= gateway_init,
 	.getattr	= gateway_getattr,
 	.fgetattr	= gateway_fgetattr,
 	.access		= gateway_access,
@@ -662,9 +991,9 @@ struct fuse_operations gateway_operations = {
 	.create		= gateway_create,
 	.open		= gateway_open,
 	.read		= gateway_read,
-//	.read_buf	= gateway_read_buf,
+	.read_buf	= gateway_read_buf,
 	.write		= gateway_write,
-//	.write_buf	= gateway_write_buf,
+	.write_buf	= gateway_write_buf,
 	.statfs		= gateway_statfs,
 	.flush		= gateway_flush,
 	.release	= gateway_release,
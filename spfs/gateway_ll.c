@@ -0,0 +1,1256 @@
+#include "spfs_config.h"
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#ifdef HAVE_SETXATTR
+#include <sys/xattr.h>
+#endif
+#include <sys/file.h> /* flock(2) */
+
+#include "include/util.h"
+#include "include/log.h"
+
+#include "context.h"
+#include "inodes.h"
+#include "xattr.h"
+#include "trace.h"
+
+#define GATEWAY_LL_TIMEOUT	1.0
+
+extern void gateway_conn_init(struct fuse_conn_info *conn);
+
+#define PROC_FD_PATH_MAX	sizeof("/proc/self/fd/") + 10
+
+/* Low-level gateway file handle.
+ * Unlike high-level API, fi->fh is passed to us as is, so stale handles are
+ * reopened in place once per work mode change. */
+struct gateway_ll_fh_s {
+	pthread_rwlock_t	lock;
+	struct spfs_inode_s	*inode;
+	unsigned		open_flags;
+	unsigned long		gen;
+	int			fd;
+	DIR			*dp;
+	struct dirent		*entry;
+	off_t			offset;
+};
+
+static char *proc_fd_path(int fd, char *buf)
+{
+	snprintf(buf, PROC_FD_PATH_MAX, "/proc/self/fd/%d", fd);
+	return buf;
+}
+
+static int sys_err(int res)
+{
+	return (res == -1) ? -errno : res;
+}
+
+static int gateway_ll_interrupted(void *data)
+{
+	return fuse_req_interrupted(data);
+}
+
+static void gateway_ll_interrupt(fuse_req_t req, void *data)
+{
+	wake_mode_waiters();
+}
+
+/* Returns proxy work mode reference. Requests are put to sleep in Stub mode
+ * until work mode change. */
+static int gateway_ll_enter(fuse_req_t req, struct work_mode_s **wm)
+{
+	int err;
+
+	while (1) {
+		*wm = work_mode_enter();
+		if (!*wm)
+			return -EFAULT;
+
+		if ((*wm)->mode == SPFS_PROXY_MODE)
+			return 0;
+
+		work_mode_leave(*wm);
+
+		fuse_req_interrupt_func(req, gateway_ll_interrupt, NULL);
+		err = __wait_mode_change(SPFS_STUB_MODE, gateway_ll_interrupted, req);
+		fuse_req_interrupt_func(req, NULL, NULL);
+		if (err != -ERESTARTSYS)
+			return err;
+	}
+}
+
+/* Operation is traced by path of the inode, or of its child "name" */
+static void gateway_ll_trace(unsigned op, struct spfs_inode_s *inode,
+			     const char *name, int mode, uint64_t start,
+			     int err)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	if (!start)
+		return;
+
+	ret = name ? spfs_inode_child_path(inode, name, path, sizeof(path)) :
+		     spfs_inode_path(inode, path, sizeof(path));
+	spfs_trace(op, ret ? NULL : path, mode, start, err);
+}
+
+static void gateway_ll_reply_err(fuse_req_t req, int err)
+{
+	if (err < 0)
+		pr_info("= %d (%s)\n", err, strerror(-err));
+	else
+		pr_info("= %d\n", err);
+	fuse_reply_err(req, -err);
+}
+
+/* This macro is used for any operation on inode: "_call" is evaluated with
+ * "_fd" set to O_PATH descriptor of the inode, resolved for proxy work mode
+ * "_wm".
+ * Operation is restarted, if work mode has changed in between. It's traced
+ * as "_op" on child "_name" of the inode, or on the inode itself. */
+#define GATEWAY_LL_INODE(_req, _op, _inode, _name, _wm, _fd, _call)		\
+({										\
+	uint64_t __start = spfs_trace_start();					\
+	int __mode = SPFS_STUB_MODE;						\
+	struct work_mode_s *_wm;						\
+	int _fd, __err;								\
+										\
+	do {									\
+		__err = gateway_ll_enter(_req, &_wm);				\
+		if (__err)							\
+			break;							\
+		__mode = _wm->mode;						\
+										\
+		_fd = spfs_inode_get(_inode, _wm);				\
+		if (_fd >= 0) {							\
+			__err = (_call);					\
+			spfs_inode_put(_inode);					\
+		} else								\
+			__err = _fd;						\
+										\
+		if (__err != -ERESTARTSYS)					\
+			work_mode_served(_wm);					\
+		work_mode_leave(_wm);						\
+	} while (__err == -ERESTARTSYS);					\
+	gateway_ll_trace(_op, _inode, _name, __mode, __start, __err);		\
+	__err;									\
+})
+
+/* This macro is used for link() and rename(), where both inodes have to be
+ * resolved in the same work mode. It's traced on the source. */
+#define GATEWAY_LL_INODE2(_req, _op, _inode, _name, _fd, _newinode, _newfd,	\
+			  _call)						\
+({										\
+	uint64_t __start = spfs_trace_start();					\
+	int __mode = SPFS_STUB_MODE;						\
+	struct work_mode_s *___wm;						\
+	int _fd, _newfd, __err;							\
+										\
+	do {									\
+		__err = gateway_ll_enter(_req, &___wm);				\
+		if (__err)							\
+			break;							\
+		__mode = ___wm->mode;						\
+										\
+		_fd = spfs_inode_get(_inode, ___wm);				\
+		if (_fd >= 0) {							\
+			_newfd = spfs_inode_get(_newinode, ___wm);		\
+			if (_newfd >= 0) {					\
+				__err = (_call);				\
+				spfs_inode_put(_newinode);			\
+			} else							\
+				__err = _newfd;					\
+			spfs_inode_put(_inode);					\
+		} else								\
+			__err = _fd;						\
+										\
+		if (__err != -ERESTARTSYS)					\
+			work_mode_served(___wm);				\
+		work_mode_leave(___wm);						\
+	} while (__err == -ERESTARTSYS);					\
+	gateway_ll_trace(_op, _inode, _name, __mode, __start, __err);		\
+	__err;									\
+})
+
+static int gateway_ll_fh_reopen(struct gateway_ll_fh_s *fh,
+				struct work_mode_s *wm)
+{
+	char path[PROC_FD_PATH_MAX];
+	int ofd, fd, err = 0;
+	DIR *dp = NULL;
+
+	if (fh->gen > wm->generation)
+		return -ERESTARTSYS;
+
+	ofd = spfs_inode_get(fh->inode, wm);
+	if (ofd < 0)
+		return ofd;
+
+	fd = open(proc_fd_path(ofd, path),
+		  fh->open_flags & ~(O_CREAT | O_EXCL | O_TRUNC | O_NOFOLLOW));
+	if (fd < 0) {
+		err = -errno;
+		goto put_inode;
+	}
+
+	if (fh->dp) {
+		dp = fdopendir(fd);
+		if (!dp) {
+			err = -errno;
+			close(fd);
+			goto put_inode;
+		}
+		seekdir(dp, fh->offset);
+		closedir(fh->dp);
+		fh->dp = dp;
+		fh->entry = NULL;
+	} else if (fh->fd >= 0)
+		close(fh->fd);
+
+	pr_info("%s: reopened file handle %p as fd %d (generation: %lu -> %lu)\n",
+			__func__, fh, fd, fh->gen, wm->generation);
+
+	fh->fd = fd;
+	fh->gen = wm->generation;
+
+put_inode:
+	spfs_inode_put(fh->inode);
+	return err;
+}
+
+/* Returns backing descriptor of the file handle, valid for proxy work mode
+ * "wm". Handle is read-locked until gateway_ll_fh_put() call. */
+static int gateway_ll_fh_get(struct gateway_ll_fh_s *fh, struct work_mode_s *wm)
+{
+	int err;
+
+	pthread_rwlock_rdlock(&fh->lock);
+	while (fh->gen != wm->generation) {
+		pthread_rwlock_unlock(&fh->lock);
+
+		pthread_rwlock_wrlock(&fh->lock);
+		err = (fh->gen != wm->generation) ? gateway_ll_fh_reopen(fh, wm) : 0;
+		pthread_rwlock_unlock(&fh->lock);
+		if (err)
+			return err;
+
+		pthread_rwlock_rdlock(&fh->lock);
+	}
+	return fh->fd;
+}
+
+static void gateway_ll_fh_put(struct gateway_ll_fh_s *fh)
+{
+	pthread_rwlock_unlock(&fh->lock);
+}
+
+static struct gateway_ll_fh_s *gateway_ll_fh(struct fuse_file_info *fi)
+{
+	return (struct gateway_ll_fh_s *)(uintptr_t)fi->fh;
+}
+
+/* This macro is used for any file handle related operation. It's traced
+ * as "_op" on the inode of the handle. */
+#define GATEWAY_LL_FH(_req, _op, _fi, _fh, _wm, _fd, _call)			\
+({										\
+	uint64_t __start = spfs_trace_start();					\
+	int __mode = SPFS_STUB_MODE;						\
+	struct gateway_ll_fh_s *_fh = gateway_ll_fh(_fi);			\
+	struct work_mode_s *_wm;						\
+	int _fd, __err;								\
+										\
+	do {									\
+		__err = gateway_ll_enter(_req, &_wm);				\
+		if (__err)							\
+			break;							\
+		__mode = _wm->mode;						\
+										\
+		_fd = gateway_ll_fh_get(_fh, _wm);				\
+		if (_fd >= 0) {							\
+			__err = (_call);					\
+			gateway_ll_fh_put(_fh);					\
+		} else								\
+			__err = _fd;						\
+										\
+		if (__err != -ERESTARTSYS)					\
+			work_mode_served(_wm);					\
+		work_mode_leave(_wm);						\
+	} while (__err == -ERESTARTSYS);					\
+	gateway_ll_trace(_op, _fh->inode, NULL, __mode, __start, __err);	\
+	__err;									\
+})
+
+static int gateway_ll_create_fh(struct spfs_inode_s *inode, int fd,
+				unsigned open_flags, struct work_mode_s *wm,
+				struct fuse_file_info *fi)
+{
+	struct gateway_ll_fh_s *fh;
+
+	fh = malloc(sizeof(*fh));
+	if (!fh)
+		return -ENOMEM;
+
+	pthread_rwlock_init(&fh->lock, NULL);
+	fh->inode = inode;
+	fh->open_flags = open_flags;
+	fh->gen = wm->generation;
+	fh->fd = fd;
+	fh->dp = NULL;
+	fh->entry = NULL;
+	fh->offset = 0;
+
+	if (open_flags & O_DIRECTORY) {
+		fh->dp = fdopendir(fd);
+		if (!fh->dp) {
+			pthread_rwlock_destroy(&fh->lock);
+			free(fh);
+			return -errno;
+		}
+	}
+
+	fi->fh = (uintptr_t)fh;
+	return 0;
+}
+
+static void gateway_ll_release_fh(struct gateway_ll_fh_s *fh)
+{
+	pr_debug("%s: closed fd %d\n", __func__, fh->fd);
+
+	if (fh->dp)
+		closedir(fh->dp);
+	else if (fh->fd >= 0)
+		close(fh->fd);
+	pthread_rwlock_destroy(&fh->lock);
+	free(fh);
+}
+
+static int gateway_ll_entry(fuse_req_t req, struct spfs_inode_s *parent,
+			    const char *name, struct fuse_entry_param *e)
+{
+	uint64_t start = spfs_trace_start();
+	int mode = SPFS_STUB_MODE;
+	struct spfs_inode_s *inode;
+	struct work_mode_s *wm;
+	int err;
+
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = GATEWAY_LL_TIMEOUT;
+	e->entry_timeout = GATEWAY_LL_TIMEOUT;
+
+	do {
+		err = gateway_ll_enter(req, &wm);
+		if (err)
+			break;
+		mode = wm->mode;
+
+		err = spfs_inode_lookup(parent, name, wm, &e->attr, &inode);
+		if (err != -ERESTARTSYS)
+			work_mode_served(wm);
+		work_mode_leave(wm);
+	} while (err == -ERESTARTSYS);
+	gateway_ll_trace(SPFS_TRACE_lookup, parent, name, mode, start, err);
+
+	if (!err)
+		e->ino = spfs_inode_ino(inode);
+	return err;
+}
+
+static void gateway_ll_reply_entry(fuse_req_t req, struct spfs_inode_s *parent,
+				   const char *name, int err)
+{
+	struct fuse_entry_param e;
+
+	if (!err)
+		err = gateway_ll_entry(req, parent, name, &e);
+	if (err) {
+		gateway_ll_reply_err(req, err);
+		return;
+	}
+	pr_info("= 0 (ino: %lu)\n", e.ino);
+	fuse_reply_entry(req, &e);
+}
+
+static void gateway_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	pr_info("%s(%lu, \"%s\") = ...\n", __func__, parent, name);
+	gateway_ll_reply_entry(req, spfs_inode(parent), name, 0);
+}
+
+static void gateway_ll_forget(fuse_req_t req, fuse_ino_t ino,
+			      unsigned long nlookup)
+{
+	pr_debug("%s(%lu, %lu)\n", __func__, ino, nlookup);
+	spfs_inode_forget(spfs_inode(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void gateway_ll_forget_multi(fuse_req_t req, size_t count,
+				    struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	pr_debug("%s(%ld)\n", __func__, count);
+	for (i = 0; i < count; i++)
+		spfs_inode_forget(spfs_inode(forgets[i].ino), forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void gateway_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+			       struct fuse_file_info *fi)
+{
+	struct stat st;
+	int err;
+
+	pr_info("%s(%lu, ...) = ...\n", __func__, ino);
+
+	if ((ino == FUSE_ROOT_ID) && (ctx_work_mode() == SPFS_STUB_MODE)) {
+		/* See stub_getattr() */
+		pr_info("= 0\n");
+		fuse_reply_attr(req, &get_context()->stub_root_stat,
+				GATEWAY_LL_TIMEOUT);
+		return;
+	}
+
+	err = GATEWAY_LL_INODE(req, SPFS_TRACE_getattr, spfs_inode(ino), NULL,
+			wm, fd,
+			sys_err(fstatat(fd, "", &st,
+					AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)));
+	if (err) {
+		gateway_ll_reply_err(req, err);
+		return;
+	}
+	pr_info("= 0\n");
+	fuse_reply_attr(req, &st, GATEWAY_LL_TIMEOUT);
+}
+
+static int gateway_ll_do_setattr(int fd, int ffd, struct stat *attr, int to_set)
+{
+	char path[PROC_FD_PATH_MAX];
+	int res;
+
+	proc_fd_path(fd, path);
+
+	if (to_set & FUSE_SET_ATTR_MODE) {
+		res = (ffd >= 0) ? fchmod(ffd, attr->st_mode) :
+				   chmod(path, attr->st_mode);
+		if (res == -1)
+			return -errno;
+	}
+
+	if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+		gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+
+		res = fchownat(fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+		if (res == -1)
+			return -errno;
+	}
+
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		res = (ffd >= 0) ? ftruncate(ffd, attr->st_size) :
+				   truncate(path, attr->st_size);
+		if (res == -1)
+			return -errno;
+	}
+
+	if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		struct timespec tv[2];
+
+		tv[0].tv_sec = 0;
+		tv[1].tv_sec = 0;
+		tv[0].tv_nsec = UTIME_OMIT;
+		tv[1].tv_nsec = UTIME_OMIT;
+
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_ATIME)
+			tv[0] = attr->st_atim;
+
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_MTIME)
+			tv[1] = attr->st_mtim;
+
+		res = (ffd >= 0) ? futimens(ffd, tv) :
+				   utimensat(AT_FDCWD, path, tv, 0);
+		if (res == -1)
+			return -errno;
+	}
+
+	res = fstatat(fd, "", attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	return sys_err(res);
+}
+
+static int gateway_ll_setattr_fh(struct spfs_inode_s *inode,
+				 struct work_mode_s *wm, int ffd,
+				 struct stat *attr, int to_set)
+{
+	int fd, err;
+
+	fd = spfs_inode_get(inode, wm);
+	if (fd < 0)
+		return fd;
+
+	err = gateway_ll_do_setattr(fd, ffd, attr, to_set);
+	spfs_inode_put(inode);
+	return err;
+}
+
+static void gateway_ll_setattr(fuse_req_t req, fuse_ino_t ino,
+			       struct stat *attr, int to_set,
+			       struct fuse_file_info *fi)
+{
+	struct spfs_inode_s *inode = spfs_inode(ino);
+	int err;
+
+	pr_info("%s(%lu, 0x%x, ...) = ...\n", __func__, ino, to_set);
+
+	if (fi)
+		err = GATEWAY_LL_FH(req, SPFS_TRACE_setattr, fi, fh, wm, ffd,
+				gateway_ll_setattr_fh(inode, wm, ffd, attr, to_set));
+	else
+		err = GATEWAY_LL_INODE(req, SPFS_TRACE_setattr, inode, NULL,
+				wm, fd,
+				gateway_ll_do_setattr(fd, -1, attr, to_set));
+	if (err) {
+		gateway_ll_reply_err(req, err);
+		return;
+	}
+	pr_info("= 0\n");
+	fuse_reply_attr(req, attr, GATEWAY_LL_TIMEOUT);
+}
+
+static void gateway_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	char buf[PATH_MAX + 1];
+	int res;
+
+	pr_info("%s(%lu) = ...\n", __func__, ino);
+
+	res = GATEWAY_LL_INODE(req, SPFS_TRACE_readlink, spfs_inode(ino), NULL,
+			wm, fd,
+			sys_err(readlinkat(fd, "", buf, sizeof(buf))));
+	if (res < 0) {
+		gateway_ll_reply_err(req, res);
+		return;
+	}
+	if (res == sizeof(buf)) {
+		gateway_ll_reply_err(req, -ENAMETOOLONG);
+		return;
+	}
+	buf[res] = '\0';
+	pr_info("= 0\n");
+	fuse_reply_readlink(req, buf);
+}
+
+static int gateway_ll_do_mknod(int dfd, const char *name, mode_t mode, dev_t rdev)
+{
+	int res;
+
+	if (S_ISDIR(mode))
+		res = mkdirat(dfd, name, mode);
+	else if (S_ISFIFO(mode))
+		res = mkfifoat(dfd, name, mode);
+	else
+		res = mknodat(dfd, name, mode, rdev);
+	return sys_err(res);
+}
+
+static void gateway_ll_mknod(fuse_req_t req, fuse_ino_t parent,
+			     const char *name, mode_t mode, dev_t rdev)
+{
+	struct spfs_inode_s *inode = spfs_inode(parent);
+	int err;
+
+	pr_info("%s(%lu, \"%s\", 0%o, %lx) = ...\n", __func__, parent, name,
+			mode, rdev);
+	err = GATEWAY_LL_INODE(req, SPFS_TRACE_mknod, inode, name, wm, fd,
+			gateway_ll_do_mknod(fd, name, mode, rdev));
+	gateway_ll_reply_entry(req, inode, name, err);
+}
+
+static void gateway_ll_mkdir(fuse_req_t req, fuse_ino_t parent,
+			     const char *name, mode_t mode)
+{
+	struct spfs_inode_s *inode = spfs_inode(parent);
+	int err;
+
+	pr_info("%s(%lu, \"%s\", 0%o) = ...\n", __func__, parent, name, mode);
+	err = GATEWAY_LL_INODE(req, SPFS_TRACE_mkdir, inode, name, wm, fd,
+			gateway_ll_do_mknod(fd, name, S_IFDIR | mode, 0));
+	gateway_ll_reply_entry(req, inode, name, err);
+}
+
+static void gateway_ll_symlink(fuse_req_t req, const char *link,
+			       fuse_ino_t parent, const char *name)
+{
+	struct spfs_inode_s *inode = spfs_inode(parent);
+	int err;
+
+	pr_info("%s(\"%s\", %lu, \"%s\") = ...\n", __func__, link, parent, name);
+	err = GATEWAY_LL_INODE(req, SPFS_TRACE_symlink, inode, name, wm, fd,
+			sys_err(symlinkat(link, fd, name)));
+	gateway_ll_reply_entry(req, inode, name, err);
+}
+
+static void gateway_ll_remove(fuse_req_t req, unsigned op, fuse_ino_t parent,
+			      const char *name, int flags)
+{
+	struct spfs_inode_s *inode = spfs_inode(parent);
+	char path[PATH_MAX];
+	int err;
+
+	err = spfs_inode_child_path(inode, name, path, sizeof(path));
+	if (!err)
+		err = GATEWAY_LL_INODE(req, op, inode, name, wm, fd,
+				sys_err(unlinkat(fd, name, flags)));
+	if (!err && !(flags & AT_REMOVEDIR))
+		(void) spfs_del_xattrs(path);
+	gateway_ll_reply_err(req, err);
+}
+
+static void gateway_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	pr_info("%s(%lu, \"%s\") = ...\n", __func__, parent, name);
+	gateway_ll_remove(req, SPFS_TRACE_unlink, parent, name, 0);
+}
+
+static void gateway_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	pr_info("%s(%lu, \"%s\") = ...\n", __func__, parent, name);
+	gateway_ll_remove(req, SPFS_TRACE_rmdir, parent, name, AT_REMOVEDIR);
+}
+
+static int gateway_ll_do_rename(int dfd, const char *name,
+				int newdfd, const char *newname, struct stat *st)
+{
+	if (renameat(dfd, name, newdfd, newname))
+		return -errno;
+	return sys_err(fstatat(newdfd, newname, st, AT_SYMLINK_NOFOLLOW));
+}
+
+static void gateway_ll_rename(fuse_req_t req, fuse_ino_t parent,
+			      const char *name, fuse_ino_t newparent,
+			      const char *newname)
+{
+	struct spfs_inode_s *inode = spfs_inode(parent);
+	struct spfs_inode_s *newinode = spfs_inode(newparent);
+	char from[PATH_MAX], to[PATH_MAX];
+	struct stat st;
+	int err;
+
+	pr_info("%s(%lu, \"%s\", %lu, \"%s\") = ...\n", __func__,
+			parent, name, newparent, newname);
+
+	err = spfs_inode_child_path(inode, name, from, sizeof(from));
+	if (!err)
+		err = spfs_inode_child_path(newinode, newname, to, sizeof(to));
+	if (!err)
+		err = GATEWAY_LL_INODE2(req, SPFS_TRACE_rename, inode, name,
+				fd, newinode, newfd,
+				gateway_ll_do_rename(fd, name, newfd, newname, &st));
+	if (!err) {
+		spfs_inode_moved(&st, newinode, newname);
+		(void) spfs_move_xattrs(from, to);
+	}
+	gateway_ll_reply_err(req, err);
+}
+
+static void gateway_ll_link(fuse_req_t req, fuse_ino_t ino,
+			    fuse_ino_t newparent, const char *newname)
+{
+	struct spfs_inode_s *inode = spfs_inode(ino);
+	struct spfs_inode_s *newinode = spfs_inode(newparent);
+	char from[PATH_MAX], to[PATH_MAX], path[PROC_FD_PATH_MAX];
+	int err;
+
+	pr_info("%s(%lu, %lu, \"%s\") = ...\n", __func__, ino, newparent, newname);
+
+	err = spfs_inode_path(inode, from, sizeof(from));
+	if (!err)
+		err = spfs_inode_child_path(newinode, newname, to, sizeof(to));
+	if (!err)
+		err = GATEWAY_LL_INODE2(req, SPFS_TRACE_link, inode, NULL,
+				fd, newinode, newfd,
+				sys_err(linkat(AT_FDCWD, proc_fd_path(fd, path),
+					       newfd, newname, AT_SYMLINK_FOLLOW)));
+	if (!err)
+		(void) spfs_dup_xattrs(from, to);
+	gateway_ll_reply_entry(req, newinode, newname, err);
+}
+
+static int gateway_ll_do_open(int fd, struct spfs_inode_s *inode,
+			      struct work_mode_s *wm, struct fuse_file_info *fi)
+{
+	char path[PROC_FD_PATH_MAX];
+	int ffd, err;
+
+	ffd = open(proc_fd_path(fd, path), fi->flags & ~O_NOFOLLOW);
+	if (ffd < 0)
+		return -errno;
+
+	err = gateway_ll_create_fh(inode, ffd, fi->flags, wm, fi);
+	if (err)
+		close(ffd);
+	return err;
+}
+
+static void gateway_ll_open(fuse_req_t req, fuse_ino_t ino,
+			    struct fuse_file_info *fi)
+{
+	struct spfs_inode_s *inode = spfs_inode(ino);
+	int err;
+
+	pr_info("%s(%lu, 0%o) = ...\n", __func__, ino, fi->flags);
+	err = GATEWAY_LL_INODE(req, (fi->flags & O_DIRECTORY) ?
+				    SPFS_TRACE_opendir : SPFS_TRACE_open,
+			inode, NULL, wm, fd,
+			gateway_ll_do_open(fd, inode, wm, fi));
+	if (err) {
+		gateway_ll_reply_err(req, err);
+		return;
+	}
+	pr_info("= 0\n");
+	if (fuse_reply_open(req, fi) == -ENOENT)
+		/* Request was interrupted */
+		gateway_ll_release_fh(gateway_ll_fh(fi));
+}
+
+static void gateway_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+			       struct fuse_file_info *fi)
+{
+	fi->flags |= O_DIRECTORY;
+	gateway_ll_open(req, ino, fi);
+}
+
+static int gateway_ll_do_create(int dfd, const char *name, mode_t mode,
+				struct spfs_inode_s *parent,
+				struct work_mode_s *wm, struct fuse_file_info *fi,
+				struct fuse_entry_param *e)
+{
+	struct spfs_inode_s *inode;
+	int fd, err;
+
+	fd = openat(dfd, name, (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+	if (fd < 0)
+		return -errno;
+
+	err = spfs_inode_lookup(parent, name, wm, &e->attr, &inode);
+	if (err)
+		goto close_fd;
+
+	err = gateway_ll_create_fh(inode, fd, fi->flags, wm, fi);
+	if (err) {
+		spfs_inode_forget(inode, 1);
+		goto close_fd;
+	}
+
+	e->ino = spfs_inode_ino(inode);
+	return 0;
+
+close_fd:
+	/* File is created already, so restarted request must not fail on it */
+	if (err == -ERESTARTSYS)
+		fi->flags &= ~O_EXCL;
+	close(fd);
+	return err;
+}
+
+static void gateway_ll_create(fuse_req_t req, fuse_ino_t parent,
+			      const char *name, mode_t mode,
+			      struct fuse_file_info *fi)
+{
+	struct spfs_inode_s *inode = spfs_inode(parent);
+	struct fuse_entry_param e = {
+		.attr_timeout = GATEWAY_LL_TIMEOUT,
+		.entry_timeout = GATEWAY_LL_TIMEOUT,
+	};
+	int err;
+
+	pr_info("%s(%lu, \"%s\", 0%o, 0%o) = ...\n", __func__, parent, name,
+			mode, fi->flags);
+	err = GATEWAY_LL_INODE(req, SPFS_TRACE_create, inode, name, wm, fd,
+			gateway_ll_do_create(fd, name, mode, inode, wm,
+					     fi, &e));
+	if (err) {
+		gateway_ll_reply_err(req, err);
+		return;
+	}
+	pr_info("= 0 (ino: %lu)\n", e.ino);
+	if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+		/* Request was interrupted */
+		gateway_ll_release_fh(gateway_ll_fh(fi));
+		spfs_inode_forget(spfs_inode(e.ino), 1);
+	}
+}
+
+static int gateway_ll_do_read(fuse_req_t req, int fd, size_t size, off_t off)
+{
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = fd;
+	buf.buf[0].pos = off;
+
+	/* Data is spliced from backing file, so reply under handle lock */
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+	return 0;
+}
+
+static void gateway_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			    off_t off, struct fuse_file_info *fi)
+{
+	int err;
+
+	pr_info("%s(%lu, %ld, %ld, ...) = ...\n", __func__, ino, size, off);
+	err = GATEWAY_LL_FH(req, SPFS_TRACE_read, fi, fh, wm, fd,
+			gateway_ll_do_read(req, fd, size, off));
+	if (err)
+		gateway_ll_reply_err(req, err);
+}
+
+static int gateway_ll_do_write_buf(int fd, struct fuse_bufvec *bufv, off_t off)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fd;
+	dst.buf[0].pos = off;
+
+	return fuse_buf_copy(&dst, bufv, FUSE_BUF_SPLICE_NONBLOCK);
+}
+
+static void gateway_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+				 struct fuse_bufvec *bufv, off_t off,
+				 struct fuse_file_info *fi)
+{
+	int res;
+
+	pr_info("%s(%lu, %ld, %ld, ...) = ...\n", __func__, ino,
+			fuse_buf_size(bufv), off);
+	res = GATEWAY_LL_FH(req, SPFS_TRACE_write_buf, fi, fh, wm, fd,
+			gateway_ll_do_write_buf(fd, bufv, off));
+	if (res < 0) {
+		gateway_ll_reply_err(req, res);
+		return;
+	}
+	pr_info("= %d\n", res);
+	fuse_reply_write(req, res);
+}
+
+static int gateway_ll_do_flush(int fd)
+{
+	int res;
+
+	/* See proxy_flush() */
+	res = dup(fd);
+	if (res < 0)
+		return -errno;
+	return sys_err(close(res));
+}
+
+static void gateway_ll_flush(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info *fi)
+{
+	pr_info("%s(%lu, ...) = ...\n", __func__, ino);
+	gateway_ll_reply_err(req, GATEWAY_LL_FH(req, SPFS_TRACE_flush,
+				fi, fh, wm, fd,
+				gateway_ll_do_flush(fd)));
+}
+
+static void gateway_ll_release(fuse_req_t req, fuse_ino_t ino,
+			       struct fuse_file_info *fi)
+{
+	uint64_t start = spfs_trace_start();
+
+	pr_info("%s(%lu, ...) = ...\n", __func__, ino);
+	gateway_ll_release_fh(gateway_ll_fh(fi));
+	gateway_ll_trace(SPFS_TRACE_release, spfs_inode(ino), NULL,
+			 ctx_work_mode(), start, 0);
+	gateway_ll_reply_err(req, 0);
+}
+
+static int gateway_ll_do_fsync(int fd, int datasync)
+{
+#ifdef HAVE_FDATASYNC
+	if (datasync)
+		return sys_err(fdatasync(fd));
+#endif
+	return sys_err(fsync(fd));
+}
+
+static void gateway_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			     struct fuse_file_info *fi)
+{
+	pr_info("%s(%lu, %d, ...) = ...\n", __func__, ino, datasync);
+	gateway_ll_reply_err(req, GATEWAY_LL_FH(req, SPFS_TRACE_fsync,
+				fi, fh, wm, fd,
+				gateway_ll_do_fsync(fd, datasync)));
+}
+
+static int gateway_ll_do_readdir(fuse_req_t req, struct gateway_ll_fh_s *fh,
+				 size_t size, off_t off)
+{
+	char *buf, *p;
+	size_t rem = size;
+
+	buf = calloc(1, size);
+	if (!buf)
+		return -ENOMEM;
+
+	if (off != fh->offset) {
+		seekdir(fh->dp, off);
+		fh->entry = NULL;
+		fh->offset = off;
+	}
+
+	p = buf;
+	while (1) {
+		struct stat st;
+		off_t nextoff;
+		size_t entsize;
+
+		if (!fh->entry) {
+			errno = 0;
+			fh->entry = readdir(fh->dp);
+			if (!fh->entry) {
+				if (errno && (rem == size)) {
+					free(buf);
+					return -errno;
+				}
+				break;
+			}
+		}
+
+		memset(&st, 0, sizeof(st));
+		st.st_ino = fh->entry->d_ino;
+		st.st_mode = fh->entry->d_type << 12;
+		nextoff = telldir(fh->dp);
+
+		entsize = fuse_add_direntry(req, p, rem, fh->entry->d_name,
+					    &st, nextoff);
+		if (entsize > rem)
+			break;
+
+		p += entsize;
+		rem -= entsize;
+
+		fh->entry = NULL;
+		fh->offset = nextoff;
+	}
+
+	fuse_reply_buf(req, buf, size - rem);
+	free(buf);
+	return 0;
+}
+
+static void gateway_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			       off_t off, struct fuse_file_info *fi)
+{
+	int err;
+
+	pr_info("%s(%lu, %ld, %ld, ...) = ...\n", __func__, ino, size, off);
+	/* Readdir calls are serialized by kernel for each file */
+	err = GATEWAY_LL_FH(req, SPFS_TRACE_readdir, fi, fh, wm, fd,
+			gateway_ll_do_readdir(req, fh, size, off));
+	if (err)
+		gateway_ll_reply_err(req, err);
+}
+
+static void gateway_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+				  struct fuse_file_info *fi)
+{
+	uint64_t start = spfs_trace_start();
+
+	pr_info("%s(%lu, ...) = ...\n", __func__, ino);
+	gateway_ll_release_fh(gateway_ll_fh(fi));
+	gateway_ll_trace(SPFS_TRACE_releasedir, spfs_inode(ino), NULL,
+			 ctx_work_mode(), start, 0);
+	gateway_ll_reply_err(req, 0);
+}
+
+static void gateway_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+				struct fuse_file_info *fi)
+{
+	pr_info("%s(%lu, %d, ...) = ...\n", __func__, ino, datasync);
+	gateway_ll_reply_err(req, GATEWAY_LL_FH(req, SPFS_TRACE_fsyncdir,
+				fi, fh, wm, fd,
+				gateway_ll_do_fsync(dirfd(fh->dp), datasync)));
+}
+
+static void gateway_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs stbuf;
+	int err;
+
+	pr_info("%s(%lu) = ...\n", __func__, ino);
+	err = GATEWAY_LL_INODE(req, SPFS_TRACE_statfs, spfs_inode(ino), NULL,
+			wm, fd,
+			sys_err(fstatvfs(fd, &stbuf)));
+	if (err) {
+		gateway_ll_reply_err(req, err);
+		return;
+	}
+	pr_info("= 0\n");
+	fuse_reply_statfs(req, &stbuf);
+}
+
+static void gateway_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	char path[PROC_FD_PATH_MAX];
+
+	pr_info("%s(%lu, 0%o) = ...\n", __func__, ino, mask);
+	gateway_ll_reply_err(req, GATEWAY_LL_INODE(req, SPFS_TRACE_access,
+				spfs_inode(ino), NULL, wm, fd,
+				sys_err(access(proc_fd_path(fd, path), mask))));
+}
+
+#ifdef HAVE_SETXATTR
+static void gateway_ll_reply_xattr(fuse_req_t req, const char *value,
+				   size_t size, ssize_t res)
+{
+	if (res < 0) {
+		gateway_ll_reply_err(req, res);
+		return;
+	}
+	pr_info("= %ld\n", res);
+	if (size)
+		fuse_reply_buf(req, value, res);
+	else
+		fuse_reply_xattr(req, res);
+}
+
+/* There is no race free way to work with xattrs of a symlink by descriptor */
+static int gateway_ll_xattr_fd(struct spfs_inode_s *inode, int fd, char *path)
+{
+	if (S_ISLNK(inode->mode))
+		return -EPERM;
+	proc_fd_path(fd, path);
+	return 0;
+}
+
+static ssize_t gateway_ll_do_getxattr(struct spfs_inode_s *inode, int fd,
+				      const char *name, char *value, size_t size)
+{
+	char path[PROC_FD_PATH_MAX];
+	int err;
+
+	err = gateway_ll_xattr_fd(inode, fd, path);
+	if (err)
+		return err;
+	return sys_err(getxattr(path, name, value, size));
+}
+
+static void gateway_ll_getxattr(fuse_req_t req, fuse_ino_t ino,
+				const char *name, size_t size)
+{
+	struct spfs_inode_s *inode = spfs_inode(ino);
+	char path[PATH_MAX];
+	char *value = NULL;
+	ssize_t res;
+
+	pr_info("%s(%lu, \"%s\", %ld) = ...\n", __func__, ino, name, size);
+
+	if (size) {
+		value = malloc(size);
+		if (!value) {
+			gateway_ll_reply_err(req, -ENOMEM);
+			return;
+		}
+	}
+
+	if (is_spfs_xattr(name)) {
+		res = spfs_inode_path(inode, path, sizeof(path));
+		if (!res)
+			res = spfs_getxattr(path, name, value, size);
+	} else
+		res = GATEWAY_LL_INODE(req, SPFS_TRACE_getxattr, inode, NULL,
+				wm, fd,
+				gateway_ll_do_getxattr(inode, fd, name,
+						       value, size));
+	gateway_ll_reply_xattr(req, value, size, res);
+	free(value);
+}
+
+static ssize_t gateway_ll_do_listxattr(struct spfs_inode_s *inode, int fd,
+				       char *list, size_t size)
+{
+	char path[PROC_FD_PATH_MAX];
+	int err;
+
+	err = gateway_ll_xattr_fd(inode, fd, path);
+	if (err)
+		return err;
+	return sys_err(listxattr(path, list, size));
+}
+
+static void gateway_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	struct spfs_inode_s *inode = spfs_inode(ino);
+	char *list = NULL;
+	ssize_t res;
+
+	pr_info("%s(%lu, %ld) = ...\n", __func__, ino, size);
+
+	if (size) {
+		list = malloc(size);
+		if (!list) {
+			gateway_ll_reply_err(req, -ENOMEM);
+			return;
+		}
+	}
+
+	res = GATEWAY_LL_INODE(req, SPFS_TRACE_listxattr, inode, NULL, wm, fd,
+			gateway_ll_do_listxattr(inode, fd, list, size));
+	gateway_ll_reply_xattr(req, list, size, res);
+	free(list);
+}
+
+static int gateway_ll_do_setxattr(struct spfs_inode_s *inode, int fd,
+				  const char *name, const char *value,
+				  size_t size, int flags)
+{
+	char path[PROC_FD_PATH_MAX];
+	int err;
+
+	err = gateway_ll_xattr_fd(inode, fd, path);
+	if (err)
+		return err;
+	return sys_err(setxattr(path, name, value, size, flags));
+}
+
+static void gateway_ll_setxattr(fuse_req_t req, fuse_ino_t ino,
+				const char *name, const char *value,
+				size_t size, int flags)
+{
+	struct spfs_inode_s *inode = spfs_inode(ino);
+	char path[PATH_MAX];
+	int err;
+
+	pr_info("%s(%lu, \"%s\", \"%s\", %ld, 0x%x) = ...\n", __func__,
+			ino, name, value, size, flags);
+
+	if (is_spfs_xattr(name)) {
+		err = spfs_inode_path(inode, path, sizeof(path));
+		if (!err)
+			err = spfs_setxattr(path, name, value, size, flags);
+	} else
+		err = GATEWAY_LL_INODE(req, SPFS_TRACE_setxattr, inode, NULL,
+				wm, fd,
+				gateway_ll_do_setxattr(inode, fd, name,
+						       value, size, flags));
+	gateway_ll_reply_err(req, err);
+}
+
+static int gateway_ll_do_removexattr(struct spfs_inode_s *inode, int fd,
+				     const char *name)
+{
+	char path[PROC_FD_PATH_MAX];
+	int err;
+
+	err = gateway_ll_xattr_fd(inode, fd, path);
+	if (err)
+		return err;
+	return sys_err(removexattr(path, name));
+}
+
+static void gateway_ll_removexattr(fuse_req_t req, fuse_ino_t ino,
+				   const char *name)
+{
+	struct spfs_inode_s *inode = spfs_inode(ino);
+	char path[PATH_MAX];
+	int err;
+
+	pr_info("%s(%lu, \"%s\") = ...\n", __func__, ino, name);
+
+	if (is_spfs_xattr(name)) {
+		err = spfs_inode_path(inode, path, sizeof(path));
+		if (!err)
+			err = spfs_removexattr(path, name);
+	} else
+		err = GATEWAY_LL_INODE(req, SPFS_TRACE_removexattr, inode, NULL,
+				wm, fd,
+				gateway_ll_do_removexattr(inode, fd, name));
+	gateway_ll_reply_err(req, err);
+}
+#endif /* HAVE_SETXATTR */
+
+static void gateway_ll_flock(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info *fi, int op)
+{
+	pr_info("%s(%lu, %d, ...) = ...\n", __func__, ino, op);
+	gateway_ll_reply_err(req, GATEWAY_LL_FH(req, SPFS_TRACE_flock,
+				fi, fh, wm, fd,
+				sys_err(flock(fd, op))));
+}
+
+#ifdef HAVE_POSIX_FALLOCATE
+static void gateway_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+				 off_t offset, off_t length,
+				 struct fuse_file_info *fi)
+{
+	pr_info("%s(%lu, 0%o, %ld, %ld, ...) = ...\n", __func__, ino, mode,
+			offset, length);
+	if (mode) {
+		gateway_ll_reply_err(req, -EOPNOTSUPP);
+		return;
+	}
+	gateway_ll_reply_err(req, GATEWAY_LL_FH(req, SPFS_TRACE_fallocate,
+				fi, fh, wm, fd,
+				-posix_fallocate(fd, offset, length)));
+}
+#endif
+
+/* POSIX locks are not implemented: spfs is always mounted with
+ * "no_remote_lock", so kernel handles them locally. */
+static void gateway_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	gateway_conn_init(conn);
+}
+
+struct fuse_lowlevel_ops gateway_ll_operations = {
+	.init		= gateway_ll_init,
+	.lookup		= gateway_ll_lookup,
+	.forget		= gateway_ll_forget,
+	.forget_multi	= gateway_ll_forget_multi,
+	.getattr	= gateway_ll_getattr,
+	.setattr	= gateway_ll_setattr,
+	.readlink	= gateway_ll_readlink,
+	.mknod		= gateway_ll_mknod,
+	.mkdir		= gateway_ll_mkdir,
+	.symlink	= gateway_ll_symlink,
+	.unlink		= gateway_ll_unlink,
+	.rmdir		= gateway_ll_rmdir,
+	.rename		= gateway_ll_rename,
+	.link		= gateway_ll_link,
+	.open		= gateway_ll_open,
+	.create		= gateway_ll_create,
+	.read		= gateway_ll_read,
+	.write_buf	= gateway_ll_write_buf,
+	.flush		= gateway_ll_flush,
+	.release	= gateway_ll_release,
+	.fsync		= gateway_ll_fsync,
+	.opendir	= gateway_ll_opendir,
+	.readdir	= gateway_ll_readdir,
+	.releasedir	= gateway_ll_releasedir,
+	.fsyncdir	= gateway_ll_fsyncdir,
+	.statfs		= gateway_ll_statfs,
+	.access		= gateway_ll_access,
+#ifdef HAVE_SETXATTR
+	.setxattr	= gateway_ll_setxattr,
+	.getxattr	= gateway_ll_getxattr,
+	.listxattr	= gateway_ll_listxattr,
+	.removexattr	= gateway_ll_removexattr,
+#endif
+	.flock		= gateway_ll_flock,
+#ifdef HAVE_POSIX_FALLOCATE
+	.fallocate	= gateway_ll_fallocate,
+#endif
+};
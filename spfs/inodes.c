@@ -0,0 +1,492 @@
+#include "spfs_config.h"
+
+#include <fuse_lowlevel.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "include/log.h"
+
+#include "context.h"
+#include "inodes.h"
+#include "xattr.h"
+
+#define INODE_HASH_BITS		12
+#define INODE_HASH_SIZE		(1 << INODE_HASH_BITS)
+
+struct stale_fd_s {
+	struct list_head	list;
+	int			fd;
+};
+
+/* Protects hash table, tree topology, reference counters and descriptors of
+ * all the inodes. */
+static pthread_mutex_t inodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hlist_head inodes_hash[INODE_HASH_SIZE];
+
+/* Root inode never has descriptor of it's own: it's always proxy directory of
+ * the caller's work mode. */
+static struct spfs_inode_s root_inode = {
+	.name		= "",
+	.mode		= S_IFDIR,
+	.fd		= -1,
+	.stale_fds	= LIST_HEAD_INIT(root_inode.stale_fds),
+	.nlookup	= 1,
+};
+
+struct spfs_inode_s *spfs_inode(uint64_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &root_inode;
+	return (struct spfs_inode_s *)(uintptr_t)ino;
+}
+
+uint64_t spfs_inode_ino(struct spfs_inode_s *inode)
+{
+	if (inode == &root_inode)
+		return FUSE_ROOT_ID;
+	return (uintptr_t)inode;
+}
+
+static struct hlist_head *inode_hash_head(dev_t dev, ino_t ino)
+{
+	uint64_t key = ((uint64_t)ino ^ (uint64_t)dev) * 0x9e3779b97f4a7c15ULL;
+
+	return &inodes_hash[key >> (64 - INODE_HASH_BITS)];
+}
+
+static struct spfs_inode_s *inode_find(dev_t dev, ino_t ino)
+{
+	struct spfs_inode_s *inode;
+
+	hlist_for_each_entry(inode, inode_hash_head(dev, ino), hash) {
+		if ((inode->dev == dev) && (inode->ino == ino))
+			return inode;
+	}
+	return NULL;
+}
+
+static bool inode_valid(const struct spfs_inode_s *inode,
+			const struct work_mode_s *wm)
+{
+	return (inode == &root_inode) || (inode->gen == wm->generation);
+}
+
+static void inode_close_stale_fds(struct spfs_inode_s *inode)
+{
+	struct stale_fd_s *sfd, *tmp;
+
+	list_for_each_entry_safe(sfd, tmp, &inode->stale_fds, list) {
+		list_del(&sfd->list);
+		close(sfd->fd);
+		free(sfd);
+	}
+}
+
+/* Descriptor can be in use by other threads. In this case it will be closed,
+ * when the last user puts the inode. */
+static void inode_retire_fd(struct spfs_inode_s *inode)
+{
+	struct stale_fd_s *sfd;
+
+	if (inode->fd < 0)
+		return;
+
+	if (!inode->users) {
+		close(inode->fd);
+		goto out;
+	}
+
+	sfd = malloc(sizeof(*sfd));
+	if (!sfd) {
+		pr_err("%s: failed to allocate, leaking fd %d\n", __func__, inode->fd);
+		goto out;
+	}
+	sfd->fd = inode->fd;
+	list_add(&sfd->list, &inode->stale_fds);
+out:
+	inode->fd = -1;
+}
+
+static void inode_bind(struct spfs_inode_s *inode, int fd,
+		       const struct stat *st, unsigned long gen)
+{
+	inode_retire_fd(inode);
+
+	inode->fd = fd;
+	inode->gen = gen;
+	inode->mode = st->st_mode;
+
+	if ((inode->dev != st->st_dev) || (inode->ino != st->st_ino)) {
+		hlist_del_init(&inode->hash);
+		inode->dev = st->st_dev;
+		inode->ino = st->st_ino;
+		hlist_add_head(&inode->hash, inode_hash_head(inode->dev, inode->ino));
+	}
+}
+
+static void inode_try_free(struct spfs_inode_s *inode)
+{
+	struct spfs_inode_s *parent;
+
+	while ((inode != &root_inode) &&
+	       !inode->nlookup && !inode->children && !inode->users) {
+		parent = inode->parent;
+
+		hlist_del_init(&inode->hash);
+		inode_retire_fd(inode);
+		inode_close_stale_fds(inode);
+		free(inode->name);
+		free(inode);
+
+		parent->children--;
+		inode = parent;
+	}
+}
+
+static int inode_set_parent(struct spfs_inode_s *inode,
+			    struct spfs_inode_s *parent, const char *name)
+{
+	struct spfs_inode_s *old_parent = inode->parent;
+	char *new_name;
+
+	if ((old_parent == parent) && !strcmp(inode->name, name))
+		return 0;
+
+	new_name = strdup(name);
+	if (!new_name) {
+		pr_err("%s: failed to duplicate %s\n", __func__, name);
+		return -ENOMEM;
+	}
+
+	free(inode->name);
+	inode->name = new_name;
+
+	if (old_parent != parent) {
+		parent->children++;
+		inode->parent = parent;
+
+		old_parent->children--;
+		inode_try_free(old_parent);
+	}
+	return 0;
+}
+
+static struct spfs_inode_s *inode_alloc(struct spfs_inode_s *parent,
+					const char *name, int fd,
+					const struct stat *st,
+					unsigned long gen)
+{
+	struct spfs_inode_s *inode;
+
+	inode = calloc(1, sizeof(*inode));
+	if (!inode) {
+		pr_err("%s: failed to allocate inode\n", __func__);
+		return NULL;
+	}
+
+	inode->name = strdup(name);
+	if (!inode->name) {
+		pr_err("%s: failed to duplicate %s\n", __func__, name);
+		free(inode);
+		return NULL;
+	}
+
+	INIT_HLIST_NODE(&inode->hash);
+	INIT_LIST_HEAD(&inode->stale_fds);
+
+	inode->fd = -1;
+	inode_bind(inode, fd, st, gen);
+
+	inode->parent = parent;
+	parent->children++;
+	return inode;
+}
+
+static int inode_path(struct spfs_inode_s *inode, char *buf, size_t size)
+{
+	char *p = buf + size;
+	size_t len;
+
+	*--p = '\0';
+	for (; inode != &root_inode; inode = inode->parent) {
+		len = strlen(inode->name);
+		if (p - buf < len + 1)
+			return -ENAMETOOLONG;
+		p -= len;
+		memcpy(p, inode->name, len);
+		*--p = '/';
+	}
+	if (!*p)
+		*--p = '/';
+
+	memmove(buf, p, buf + size - p);
+	return 0;
+}
+
+static int inode_child_path(struct spfs_inode_s *parent, const char *name,
+			    char *buf, size_t size)
+{
+	size_t len;
+	int err;
+
+	err = inode_path(parent, buf, size);
+	if (err)
+		return err;
+
+	len = strlen(buf);
+	if (snprintf(buf + len, size - len, "%s%s",
+		     (parent == &root_inode) ? "" : "/", name) >= size - len)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+int spfs_inode_path(struct spfs_inode_s *inode, char *buf, size_t size)
+{
+	int err;
+
+	pthread_mutex_lock(&inodes_lock);
+	err = inode_path(inode, buf, size);
+	pthread_mutex_unlock(&inodes_lock);
+	return err;
+}
+
+int spfs_inode_child_path(struct spfs_inode_s *parent, const char *name,
+			  char *buf, size_t size)
+{
+	int err;
+
+	pthread_mutex_lock(&inodes_lock);
+	err = inode_child_path(parent, name, buf, size);
+	pthread_mutex_unlock(&inodes_lock);
+	return err;
+}
+
+/* Files with link remap xattr live somewhere else in proxy directory */
+static int inode_openat(int dfd, const char *name, const char *path,
+			const struct work_mode_s *wm)
+{
+	char real[PATH_MAX];
+	ssize_t size;
+	int fd;
+
+	size = spfs_getxattr(path, SPFS_XATTR_LINK_REMAP, real, sizeof(real) - 1);
+	if (size > 0) {
+		real[size] = '\0';
+		pr_debug("found real path '%s' for file '%s'\n", real, path);
+
+		dfd = wm->proxy_dir_fd;
+		name = real + strspn(real, "/");
+		if (!*name)
+			name = ".";
+	}
+
+	fd = openat(dfd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	return fd;
+}
+
+static int inode_resolve(struct spfs_inode_s *inode, struct work_mode_s *wm)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int dfd, fd, err;
+
+	err = inode_path(inode, path, sizeof(path));
+	if (err)
+		return err;
+
+	dfd = (inode->parent == &root_inode) ? wm->proxy_dir_fd : inode->parent->fd;
+
+	fd = inode_openat(dfd, inode->name, path, wm);
+	if (fd < 0) {
+		pr_debug("%s: failed to resolve '%s': %d\n", __func__, path, fd);
+		return fd;
+	}
+
+	if (fstatat(fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
+		err = -errno;
+		pr_perror("%s: failed to stat '%s'", __func__, path);
+		close(fd);
+		return err;
+	}
+
+	pr_debug("%s: '%s' resolved as fd %d (generation: %lu -> %lu)\n",
+			__func__, path, fd, inode->gen, wm->generation);
+
+	inode_bind(inode, fd, &st, wm->generation);
+	return 0;
+}
+
+/* Resolves the inode and all it's stale ancestors in work mode "wm" top down.
+ * Deep trees are resolved iteratively to avoid recursion with path buffers on
+ * stack. */
+static int inode_revalidate(struct spfs_inode_s *inode, struct work_mode_s *wm)
+{
+	struct spfs_inode_s *stale;
+	int err;
+
+	while (!inode_valid(inode, wm)) {
+		stale = inode;
+		while (!inode_valid(stale->parent, wm))
+			stale = stale->parent;
+
+		/* Caller works with outdated work mode */
+		if (stale->gen > wm->generation)
+			return -ERESTARTSYS;
+
+		err = inode_resolve(stale, wm);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/* Returns O_PATH descriptor of the inode, valid for work mode "wm".
+ * Descriptor is guaranteed to stay open until spfs_inode_put() call. */
+int spfs_inode_get(struct spfs_inode_s *inode, struct work_mode_s *wm)
+{
+	int fd;
+
+	pthread_mutex_lock(&inodes_lock);
+	fd = inode_revalidate(inode, wm);
+	if (!fd) {
+		fd = (inode == &root_inode) ? wm->proxy_dir_fd : inode->fd;
+		inode->users++;
+	}
+	pthread_mutex_unlock(&inodes_lock);
+	return fd;
+}
+
+void spfs_inode_put(struct spfs_inode_s *inode)
+{
+	pthread_mutex_lock(&inodes_lock);
+	if (!--inode->users)
+		inode_close_stale_fds(inode);
+	inode_try_free(inode);
+	pthread_mutex_unlock(&inodes_lock);
+}
+
+/* Dot entries are resolved to the parent itself, or to it's own parent:
+ * they are not new inodes, and ".." of the root must not escape proxy
+ * directory. */
+static int inode_lookup_dot(struct spfs_inode_s *parent, const char *name,
+			    struct work_mode_s *wm, struct stat *st,
+			    struct spfs_inode_s **inode)
+{
+	struct spfs_inode_s *dot = parent;
+	int fd, err;
+
+	pthread_mutex_lock(&inodes_lock);
+	if (!strcmp(name, "..") && (parent != &root_inode))
+		dot = parent->parent;
+
+	err = inode_revalidate(dot, wm);
+	if (err)
+		goto unlock;
+
+	fd = (dot == &root_inode) ? wm->proxy_dir_fd : dot->fd;
+	if (fstatat(fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
+		err = -errno;
+		goto unlock;
+	}
+
+	dot->nlookup++;
+	*inode = dot;
+unlock:
+	pthread_mutex_unlock(&inodes_lock);
+	return err;
+}
+
+int spfs_inode_lookup(struct spfs_inode_s *parent, const char *name,
+		      struct work_mode_s *wm, struct stat *st,
+		      struct spfs_inode_s **inode)
+{
+	char path[PATH_MAX];
+	struct spfs_inode_s *found;
+	int dfd, fd, err;
+
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+		return inode_lookup_dot(parent, name, wm, st, inode);
+
+	dfd = spfs_inode_get(parent, wm);
+	if (dfd < 0)
+		return dfd;
+
+	err = spfs_inode_child_path(parent, name, path, sizeof(path));
+	if (err)
+		goto put_parent;
+
+	fd = inode_openat(dfd, name, path, wm);
+	if (fd < 0) {
+		err = fd;
+		goto put_parent;
+	}
+
+	if (fstatat(fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
+		err = -errno;
+		goto close_fd;
+	}
+
+	pthread_mutex_lock(&inodes_lock);
+	found = inode_find(st->st_dev, st->st_ino);
+	if (found) {
+		if (found->gen > wm->generation)
+			err = -ERESTARTSYS;
+		else {
+			if (found->gen != wm->generation) {
+				inode_bind(found, fd, st, wm->generation);
+				fd = -1;
+			}
+			err = inode_set_parent(found, parent, name);
+		}
+	} else {
+		found = inode_alloc(parent, name, fd, st, wm->generation);
+		if (found)
+			fd = -1;
+		else
+			err = -ENOMEM;
+	}
+	if (!err) {
+		found->nlookup++;
+		*inode = found;
+	}
+	pthread_mutex_unlock(&inodes_lock);
+
+close_fd:
+	if (fd >= 0)
+		close(fd);
+put_parent:
+	spfs_inode_put(parent);
+	return err;
+}
+
+void spfs_inode_forget(struct spfs_inode_s *inode, uint64_t nlookup)
+{
+	pthread_mutex_lock(&inodes_lock);
+	if (inode->nlookup < nlookup) {
+		pr_err("%s: inode %p: forget %lu of %lu lookups\n", __func__,
+				inode, nlookup, inode->nlookup);
+		nlookup = inode->nlookup;
+	}
+	inode->nlookup -= nlookup;
+	inode_try_free(inode);
+	pthread_mutex_unlock(&inodes_lock);
+}
+
+/* Called after successful rename to keep the inode resolvable by name */
+void spfs_inode_moved(const struct stat *st,
+		      struct spfs_inode_s *newparent, const char *newname)
+{
+	struct spfs_inode_s *inode;
+
+	pthread_mutex_lock(&inodes_lock);
+	inode = inode_find(st->st_dev, st->st_ino);
+	if (inode)
+		(void) inode_set_parent(inode, newparent, newname);
+	pthread_mutex_unlock(&inodes_lock);
+}
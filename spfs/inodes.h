@@ -0,0 +1,52 @@
+#ifndef __SPFS_INODES_H_
+#define __SPFS_INODES_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "include/list.h"
+
+struct work_mode_s;
+
+/* Inode of the low-level gateway.
+ * Each inode keeps an O_PATH descriptor of the backing file in proxy
+ * directory, resolved for work mode with generation "gen".
+ * Parent and name are kept to be able to resolve the inode again, when work
+ * mode changes. */
+struct spfs_inode_s {
+	struct hlist_node	hash;
+	struct spfs_inode_s	*parent;
+	char			*name;
+
+	dev_t			dev;
+	ino_t			ino;
+	mode_t			mode;
+
+	int			fd;
+	unsigned long		gen;
+	struct list_head	stale_fds;
+
+	uint64_t		nlookup;
+	unsigned		children;
+	unsigned		users;
+};
+
+struct spfs_inode_s *spfs_inode(uint64_t ino);
+uint64_t spfs_inode_ino(struct spfs_inode_s *inode);
+
+int spfs_inode_get(struct spfs_inode_s *inode, struct work_mode_s *wm);
+void spfs_inode_put(struct spfs_inode_s *inode);
+
+int spfs_inode_lookup(struct spfs_inode_s *parent, const char *name,
+		      struct work_mode_s *wm, struct stat *st,
+		      struct spfs_inode_s **inode);
+void spfs_inode_forget(struct spfs_inode_s *inode, uint64_t nlookup);
+void spfs_inode_moved(const struct stat *st,
+		      struct spfs_inode_s *newparent, const char *newname);
+
+int spfs_inode_path(struct spfs_inode_s *inode, char *buf, size_t size);
+int spfs_inode_child_path(struct spfs_inode_s *parent, const char *name,
+			  char *buf, size_t size);
+
+#endif
@@ -23,6 +23,16 @@ struct cmd_package_s {
 	char		path[0];
 };
 
+/* Reply to any command. Status goes first, so the reply can be received as
+ * plain status as well. */
+struct spfs_reply_s {
+	int		status;
+	unsigned	reopened;
+	unsigned	skipped;
+	long		reopen_us;
+	unsigned long	xattr_lookups_avoided;
+};
+
 static inline size_t mode_packet_size(const char *path)
 {
 	size_t len = path ? (strlen(path) + 1) : 0;
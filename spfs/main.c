@@ -1,6 +1,7 @@
 #include "spfs_config.h"
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <getopt.h>
 #include <stdlib.h>
 
@@ -12,8 +13,18 @@
 #include "include/namespaces.h"
 
 #include "context.h"
+#include "trace.h"
 
 extern struct fuse_operations gateway_operations;
+extern struct fuse_lowlevel_ops gateway_ll_operations;
+
+struct spfs_fuse_s {
+	/* High-level (path based) gateway */
+	struct fuse		*fuse;
+	/* Low-level (inode based) gateway */
+	struct fuse_session	*se;
+	struct fuse_chan	*ch;
+};
 
 static void copy_args(char **old, int *old_index, char **new, int *new_index)
 {
@@ -43,6 +54,8 @@ static void help(int argc, char **argv, int help_level)
 	printf("\t     --ready-fd              fd number to report ready status\n");
 	printf("\t     --single-user           spfs won't close socket connection\n");
 	printf("\t     --mntns-pid             pid with mount namespace for mountpoint\n");
+	printf("\t     --lowlevel              use inode based FUSE gateway\n");
+	printf("\t     --trace-dir             binary trace directory (path based gateway)\n");
 	printf("\t-v                           increase verbosity (can be used multiple times)\n");
 	printf("\n");
 
@@ -57,7 +70,8 @@ static void help(int argc, char **argv, int help_level)
 int parse_options(int *orig_argc, char ***orig_argv,
 		  char **proxy_dir, spfs_mode_t *mode, char **log, char **socket_path,
 		  int *verbosity, char **root, int *ready_fd, bool *single_user,
-		  int *mnt_ns_pid, int *proxy_mnt_ns_pid)
+		  int *mnt_ns_pid, int *proxy_mnt_ns_pid, bool *lowlevel,
+		  char **trace_dir)
 {
 	static struct option opts[] = {
 		{"proxy-dir",	required_argument,	0, 'p'},
@@ -70,6 +84,8 @@ int parse_options(int *orig_argc, char ***orig_argv,
 		{"single-user",	no_argument,		0, 1001},
 		{"mntns-pid",	required_argument,	0, 1002},
 		{"proxy-mntns-pid",	required_argument,	0, 1003},
+		{"lowlevel",	no_argument,		0, 1004},
+		{"trace-dir",	required_argument,	0, 1005},
 		{0,		0,			0,  0 }
 	};
 	int oind = 0, nind = 1;
@@ -156,6 +172,14 @@ int parse_options(int *orig_argc, char ***orig_argv,
 				proxy_mnt_ns_pid_str = optarg;
 				nind += 2;
 				break;
+			case 1004:
+				*lowlevel = true;
+				nind += 1;
+				break;
+			case 1005:
+				*trace_dir = optarg;
+				nind += 2;
+				break;
 			case '?':
 				copy_args(argv, &nind, new_argv, &new_argc);
 				break;
@@ -264,10 +288,60 @@ err_unmount:
 	return NULL;
 }
 
+/* Options, which are meaningful for high-level API only */
+static const struct fuse_opt fuse_ll_discard_opts[] = {
+	FUSE_OPT_KEY("intr", FUSE_OPT_KEY_DISCARD),
+	FUSE_OPT_KEY("intr_signal=", FUSE_OPT_KEY_DISCARD),
+	FUSE_OPT_END
+};
+
+static struct fuse_session *setup_fuse_lowlevel(struct fuse_args *args,
+		const struct fuse_lowlevel_ops *op, size_t op_size,
+		char *mountpoint, struct fuse_chan **ch)
+{
+	struct fuse_session *se;
+
+	if (fuse_opt_parse(args, NULL, fuse_ll_discard_opts, NULL) == -1)
+		return NULL;
+
+	*ch = fuse_mount(mountpoint, args);
+	if (!*ch)
+		return NULL;
+
+	se = fuse_lowlevel_new(args, op, op_size, NULL);
+	if (se == NULL)
+		goto err_unmount;
+
+	if (fuse_set_signal_handlers(se) == -1)
+		goto err_destroy;
+
+	fuse_session_add_chan(se, *ch);
+	return se;
+
+err_destroy:
+	fuse_session_destroy(se);
+err_unmount:
+	fuse_unmount(mountpoint, *ch);
+	return NULL;
+}
+
+static void teardown_fuse(struct spfs_fuse_s *sf, char *mountpoint)
+{
+	if (sf->fuse) {
+		fuse_teardown(sf->fuse, mountpoint);
+		return;
+	}
+
+	fuse_remove_signal_handlers(sf->se);
+	fuse_session_remove_chan(sf->ch);
+	fuse_session_destroy(sf->se);
+	fuse_unmount(mountpoint, sf->ch);
+}
+
 static int mount_fuse(int argc, char **argv,
 		      char **mountpoint,
 		      int *multithreaded, int *foreground,
-		      struct fuse **fuse)
+		      bool lowlevel, struct spfs_fuse_s *sf)
 {
 	int err;
 	struct spfs_context_s *ctx = get_context();
@@ -296,9 +370,15 @@ static int mount_fuse(int argc, char **argv,
 		return err;
 	}
 
-	*fuse = setup_fuse(&args, &gateway_operations,
-			  sizeof(gateway_operations), *mountpoint, NULL);
-	if (*fuse == NULL) {
+	if (lowlevel)
+		sf->se = setup_fuse_lowlevel(&args, &gateway_ll_operations,
+					     sizeof(gateway_ll_operations),
+					     *mountpoint, &sf->ch);
+	else
+		sf->fuse = setup_fuse(&args, &gateway_operations,
+				      sizeof(gateway_operations), *mountpoint,
+				      NULL);
+	if ((sf->fuse == NULL) && (sf->se == NULL)) {
 		pr_crit("failed to setup fuse at %s\n", *mountpoint);
 
 		err = check_capabilities(1 << CAP_SYS_ADMIN, getpid());
@@ -319,7 +399,7 @@ static int mount_fuse(int argc, char **argv,
 static int mount_fuse_ns(int argc, char **argv,
 		         char **mountpoint, int mnt_ns_pid,
 		         int *multithreaded, int *foreground,
-		         struct fuse **fuse)
+		         bool lowlevel, struct spfs_fuse_s *sf)
 {
 	int err, mnt_ns_fd = -1;
 	struct spfs_context_s *ctx = get_context();
@@ -336,7 +416,7 @@ static int mount_fuse_ns(int argc, char **argv,
 
 	err = mount_fuse(argc, argv, mountpoint,
 			 multithreaded, foreground,
-			 fuse);
+			 lowlevel, sf);
 
 	if (mnt_ns_fd >= 0) {
 		err = set_ns(ctx->mnt_ns_fd);
@@ -350,7 +430,7 @@ close_fd:
 	return err;
 
 teardown:
-	fuse_teardown(*fuse, *mountpoint);
+	teardown_fuse(sf, *mountpoint);
 	goto close_fd;
 
 }
@@ -362,15 +442,17 @@ int main(int argc, char *argv[])
 	char *socket_path = "/var/run/fuse_control.sock";
 	int ready_fd = -1, multithreaded, foreground, err, verbosity = 0;
 	char *root = "", *mountpoint;
-	bool single_user = false;
+	char *trace_dir = NULL;
+	bool single_user = false, lowlevel = false;
 	int mnt_ns_pid = 0;
 	int proxy_mnt_ns_pid = 0;
 	spfs_mode_t mode = SPFS_STUB_MODE;
-	struct fuse *fuse = NULL;
+	struct spfs_fuse_s sf = { };
 
 	if (parse_options(&argc, &argv, &proxy_dir, &mode, &log_file,
 			  &socket_path, &verbosity, &root, &ready_fd,
-			  &single_user, &mnt_ns_pid, &proxy_mnt_ns_pid))
+			  &single_user, &mnt_ns_pid, &proxy_mnt_ns_pid,
+			  &lowlevel, &trace_dir))
 		return -1;
 
 	if (access("/dev/fuse", R_OK | W_OK)) {
@@ -384,6 +466,12 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	if (trace_dir && spfs_trace_init(trace_dir)) {
+		pr_crit("failed to initialize trace\n");
+		err = -1;
+		goto destroy_context;
+	}
+
 	pr_debug("%s: daemon      : %s\n", __func__, foreground ? "no" : "yes");
 	pr_debug("%s: mode        : %d\n", __func__, mode);
 	if (proxy_dir)
@@ -392,11 +480,14 @@ int main(int argc, char *argv[])
 	pr_debug("%s: socket path : %s\n", __func__, socket_path);
 	pr_debug("%s: root        : %s\n", __func__, root);
 	pr_debug("%s: verbosity   : +%d\n", __func__, verbosity);
+	pr_debug("%s: gateway     : %s\n", __func__, lowlevel ? "lowlevel" : "path");
+	if (trace_dir)
+		pr_debug("%s: trace dir   : %s\n", __func__, trace_dir);
 
 	err = mount_fuse_ns(argc, argv,
 			    &mountpoint, mnt_ns_pid,
 			    &multithreaded, &foreground,
-			    &fuse);
+			    lowlevel, &sf);
 	if (err) {
 		pr_err("failed to mount fuse\n");
 		goto destroy_context;
@@ -416,6 +507,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* Writer thread is started after daemonizing, and after joining
+	 * mount namespace: setns() can't change mount namespace of
+	 * multithreaded process. */
+	if (start_log_writer())
+		goto teardown;
+
 	pr_info("SPFS master started successfully\n");
 
 	if (ready_fd != -1) {
@@ -428,13 +525,15 @@ int main(int argc, char *argv[])
 		close(ready_fd);
 	}
 
-	if (multithreaded)
-		err = fuse_loop_mt(fuse);
+	if (sf.se)
+		err = multithreaded ? fuse_session_loop_mt(sf.se) :
+				      fuse_session_loop(sf.se);
 	else
-		err = fuse_loop(fuse);
+		err = multithreaded ? fuse_loop_mt(sf.fuse) :
+				      fuse_loop(sf.fuse);
 
 teardown:
-	fuse_teardown(fuse, mountpoint);
+	teardown_fuse(&sf, mountpoint);
 destroy_context:
 	context_fini();
 	return (err == -1) ? 1 : 0;
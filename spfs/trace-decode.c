@@ -0,0 +1,308 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "include/util.h"
+
+#include "context.h"
+#include "trace.h"
+
+/* Decoder of spfs binary trace.
+ * Records of all the given per-thread files are merged and printed in start
+ * time order, one per line. With "--summary" latency statistics per operation
+ * and work mode is printed instead.
+ */
+
+struct trace_entry_s {
+	struct spfs_trace_rec_s	rec;
+	uint32_t		tid;
+};
+
+struct trace_s {
+	struct trace_entry_s	*entries;
+	size_t			nr;
+	size_t			size;
+};
+
+static const char *trace_modes[] = {
+	[SPFS_PROXY_MODE]	= "proxy",
+	[SPFS_STUB_MODE]	= "stub",
+};
+
+static const char *trace_mode(unsigned mode)
+{
+	return (mode < sizeof(trace_modes) / sizeof(trace_modes[0])) ?
+		trace_modes[mode] : "?";
+}
+
+static int trace_add(struct trace_s *t, const struct spfs_trace_rec_s *rec,
+		     uint32_t tid)
+{
+	if (t->nr == t->size) {
+		size_t size = t->size ? t->size * 2 : 4096;
+		struct trace_entry_s *entries;
+
+		entries = realloc(t->entries, size * sizeof(*entries));
+		if (!entries) {
+			fprintf(stderr, "failed to allocate trace entries\n");
+			return -ENOMEM;
+		}
+		t->entries = entries;
+		t->size = size;
+	}
+	t->entries[t->nr].rec = *rec;
+	t->entries[t->nr].tid = tid;
+	t->nr++;
+	return 0;
+}
+
+static int trace_load(struct trace_s *t, const char *file,
+		      uint64_t from, uint64_t to, uint64_t path_hash)
+{
+	const struct spfs_trace_hdr_s *hdr;
+	const struct spfs_trace_rec_s *recs;
+	uint64_t count, first, i;
+	struct stat st;
+	int fd, err = -EINVAL;
+	void *map;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open %s: %s\n", file, strerror(errno));
+		return -errno;
+	}
+
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "failed to stat %s: %s\n", file, strerror(errno));
+		err = -errno;
+		goto close_fd;
+	}
+
+	if (st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "%s: file is too small\n", file);
+		goto close_fd;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "failed to map %s: %s\n", file, strerror(errno));
+		err = -errno;
+		goto close_fd;
+	}
+
+	hdr = map;
+	if ((hdr->magic != SPFS_TRACE_MAGIC) ||
+	    (hdr->version != SPFS_TRACE_VERSION) ||
+	    (hdr->rec_size != sizeof(*recs)) ||
+	    (st.st_size < sizeof(*hdr) + hdr->capacity * sizeof(*recs))) {
+		fprintf(stderr, "%s: not an spfs trace file\n", file);
+		goto unmap;
+	}
+
+	recs = (const struct spfs_trace_rec_s *)(hdr + 1);
+	count = hdr->count;
+	/* Ring was wrapped: the oldest record follows the newest one */
+	first = (count > hdr->capacity) ? count - hdr->capacity : 0;
+
+	err = 0;
+	for (i = first; i < count; i++) {
+		const struct spfs_trace_rec_s *rec = &recs[i % hdr->capacity];
+
+		if ((rec->end_ns < from) || (rec->start_ns > to))
+			continue;
+		if (path_hash && (rec->path_hash != path_hash))
+			continue;
+
+		err = trace_add(t, rec, hdr->tid);
+		if (err)
+			break;
+	}
+
+unmap:
+	munmap(map, st.st_size);
+close_fd:
+	close(fd);
+	return err;
+}
+
+static int trace_cmp_start(const void *a, const void *b)
+{
+	const struct trace_entry_s *ea = a, *eb = b;
+
+	if (ea->rec.start_ns < eb->rec.start_ns)
+		return -1;
+	return ea->rec.start_ns > eb->rec.start_ns;
+}
+
+static uint64_t trace_latency(const struct spfs_trace_rec_s *rec)
+{
+	return (rec->end_ns > rec->start_ns) ? rec->end_ns - rec->start_ns : 0;
+}
+
+static void trace_print(const struct trace_s *t)
+{
+	size_t i;
+
+	printf("%-20s %8s %-12s %-5s %10s %12s %s\n",
+		"start", "tid", "op", "mode", "result", "latency_us", "path_hash");
+
+	for (i = 0; i < t->nr; i++) {
+		const struct trace_entry_s *e = &t->entries[i];
+
+		printf("%10lu.%09lu %8u %-12s %-5s %10d %12.3f %016lx\n",
+			e->rec.start_ns / 1000000000, e->rec.start_ns % 1000000000,
+			e->tid, spfs_trace_op_name(e->rec.op),
+			trace_mode(e->rec.mode), e->rec.result,
+			trace_latency(&e->rec) / 1000.0, e->rec.path_hash);
+	}
+}
+
+static int trace_cmp_op(const void *a, const void *b)
+{
+	const struct trace_entry_s *ea = a, *eb = b;
+	uint64_t la, lb;
+
+	if (ea->rec.op != eb->rec.op)
+		return (ea->rec.op < eb->rec.op) ? -1 : 1;
+	if (ea->rec.mode != eb->rec.mode)
+		return (ea->rec.mode < eb->rec.mode) ? -1 : 1;
+
+	la = trace_latency(&ea->rec);
+	lb = trace_latency(&eb->rec);
+	if (la < lb)
+		return -1;
+	return la > lb;
+}
+
+/* Entries are reordered by operation, mode and latency */
+static void trace_summary(struct trace_s *t)
+{
+	size_t i, first;
+
+	qsort(t->entries, t->nr, sizeof(*t->entries), trace_cmp_op);
+
+	printf("%-12s %-5s %10s %8s %12s %12s %12s %12s\n",
+		"op", "mode", "count", "errors",
+		"avg_us", "p50_us", "p99_us", "max_us");
+
+	for (first = 0; first < t->nr; first = i) {
+		const struct spfs_trace_rec_s *rec = &t->entries[first].rec;
+		size_t nr, errors = 0;
+		uint64_t total = 0;
+
+		for (i = first; i < t->nr; i++) {
+			const struct spfs_trace_rec_s *r = &t->entries[i].rec;
+
+			if ((r->op != rec->op) || (r->mode != rec->mode))
+				break;
+			total += trace_latency(r);
+			if (r->result < 0)
+				errors++;
+		}
+		nr = i - first;
+
+		printf("%-12s %-5s %10lu %8lu %12.3f %12.3f %12.3f %12.3f\n",
+			spfs_trace_op_name(rec->op), trace_mode(rec->mode),
+			nr, errors, total / nr / 1000.0,
+			trace_latency(&t->entries[first + nr / 2].rec) / 1000.0,
+			trace_latency(&t->entries[first + nr * 99 / 100].rec) / 1000.0,
+			trace_latency(&t->entries[i - 1].rec) / 1000.0);
+	}
+}
+
+static int trace_time(const char *str, uint64_t *ns)
+{
+	char *end;
+	double sec;
+
+	errno = 0;
+	sec = strtod(str, &end);
+	if (errno || (end == str) || *end || (sec < 0)) {
+		fprintf(stderr, "invalid time: %s\n", str);
+		return -EINVAL;
+	}
+	*ns = sec * 1000000000;
+	return 0;
+}
+
+static void help(const char *program)
+{
+	printf("usage: %s [options] trace-file...\n", program);
+	printf("\n");
+	printf("options:\n");
+	printf("\t-s   --summary               print latency statistics per operation\n");
+	printf("\t-p   --path                  records for this path only (relative to mountpoint)\n");
+	printf("\t     --from                  records, ended after this time (seconds since epoch)\n");
+	printf("\t     --to                    records, started before this time (seconds since epoch)\n");
+	printf("\t-h   --help                  print help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option opts[] = {
+		{"summary",	no_argument,		0, 's'},
+		{"path",	required_argument,	0, 'p'},
+		{"from",	required_argument,	0, 1000},
+		{"to",		required_argument,	0, 1001},
+		{"help",	no_argument,		0, 'h'},
+		{0,		0,			0,  0 }
+	};
+	struct trace_s trace = { };
+	uint64_t from = 0, to = UINT64_MAX, path_hash = 0;
+	bool summary = false;
+	int c, err;
+
+	while ((c = getopt_long(argc, argv, "sp:h", opts, NULL)) != -1) {
+		switch (c) {
+			case 's':
+				summary = true;
+				break;
+			case 'p':
+				path_hash = str_hash(optarg);
+				break;
+			case 1000:
+				if (trace_time(optarg, &from))
+					return 1;
+				break;
+			case 1001:
+				if (trace_time(optarg, &to))
+					return 1;
+				break;
+			case 'h':
+				help(argv[0]);
+				return 0;
+			default:
+				help(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind == argc) {
+		help(argv[0]);
+		return 1;
+	}
+
+	for (; optind < argc; optind++) {
+		err = trace_load(&trace, argv[optind], from, to, path_hash);
+		if (err == -ENOMEM)
+			return 1;
+	}
+
+	if (summary)
+		trace_summary(&trace);
+	else {
+		qsort(trace.entries, trace.nr, sizeof(*trace.entries),
+		      trace_cmp_start);
+		trace_print(&trace);
+	}
+
+	free(trace.entries);
+	return 0;
+}
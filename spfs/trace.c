@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "include/log.h"
+#include "include/util.h"
+
+#include "trace.h"
+
+struct spfs_trace_s {
+	struct spfs_trace_hdr_s	*hdr;
+	struct spfs_trace_rec_s	*recs;
+	size_t			size;
+};
+
+bool spfs_trace_enabled;
+
+/* Number of file names to try for the same tid */
+#define TRACE_NAME_TRIES	1024
+
+static int trace_dir_fd = -1;
+static pthread_key_t trace_key;
+
+static __thread struct spfs_trace_s *thread_trace;
+/* Set, if thread failed to create trace file: it doesn't try again */
+static __thread bool thread_trace_failed;
+
+static void trace_exit(void *data)
+{
+	struct spfs_trace_s *t = data;
+
+	munmap(t->hdr, t->size);
+	free(t);
+}
+
+/* Tid can be recycled, so trace of previous thread with the same tid is
+ * kept: new file gets sequence number suffix instead. */
+static int trace_open(char *name, size_t size, pid_t tid)
+{
+	unsigned seq;
+	int fd;
+
+	for (seq = 0; seq < TRACE_NAME_TRIES; seq++) {
+		if (!seq)
+			snprintf(name, size, "spfs-trace.%d.%d", getpid(), tid);
+		else
+			snprintf(name, size, "spfs-trace.%d.%d.%u", getpid(),
+					tid, seq);
+
+		fd = openat(trace_dir_fd, name,
+			    O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+		if (fd >= 0)
+			return fd;
+		if (errno != EEXIST)
+			break;
+	}
+	pr_perror("%s: failed to create trace file %s", __func__, name);
+	return -1;
+}
+
+static struct spfs_trace_s *trace_create(void)
+{
+	struct spfs_trace_s *t;
+	char name[64];
+	pid_t tid = gettid();
+	int fd;
+
+	t = malloc(sizeof(*t));
+	if (!t) {
+		pr_err("%s: failed to allocate trace\n", __func__);
+		return NULL;
+	}
+	t->size = sizeof(*t->hdr) + SPFS_TRACE_RECORDS * sizeof(*t->recs);
+
+	fd = trace_open(name, sizeof(name), tid);
+	if (fd < 0)
+		goto free_trace;
+
+	if (ftruncate(fd, t->size)) {
+		pr_perror("%s: failed to resize trace file %s", __func__, name);
+		goto close_fd;
+	}
+
+	t->hdr = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (t->hdr == MAP_FAILED) {
+		pr_perror("%s: failed to map trace file %s", __func__, name);
+		goto close_fd;
+	}
+	close(fd);
+
+	t->recs = (struct spfs_trace_rec_s *)(t->hdr + 1);
+
+	t->hdr->version = SPFS_TRACE_VERSION;
+	t->hdr->rec_size = sizeof(*t->recs);
+	t->hdr->pid = getpid();
+	t->hdr->tid = tid;
+	t->hdr->capacity = SPFS_TRACE_RECORDS;
+	t->hdr->count = 0;
+	/* Magic goes last: decoder skips files without it */
+	__atomic_store_n(&t->hdr->magic, SPFS_TRACE_MAGIC, __ATOMIC_RELEASE);
+
+	pthread_setspecific(trace_key, t);
+	pr_debug("%s: trace file %s created\n", __func__, name);
+	return t;
+
+close_fd:
+	close(fd);
+free_trace:
+	free(t);
+	return NULL;
+}
+
+void __spfs_trace(unsigned op, const char *path, int mode,
+		  uint64_t start, int result)
+{
+	struct spfs_trace_s *t = thread_trace;
+	struct spfs_trace_rec_s *rec;
+	uint64_t count;
+
+	if (!t) {
+		if (thread_trace_failed)
+			return;
+
+		t = thread_trace = trace_create();
+		if (!t) {
+			thread_trace_failed = true;
+			return;
+		}
+	}
+
+	count = t->hdr->count;
+	rec = &t->recs[count % SPFS_TRACE_RECORDS];
+
+	rec->path_hash = path ? str_hash(path) : 0;
+	rec->start_ns = start;
+	rec->end_ns = spfs_trace_now();
+	rec->result = result;
+	rec->op = op;
+	rec->mode = mode;
+	rec->pad = 0;
+
+	__atomic_store_n(&t->hdr->count, count + 1, __ATOMIC_RELEASE);
+}
+
+int spfs_trace_init(const char *dir)
+{
+	int fd, err;
+
+	err = pthread_key_create(&trace_key, trace_exit);
+	if (err) {
+		pr_err("%s: failed to create trace key: %d\n", __func__, err);
+		return -err;
+	}
+
+	fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		pr_perror("%s: failed to open trace directory %s", __func__, dir);
+		return -errno;
+	}
+
+	/* Trace files are created in worker threads, after chroot */
+	fd = save_fd(fd, O_CLOEXEC);
+	if (fd < 0) {
+		pr_crit("%s: failed to save trace directory fd\n", __func__);
+		return fd;
+	}
+
+	trace_dir_fd = fd;
+	spfs_trace_enabled = true;
+	pr_info("%s: tracing gateway operations to %s\n", __func__, dir);
+	return 0;
+}
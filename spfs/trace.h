@@ -0,0 +1,99 @@
+#ifndef __SPFS_TRACE_H_
+#define __SPFS_TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* Binary trace of gateway operations.
+ * Each thread writes fixed-size records to its own memory-mapped file
+ * "spfs-trace.<pid>.<tid>[.<seq>]" in trace directory. File is a ring: when it's
+ * full, the oldest records are overwritten. Records are decoded by spfs-trace.
+ */
+
+#define SPFS_TRACE_MAGIC	0x3143525453465053ULL	/* "SPFSTRC1" */
+#define SPFS_TRACE_VERSION	1
+#define SPFS_TRACE_RECORDS	(1 << 16)
+
+#define SPFS_TRACE_OPS(op)							\
+	op(getattr) op(readlink) op(mknod) op(mkdir) op(unlink) op(rmdir)	\
+	op(symlink) op(rename) op(link) op(chmod) op(chown) op(truncate)	\
+	op(open) op(read) op(write) op(statfs) op(flush) op(release)		\
+	op(fsync) op(setxattr) op(getxattr) op(listxattr) op(removexattr)	\
+	op(opendir) op(readdir) op(releasedir) op(fsyncdir) op(access)		\
+	op(create) op(ftruncate) op(fgetattr) op(lock) op(utimens)		\
+	op(bmap) op(ioctl) op(poll) op(write_buf) op(read_buf) op(flock)	\
+	op(fallocate) op(mode_switch) op(lookup) op(setattr)
+
+#define SPFS_TRACE_OP_ENUM(name)	SPFS_TRACE_##name,
+enum {
+	SPFS_TRACE_OPS(SPFS_TRACE_OP_ENUM)
+	SPFS_TRACE_OP_MAX,
+};
+#undef SPFS_TRACE_OP_ENUM
+
+static inline const char *spfs_trace_op_name(unsigned op)
+{
+#define SPFS_TRACE_OP_NAME(name)	#name,
+	static const char *names[] = {
+		SPFS_TRACE_OPS(SPFS_TRACE_OP_NAME)
+	};
+#undef SPFS_TRACE_OP_NAME
+
+	return (op < SPFS_TRACE_OP_MAX) ? names[op] : "unknown";
+}
+
+struct spfs_trace_hdr_s {
+	uint64_t	magic;
+	uint32_t	version;
+	uint32_t	rec_size;
+	uint32_t	pid;
+	uint32_t	tid;
+	uint64_t	capacity;
+	/* Number of records ever written. Updated after the record */
+	uint64_t	count;
+	uint64_t	reserved[2];
+};
+
+/* Timestamps are CLOCK_REALTIME nanoseconds, to match them against log
+ * messages of spfs and spfs-manager.
+ * Mode switch record has hash of proxy directory as path hash and new mode
+ * as mode. */
+struct spfs_trace_rec_s {
+	uint64_t	path_hash;
+	uint64_t	start_ns;
+	uint64_t	end_ns;
+	int32_t		result;
+	uint16_t	op;
+	uint8_t		mode;
+	uint8_t		pad;
+};
+
+extern bool spfs_trace_enabled;
+
+int spfs_trace_init(const char *dir);
+void __spfs_trace(unsigned op, const char *path, int mode,
+		  uint64_t start, int result);
+
+static inline uint64_t spfs_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns zero, if tracing is disabled */
+static inline uint64_t spfs_trace_start(void)
+{
+	return spfs_trace_enabled ? spfs_trace_now() : 0;
+}
+
+static inline void spfs_trace(unsigned op, const char *path, int mode,
+			      uint64_t start, int result)
+{
+	if (start)
+		__spfs_trace(op, path, mode, start, result);
+}
+
+#endif
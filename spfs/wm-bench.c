@@ -0,0 +1,198 @@
+#include "spfs_config.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <fuse.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "include/log.h"
+
+#include "context.h"
+
+/* Getattr throughput of fh-less gateway requests as number of FUSE worker
+ * threads grows.
+ * Each thread takes work mode reference, stats proxy directory through it and
+ * releases the reference, like GATEWAY_METHOD_RESTARTABLE does. "locked"
+ * variant takes the reference under a mutex with plain counter, like it was
+ * done before lock-free work mode publication.
+ * Work mode is switched by "socket" thread every millisecond to make sure,
+ * that reclamation is exercised as well.
+ */
+
+#define WM_BENCH_MAX_THREADS	64
+#define WM_BENCH_CACHE_LINE	64
+
+/* Each counter has a cache line of it's own: otherwise threads contend on
+ * shared lines, and false sharing is measured instead of work mode scaling */
+struct wm_bench_ops_s {
+	unsigned long		ops;
+} __attribute__((aligned(WM_BENCH_CACHE_LINE)));
+
+static pthread_mutex_t wm_bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *wm_bench_dir;
+static int wm_bench_stop;
+
+static struct work_mode_s *wm_bench_get_locked(void)
+{
+	struct work_mode_s *wm;
+
+	pthread_mutex_lock(&wm_bench_lock);
+	wm = get_context()->wm;
+	wm->cnt++;
+	pthread_mutex_unlock(&wm_bench_lock);
+	return wm;
+}
+
+static void wm_bench_put_locked(struct work_mode_s *wm)
+{
+	pthread_mutex_lock(&wm_bench_lock);
+	wm->cnt--;
+	pthread_mutex_unlock(&wm_bench_lock);
+}
+
+static void *wm_bench_locked(void *data)
+{
+	struct wm_bench_ops_s *bo = data;
+	struct work_mode_s *wm;
+	struct stat st;
+
+	while (!__atomic_load_n(&wm_bench_stop, __ATOMIC_RELAXED)) {
+		wm = wm_bench_get_locked();
+		fstatat(wm->proxy_dir_fd, "", &st, AT_EMPTY_PATH);
+		wm_bench_put_locked(wm);
+		bo->ops++;
+	}
+	return NULL;
+}
+
+static void *wm_bench_lockfree(void *data)
+{
+	struct wm_bench_ops_s *bo = data;
+	struct work_mode_s *wm;
+	struct stat st;
+
+	while (!__atomic_load_n(&wm_bench_stop, __ATOMIC_RELAXED)) {
+		wm = work_mode_enter();
+		if (!wm)
+			break;
+		fstatat(wm->proxy_dir_fd, "", &st, AT_EMPTY_PATH);
+		work_mode_leave(wm);
+		bo->ops++;
+	}
+	return NULL;
+}
+
+static void *wm_bench_switch(void *data)
+{
+	unsigned long *switches = data;
+	struct timespec ts = {
+		.tv_nsec = 1000000,
+	};
+
+	while (!__atomic_load_n(&wm_bench_stop, __ATOMIC_RELAXED)) {
+		if (set_work_mode(get_context(), SPFS_PROXY_MODE,
+				  wm_bench_dir, 0))
+			break;
+		(*switches)++;
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+static int wm_bench_run(const char *name, void *(*fn)(void *),
+			int nr_threads, int seconds, bool switch_mode)
+{
+	pthread_t threads[WM_BENCH_MAX_THREADS], switcher;
+	struct wm_bench_ops_s ops[WM_BENCH_MAX_THREADS] = { };
+	unsigned long total = 0, switches = 0;
+	int i, err;
+
+	wm_bench_stop = 0;
+
+	for (i = 0; i < nr_threads; i++) {
+		err = pthread_create(&threads[i], NULL, fn, &ops[i]);
+		if (err) {
+			pr_err("failed to create thread: %d\n", err);
+			nr_threads = i;
+			break;
+		}
+	}
+
+	if (switch_mode) {
+		err = pthread_create(&switcher, NULL, wm_bench_switch, &switches);
+		if (err) {
+			pr_err("failed to create switch thread: %d\n", err);
+			switch_mode = false;
+		}
+	}
+
+	sleep(seconds);
+	__atomic_store_n(&wm_bench_stop, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+		total += ops[i].ops;
+	}
+	if (switch_mode)
+		pthread_join(switcher, NULL);
+
+	printf("%-10s %3d threads: %12lu getattr/s", name, nr_threads,
+			total / seconds);
+	if (switch_mode)
+		printf(" (%lu switches)", switches);
+	printf("\n");
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int max_threads = 16, seconds = 3, nr;
+	int err;
+
+	if (argc < 2) {
+		printf("usage: %s <proxy dir> [max threads] [seconds]\n", argv[0]);
+		return 1;
+	}
+
+	wm_bench_dir = argv[1];
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	if (argc > 3)
+		seconds = atoi(argv[3]);
+
+	if ((max_threads <= 0) || (max_threads > WM_BENCH_MAX_THREADS) ||
+	    (seconds <= 0)) {
+		printf("invalid arguments\n");
+		return 1;
+	}
+
+	err = setup_log("/dev/null", 0);
+	if (err)
+		return 1;
+
+	err = set_work_mode(get_context(), SPFS_PROXY_MODE, wm_bench_dir, 0);
+	if (err)
+		return 1;
+
+	for (nr = 1; nr <= max_threads; nr *= 2) {
+		wm_bench_run("locked", wm_bench_locked, nr, seconds, false);
+		wm_bench_run("lock-free", wm_bench_lockfree, nr, seconds, false);
+		wm_bench_run("lock-free", wm_bench_lockfree, nr, seconds, true);
+	}
+	return 0;
+}
+
+/* Context dependencies, which are not used by benchmark */
+struct fuse_operations stub_operations;
+struct fuse_operations proxy_operations;
+
+int spfs_execute_cmd(int sock, void *data, void *package, size_t psize)
+{
+	return -ENOTSUP;
+}
@@ -1,14 +1,15 @@
 #include <stdlib.h>
-#include <search.h>
 #include <semaphore.h>
 #include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 
 #include "include/list.h"
 #include "include/log.h"
+#include "include/util.h"
 
 #include "xattr.h"
 
@@ -19,12 +20,17 @@ struct file_xattr_s {
 	size_t		size;
 };
 
+/* Xattrs can be shared by hard links, which can live in different shards.
+ * So the list is protected by its own lock. */
 struct xattr_tree_s {
+	pthread_mutex_t		lock;
 	struct list_head	xattrs;
 	int			users;
 };
 
 struct file_xattr_tree_s {
+	struct hlist_node	hash;
+	uint64_t		hval;
 	char			*path;
 	struct xattr_tree_s	*tree;
 };
@@ -209,6 +215,7 @@ static void destroy_xattr_tree(struct xattr_tree_s *tree)
 	list_for_each_entry_safe(fx, tmp, &tree->xattrs, list) {
 		destroy_xattr(fx);
 	}
+	pthread_mutex_destroy(&tree->lock);
 	free(tree);
 }
 
@@ -226,6 +233,7 @@ static struct xattr_tree_s *create_xattr_tree(void)
 		pr_err("failed to allocate\n");
 		return NULL;
 	}
+	pthread_mutex_init(&tree->lock, NULL);
 	tree->users = 1;
 	INIT_LIST_HEAD(&tree->xattrs);
 
@@ -234,7 +242,7 @@ static struct xattr_tree_s *create_xattr_tree(void)
 
 static void put_xattr_tree(struct xattr_tree_s *tree)
 {
-	if (--tree->users)
+	if (__atomic_sub_fetch(&tree->users, 1, __ATOMIC_ACQ_REL))
 		return;
 
 	destroy_xattr_tree(tree);
@@ -242,11 +250,12 @@ static void put_xattr_tree(struct xattr_tree_s *tree)
 
 static struct xattr_tree_s *get_xattr_tree(struct xattr_tree_s *tree)
 {
-	tree->users++;
+	__atomic_add_fetch(&tree->users, 1, __ATOMIC_RELAXED);
 	return tree;
 }
 
-static struct file_xattr_tree_s *create_file_xattr_tree(const char *path, struct xattr_tree_s *tree)
+static struct file_xattr_tree_s *create_file_xattr_tree(const char *path,
+							uint64_t hval)
 {
 	struct file_xattr_tree_s *fxt;
 
@@ -259,16 +268,12 @@ static struct file_xattr_tree_s *create_file_xattr_tree(const char *path, struct
 	if (!fxt->path)
 		goto free_fxt;
 
-	if (tree)
-		tree = get_xattr_tree(tree);
-	else
-		tree = create_xattr_tree();
-	if (!tree)
+	fxt->tree = create_xattr_tree();
+	if (!fxt->tree)
 		goto free_fxt_path;
 
-	fxt->tree = tree;
-	INIT_LIST_HEAD(&tree->xattrs);
-
+	fxt->hval = hval;
+	INIT_HLIST_NODE(&fxt->hash);
 	return fxt;
 
 free_fxt_path:
@@ -285,98 +290,291 @@ void destroy_file_xattr_tree(struct file_xattr_tree_s *fxt)
 	free(fxt);
 }
 
-static pthread_mutex_t files_tree_lock = PTHREAD_MUTEX_INITIALIZER;
-static void *files_tree_root = NULL;
+/* Files with xattrs are kept in hash table, split into shards with own locks.
+ * Path hash is calculated once per request: lower bits select the shard,
+ * upper bits select the bucket within the shard.
+ * Most of the files have no xattrs at all, so the number of files in the
+ * table is kept to skip the lookup, when there are none. */
+#define XATTR_SHARD_BITS	6
+#define XATTR_SHARDS		(1 << XATTR_SHARD_BITS)
+#define XATTR_BUCKET_BITS	10
+#define XATTR_BUCKETS		(1 << XATTR_BUCKET_BITS)
+
+struct xattr_shard_s {
+	pthread_mutex_t		lock;
+	struct hlist_head	buckets[XATTR_BUCKETS];
+};
+
+static struct xattr_shard_s xattr_shards[XATTR_SHARDS] = {
+	[0 ... XATTR_SHARDS - 1] = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	},
+};
+
+static unsigned long xattr_files;
 
-static int compare_fxt(const void *a, const void *b)
+static bool no_file_xattrs(void)
 {
-	const struct file_xattr_tree_s *f = a, *s = b;
+	return !__atomic_load_n(&xattr_files, __ATOMIC_ACQUIRE);
+}
+
+/* Counting Bloom filter of the files in the table. It answers most of the
+ * lookups for files without xattrs without taking shard lock.
+ * With 1M counters and 3 hashes false positive rate is ~0.3% for 50k
+ * files. Saturated counters are never decremented. */
+#define XATTR_FILTER_BITS	20
+#define XATTR_FILTER_SIZE	(1 << XATTR_FILTER_BITS)
+#define XATTR_FILTER_HASHES	3
 
-	return strcmp(f->path, s->path);
+static uint8_t xattr_filter[XATTR_FILTER_SIZE];
+
+static unsigned xattr_filter_slot(uint64_t hval, int i)
+{
+	uint32_t h1 = hval, h2 = (hval >> 32) | 1;
+
+	return (h1 + i * h2) & (XATTR_FILTER_SIZE - 1);
 }
 
-static struct file_xattr_tree_s *find_file_xattr_tree(const char *path)
+static void xattr_filter_update(uint64_t hval, int delta)
 {
-	const struct file_xattr_tree_s cookie = {
-		.path = (char *)path,
-	};
-	struct file_xattr_tree_s **found_fxt;
+	int i;
+
+	for (i = 0; i < XATTR_FILTER_HASHES; i++) {
+		uint8_t *c = &xattr_filter[xattr_filter_slot(hval, i)];
+		uint8_t v = __atomic_load_n(c, __ATOMIC_RELAXED);
+
+		do {
+			if (v == UINT8_MAX)
+				break;
+		} while (!__atomic_compare_exchange_n(c, &v, v + delta, false,
+						      __ATOMIC_RELAXED,
+						      __ATOMIC_RELAXED));
+	}
+}
 
-	found_fxt = tfind(&cookie, &files_tree_root, compare_fxt);
+static bool xattr_filter_test(uint64_t hval)
+{
+	int i;
 
-	return found_fxt ? *found_fxt : NULL;
+	for (i = 0; i < XATTR_FILTER_HASHES; i++) {
+		if (!__atomic_load_n(&xattr_filter[xattr_filter_slot(hval, i)],
+				     __ATOMIC_RELAXED))
+			return false;
+	}
+	return true;
 }
 
+/* Avoided lookups are counted per thread, to not bounce shared counter on
+ * every request. Counters of live threads are summed up on read, and the
+ * counter of exiting thread is added to the total. */
+struct lookups_avoided_s {
+	struct list_head	list;
+	unsigned long		count;
+};
+
+static pthread_mutex_t lookups_avoided_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(lookups_avoided_threads);
+static unsigned long xattr_lookups_avoided;
+static __thread struct lookups_avoided_s lookups_avoided;
+static pthread_key_t lookups_avoided_key;
+static pthread_once_t lookups_avoided_once = PTHREAD_ONCE_INIT;
 
-static struct file_xattr_tree_s *search_file_xattr_tree(const char *path)
+static void put_lookups_avoided(void *data)
 {
-	struct file_xattr_tree_s *new_fxt, **found_fxt;
+	struct lookups_avoided_s *la = data;
 
-	new_fxt = create_file_xattr_tree(path, NULL);
-	if (!new_fxt)
-		return NULL;
+	pthread_mutex_lock(&lookups_avoided_lock);
+	xattr_lookups_avoided += la->count;
+	list_del(&la->list);
+	pthread_mutex_unlock(&lookups_avoided_lock);
+}
 
-	found_fxt = tsearch(new_fxt, &files_tree_root, compare_fxt);
-	if (!found_fxt)
-		return NULL;
+static void create_lookups_avoided_key(void)
+{
+	if (pthread_key_create(&lookups_avoided_key, put_lookups_avoided))
+		pr_crit("%s: failed to create avoided lookups key\n", __func__);
+}
+
+static void xattr_lookup_avoided(void)
+{
+	struct lookups_avoided_s *la = &lookups_avoided;
+
+	if (!la->list.next) {
+		pthread_once(&lookups_avoided_once, create_lookups_avoided_key);
+
+		pthread_mutex_lock(&lookups_avoided_lock);
+		list_add(&la->list, &lookups_avoided_threads);
+		pthread_mutex_unlock(&lookups_avoided_lock);
+
+		/* Destructor unregisters the counter on thread exit */
+		pthread_setspecific(lookups_avoided_key, la);
+	}
+
+	__atomic_store_n(&la->count, la->count + 1, __ATOMIC_RELAXED);
+}
+
+unsigned long spfs_xattr_lookups_avoided(void)
+{
+	struct lookups_avoided_s *la;
+	unsigned long count;
+
+	pthread_mutex_lock(&lookups_avoided_lock);
+	count = xattr_lookups_avoided;
+	list_for_each_entry(la, &lookups_avoided_threads, list)
+		count += __atomic_load_n(&la->count, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&lookups_avoided_lock);
+	return count;
+}
+
+/* Returns false, if path has no xattrs for sure */
+static bool file_xattrs_may_exist(const char *path, uint64_t *hval)
+{
+	if (no_file_xattrs())
+		return false;
+
+	*hval = str_hash(path);
+	return xattr_filter_test(*hval);
+}
+
+static struct xattr_shard_s *xattr_shard(uint64_t hval)
+{
+	return &xattr_shards[hval & (XATTR_SHARDS - 1)];
+}
+
+static struct hlist_head *xattr_bucket(uint64_t hval)
+{
+	return &xattr_shard(hval)->buckets[hval >> (64 - XATTR_BUCKET_BITS)];
+}
+
+static void lock_xattr_shard(uint64_t hval)
+{
+	pthread_mutex_lock(&xattr_shard(hval)->lock);
+}
+
+static void unlock_xattr_shard(uint64_t hval)
+{
+	pthread_mutex_unlock(&xattr_shard(hval)->lock);
+}
+
+/* Locks shards of two paths in the order of shard index to avoid deadlock */
+static void lock_xattr_shards(uint64_t f, uint64_t s)
+{
+	struct xattr_shard_s *fs = xattr_shard(f), *ss = xattr_shard(s);
+
+	if (fs > ss) {
+		struct xattr_shard_s *tmp = fs;
+
+		fs = ss;
+		ss = tmp;
+	}
+	pthread_mutex_lock(&fs->lock);
+	if (ss != fs)
+		pthread_mutex_lock(&ss->lock);
+}
+
+static void unlock_xattr_shards(uint64_t f, uint64_t s)
+{
+	struct xattr_shard_s *fs = xattr_shard(f), *ss = xattr_shard(s);
 
-	if (*found_fxt != new_fxt)
-		destroy_file_xattr_tree(new_fxt);
-	else
-		pr_debug("added xattr tree for %s\n", path);
+	pthread_mutex_unlock(&fs->lock);
+	if (ss != fs)
+		pthread_mutex_unlock(&ss->lock);
+}
+
+/* Shard of the path must be locked */
+static struct file_xattr_tree_s *find_file_xattr_tree(const char *path,
+						      uint64_t hval)
+{
+	struct file_xattr_tree_s *fxt;
 
-	return *found_fxt;
+	hlist_for_each_entry(fxt, xattr_bucket(hval), hash) {
+		if ((fxt->hval == hval) && !strcmp(fxt->path, path))
+			return fxt;
+	}
+	return NULL;
+}
+
+static void add_file_xattr_tree(struct file_xattr_tree_s *fxt)
+{
+	hlist_add_head(&fxt->hash, xattr_bucket(fxt->hval));
+	xattr_filter_update(fxt->hval, 1);
+	__atomic_add_fetch(&xattr_files, 1, __ATOMIC_RELEASE);
 }
 
 static void remove_file_xattr_tree(struct file_xattr_tree_s *fxt)
 {
-	(void)tdelete(fxt, &files_tree_root, compare_fxt);
+	hlist_del_init(&fxt->hash);
+	xattr_filter_update(fxt->hval, -1);
+	__atomic_sub_fetch(&xattr_files, 1, __ATOMIC_RELEASE);
+}
+
+static struct file_xattr_tree_s *search_file_xattr_tree(const char *path,
+							uint64_t hval)
+{
+	struct file_xattr_tree_s *fxt;
+
+	fxt = find_file_xattr_tree(path, hval);
+	if (fxt)
+		return fxt;
+
+	fxt = create_file_xattr_tree(path, hval);
+	if (!fxt)
+		return NULL;
+
+	add_file_xattr_tree(fxt);
+	pr_debug("added xattr tree for %s\n", path);
+	return fxt;
 }
 
 int spfs_setxattr(const char *path, const char *name, const void *value,
 		  size_t size, int flags)
 {
-	int err;
+	uint64_t hval = str_hash(path);
 	struct file_xattr_tree_s *fxt;
+	int err;
 
-	err = pthread_mutex_lock(&files_tree_lock);
-	if (err) {
-		pr_err("%s: failed to lock xattr tree: %d\n", __func__, err);
-		return -err;
-	}
+	lock_xattr_shard(hval);
 
-	fxt = search_file_xattr_tree(path);
+	fxt = search_file_xattr_tree(path, hval);
 	if (!fxt) {
 		err = -ENOSPC;
 		goto unlock;
 	}
 
+	pthread_mutex_lock(&fxt->tree->lock);
 	err = tree_setxattr(fxt->tree, fxt->path, name, value, size, flags);
+	pthread_mutex_unlock(&fxt->tree->lock);
+
+	if (err && empty_xattr_tree(fxt->tree)) {
+		remove_file_xattr_tree(fxt);
+		destroy_file_xattr_tree(fxt);
+	}
 
 unlock:
-	if (pthread_mutex_unlock(&files_tree_lock))
-		pr_err("%s: failed to unlock xattr tree: %d\n", __func__, err);
+	unlock_xattr_shard(hval);
 	return err;
 }
 
 int spfs_removexattr(const char *path, const char *name)
 {
-	int err;
 	struct file_xattr_tree_s *fxt;
+	uint64_t hval;
+	int err;
 
-	err = pthread_mutex_lock(&files_tree_lock);
-	if (err) {
-		pr_err("%s: failed to lock xattr tree: %d\n", __func__, err);
-		return -err;
-	}
+	if (!file_xattrs_may_exist(path, &hval))
+		return -ENODATA;
 
-	fxt = find_file_xattr_tree(path);
+	lock_xattr_shard(hval);
+
+	fxt = find_file_xattr_tree(path, hval);
 	if (!fxt) {
 		err = -ENODATA;
 		goto unlock;
 	}
 
+	pthread_mutex_lock(&fxt->tree->lock);
 	err = tree_removexattr(fxt->tree, name);
+	pthread_mutex_unlock(&fxt->tree->lock);
 	if (!err)
 		pr_debug("removed xattr %s from file %s\n", name, path);
 
@@ -387,82 +585,82 @@ int spfs_removexattr(const char *path, const char *name)
 	}
 
 unlock:
-	if (pthread_mutex_unlock(&files_tree_lock))
-		pr_err("%s: failed to unlock xattr tree: %d\n", __func__, err);
+	unlock_xattr_shard(hval);
 	return err;
-
 }
 
 ssize_t spfs_getxattr(const char *path, const char *name,
 		      void *value, size_t size)
 {
-	ssize_t err;
 	struct file_xattr_tree_s *fxt;
+	uint64_t hval;
+	ssize_t err;
 
-	err = pthread_mutex_lock(&files_tree_lock);
-	if (err) {
-		pr_err("%s: failed to lock xattr tree: %d\n", __func__, err);
-		return -err;
+	if (!file_xattrs_may_exist(path, &hval)) {
+		xattr_lookup_avoided();
+		return -ENODATA;
 	}
 
-	fxt = find_file_xattr_tree(path);
+	lock_xattr_shard(hval);
+
+	fxt = find_file_xattr_tree(path, hval);
 	if (!fxt) {
 		err = -ENODATA;
 		goto unlock;
 	}
 
+	pthread_mutex_lock(&fxt->tree->lock);
 	err = tree_getxattr(fxt->tree, name, value, size);
+	pthread_mutex_unlock(&fxt->tree->lock);
 	if (err >= 0)
 		pr_debug("return xattr %s of file %s\n", name, path);
 
 unlock:
-	if (pthread_mutex_unlock(&files_tree_lock))
-		pr_err("%s: failed to unlock xattr tree: %d\n", __func__, err);
+	unlock_xattr_shard(hval);
 	return err;
 }
 
 ssize_t spfs_listxattr(const char *path, char *list, size_t size)
 {
-	int err;
 	struct file_xattr_tree_s *fxt;
+	uint64_t hval;
+	int err;
 
-	err = pthread_mutex_lock(&files_tree_lock);
-	if (err) {
-		pr_err("%s: failed to lock xattr tree: %d\n", __func__, err);
-		return -err;
-	}
+	if (!file_xattrs_may_exist(path, &hval))
+		return -ENODATA;
 
-	fxt = find_file_xattr_tree(path);
+	lock_xattr_shard(hval);
+
+	fxt = find_file_xattr_tree(path, hval);
 	if (!fxt) {
 		err = -ENODATA;
 		goto unlock;
 	}
 
+	pthread_mutex_lock(&fxt->tree->lock);
 	err = tree_listxattr(fxt->tree, list, size);
+	pthread_mutex_unlock(&fxt->tree->lock);
 
 unlock:
-	if (pthread_mutex_unlock(&files_tree_lock))
-		pr_err("%s: failed to unlock xattr tree: %d\n", __func__, err);
+	unlock_xattr_shard(hval);
 	return err;
 }
 
 int spfs_del_xattrs(const char *path)
 {
-	ssize_t err;
 	struct file_xattr_tree_s *fxt;
+	uint64_t hval;
 
-	err = pthread_mutex_lock(&files_tree_lock);
-	if (err) {
-		pr_err("%s: failed to lock xattr tree: %d\n", __func__, err);
-		return -err;
-	}
+	if (!file_xattrs_may_exist(path, &hval))
+		return -ENODATA;
+
+	lock_xattr_shard(hval);
 
-	fxt = find_file_xattr_tree(path);
+	fxt = find_file_xattr_tree(path, hval);
 	if (fxt)
 		remove_file_xattr_tree(fxt);
 
-	if (pthread_mutex_unlock(&files_tree_lock))
-		pr_err("%s: failed to unlock xattr tree: %d\n", __func__, err);
+	unlock_xattr_shard(hval);
 
 	if (!fxt)
 		return -ENODATA;
@@ -489,64 +687,84 @@ bool is_spfs_xattr(const char *xattr)
 int spfs_move_xattrs(const char *from, const char *to)
 {
 	struct file_xattr_tree_s *from_fxt, *to_fxt;
-	ssize_t err = 0;
+	uint64_t from_hval, to_hval;
+	int err = 0;
 
-	err = pthread_mutex_lock(&files_tree_lock);
-	if (err) {
-		pr_err("%s: failed to lock xattr tree: %d\n", __func__, err);
-		return -err;
-	}
+	if (no_file_xattrs())
+		return 0;
+
+	from_hval = str_hash(from);
+	to_hval = str_hash(to);
+	/* Tree of the path itself must not be removed as destination */
+	if ((from_hval == to_hval) && !strcmp(from, to))
+		return 0;
 
-	to_fxt = find_file_xattr_tree(to);
-	if (to_fxt)
+	lock_xattr_shards(from_hval, to_hval);
+
+	to_fxt = find_file_xattr_tree(to, to_hval);
+	if (to_fxt) {
+		remove_file_xattr_tree(to_fxt);
 		destroy_file_xattr_tree(to_fxt);
+	}
 
-	from_fxt = find_file_xattr_tree(from);
+	from_fxt = find_file_xattr_tree(from, from_hval);
 	if (from_fxt) {
 		char *old_path = from_fxt->path;
 
 		from_fxt->path = strdup(to);
 		if (!from_fxt->path) {
+			from_fxt->path = old_path;
 			err = -ENOMEM;
 			pr_err("failed to duplicate\n");
 			goto unlock;
 		}
 		free(old_path);
+
+		remove_file_xattr_tree(from_fxt);
+		from_fxt->hval = to_hval;
+		add_file_xattr_tree(from_fxt);
 		pr_debug("moved xattrs from %s to %s\n", from, to);
 	}
 
 unlock:
-	if (pthread_mutex_unlock(&files_tree_lock))
-		pr_err("%s: failed to unlock xattr tree: %d\n", __func__, err);
-
+	unlock_xattr_shards(from_hval, to_hval);
 	return err;
 }
 
 int spfs_dup_xattrs(const char *from, const char *to)
 {
 	struct file_xattr_tree_s *from_fxt, *to_fxt;
-	ssize_t err = 0;
+	uint64_t from_hval, to_hval;
+	int err = 0;
 
-	err = pthread_mutex_lock(&files_tree_lock);
-	if (err) {
-		pr_err("%s: failed to lock xattr tree: %d\n", __func__, err);
-		return -err;
-	}
+	if (no_file_xattrs())
+		return 0;
+
+	from_hval = str_hash(from);
+	to_hval = str_hash(to);
+	/* Tree of the path itself must not be removed as destination */
+	if ((from_hval == to_hval) && !strcmp(from, to))
+		return 0;
 
-	to_fxt = search_file_xattr_tree(to);
-	from_fxt = find_file_xattr_tree(from);
+	lock_xattr_shards(from_hval, to_hval);
+
+	from_fxt = find_file_xattr_tree(from, from_hval);
+	to_fxt = find_file_xattr_tree(to, to_hval);
 
 	if (from_fxt) {
-		put_xattr_tree(to_fxt->tree);
-		to_fxt->tree = get_xattr_tree(from_fxt->tree);
-	} else {
+		if (!to_fxt)
+			to_fxt = search_file_xattr_tree(to, to_hval);
+		if (to_fxt) {
+			put_xattr_tree(to_fxt->tree);
+			to_fxt->tree = get_xattr_tree(from_fxt->tree);
+			pr_debug("duplicated xattrs from %s to %s\n", from, to);
+		} else
+			err = -ENOSPC;
+	} else if (to_fxt) {
 		remove_file_xattr_tree(to_fxt);
 		destroy_file_xattr_tree(to_fxt);
 	}
 
-	if (pthread_mutex_unlock(&files_tree_lock))
-		pr_err("%s: failed to unlock xattr tree: %d\n", __func__, err);
-
-	pr_debug("duplicated xattrs from %s to %s\n", from, to);
+	unlock_xattr_shards(from_hval, to_hval);
 	return err;
 }
@@ -18,4 +18,6 @@ ssize_t spfs_listxattr(const char *path, char *list, size_t size);
 int spfs_move_xattrs(const char *from, const char *to);
 int spfs_dup_xattrs(const char *from, const char *to);
 
+unsigned long spfs_xattr_lookups_avoided(void);
+
 #endif
@@ -15,7 +15,8 @@ int futex_op(int *uaddr, int op, int val, const struct timespec *timeout,
 			                 int *uaddr2, int val3)
 {
 	if (syscall(SYS_futex, uaddr, op, val, timeout, uaddr2, val3) < 0) {
-		if (errno != ETIMEDOUT)
+		/* Timeout, value change and signal are not errors */
+		if ((errno != ETIMEDOUT) && (errno != EAGAIN) && (errno != EINTR))
 			pr_perror("SyS_futex failed");
 		return -errno;
 	}
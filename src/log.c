@@ -1,72 +1,367 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
 
 
 #include "include/log.h"
 #include "include/util.h"
+#include "include/list.h"
 
-static int log_level = LOG_DEBUG;
+int log_level = LOG_DEBUG;
 FILE *stream;
 
 static bool print_timestamp;
 
+/* Seconds part of timestamp is formatted once per second per thread */
+static __thread time_t cached_sec = -1;
+static __thread char cached_time[48];
+
+static __thread pid_t cached_tid;
+
+pid_t log_tid(void)
+{
+	if (!cached_tid)
+		cached_tid = gettid();
+	return cached_tid;
+}
+
 static char *print_time(char *buf, size_t size)
 {
-	struct timeval tv;
-	struct tm *tm;
+	struct timespec ts;
+	struct tm tm;
 
-	if (gettimeofday(&tv, NULL))
+	if (clock_gettime(CLOCK_REALTIME, &ts))
 		return NULL;
 
-	tm = localtime(&tv.tv_sec);
-	if (!tm)
-		return NULL;
+	if (ts.tv_sec != cached_sec) {
+		if (!localtime_r(&ts.tv_sec, &tm))
+			return NULL;
 
-	if (!strftime(buf, size, "%a %b %e %Y %H:%M:%S", tm))
-		return NULL;
+		if (!strftime(cached_time, sizeof(cached_time),
+			      "%a %b %e %Y %H:%M:%S", &tm))
+			return NULL;
 
-	sprintf(buf + strlen(buf), ".%06ld", tv.tv_usec);
+		cached_sec = ts.tv_sec;
+	}
 
+	snprintf(buf, size, "%s.%06ld", cached_time, ts.tv_nsec / 1000);
 	return buf;
 }
 
-static int print_on_level_va(unsigned int level, const char *format, va_list args)
+/* Asynchronous log.
+ * Each thread formats messages into its own ring buffer. Ring has single
+ * producer (the thread) and single consumer (whoever holds log_rings_lock:
+ * either writer thread, or a thread flushing the log). So producer takes no
+ * locks, unless ring is full.
+ * Messages of error levels and above are flushed synchronously, so they
+ * can't be lost on crash.
+ * Forked children don't have writer thread, so they log synchronously.
+ */
+#define LOG_RING_SIZE		(128 << 10)
+#define LOG_FLUSH_LEVEL		LOG_ERR
+
+struct log_ring_s {
+	struct list_head	list;
+	unsigned long		head;
+	unsigned long		tail;
+	int			dead;
+	char			buf[LOG_RING_SIZE];
+};
+
+static LIST_HEAD(log_rings);
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t log_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_writer_cond = PTHREAD_COND_INITIALIZER;
+static int log_writer_sleeping;
+
+static bool log_async;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+static __thread struct log_ring_s *log_ring;
+/* Set while thread is logging: message from signal handler, interrupted
+ * logging, is written synchronously */
+static __thread bool in_log;
+
+static FILE *log_stream(void)
+{
+	return (stream) ? stream : stdout;
+}
+
+static void log_wake_writer(void)
+{
+	if (!__atomic_load_n(&log_writer_sleeping, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&log_writer_lock);
+	pthread_cond_signal(&log_writer_cond);
+	pthread_mutex_unlock(&log_writer_lock);
+}
+
+static void log_ring_exit(void *data)
+{
+	struct log_ring_s *r = data;
+
+	/* Ring is released by writer, when it's drained */
+	__atomic_store_n(&r->dead, 1, __ATOMIC_SEQ_CST);
+	log_wake_writer();
+}
+
+static struct log_ring_s *log_ring_get(void)
+{
+	struct log_ring_s *r = log_ring;
+
+	if (r)
+		return r;
+
+	r = malloc(sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->head = r->tail = 0;
+	r->dead = 0;
+
+	pthread_mutex_lock(&log_rings_lock);
+	list_add_tail(&r->list, &log_rings);
+	pthread_mutex_unlock(&log_rings_lock);
+
+	pthread_setspecific(log_ring_key, r);
+	log_ring = r;
+	return r;
+}
+
+/* Must be called with log_rings_lock held */
+static size_t log_drain(void)
+{
+	FILE *out = log_stream();
+	struct log_ring_s *r, *tmp;
+	size_t written = 0;
+
+	list_for_each_entry_safe(r, tmp, &log_rings, list) {
+		int dead = __atomic_load_n(&r->dead, __ATOMIC_SEQ_CST);
+		unsigned long head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+		unsigned long tail = r->tail;
+
+		while (tail != head) {
+			size_t off = tail % LOG_RING_SIZE;
+			size_t len = head - tail;
+
+			if (len > LOG_RING_SIZE - off)
+				len = LOG_RING_SIZE - off;
+
+			(void) fwrite(r->buf + off, 1, len, out);
+			tail += len;
+			written += len;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+		if (dead) {
+			list_del(&r->list);
+			free(r);
+		}
+	}
+	return written;
+}
+
+static bool log_pending(void)
+{
+	struct log_ring_s *r;
+	bool pending = false;
+
+	pthread_mutex_lock(&log_rings_lock);
+	list_for_each_entry(r, &log_rings, list) {
+		if (__atomic_load_n(&r->dead, __ATOMIC_SEQ_CST) ||
+		    (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail)) {
+			pending = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&log_rings_lock);
+	return pending;
+}
+
+void log_flush(void)
 {
-	int saved_errno = errno, res;
-	FILE *out = (stream) ? stream : stdout;
+	if (!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+		return;
 
-	if (level > log_level)
+	pthread_mutex_lock(&log_rings_lock);
+	(void) log_drain();
+	pthread_mutex_unlock(&log_rings_lock);
+}
+
+static void *log_writer(void *data)
+{
+	struct timespec ts;
+	size_t written;
+
+	while (1) {
+		pthread_mutex_lock(&log_rings_lock);
+		written = log_drain();
+		pthread_mutex_unlock(&log_rings_lock);
+		if (written)
+			continue;
+
+		pthread_mutex_lock(&log_writer_lock);
+		__atomic_store_n(&log_writer_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!log_pending()) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			pthread_cond_timedwait(&log_writer_cond,
+					       &log_writer_lock, &ts);
+		}
+		__atomic_store_n(&log_writer_sleeping, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&log_writer_lock);
+	}
+	return NULL;
+}
+
+static bool log_enqueue(const char *msg, size_t len)
+{
+	struct log_ring_s *r;
+	unsigned long head;
+	size_t off, part;
+
+	if (len > LOG_RING_SIZE)
+		return false;
+
+	r = log_ring_get();
+	if (!r)
+		return false;
+
+	head = r->head;
+	while (LOG_RING_SIZE - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) < len) {
+		/* Ring is full: wait for writer */
+		log_wake_writer();
+		sched_yield();
+	}
+
+	off = head % LOG_RING_SIZE;
+	part = LOG_RING_SIZE - off;
+	if (part > len)
+		part = len;
+
+	memcpy(r->buf + off, msg, part);
+	memcpy(r->buf, msg + part, len - part);
+
+	__atomic_store_n(&r->head, head + len, __ATOMIC_SEQ_CST);
+
+	log_wake_writer();
+	return true;
+}
+
+static void log_write(unsigned int level, const char *msg, size_t len)
+{
+	if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE) && !in_log) {
+		bool queued;
+
+		in_log = true;
+		queued = log_enqueue(msg, len);
+		if (queued && (level <= LOG_FLUSH_LEVEL))
+			log_flush();
+		in_log = false;
+
+		if (queued)
+			return;
+	}
+
+	(void) fwrite(msg, 1, len, log_stream());
+}
+
+/* Called in child process, which doesn't have writer thread */
+void forget_log_writer(void)
+{
+	__atomic_store_n(&log_async, false, __ATOMIC_RELEASE);
+	log_ring = NULL;
+	cached_tid = 0;
+}
+
+static void log_init_once(void)
+{
+	if (pthread_key_create(&log_ring_key, log_ring_exit))
+		return;
+
+	pthread_atfork(NULL, NULL, forget_log_writer);
+	atexit(log_flush);
+}
+
+int start_log_writer(void)
+{
+	sigset_t blockmask, oldmask;
+	pthread_t writer;
+	int err;
+
+	if (log_async)
 		return 0;
 
-	res = vfprintf(out, format, args);
+	pthread_once(&log_once, log_init_once);
 
-	errno -= saved_errno;
-	return res;
+	/* Signal handlers log as well: they must not be run by writer */
+	sigfillset(&blockmask);
+	pthread_sigmask(SIG_BLOCK, &blockmask, &oldmask);
+	err = pthread_create(&writer, NULL, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	if (err) {
+		pr_err("%s: failed to create log writer: %d\n", __func__, err);
+		return -err;
+	}
+	pthread_detach(writer);
+
+	__atomic_store_n(&log_async, true, __ATOMIC_RELEASE);
+	pr_debug("Asynchronous log started\n");
+	return 0;
 }
 
 int print_on_level(unsigned int loglevel, const char *format, ...)
 {
-	char buffer[4096];
+	char buffer[4096], *msg = buffer;
 	char time[64];
 	va_list params;
-	int res;
-	const char *ptr = format;
-
-	if (print_timestamp) {
-		snprintf(buffer, sizeof(buffer), "%s  %s",
-				print_time(time, sizeof(time)) ? time : "(none)",
-				format);
-		ptr = buffer;
-	}
+	int saved_errno = errno, res, off = 0;
+	size_t len;
+
+	if (!log_enabled(loglevel))
+		return 0;
+
+	if (print_timestamp)
+		off = snprintf(buffer, sizeof(buffer), "%s  ",
+				print_time(time, sizeof(time)) ? time : "(none)");
 
 	va_start(params, format);
-	res = print_on_level_va(loglevel, ptr, params);
+	res = vsnprintf(buffer + off, sizeof(buffer) - off, format, params);
 	va_end(params);
+	if (res < 0)
+		goto out;
+
+	len = off + res;
+	if (len >= sizeof(buffer)) {
+		msg = malloc(len + 1);
+		if (msg) {
+			memcpy(msg, buffer, off);
+			va_start(params, format);
+			vsnprintf(msg + off, len + 1 - off, format, params);
+			va_end(params);
+		} else {
+			msg = buffer;
+			len = sizeof(buffer) - 1;
+		}
+	}
+
+	log_write(loglevel, msg, len);
+
+	if (msg != buffer)
+		free(msg);
+out:
+	errno = saved_errno;
 	return res;
 }
 
@@ -105,6 +400,7 @@ int setup_log_ts(const char *log_file, int verbosity, bool enable_ts)
 		close(fd);
 		return -errno;
 	}
+	tzset();
 	log_ts_control(enable_ts);
 	setvbuf(log, NULL, _IONBF, 0);
 	set_log_level(log, verbosity);
@@ -17,7 +17,6 @@
 		                                  (struct cmsghdr *)NULL)
 
 #define CR_SCM_MSG_SIZE		(1024)
-#define CR_SCM_MAX_FD		(252)
 
 struct scm_fdset {
 	struct msghdr	hdr;
@@ -195,14 +194,31 @@ int recv_fds(struct parasite_ctl *ctl, bool seized, int *fds, int nr_fds, struct
 		}
 
 		cmsg = __CMSG_FIRSTHDR(&fdset->msg_buf, fdset->hdr.msg_controllen);
-		if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
-			pr_err("Crappy cmsg_type\n");
-			return -EINVAL;
-		}
 		if (fdset->hdr.msg_flags & MSG_CTRUNC) {
+			int installed = 0, j;
+
+			/*
+			 * Receiver is out of free fds. Fds, installed before
+			 * the truncation, are reported to be closed by the
+			 * caller, and the rest is set to -1.
+			 */
+			if (cmsg && cmsg->cmsg_type == SCM_RIGHTS)
+				installed = min((int)((cmsg->cmsg_len - sizeof(struct cmsghdr)) / sizeof(int)),
+						min_fd);
+			if (installed > 0)
+				memcpy(&fds[i], cmsg_data, sizeof(int) * installed);
+			else
+				installed = 0;
+			for (j = i + installed; j < nr_fds; j++)
+				fds[j] = -1;
+
 			pr_err("Message truncated\n");
 			return -ENFILE;
 		}
+		if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+			pr_err("Crappy cmsg_type\n");
+			return -EINVAL;
+		}
 
 		min_fd = (cmsg->cmsg_len - sizeof(struct cmsghdr)) / sizeof(int);
 		/*
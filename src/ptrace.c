@@ -36,6 +36,31 @@ const char code_int_80[] = {
 	0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc	/* int 3, ... */
 };
 
+/*
+ * Injected syscall vector: executes %r12 syscalls, described by array of
+ * struct seized_syscall_s at %rbx, and stops on the first failed one.
+ * Number of not executed syscalls is left in %r12.
+ */
+const char code_syscall_vec[] = {
+	0x4d, 0x85, 0xe4,			/* 1: test %r12,%r12       */
+	0x74, 0x32,				/*    je 2f                */
+	0x48, 0x8b, 0x03,			/*    mov (%rbx),%rax      */
+	0x48, 0x8b, 0x7b, 0x08,			/*    mov 0x8(%rbx),%rdi   */
+	0x48, 0x8b, 0x73, 0x10,			/*    mov 0x10(%rbx),%rsi  */
+	0x48, 0x8b, 0x53, 0x18,			/*    mov 0x18(%rbx),%rdx  */
+	0x4c, 0x8b, 0x53, 0x20,			/*    mov 0x20(%rbx),%r10  */
+	0x4c, 0x8b, 0x43, 0x28,			/*    mov 0x28(%rbx),%r8   */
+	0x4c, 0x8b, 0x4b, 0x30,			/*    mov 0x30(%rbx),%r9   */
+	0x0f, 0x05,				/*    syscall              */
+	0x48, 0x89, 0x43, 0x38,			/*    mov %rax,0x38(%rbx)  */
+	0x48, 0x3d, 0x01, 0xf0, 0xff, 0xff,	/*    cmp $-4095,%rax      */
+	0x73, 0x09,				/*    jae 2f               */
+	0x48, 0x83, 0xc3, 0x40,			/*    add $0x40,%rbx       */
+	0x49, 0xff, 0xcc,			/*    dec %r12             */
+	0xeb, 0xc9,				/*    jmp 1b               */
+	0xcc,					/* 2: int 3                */
+};
+
 int ptrace_peek_area(pid_t pid, void *dst, void *addr, long bytes)
 {
 	unsigned long w;
@@ -296,6 +321,17 @@ err:
 	return ret;
 }
 
+static int parasite_execute(struct parasite_ctl *ctl, unsigned long ip,
+			    user_regs_struct_t *regs)
+{
+	int err;
+
+	err = parasite_run(ctl->pid, PTRACE_CONT, ip, 0, regs, &ctl->orig);
+	if (!err)
+		err = parasite_trap(ctl, ctl->pid, regs, &ctl->orig);
+	return err;
+}
+
 static int __parasite_execute_syscall(struct parasite_ctl *ctl,
 				      user_regs_struct_t *regs, const char *code_syscall)
 {
@@ -314,9 +350,7 @@ static int __parasite_execute_syscall(struct parasite_ctl *ctl,
 		return -1;
 	}
 
-	err = parasite_run(pid, PTRACE_CONT, ctl->syscall_ip, 0, regs, &ctl->orig);
-	if (!err)
-		err = parasite_trap(ctl, pid, regs, &ctl->orig);
+	err = parasite_execute(ctl, ctl->syscall_ip, regs);
 
 	if (ptrace_poke_area(pid, (void *)code_orig,
 			     (void *)ctl->syscall_ip, sizeof(code_orig))) {
@@ -368,6 +402,50 @@ int syscall_seized(struct parasite_ctl *ctl, int nr, unsigned long *ret,
 	return err;
 }
 
+void syscall_vec_install(struct parasite_ctl *ctl, unsigned long offset)
+{
+	memcpy(ctl->local_map + offset, code_syscall_vec, sizeof(code_syscall_vec));
+	ctl->syscall_vec_ip = (unsigned long)ctl->remote_map + offset;
+}
+
+int syscall_vec_seized(struct parasite_ctl *ctl, struct seized_syscall_s *calls,
+		       int nr_calls)
+{
+	user_regs_struct_t regs = ctl->orig.regs;
+	int i, err;
+
+	if (!nr_calls)
+		return 0;
+
+	if (ctl->syscall_vec_ip && user_regs_native(&regs)) {
+		regs.native.bx = (unsigned long)ctl->remote_map +
+				 ((void *)calls - ctl->local_map);
+		regs.native.r12 = nr_calls;
+
+		err = parasite_execute(ctl, ctl->syscall_vec_ip, &regs);
+		if (err)
+			return err;
+
+		return nr_calls - regs.native.r12;
+	}
+
+	/* Compat task: one stop per syscall */
+	for (i = 0; i < nr_calls; i++) {
+		struct seized_syscall_s *c = &calls[i];
+		unsigned long ret;
+
+		err = syscall_seized(ctl, c->nr, &ret, c->args[0], c->args[1],
+				     c->args[2], c->args[3], c->args[4], c->args[5]);
+		if (err)
+			return err;
+
+		c->ret = ret;
+		if (IS_ERR_VALUE(ret))
+			break;
+	}
+	return i;
+}
+
 void *mmap_seized(struct parasite_ctl *ctl,
 		  void *addr, size_t length, int prot,
 		  int flags, int fd, off_t offset)
@@ -11,10 +11,12 @@
 #include "include/log.h"
 #include "include/socket.h"
 
-int seqpacket_sock_send(int sock, void *packet, size_t psize)
+/* Reply starts with status. The rest of it is truncated, if "rsize" is less,
+ * than the reply sent. */
+int seqpacket_sock_send_reply(int sock, void *packet, size_t psize,
+			      void *reply, size_t rsize)
 {
 	ssize_t bytes;
-	int err;
 
 	bytes = send(sock, packet, psize, MSG_EOR);
 	if (bytes < 0) {
@@ -22,13 +24,24 @@ int seqpacket_sock_send(int sock, void *packet, size_t psize)
 		return -errno;
 	}
 
-	bytes = recv(sock, &err, sizeof(err), 0);
+	bytes = recv(sock, reply, rsize, 0);
 	if (bytes < 0) {
 		pr_perror("failed to receive reply via sock %d", sock);
 		return -errno;
 	}
+	if (bytes < sizeof(int)) {
+		pr_err("short reply via sock %d: %zd bytes\n", sock, bytes);
+		return -ECONNRESET;
+	}
 
-	return err;
+	return *(int *)reply;
+}
+
+int seqpacket_sock_send(int sock, void *packet, size_t psize)
+{
+	int err;
+
+	return seqpacket_sock_send_reply(sock, packet, psize, &err, sizeof(err));
 }
 
 int send_packet(const char *socket_path, void *package, size_t psize)
@@ -45,11 +58,11 @@ int send_packet(const char *socket_path, void *package, size_t psize)
 	return err;
 }
 
-int send_status(int sock, int res)
+int send_reply(int sock, const void *reply, size_t size)
 {
 	ssize_t bytes;
 
-	bytes = send(sock, &res, sizeof(res), MSG_NOSIGNAL | MSG_DONTWAIT | MSG_EOR);
+	bytes = send(sock, reply, size, MSG_NOSIGNAL | MSG_DONTWAIT | MSG_EOR);
 	if (bytes < 0) {
 		bytes = -errno;
 		pr_warn("%s: send failed via fd %d: %s\n", __func__, sock,
@@ -64,6 +77,11 @@ int send_status(int sock, int res)
 	return 0;
 }
 
+int send_status(int sock, int res)
+{
+	return send_reply(sock, &res, sizeof(res));
+}
+
 int unreliable_conn_handler(int sock, void *data,
 			    int (*packet_handler)(int sock, void *data, void *packet, size_t psize))
 {